@@ -16,7 +16,19 @@ static const char TAG[] = "Faikout";
 #endif
 #include "cn_wired.h"
 #include "cn_wired_driver.h"
+#include "metrics.h"
+#include "sketch.h"
+#include "energy.h"
+#include "automation.h"
+#include "group.h"
+#include "fusion.h"
+#include "schedule.h"
+#include "demand.h"
+#include "tune.h"
 #include "daikin_s21.h"
+#include "s21link.h"
+#include "x50alink.h"
+#include "acproto.h"
 #include "halib.h"
 
 #ifdef  CONFIG_IDF_TARGET_ESP32S3
@@ -93,21 +105,10 @@ struct
    poll_t RX;
    poll_t Ra;
    poll_t Rd;
-   uint8_t rgfan:1;             // Use RG for fan
 } s21 = { 0 };
 
 // Settings (RevK library used by MQTT setting command)
 
-enum
-{                               // Number the control fields
-#define	b(name)		CONTROL_##name##_pos,
-#define	t(name)		b(name)
-#define	r(name)		b(name)
-#define	i(name)		b(name)
-#define	e(name,values)	b(name)
-#define	s(name,len)	b(name)
-#include "acextras.m"
-};
 #define	b(name)		const uint64_t CONTROL_##name=(1ULL<<CONTROL_##name##_pos);
 #define	t(name)		b(name)
 #define	r(name)		b(name)
@@ -167,11 +168,27 @@ struct
    uint8_t protocol_set:1;
    uint8_t faikouton:1;         // Last faikout power state
    uint8_t startup:1;           // In a startup phase (i.e. full comms not yet confirmed)
+   uint8_t probe:1;             // Probe requested
 } b = { 0 };
 
 static httpd_handle_t webserver = NULL;
 static uint8_t proto = 0;
 
+struct
+{                               // Comms error recovery
+   uint8_t fails;               // Consecutive failures
+   uint32_t resync;             // Flushed and resynced
+   uint32_t retry;              // Command retried
+   uint32_t restart;            // UART restarted
+} recover = { 0 };
+
+struct
+{                               // Probe of all known S21 query commands, for a simulator profile
+   jo_t j;                      // Responses so far
+   char cmd[8];                 // Command being sent
+   uint8_t got:1;               // Response to it recorded
+} probe = { 0 };
+
 static int
 uart_enabled (void)
 {
@@ -296,48 +313,25 @@ struct
    uint8_t control_count;       // How many times we have tried to change control and not worked yet
    uint32_t statscount;         // Count for b() i(), etc.
 #define	b(name)		uint8_t	name;uint32_t total##name;
-#define	t(name)		float name;float min##name;float total##name;float max##name;uint32_t count##name;
+#define	t(name)		float name;float min##name;float total##name;float max##name;uint32_t count##name;sketch_t *sketch##name;
 #define	r(name)		float min##name;float max##name;
-#define	i(name)		int name;int min##name;int total##name;int max##name;
+#define	i(name)		int name;int min##name;int total##name;int max##name;sketch_t *sketch##name;
 #define	e(name,values)	uint8_t name;
 #define	s(name,len)	char name[len];
 #include "acextras.m"
-   float env_prev;              // Predictive, last period value
-   float env_delta;             // Predictive, diff to last
-   float env_delta_prev;        // Predictive, previous diff
    uint32_t controlvalid;       // uptime to which auto mode is valid
-   uint32_t sample;             // Last uptime sampled
-   uint32_t countApproaching,
-     countApproachingPrev;      // Count of "approaching temp", and previous sample
-   uint32_t countBeyond,
-     countBeyondPrev;           // Count of "beyond temp", and previous sample
-   uint32_t countTotal,
-     countTotalPrev;            // Count total, and previous sample
-   uint8_t fansaved;            // Saved fan we override at start
-   uint8_t talking:1;           // We are getting answers
-   uint8_t lastheat:1;          // Last heat mode
-   uint8_t status_changed:1;    // Status has changed
-   uint8_t mode_changed:1;      // Status or control has changed for enum or bool
-   uint8_t status_report:1;     // Send status report
-   uint8_t ha_send:1;           // Send HA config
-   uint8_t remote:1;            // Remote control via MQTT
-   uint8_t hysteresis:1;        // Thermostat hysteresis state
-   uint8_t cnresend:2;          // Resends
-   uint8_t action:3;            // hvac_action
-   uint8_t protocol_ver;        // Protocol version
+   float confidence;            // Sensor fusion confidence in env, 0-1
+   // Flags set from more than one task are a byte each, not bitfields, so one task's write cannot undo another's
+   volatile uint8_t talking;    // We are getting answers
+   volatile uint8_t status_changed;     // Status has changed
+   volatile uint8_t mode_changed;       // Status or control has changed for enum or bool
+   volatile uint8_t status_report;      // Send status report
+   volatile uint8_t ha_send;    // Send HA config
+   volatile uint8_t remote;     // Remote control via MQTT
+   volatile uint8_t action;     // hvac_action
+   uint8_t cnresend:2;          // Resends, protocol task only
 } daikin = { 0 };
 
-enum
-{
-   HVAC_OFF,
-   HVAC_PREHEATING,
-   HVAC_HEATING,
-   HVAC_COOLING,
-   HVAC_DRYING,
-   HVAC_FAN,
-   HVAC_IDLE,
-   HVAC_DEFROSTING,
-};
 const char *const hvac_action[] = { "off", "preheating", "heating", "cooling", "drying", "fan", "idle", "defrosting" };
 
 const char *
@@ -486,6 +480,100 @@ set_float (const char *name, float *ptr, uint64_t flag, float val)
 #define report_float(name,val) set_float(#name,&daikin.name,CONTROL_##name,val)
 #define report_bool(name,val) report_uint8(name, (val ? 1 : 0))
 
+// Aircon payloads (acproto.c) are decoded and encoded through the daikin struct, by field
+static const struct
+{
+   const char *name;
+   void *ptr;
+   char type;                   // b, t, i, e, s, or r with no value
+   uint8_t len;                 // For s
+} ac_fields[] = {
+#define b(name)         [CONTROL_##name##_pos]={#name,&daikin.name,'b'},
+#define t(name)         [CONTROL_##name##_pos]={#name,&daikin.name,'t'},
+#define r(name)         [CONTROL_##name##_pos]={#name,NULL,'r'},
+#define i(name)         [CONTROL_##name##_pos]={#name,&daikin.name,'i'},
+#define e(name,values)  [CONTROL_##name##_pos]={#name,&daikin.name,'e'},
+#define s(name,len)     [CONTROL_##name##_pos]={#name,daikin.name,'s',len},
+#include "acextras.m"
+};
+
+static void
+ac_report_uint8 (void *ctx, int pos, uint8_t val)
+{
+   set_uint8 (ac_fields[pos].name, ac_fields[pos].ptr, 1ULL << pos, val);
+}
+
+static void
+ac_report_int (void *ctx, int pos, int val)
+{
+   set_int (ac_fields[pos].name, ac_fields[pos].ptr, 1ULL << pos, val);
+}
+
+static void
+ac_report_float (void *ctx, int pos, float val)
+{
+   set_float (ac_fields[pos].name, ac_fields[pos].ptr, 1ULL << pos, val);
+}
+
+static void
+ac_report_string (void *ctx, int pos, const char *val)
+{                               // Model, not a control
+   char *ptr = ac_fields[pos].ptr;
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   if (strncmp (ptr, val, ac_fields[pos].len - 1))
+   {
+      strncpy (ptr, val, ac_fields[pos].len - 1);
+      ptr[ac_fields[pos].len - 1] = 0;
+      daikin.status_changed = 1;
+   }
+   xSemaphoreGive (daikin.mutex);
+}
+
+static float
+ac_get (void *ctx, int pos)
+{
+   void *ptr = ac_fields[pos].ptr;
+   switch (ac_fields[pos].type)
+   {
+   case 'b':
+   case 'e':
+      return *(uint8_t *) ptr;
+   case 'i':
+      return *(int *) ptr;
+   case 't':
+      return *(float *) ptr;
+   }
+   return NAN;
+}
+
+static acproto_t ac = {
+   .report_uint8 = ac_report_uint8,
+   .report_int = ac_report_int,
+   .report_float = ac_report_float,
+   .report_string = ac_report_string,
+   .get = ac_get,
+};
+
+static acproto_t *
+ac_settings (void)
+{                               // Settings, which may have changed, and S21 poll state
+   ac.noswingv = noswingv;
+   ac.noswingh = noswingh;
+   ac.nopowerful = nopowerful;
+   ac.nocomfort = nocomfort;
+   ac.noquiet = noquiet;
+   ac.nostreamer = nostreamer;
+   ac.nosensor = nosensor;
+   ac.noled = noled;
+   ac.nodemand = nodemand;
+   ac.noecono = noecono;
+   ac.noflap = noflap;
+   ac.noantifreeze = noantifreeze;
+   ac.dark = dark;
+   ac.f6bad = s21.F6.bad;
+   return &ac;
+}
+
 jo_t
 jo_comms_alloc (void)
 {
@@ -504,9 +592,20 @@ enum
    RES_NOACK,
    RES_BAD,
    RES_WAIT,
-   RES_TIMEOUT
+   RES_TIMEOUT,
+   RES_BADSUM
 };
 
+static void
+res_metric (const char *proto, uint8_t cmd, uint8_t cmd2, int64_t start, int r)
+{                               // Record bus metrics for an exchange
+   if (r == RES_WAIT)
+      return;                   // Not sent
+   metrics_record (proto, cmd, cmd2, start,
+                   r == RES_OK ? METRIC_ACK : r == RES_NAK ? METRIC_NAK : r == RES_TIMEOUT ? METRIC_TIMEOUT : r ==
+                   RES_BADSUM ? METRIC_BADSUM : METRIC_BAD);
+}
+
 static int
 check_length (uint8_t cmd, uint8_t cmd2, int len, int required, const uint8_t *payload)
 {
@@ -523,11 +622,32 @@ check_length (uint8_t cmd, uint8_t cmd2, int len, int required, const uint8_t *p
    return 0;
 }
 
+static void
+comm_fail (void)
+{                               // Comms error - resync on next message, and only restart UART if it keeps happening
+   if (!b.protocol_set || b.loopback || proto_type () == PROTO_TYPE_CN_WIRED || ++recover.fails >= commsfail)
+   {                            // Scanning protocols, passive protocol, or given up
+      if (b.protocol_set && !b.loopback)
+         recover.restart++;
+      recover.fails = 0;
+      daikin.talking = 0;
+      return;
+   }
+   recover.resync++;
+   uart_flush_input (uart);
+}
+
+static void
+comm_ok (void)
+{                               // Good exchange
+   recover.fails = 0;
+}
+
 static void
 comm_timeout (uint8_t *buf, int rxlen)
 {
-   daikin.talking = 0;
    b.loopback = 0;
+   comm_fail ();
    jo_t j = jo_comms_alloc ();
    jo_bool (j, "timeout", 1);
    if (rxlen)
@@ -556,169 +676,8 @@ daikin_s21_response (uint8_t cmd, uint8_t cmd2, int len, uint8_t *payload)
       else
          jo_stringn (s21debug, tag, (char *) payload, len);
    }
-   // Remember to add to polling if we add more handlers
-   if (cmd == 'G')
-      switch (cmd2)
-      {
-      case '1':                // 'G1' - basic status
-         if (check_length (cmd, cmd2, len, S21_PAYLOAD_LEN, payload))
-         {
-            report_uint8 (online, 1);
-            report_bool (power, payload[0] == '1');
-            report_uint8 (mode, "30721003"[payload[1] & 0x7] - '0');    // FHCA456D mapped from AXDCHXF
-            report_uint8 (heat, daikin.mode == FAIKIN_MODE_HEAT);       // Crude - TODO find if anything actually tells us this
-            if (daikin.mode == FAIKIN_MODE_HEAT || daikin.mode == FAIKIN_MODE_COOL || daikin.mode == FAIKIN_MODE_AUTO)
-               report_float (temp, s21_decode_target_temp (payload[2]));
-            else if (!isnan (daikin.temp))
-               report_float (temp, daikin.temp);        // Does not have temp in other modes
-            if (!s21.rgfan)
-            {                   // RG is better, so we only look at G1 if RG does not work
-               if (payload[3] != 'A')   // Set fan speed
-                  report_uint8 (fan, "00012345"[payload[3] & 0x7] - '0');       // XXX12345 mapped to A12345Q
-               else if (daikin.fan == 6)
-                  report_uint8 (fan, 6);        // Quiet mode set (it returns as auto, so we assume it should be quiet if fan speed is low)
-               else
-                  report_uint8 (fan, 0);        // Auto as fan too fast to be quiet mode
-            }
-         }
-         break;
-      case '3':                // Seems to be an alternative to G6
-         // If F6 is supported, F3 does not provide "powerful" flag even if supported.
-         // We may still get G3 response for debug or from injection via MQTT "send".
-         if (s21.F6.bad && check_length (cmd, cmd2, len, 1, payload))
-         {
-            report_bool (powerful, payload[3] & 0x02);
-         }
-         break;
-      case '5':                // 'G5' - swing status
-         if (check_length (cmd, cmd2, len, 1, payload))
-         {
-            if (!noswingv)
-               report_bool (swingv, payload[0] & 1);
-            if (!noswingh)
-               report_bool (swingh, payload[0] & 2);
-         }
-         break;
-      case '6':                // 'G6' - "powerful" mode and some others
-         if (check_length (cmd, cmd2, len, S21_PAYLOAD_LEN, payload))
-         {
-            if (!nopowerful)
-               report_bool (powerful, payload[0] & 0x02);
-            if (!nocomfort)
-               report_bool (comfort, payload[0] & 0x40);
-            if (!noquiet)
-               report_bool (quiet, payload[0] & 0x80);
-            if (!nostreamer)
-               report_bool (streamer, payload[1] & 0x80);
-            if (!nosensor)
-               report_bool (sensor, payload[3] & 0x08);
-            if (!noled)
-               report_bool (led, (payload[3] & 0x0C) != 0x0C);
-         }
-         break;
-      case '7':                // 'G7' - "demand" and "eco" mode
-         if (check_length (cmd, cmd2, len, 2, payload))
-         {
-            if (!nodemand && payload[0] != '1')
-               report_int (demand, 100 - (payload[0] - '0'));
-            if (!noecono)
-               report_bool (econo, payload[1] & 0x02);
-         }
-         break;
-      case '8':
-         if (check_length (cmd, cmd2, len, 2, payload))
-         {
-            daikin.protocol_ver = payload[1] & (~0x30);
-         }
-         break;
-      case '9':
-         if (check_length (cmd, cmd2, len, 2, payload))
-         {
-            report_float (home, (float) ((signed) payload[0] - 0x80) / 2);
-            report_float (outside, (float) ((signed) payload[1] - 0x80) / 2);
-         }
-         break;
-      case 'C':
-         if (len > 0)
-         {
-            // Normally response length would be 4, but let's try being more creative
-            // and future-proof. Accept the whole payload whatever it is.
-            int limit = len >= sizeof (daikin.model) ? sizeof (daikin.model) - 1 : len;
-            for (int i = 0; i < limit; i++)     // The string is provided in reverse
-               daikin.model[i] = payload[len - i - 1];
-            daikin.model[limit] = 0;
-         }
-         break;
-      case 'M':                // Power meter
-         report_int (Wh, s21_decode_hex_sensor (payload) * 100);        // 100Wh units
-         break;
-      }
-   if (cmd == 'S')
-   {
-      if (cmd2 == 'G')
-      {
-         if (check_length (cmd, cmd2, len, 1, payload))
-         {                      // One byte response!
-            switch (cmd2)
-            {
-            case 'G':
-               if (strchr ("34567AB", payload[0]))
-               {                // Sensible FAN, else us F1
-                  if (payload[0] >= '3' && payload[0] <= '7')
-                     report_uint8 (fan, payload[0] - '3' + 1);  // 1-5
-                  else if (payload[0] == 'A')
-                     report_uint8 (fan, 0);     // Auto
-                  else if (payload[0] == 'B')
-                     report_uint8 (fan, 6);     // Quiet
-                  s21.rgfan = 1;
-               } else
-                  s21.rgfan = 0;
-               break;
-            }
-         }
-      } else if (cmd2 == 'L' || cmd2 == 'd' || cmd2 == 'D' || cmd2 == 'N' || cmd2 == 'M')
-      {                         // These responses are always only 3 bytes long
-         if (check_length (cmd, cmd2, len, 3, payload))
-         {
-            int v = s21_decode_int_sensor (payload);
-            switch (cmd2)
-            {
-            case 'L':          // Fan
-               report_int (fanrpm, v * 10);
-               break;
-            case 'd':          // Compressor
-               report_int (comp, v);
-               break;
-            case 'N':          // Angle vertical swing
-               report_int (anglev, v);
-               break;
-            }
-         }
-      } else if (check_length (cmd, cmd2, len, S21_PAYLOAD_LEN, payload))
-      {
-         float t = s21_decode_float_sensor (payload);
-
-         if (t < 100)           // Sanity check
-         {
-            switch (cmd2)
-            {                   // Temperatures (guess)
-            case 'H':          // 'SH' - home temp
-               report_float (home, t);
-               break;
-            case 'a':          // 'Sa' - outside temp
-               report_float (outside, t);
-               break;
-            case 'I':          // 'SI' - liquid ???
-               report_float (liquid, t);
-               break;
-            case 'N':          // ?
-               break;
-            case 'X':          // ?
-               break;
-            }
-         }
-      }
-   }
+   if (acproto_s21_response (ac_settings (), cmd, cmd2, len, payload) == ACPROTO_SHORT)
+      check_length (cmd, cmd2, len, ac.need, payload);
    return RES_OK;
 }
 
@@ -735,25 +694,12 @@ protocol_found (void)
    }
 }
 
-void
-cn_wired_report_fan_speed (const uint8_t *packet)
-{
-   int8_t new_fan = cnw_decode_fan (packet);
-
-   if (new_fan != FAIKIN_FAN_INVALID)
-      report_uint8 (fan, new_fan);
-   // Powerful is a dedicated flag\ for us, because this is how
-   // other protocols handle it
-   report_bool (powerful, packet[CNW_FAN_OFFSET] == CNW_FAN_POWERFUL);
-}
-
 // Parse an incoming CN_WIRED packet
 // These packets always have a fixed length of CNW_PKT_LEN
 void
 daikin_cn_wired_incoming_packet (const uint8_t *payload)
 {
    static int cnw_retries = 0;
-   int8_t new_mode;
    jo_t j;
 
    uint8_t c = cnw_checksum (payload);
@@ -804,34 +750,14 @@ daikin_cn_wired_incoming_packet (const uint8_t *payload)
       revk_info ("rx", &j);
    }
 
-   switch (payload[CNW_CRC_TYPE_OFFSET] & CNW_TYPE_MASK)
+   if (acproto_cn_wired_packet (ac_settings (), payload) == ACPROTO_UNKNOWN)
    {
-   case CNW_SENSOR_REPORT:
-      report_float (home, decode_bcd (payload[CNW_TEMP_OFFSET]));
-      b.startup = 0;            // End of startup
-      break;
-   case CNW_MODE_CHANGED:
-      new_mode = cnw_decode_mode (payload);
-      report_uint8 (power, !(payload[CNW_MODE_OFFSET] & CNW_MODE_POWEROFF));
-      if (new_mode != FAIKIN_MODE_INVALID)
-         report_uint8 (mode, new_mode);
-      report_uint8 (heat, daikin.mode == FAIKIN_MODE_HEAT);
-      report_float (temp, decode_bcd (payload[CNW_TEMP_OFFSET]));
-      cn_wired_report_fan_speed (payload);
-      report_bool (swingv, payload[CNW_SPECIALS_OFFSET] & CNW_V_SWING);
-      if (!noled)
-         report_bool (led, payload[CNW_SPECIALS_OFFSET] & CNW_LED_ON);
-      break;
-   default:
-      // From testing with people we know there are also packets of other types.
-      // Example of a type 2 packet: 0038000000000022
-      // We currently don't know what they mean.
       j = jo_comms_alloc ();
       jo_string (j, "error", "Unknown message type");
       jo_base16 (j, "dump", payload, CNW_PKT_LEN);
       revk_error ("rx", &j);
-      break;
-   }
+   } else if ((payload[CNW_CRC_TYPE_OFFSET] & CNW_TYPE_MASK) == CNW_SENSOR_REPORT)
+      b.startup = 0;            // End of startup
 }
 
 void
@@ -897,7 +823,7 @@ daikin_cn_wired_send_modes (void)
       // from the packet we've just composed and sent. We're reusing
       // receiving code for simplicity. This implements the second part
       // of Powerful vs Fan speed mutual exclusion logic, described above.
-      cn_wired_report_fan_speed (buf);
+      acproto_cn_wired_fan (ac_settings (), buf);
    }
 }
 
@@ -911,102 +837,93 @@ daikin_x50a_response (uint8_t cmd, int len, uint8_t *payload)
       jo_base16 (j, "payload", payload, len);
       revk_info ("rx", &j);
    }
-   if (cmd == 0xAA && len >= 1)
-   {                            // Initialisation response
-      if (!*payload)
-         daikin.talking = 0;    // Not ready
-      return;
-   }
-   if (cmd == 0xBA && len >= 20)
-   {
-      strncpy (daikin.model, (char *) payload, sizeof (daikin.model));
-      daikin.status_changed = 1;
-      return;
-   }
-   if (cmd == 0xCA && len >= 7)
-   {                            // Main status settings
-      report_uint8 (online, 1);
-      report_uint8 (power, payload[0]);
-      report_uint8 (mode, payload[1]);
-      report_uint8 (heat, payload[2] == 1);
-      report_uint8 (slave, payload[9]);
-      report_uint8 (fan, (payload[6] >> 4) & 7);
-      return;
-   }
-   if (cmd == 0xCB && len >= 2)
-   {                            // We get all this from CA
-      return;
-   }
-   if (cmd == 0xBD && len >= 29)
-   {                            // Looks like temperatures - we assume 0000 is not set
-      float t;
-      if ((t = (int16_t) (payload[0] + (payload[1] << 8)) / 128.0) && t < 100)
-         report_float (inlet, t);
-      if ((t = (int16_t) (payload[2] + (payload[3] << 8)) / 128.0) && t < 100)
-         report_float (home, t);
-      if ((t = (int16_t) (payload[4] + (payload[5] << 8)) / 128.0) && t < 100)
-         report_float (liquid, t);
-      if ((t = (int16_t) (payload[8] + (payload[9] << 8)) / 128.0) && t < 100)
-         report_float (temp, t);
-#if 0
-      if (debug)
-      {
-         jo_t j = jo_object_alloc ();   // Debug dump
-         jo_litf (j, "a", "%.2f", (int16_t) (payload[0] + (payload[1] << 8)) / 128.0);  // inlet
-         jo_litf (j, "b", "%.2f", (int16_t) (payload[2] + (payload[3] << 8)) / 128.0);  // Room
-         jo_litf (j, "c", "%.2f", (int16_t) (payload[4] + (payload[5] << 8)) / 128.0);  // liquid
-         jo_litf (j, "d", "%.2f", (int16_t) (payload[6] + (payload[7] << 8)) / 128.0);  // same as inlet?
-         jo_litf (j, "e", "%.2f", (int16_t) (payload[8] + (payload[9] << 8)) / 128.0);  // Target
-         jo_litf (j, "f", "%.2f", (int16_t) (payload[10] + (payload[11] << 8)) / 128.0);        // same as inlet
-         revk_info ("temps", &j);
-      }
-#endif
-      return;
-   }
-   if (cmd == 0xBE && len >= 9)
-   {                            // Status/flags?
-      report_int (fanrpm, (payload[2] + (payload[3] << 8)));
-      // Flag4 ?
-      if (!noflap)
-         report_uint8 (flap, payload[5]);
-      if (!noantifreeze)
-         report_uint8 (antifreeze, payload[6]);
-      // Flag7 ?
-      // Flag8 ?
-      // Flag9 ?
-      // 0001B0040100000001
-      // 010476050101000001
-      // 010000000100000001
-#if 0
-      jo_t j = jo_comms_alloc ();       // Debug
-      jo_base16 (j, "be", payload, len);
-      revk_info ("rx", &j);
-#endif
-      return;
-   }
+   if (acproto_x50a_response (ac_settings (), cmd, len, payload) == ACPROTO_NOTREADY)
+      daikin.talking = 0;       // Not ready
 }
 
 // Timeout value for serial port read
 #define READ_TIMEOUT (500 / portTICK_PERIOD_MS)
+// Timeout between bytes once an X50A reply has started
+#define X50A_BYTE_TIMEOUT (50 / portTICK_PERIOD_MS)
+
+// Altherma_S register map. Each query is 02 reg ~sum, and the reply is 18 bytes: reg, 16 data bytes, ~sum
+enum
+{
+   AS_TEMP,                     // Signed 16 bit little endian, 0.1C units
+   AS_U8,                       // Unsigned 8 bit, times mul
+   AS_BIT,                      // Boolean, mul is the bit mask
+};
+
+static const struct
+{
+   char reg;                    // Register
+   uint8_t interval;            // Poll interval (seconds)
+} as_regs[] = {
+   {'P', 1},                    // Operating state
+   {'T', 2},                    // Water and indoor temperatures
+   {'U', 5},                    // Outdoor unit
+   {'S', 10},                   // Setpoints
+};
+
+#define	AS_REGS	(sizeof(as_regs)/sizeof(*as_regs))
+
+static const struct
+{
+   char reg;                    // Register
+   uint8_t offset;              // Offset in response (1 is first data byte)
+   uint8_t format;              // AS_*
+   uint8_t mul;                 // Multiplier, or bit mask for AS_BIT
+   uint8_t pos;                 // CONTROL_xxx_pos
+   const char *name;            // Field name
+   void *ptr;                   // Field in daikin
+} as_fields[] = {
+   // Provisional: these offsets and bits are not from any documentation, and have not been checked against a real unit
+#define	f(reg,offset,format,mul,name)	{reg,offset,format,mul,CONTROL_##name##_pos,#name,&daikin.name}
+   f ('P', 1, AS_BIT, 0x01, power),
+   f ('P', 1, AS_BIT, 0x02, heat),
+   f ('P', 1, AS_BIT, 0x04, antifreeze),
+   f ('T', 1, AS_TEMP, 0, lwt),
+   f ('T', 3, AS_TEMP, 0, rwt),
+   f ('T', 5, AS_TEMP, 0, dhw),
+   f ('T', 7, AS_TEMP, 0, home),
+   f ('T', 9, AS_TEMP, 0, liquid),
+   f ('U', 1, AS_TEMP, 0, outside),
+   f ('U', 3, AS_TEMP, 0, discharge),
+   f ('U', 9, AS_U8, 1, comp),
+   f ('U', 10, AS_U8, 10, fanrpm),
+   f ('S', 1, AS_TEMP, 0, temp),
+#undef f
+};
 
 void
 daikin_as_response (int len, uint8_t *res)
 {
    report_uint8 (online, 1);
-   switch (*res)
+   for (int f = 0; f < sizeof (as_fields) / sizeof (*as_fields); f++)
    {
-   case 'U':
-      // TODO
-      break;
-   case 'T':
-      // TODO
-      break;
-   case 'P':
-      // TODO
-      break;
-   case 'S':
-      // TODO
-      break;
+      if (as_fields[f].reg != *res)
+         continue;
+      uint8_t o = as_fields[f].offset;
+      uint64_t flag = (1ULL << as_fields[f].pos);
+      switch (as_fields[f].format)
+      {
+      case AS_TEMP:
+         if (o + 2 < len)
+         {
+            int16_t v = res[o] + (res[o + 1] << 8);
+            if (v != -32768)    // 8000 is no sensor
+               set_float (as_fields[f].name, as_fields[f].ptr, flag, (float) v / 10);
+         }
+         break;
+      case AS_U8:
+         if (o + 1 < len)
+            set_int (as_fields[f].name, as_fields[f].ptr, flag, res[o] * as_fields[f].mul);
+         break;
+      case AS_BIT:
+         if (o + 1 < len)
+            set_uint8 (as_fields[f].name, as_fields[f].ptr, flag, (res[o] & as_fields[f].mul) ? 1 : 0);
+         break;
+      }
    }
 }
 
@@ -1027,10 +944,10 @@ daikin_as_command (int len, uint8_t *buf)
    uart_write_bytes (uart, buf, len);
    uint8_t res[18];
    len = uart_read_bytes (uart, res, sizeof (res), READ_TIMEOUT);
-   if (len < 0)
+   if (len <= 0)
    {
-      daikin.talking = 0;
-      return RES_NOACK;
+      comm_timeout (NULL, 0);
+      return RES_TIMEOUT;
    }
    cs = 0;
    for (int i = 0; i < len - 1; i++)
@@ -1053,11 +970,18 @@ daikin_as_command (int len, uint8_t *buf)
          jo_stringf (j, "bad-cmd", "%c", buf[1]);
       revk_error ("comms", &j);
       if (*res == 0x15 && cs == res[len - 1])
+      {
+         comm_ok ();
          return RES_NAK;
+      }
+      comm_fail ();
+      if (len == sizeof (res) && cs != res[len - 1])
+         return RES_BADSUM;
       return RES_BAD;
    }
    if (*res == buf[1] && !b.protocol_set)
       protocol_found ();
+   comm_ok ();
    daikin_as_response (len, res);
    return RES_OK;
 }
@@ -1068,26 +992,66 @@ daikin_as_poll (char reg)
    uint8_t temp[3];
    temp[0] = 0x02;
    temp[1] = reg;
-   return daikin_as_command (2, temp);
+   int64_t start = esp_timer_get_time ();
+   int r = daikin_as_command (2, temp);
+   res_metric ("AS", reg, 0, start, r);
+   if ((r == RES_TIMEOUT || r == RES_BAD || r == RES_BADSUM) && daikin.talking && b.protocol_set)
+   {                            // Resynced, try again
+      recover.retry++;
+      start = esp_timer_get_time ();
+      r = daikin_as_command (2, temp);
+      res_metric ("AS", reg, 0, start, r);
+   }
+   return r;
+}
+
+void
+daikin_as_poll_due (void)
+{                               // Poll registers that are due, dropping any the unit keeps rejecting
+   static uint32_t next[AS_REGS];
+   static uint8_t nak[AS_REGS];
+   uint32_t now = uptime ();
+   for (int r = 0; r < AS_REGS && daikin.talking; r++)
+   {
+      if (nak[r] >= 2 || next[r] > now)
+         continue;
+      int res = daikin_as_poll (as_regs[r].reg);
+      if (res == RES_OK)
+      {
+         nak[r] = 0;
+         next[r] = now + as_regs[r].interval;
+      } else if (res == RES_NAK)
+         nak[r]++;              // Not supported, probably
+   }
+   if (!daikin.talking)
+   {                            // Start again
+      memset (next, 0, sizeof (next));
+      memset (nak, 0, sizeof (nak));
+   }
 }
 
 static int
-is_valid_s21_response (const uint8_t *buf, int rxlen, uint8_t cmd, uint8_t cmd2)
+s21link_uart_read (void *ctx, uint8_t * buf, int len)
 {
-   return rxlen >= S21_MIN_PKT_LEN && buf[S21_STX_OFFSET] == STX && buf[rxlen - 1] == ETX &&
-      buf[S21_CMD0_OFFSET] == cmd && buf[S21_CMD1_OFFSET] == cmd2;
+   return uart_read_bytes (uart, buf, len, READ_TIMEOUT);
 }
 
-static char
-s21_response_letter (char cmd)
-{                               // What is expected as a response
-   if (cmd == 'A')
-      return 'C';
-   if (cmd == 'M' || cmd == 'V')
-      return cmd;
-   return cmd + 1;
+static void
+s21link_uart_write (void *ctx, const uint8_t * buf, int len)
+{
+   uart_write_bytes (uart, buf, len);
+}
+
+static s21link_t s21link = { s21link_uart_read, s21link_uart_write };
+
+static int
+x50alink_uart_read (void *ctx, uint8_t * buf, int len, int started)
+{
+   return uart_read_bytes (uart, buf, len, started ? X50A_BYTE_TIMEOUT : READ_TIMEOUT);
 }
 
+static x50alink_t x50alink = { x50alink_uart_read, s21link_uart_write };
+
 static jo_t
 jo_s21_alloc (char cmd, char cmd2, const char *payload, int payload_len)
 {
@@ -1104,8 +1068,30 @@ jo_s21_alloc (char cmd, char cmd2, const char *payload, int payload_len)
    return j;
 }
 
-int
-daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
+static const char *const s21probe[] = {
+   "F1", "F2", "F3", "F4", "F5", "F6", "F7", "F8", "F9", "FA", "FB", "FC", "FG", "FK", "FM", "FN", "FP", "FQ", "FR", "FS", "FT", "FV",
+   "RG", "RH", "RI", "Ra", "RL", "Rd", "RN", "RM", "RX", "RD", "Re",
+   "M", "V", "VS000M",
+   "FY00", "FY10", "FY20",
+   "FU00", "FU02", "FU04", "FU05", "FU15", "FU25", "FU35", "FU45", "FU55", "FU65", "FU75", "FU85", "FU95",
+   "FX00", "FX10", "FX20", "FX30", "FX40", "FX50", "FX60", "FX70", "FX80", "FX90", "FXA0", "FXB0", "FXC0", "FXD0", "FXE0", "FXF0",
+   "FX01", "FX11", "FX21", "FX31", "FX41", "FX51", "FX61", "FX71", "FX81",
+};
+
+static void
+probe_rx (const uint8_t * buf, int len)
+{                               // Record response to command being probed, buf NULL for NAK
+   if (!probe.j || probe.got)
+      return;
+   probe.got = 1;
+   if (buf)
+      jo_base16 (probe.j, probe.cmd, buf, len);
+   else
+      jo_null (probe.j, probe.cmd);
+}
+
+static int
+daikin_s21_exchange (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
 {
    // A payload len of -1 means cmd1 and not cmd2 which is special for M and V commands
    if (debug && payload_len > 2 && !b.dumping)
@@ -1115,19 +1101,11 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
    }
    if ((!daikin.talking && !protofix) || payload_len < -1)
       return RES_WAIT;          // Failed
-   uint8_t buf[256],
-     temp;
+   uint8_t buf[256];
    int txlen = S21_MIN_PKT_LEN + payload_len;
    if (!snoop)
    {                            // Send
-      buf[S21_STX_OFFSET] = STX;
-      buf[S21_CMD0_OFFSET] = cmd;
-      if (payload_len >= 0)
-         buf[S21_CMD1_OFFSET] = cmd2;
-      if (payload_len > 0)
-         memcpy (buf + S21_PAYLOAD_OFFSET, payload, payload_len);
-      buf[S21_PAYLOAD_OFFSET + payload_len] = s21_checksum (buf, txlen);
-      buf[S21_PAYLOAD_OFFSET + payload_len + 1] = ETX;
+      s21link_frame (buf, cmd, cmd2, payload, payload_len);
       if (b.dumping)
       {
          jo_t j = jo_comms_alloc ();
@@ -1139,101 +1117,77 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
             jo_null (j, c);
          revk_info ("tx", &j);
       }
-      uart_write_bytes (uart, buf, txlen);
+      s21link.write (s21link.ctx, buf, txlen);
    }
    int rxlen = 0;
    while (1)
    {                            // Allows for continue if unexpected message
-      // Wait ACK. Apparently some models omit it so we allow for a message anyway
-      rxlen = uart_read_bytes (uart, &temp, 1, READ_TIMEOUT);
-      if (rxlen == 0)
+      uint8_t other = 0;
+      int res = s21link_receive (&s21link, cmd, buf, sizeof (buf), &rxlen, &other);
+      if (res == S21LINK_TIMEOUT)
       {
          comm_timeout (NULL, 0);
          return RES_TIMEOUT;
       }
-      if (rxlen != 1 || (temp != ACK && temp != STX))
+      if (res == S21LINK_NAK)
       {
-         // Got something else
-         if (rxlen == 1 && temp == NAK)
-         {
-            // Got an explicit NAK
-            if (debug)
-            {
-               jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
-               jo_bool (j, "nak", 1);
-               revk_error ("comms", &j);
-            } else if (b.dumping)
-            {
-               // We want to see NAKs under info/<name>/rx because we could have sent
-               // this command using command/<name>/send. We want to be informed if
-               // the unit has NAKed it.
-               jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
-               jo_bool (j, "nak", 1);
-               revk_info ("rx", &j);
-            }
-            return RES_NAK;
-         } else
+         // Got an explicit NAK
+         comm_ok ();
+         probe_rx (NULL, 0);
+         if (debug)
          {
-            // Unexpected reply, protocol broken
             jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
-            daikin.talking = 0;
-            jo_bool (j, "noack", 1);
-            jo_stringf (j, "value", "%02X", temp);
+            jo_bool (j, "nak", 1);
             revk_error ("comms", &j);
-            return RES_NOACK;
+         } else if (b.dumping)
+         {
+            // We want to see NAKs under info/<name>/rx because we could have sent
+            // this command using command/<name>/send. We want to be informed if
+            // the unit has NAKed it.
+            jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
+            jo_bool (j, "nak", 1);
+            revk_info ("rx", &j);
          }
+         return RES_NAK;
       }
-      if (temp == STX)
-         *buf = temp;           // No ACK, response started instead.
-      else
+      if (res == S21LINK_NOACK)
       {
-         if (cmd == 'D')
-         {                      // No response expected
-            if (b.dumping)
-            {                   // We may be probing commands manually using command/<name>/send,
-               // and we want to explicitly see ACKs
-               jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
-               jo_bool (j, "ack", 1);
-               revk_info ("rx", &j);
-            }
-            return RES_OK;
-         }
-         while (1)
-         {
-            rxlen = uart_read_bytes (uart, buf, 1, READ_TIMEOUT);
-            if (rxlen != 1)
-            {
-               comm_timeout (NULL, 0);
-               return RES_NOACK;
-            }
-            if (*buf == STX)
-               break;
+         // Unexpected reply, protocol broken
+         jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
+         comm_fail ();
+         jo_bool (j, "noack", 1);
+         jo_stringf (j, "value", "%02X", other);
+         revk_error ("comms", &j);
+         return RES_NOACK;
+      }
+      if (res == S21LINK_ACK)
+      {                         // No response expected
+         comm_ok ();
+         if (b.dumping)
+         {                      // We may be probing commands manually using command/<name>/send,
+            // and we want to explicitly see ACKs
+            jo_t j = jo_s21_alloc (cmd, cmd2, payload, payload_len);
+            jo_bool (j, "ack", 1);
+            revk_info ("rx", &j);
          }
+         return RES_OK;
       }
-      // Receive the rest of response till ETX
-      while (rxlen < sizeof (buf))
+      if (res == S21LINK_NOREPLY)
       {
-         if (uart_read_bytes (uart, buf + rxlen, 1, READ_TIMEOUT) != 1)
-         {
-            comm_timeout (buf, txlen);
-            return RES_NOACK;
-         }
-         rxlen++;
-         if (buf[rxlen - 1] == ETX)
-            break;
+         comm_timeout (buf, rxlen);
+         return RES_NOACK;
       }
       //ESP_LOG_BUFFER_HEX (TAG, buf, rxlen);        // TODO 
-      // Send ACK regardless of packet quality. If we don't ack due to checksum error,
-      // for example, the response will be sent again.
-      // Note not all ACs do that. My FTXF20D doesn't - Sonic-Amiga
-      temp = ACK;
-      uart_write_bytes (uart, &temp, 1);
+      probe_rx (buf, rxlen);
       if (b.dumping || snoop)
       {
          jo_t j = jo_comms_alloc ();
          jo_base16 (j, "dump", buf, rxlen);
-         char c[3] = { buf[1], buf[2] };
-         jo_stringn (j, c, (char *) buf + 3, rxlen - 5);
+         if (rxlen >= S21_MIN_PKT_LEN)
+         {
+            char c[3] = { buf[1], buf[2] };
+            jo_stringn (j, c, (char *) buf + 3, rxlen - 5);
+         }
          revk_info ("rx", &j);
       }
       int s21_bad (jo_t j)
@@ -1244,7 +1198,8 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
          {
             sleep (1);
             uart_flush (uart);
-         }
+         } else
+            comm_fail ();
          return RES_BAD;
       }
       // Check checksum
@@ -1253,7 +1208,8 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
       {                         // Sees checksum of 03 actually sends as 05
          jo_t j = jo_comms_alloc ();
          jo_stringf (j, "badsum", "%02X", c);
-         return s21_bad (j);
+         s21_bad (j);
+         return RES_BADSUM;
       }
       // For reliability, verify that we've got back the exact transmitted data
       // We're using the same buf for both tx and rx, so our sent packet is gone
@@ -1282,24 +1238,51 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
       // incremented by 1, the second character is left intact
       if (!snoop && !is_valid_s21_response (buf, rxlen, r, cmd2))
       {                         // Malformed response, no proper S21
-         daikin.talking = 0;    // Protocol is broken, will restart communication
+         if (!b.protocol_set)
+            daikin.talking = 0; // Protocol is broken, will restart communication
          jo_t j = jo_comms_alloc ();
          jo_stringf (j, "cmd", "%c%c", cmd, cmd2);
          if (buf[0] != STX)
             jo_bool (j, "badhead", 1);
          if (buf[1] != r || buf[2] != cmd2)
+         {                      // We got an extra unexpected message, so wait for another
             jo_bool (j, "mismatch", 1);
-         s21_bad (j);
-         if (buf[1] != r || buf[2] != cmd2)
-            continue;           // We got an extra unexpected message, so wait for another
+            if (!b.protocol_set)
+               s21_bad (j);
+            else
+            {
+               jo_base16 (j, "data", buf, rxlen);
+               revk_error ("comms", &j);
+            }
+            continue;
+         }
+         return s21_bad (j);
       }
       break;
    }
+   comm_ok ();
    return daikin_s21_response (buf[S21_CMD0_OFFSET], buf[S21_CMD1_OFFSET], rxlen - S21_MIN_PKT_LEN, buf + S21_PAYLOAD_OFFSET);
 }
 
-void
-daikin_x50a_command (uint8_t cmd, int txlen, uint8_t *payload)
+int
+daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
+{                               // Send command, and if it failed but we resynced, try once more
+   int64_t start = esp_timer_get_time ();
+   int r = daikin_s21_exchange (cmd, cmd2, payload_len, payload);
+   if (!snoop)
+      res_metric ("S21", cmd, payload_len < 0 ? 0 : cmd2, start, r);
+   if ((r == RES_TIMEOUT || r == RES_NOACK || r == RES_BAD || r == RES_BADSUM) && daikin.talking && b.protocol_set && !snoop)
+   {
+      recover.retry++;
+      start = esp_timer_get_time ();
+      r = daikin_s21_exchange (cmd, cmd2, payload_len, payload);
+      res_metric ("S21", cmd, payload_len < 0 ? 0 : cmd2, start, r);
+   }
+   return r;
+}
+
+static int
+daikin_x50a_exchange (uint8_t cmd, int txlen, uint8_t *payload)
 {                               // Send a command and get response
    if (debug && txlen)
    {
@@ -1309,56 +1292,52 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t *payload)
       revk_info (daikin.talking || protofix ? "tx" : "cannot-tx", &j);
    }
    if (!daikin.talking && !protofix)
-      return;                   // Failed
+      return RES_WAIT;          // Failed
    uint8_t buf[256];
-   buf[0] = 0x06;
-   buf[1] = cmd;
-   buf[2] = txlen + 6;
-   buf[3] = 1;
-   buf[4] = 0;
-   if (txlen)
-      memcpy (buf + 5, payload, txlen);
-   uint8_t c = 0;
-   for (int i = 0; i < 5 + txlen; i++)
-      c += buf[i];
-   buf[5 + txlen] = ~c;
+   int rxlen = x50alink_frame (buf, cmd, payload, txlen);
    if (b.dumping)
    {
       jo_t j = jo_comms_alloc ();
-      jo_base16 (j, "dump", buf, txlen + 6);
+      jo_base16 (j, "dump", buf, rxlen);
       revk_info ("tx", &j);
    }
-   uart_write_bytes (uart, buf, 6 + txlen);
-   // Wait for reply
-   int rxlen = uart_read_bytes (uart, buf, sizeof (buf), READ_TIMEOUT);
-   if (rxlen <= 0)
+   uart_write_bytes (uart, buf, rxlen);
+   int r = x50alink_receive (&x50alink, cmd, buf, sizeof (buf), &rxlen);
+   if (r == X50ALINK_TIMEOUT)
    {
       comm_timeout (NULL, 0);
-      return;
+      return RES_TIMEOUT;
    }
-   if (b.dumping)
-   {
+   if (r == X50ALINK_PARTIAL)
+   {                            // Partial frame, header only or short, drop it and resync on next header
+      comm_fail ();
       jo_t j = jo_comms_alloc ();
-      jo_base16 (j, "dump", buf, rxlen);
+      jo_bool (j, "partial", 1);
+      jo_base16 (j, "data", buf, rxlen);
+      revk_error ("comms", &j);
+      return RES_BAD;
+   }
+   if (b.dumping)
+   {
+      jo_t j = jo_comms_alloc ();
+      jo_base16 (j, "dump", buf, rxlen);
       revk_info ("rx", &j);
    }
-   // Check checksum
-   c = 0;
-   for (int i = 0; i < rxlen; i++)
-      c += buf[i];
-   if (c != 0xFF)
+   if (r == X50ALINK_BADSUM)
    {
-      daikin.talking = 0;
+      uint8_t c = 0;
+      for (int i = 0; i < rxlen; i++)
+         c += buf[i];
+      comm_fail ();
       jo_t j = jo_comms_alloc ();
       jo_stringf (j, "badsum", "%02X", c);
       jo_base16 (j, "data", buf, rxlen);
       revk_error ("comms", &j);
-      return;
+      return RES_BADSUM;
    }
-   // Process response
-   if (rxlen < 6 || buf[0] != 0x06 || buf[1] != cmd || buf[2] != rxlen || buf[3] != 1)
+   if (r == X50ALINK_BAD)
    {                            // Basic checks
-      daikin.talking = 0;
+      comm_fail ();
       jo_t j = jo_comms_alloc ();
       if (buf[0] != 0x06)
          jo_bool (j, "badhead", 1);
@@ -1370,9 +1349,9 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t *payload)
          jo_bool (j, "badform", 1);
       jo_base16 (j, "data", buf, rxlen);
       revk_error ("comms", &j);
-      return;
+      return RES_BAD;
    }
-   if (!buf[4])
+   if (r == X50ALINK_LOOPBACK)
    {                            // Tx sends 00 here, rx is 06
       daikin.talking = 0;
       if (!b.loopback)
@@ -1384,28 +1363,57 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t *payload)
          jo_bool (j, "loopback", 1);
          revk_error ("comms", &j);
       }
-      return;
+      return RES_OK;
    }
    b.loopback = 0;
+   comm_ok ();
    if (buf[0] == 0x06 && !b.protocol_set && (buf[1] != 0xFF || (proto & PROTO_TXINVERT)))
       protocol_found ();
-   if (buf[1] == 0xFF)
+   if (r == X50ALINK_FAULT)
    {                            // Error report
       jo_t j = jo_comms_alloc ();
       jo_bool (j, "fault", 1);
       jo_base16 (j, "data", buf, rxlen);
       revk_error ("comms", &j);
-      return;
+      return RES_NAK;
    }
    daikin_x50a_response (cmd, rxlen - 6, buf + 5);
+   return RES_OK;
 }
 
+void
+daikin_x50a_command (uint8_t cmd, int txlen, uint8_t *payload)
+{                               // Send a command, and if it failed but we resynced, try once more
+   int64_t start = esp_timer_get_time ();
+   int r = daikin_x50a_exchange (cmd, txlen, payload);
+   res_metric ("X50A", cmd, 0, start, r);
+   if ((r == RES_TIMEOUT || r == RES_BAD || r == RES_BADSUM) && daikin.talking && b.protocol_set)
+   {
+      recover.retry++;
+      start = esp_timer_get_time ();
+      r = daikin_x50a_exchange (cmd, txlen, payload);
+      res_metric ("X50A", cmd, 0, start, r);
+   }
+}
+
+static schedule_t sched = { 0 };
+
+static uint8_t sched_reload = 1;        // Schedule settings changed
+
+static char sched_nexttext[48] = "";    // Next event, for status
+
 // Parse control JSON, arrived by MQTT, and apply values
 const char *
 daikin_control (jo_t j, uint8_t insecure)
 {                               // Control settings as JSON
    jo_type_t t = jo_next (j);   // Start object
    jo_t s = NULL;
+   char *events[SCHEDULE_MAX] = { 0 };  // Changed schedule events, stored as one schedule array at the end
+   void free_events (void)
+   {
+      for (int i = 0; i < SCHEDULE_MAX; i++)
+         free (events[i]);
+   }
    while (t == JO_TAG)
    {
       const char *err = NULL;
@@ -1442,6 +1450,33 @@ daikin_control (jo_t j, uint8_t insecure)
                s = jo_object_alloc ();
             jo_bool (s, tag, *val == 't');
          }
+         if (!strncmp (tag, "schedule", 8) && isdigit ((int) tag[8]) && t == JO_STRING)
+         {                      // Stored settings, one schedule event, e.g. schedule1, blank to delete
+            int n = atoi (tag + 8);
+            char event[64] = "";
+            jo_strncpy (j, event, sizeof (event));
+            schedule_event_t e;
+            if (n < 1 || n > SCHEDULE_MAX)
+               err = "Bad schedule event number";
+            else if (!*event || !(err = schedule_parse (event, &e)))
+            {
+               free (events[n - 1]);
+               events[n - 1] = strdup (event);
+               sched_reload = 1;
+            }
+         }
+         if (!strcmp (tag, "holiday"))
+         {                      // Stored settings, "on", or last day YYYY-MM-DD, or true/false
+            if (t == JO_STRING && *val && strcmp (val, "on") && (strlen (val) != 10 || val[4] != '-' || val[7] != '-'))
+               err = "Expecting holiday \"on\" or last day YYYY-MM-DD";
+            else
+            {
+               if (!s)
+                  s = jo_object_alloc ();
+               jo_string (s, tag, t == JO_TRUE ? "on" : t == JO_STRING ? val : "");
+               sched_reload = 1;
+            }
+         }
          if (!strcmp (tag, "autoe"))
          {
             if (!s)
@@ -1463,10 +1498,23 @@ daikin_control (jo_t j, uint8_t insecure)
          jo_string (j, "field", tag);
          jo_string (j, "error", err);
          revk_error ("control", &j);
+         free_events ();
          return err;
       }
       t = jo_skip (j);
    }
+   for (int n = 0; n < SCHEDULE_MAX; n++)
+      if (events[n])
+      {                         // One schedule array, with all events changed
+         if (!s)
+            s = jo_object_alloc ();
+         jo_array (s, "schedule");
+         for (int i = 0; i < SCHEDULE_MAX; i++)
+            jo_string (s, NULL, events[i] ? : schedule[i] ? : "");
+         jo_close (s);
+         break;
+      }
+   free_events ();
    if (s)
    {
       revk_settings_store (s, NULL, 1);
@@ -1478,22 +1526,121 @@ daikin_control (jo_t j, uint8_t insecure)
 // --------------------------------------------------------------------------------
 jo_t debugsend = NULL;
 
+static fusion_t fusion = { 0 };
+
 void
-autosub (void *json, const char *topic, jo_t j)
-{
-   if (!ble_sensor_connected () && jo_find (j, (char *) json) == JO_NUMBER)
+autosub (void *arg, const char *topic, jo_t j)
+{                               // Reference temperature from MQTT topic, arg is which topic
+   if (jo_find (j, *autopayload ? autopayload : "env") == JO_NUMBER)
    {
       xSemaphoreTake (daikin.mutex, portMAX_DELAY);
       daikin.controlvalid = uptime () + tcontrol;
-      float env = jo_read_float (j);
-      if (daikin.env != env)
-         daikin.status_changed = 1;
-      daikin.env = env;
-      daikin.status_known |= CONTROL_env;       // So we report it
+      fusion_set (&fusion, FUSION_TOPIC + (intptr_t) arg, jo_read_float (j), uptime ());
       xSemaphoreGive (daikin.mutex);
    }
 }
 
+static demand_signal_t drsignal = {.cap = NAN,.price = NAN };
+
+static demand_out_t drout = { 0 };
+
+static const char *
+demand_signal (jo_t j)
+{                               // Demand response signal, cap (W) and/or price, and for (s), null or {} to clear
+   demand_signal_t s = {.cap = NAN,.price = NAN };
+   uint32_t valid = drfor;
+   jo_type_t t = jo_next (j);   // Start object
+   if (t != JO_TAG && t != JO_CLOSE)
+      return "Expecting JSON object";
+   while (t == JO_TAG)
+   {
+      char tag[8] = "";
+      jo_strncpy (j, tag, sizeof (tag));
+      t = jo_next (j);
+      if (t == JO_NUMBER)
+      {
+         if (!strcmp (tag, "cap"))
+            s.cap = jo_read_float (j);
+         else if (!strcmp (tag, "price"))
+            s.price = jo_read_float (j);
+         else if (!strcmp (tag, "for"))
+            valid = jo_read_int (j);
+      }
+      t = jo_skip (j);
+   }
+   s.until = (isnan (s.cap) && isnan (s.price) ? 0 : uptime () + valid);
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   drsignal = s;
+   xSemaphoreGive (daikin.mutex);
+   return "";
+}
+
+static void
+drsub (void *arg, const char *topic, jo_t j)
+{
+   demand_signal (j);
+}
+
+static group_t group = { 0 };
+
+static char *grouptopic = NULL;
+
+static void
+groupsub (void *arg, const char *topic, jo_t j)
+{                               // Faikout auto group announcement, and plan if from leader
+   group_member_t m = { 0 };
+   group_plan_t p = { 0 };
+   uint8_t plan = 0;
+   jo_type_t t = jo_next (j);   // Start object
+   while (t == JO_TAG)
+   {
+      char tag[12] = "";
+      jo_strncpy (j, tag, sizeof (tag));
+      t = jo_next (j);
+      if (!strcmp (tag, "id") && t == JO_STRING)
+         jo_strncpy (j, m.id, sizeof (m.id));
+      else if (!strcmp (tag, "heat"))
+         m.heat = (t == JO_TRUE);
+      else if (!strcmp (tag, "want"))
+         m.want = (t == JO_TRUE);
+      else if (!strcmp (tag, "running"))
+         m.running = (t == JO_TRUE);
+      else if (!strcmp (tag, "slave"))
+         m.slave = (t == JO_TRUE);
+      else if (!strcmp (tag, "antifreeze"))
+         m.antifreeze = (t == JO_TRUE);
+      else if (!strcmp (tag, "plan") && t == JO_OBJECT)
+      {
+         plan = 1;
+         t = jo_next (j);
+         while (t == JO_TAG)
+         {
+            jo_strncpy (j, tag, sizeof (tag));
+            t = jo_next (j);
+            if (!strcmp (tag, "grant") && t == JO_STRING)
+               jo_strncpy (j, p.grant, sizeof (p.grant));
+            else if (!strcmp (tag, "heat") && (t == JO_TRUE || t == JO_FALSE))
+            {
+               p.mode = 1;
+               p.heat = (t == JO_TRUE);
+            }
+            t = jo_skip (j);
+         }
+         t = jo_next (j);       // Past end of plan
+         continue;
+      }
+      t = jo_skip (j);          // Past value, including any object or array not used
+   }
+   if (!*m.id || !strcmp (m.id, revk_id))
+      return;                   // Bad, or our own
+   uint32_t now = uptime ();
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   group_heard (&group, &m, now);
+   if (plan)
+      group_plan_heard (&group, &p, now);
+   xSemaphoreGive (daikin.mutex);
+}
+
 // Called by an MQTT client inside the revk library
 const char *
 mqtt_client_callback (int client, const char *prefix, const char *target, const char *suffix, jo_t j)
@@ -1513,6 +1660,19 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
       daikin.status_report = 1; // Report status on connect
       daikin.ha_send = 1;
    }
+   if (!strcmp (suffix, "dr"))
+   {                            // Demand response signal
+      if (!j)
+         return "Specify cap and/or price";
+      return demand_signal (j);
+   }
+   if (!strcmp (suffix, "probe"))
+   {                            // Send all known S21 query commands, responses reported in one info/probe
+      if (proto_type () != PROTO_TYPE_S21)
+         return "Probe is for S21";
+      b.probe = 1;
+      return "";
+   }
    if (!strcmp (suffix, "send"))
    {
       if (!j)
@@ -1585,13 +1745,7 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
          daikin.mintarget = min;
          daikin.maxtarget = max;
       }
-      if (!ble_sensor_connected ())
-      {
-         if (daikin.env != env)
-            daikin.status_changed = 1;
-         daikin.env = env;
-         daikin.status_known |= CONTROL_env;    // So we report it
-      }
+      fusion_set (&fusion, FUSION_CONTROL, env, uptime ());
       xSemaphoreGive (daikin.mutex);
       return ret ? : "";
    }
@@ -1708,11 +1862,18 @@ daikin_status (void)
    xSemaphoreTake (daikin.mutex, portMAX_DELAY);
    jo_t j = jo_comms_alloc ();
 #define b(name)         if(daikin.status_known&CONTROL_##name)jo_bool(j,#name,daikin.name);
-#define t(name)         if(daikin.status_known&CONTROL_##name){if(isnan(daikin.name)||daikin.name>=100)jo_null(j,#name);else jo_litf(j,#name,"%.1f",daikin.name);}
+#define t(name)         if((daikin.status_known&CONTROL_##name)&&CONTROL_##name##_pos!=CONTROL_discharge_pos){if(isnan(daikin.name)||daikin.name>=100)jo_null(j,#name);else jo_litf(j,#name,"%.1f",daikin.name);}
 #define i(name)         if(daikin.status_known&CONTROL_##name)jo_int(j,#name,daikin.name);
 #define e(name,values)  if((daikin.status_known&CONTROL_##name)&&daikin.name<sizeof(CONTROL_##name##_VALUES)-1)jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[daikin.name]);
 #define s(name,len)     if((daikin.status_known&CONTROL_##name)&&*daikin.name)jo_string(j,#name,daikin.name);
 #include "acextras.m"
+   if (daikin.status_known & CONTROL_discharge)
+   {                            // Compressor discharge is often over 100C, so not capped as other temperatures
+      if (isnan (daikin.discharge))
+         jo_null (j, "discharge");
+      else
+         jo_litf (j, "discharge", "%.1f", daikin.discharge);
+   }
 #ifdef	ELA
    if (ble_sensor_connected ())
    {
@@ -1730,6 +1891,8 @@ daikin_status (void)
    if (ble_sensor_enabled ())
       jo_string (j, "autob", autob);
 #endif
+   if (daikin.status_known & CONTROL_env)
+      jo_int (j, "confidence", roundf (daikin.confidence * 100));
    if (daikin.remote)
    {
       jo_bool (j, "remote", 1);
@@ -1744,6 +1907,20 @@ daikin_status (void)
       jo_bool (j, "autop", autop);
       jo_bool (j, "autoe", autoe);
    }
+   if (*holiday)
+      jo_string (j, "holiday", holiday);
+   if (*sched_nexttext)
+      jo_string (j, "next", sched_nexttext);
+   if (drout.active)
+   {
+      jo_object (j, "dr");
+      jo_int (j, "demand", drout.demand);
+      jo_litf (j, "offset", "%.1f", drout.offset);
+      jo_bool (j, "econo", drout.econo);
+      if (drout.comfort)
+         jo_bool (j, "comfort", 1);
+      jo_close (j);
+   }
    xSemaphoreGive (daikin.mutex);
    return j;
 }
@@ -1985,6 +2162,26 @@ web_control (httpd_req_t *req)
          revk_web_send (req, "<tr>");
          addtime ("On", "auto1");
          addtime ("Off", "auto0");
+         revk_web_send (req, "</tr>");
+         addnote ("Weekly schedule, e.g. <i>mon-fri 06:30 on heat 21 fan3</i>, <i>daily 22:30 off</i>, blank to delete.");
+         int n = 0;
+         for (int i = 0; i < SCHEDULE_MAX; i++)
+            if (schedule[i] && *schedule[i])
+               n = i + 1;
+         for (int i = 0; i < SCHEDULE_MAX && i <= n; i++)
+         {
+            char safe[64],
+             *o = safe;
+            for (const char *p = schedule[i] ? : ""; *p && o < safe + sizeof (safe) - 1; p++)
+               if (*p != '"' && *p != '<' && *p != '&')
+                  *o++ = *p;    // Not valid in an event anyway
+            *o = 0;
+            revk_web_send (req,
+                           "<tr><td colspan=6><input size=40 id='schedule%d' value=\"%s\" onchange=\"w('schedule%d',this.value);\"></td></tr>",
+                           i + 1, safe, i + 1);
+         }
+         revk_web_send (req,
+                        "<tr><td>Holiday</td><td colspan=5><input size=10 id=holiday title=\"Schedule suspended and off, on, or last day YYYY-MM-DD\" onchange=\"w('holiday',this.value);\"> <span id=next></span></td>");
       }
       revk_web_send (req, "</tr>");
 #ifdef ELA
@@ -2053,6 +2250,8 @@ web_control (httpd_req_t *req)
                   "n('autob',o.autob);" //
                   "n('auto0',o.auto0);" //
                   "n('auto1',o.auto1);" //
+                  "n('holiday',o.holiday||'');" //
+                  "s('next',o.next?'Next: '+o.next:'');"      //
                   "n('autot',o.autot);" //
                   "s('Tautot',(o.autot?cf(o.autot):''));"       //
                   "s('0/1',(o.slave?'❋':'')+(o.antifreeze?'❄':''));"        //
@@ -2258,7 +2457,16 @@ legacy_web_set_holiday (httpd_req_t *req)
       err = "Query failed";
    else
    {
-      // TODO - ignore for now
+      if (jo_find (j, "en_hol"))
+      {                         // Holiday, until turned off
+         char val[5] = "";
+         jo_strncpy (j, val, sizeof (val));
+         jo_t s = jo_object_alloc ();
+         jo_string (s, "holiday", atoi (val) ? "on" : "");
+         revk_settings_store (s, NULL, 1);
+         jo_free (&s);
+         sched_reload = 1;
+      }
       jo_free (&j);
    }
    return legacy_simple_response (req, err);
@@ -2298,7 +2506,7 @@ legacy_web_set_demand_control (httpd_req_t *req)
 static void
 jo_protocol_version (jo_t j)
 {
-   jo_int (j, "pv", daikin.protocol_ver);       //Conditioner protocol version
+   jo_int (j, "pv", ac.protocol_ver);       //Conditioner protocol version
    jo_int (j, "cpv", 3);        // Controller protocol version 
    jo_string (j, "cpv_minor", "20");    //
 }
@@ -2455,9 +2663,7 @@ legacy_web_set_control_info (httpd_req_t *req)
          char *v = jo_strdup (j);
          if (v)
          {
-            int n = atoi (v);
-            static int8_t modes[] = { 3, 3, 7, 2, 1, -1, 0, 3 };        // AADCH-FA
-            int8_t setval = (n >= 0 && n <= 7) ? modes[n] : -1;
+            int setval = acproto_legacy_mode (v);
             if (setval == -1)
                err = "Invalid mode value";
             else
@@ -2477,15 +2683,7 @@ legacy_web_set_control_info (httpd_req_t *req)
          char *v = jo_strdup (j);
          if (v)
          {
-            int8_t setval;
-            if (*v == 'A')
-               setval = 0;
-            else if (*v == 'B')
-               setval = 6;
-            else if (*v >= '3' && *v <= '7')
-               setval = *v - '2';
-            else
-               setval = -1;
+            int setval = acproto_legacy_fan (v);
             if (setval == -1)
                err = "Invalid f_rate value";
             else
@@ -2501,7 +2699,7 @@ legacy_web_set_control_info (httpd_req_t *req)
          if (v)
          {
             int n = atoi (v);
-            daikin_set_v_e (err, swingv, n);
+            daikin_set_v_e (err, swingv, n & 1);
             daikin_set_v_e (err, swingh, !!(n & 2));
          }
          free (v);
@@ -2547,10 +2745,7 @@ static esp_err_t
 legacy_web_get_year_power (httpd_req_t *req)
 {
    jo_t j = legacy_ok ();
-   jo_stringf (j, "curr_year_heat", "%u/0/0/0/0/0/0/0/0/0/0/0", daikin.Wh / 100);       // Bodge, does not resent each year yet
-   jo_string (j, "prev_year_heat", "0/0/0/0/0/0/0/0/0/0/0/0");
-   jo_string (j, "curr_year_cool", "0/0/0/0/0/0/0/0/0/0/0/0");
-   jo_string (j, "prevyear_cool", "0/0/0/0/0/0/0/0/0/0/0/0");
+   energy_legacy_year (j);      // Per month, 0.1kWh
    return legacy_send (req, &j);
 }
 
@@ -2558,10 +2753,9 @@ static esp_err_t
 legacy_web_get_week_power (httpd_req_t *req)
 {
    // ret=OK,s_dayw=2,week_heat=0/0/0/0/0/0/0/0/0/0/0/0/0/0,week_cool=0/0/0/0/0/0/0/0/0/0/0/0/0/0
-   // Have no idea how to implement it, perhaps the original module keeps some internal statistics.
-   // For now let's just prevent errors in OpenHAB and return an empty OK response
-   // Note all zeroes from my BRP
+   // Per day, today first, 0.1kWh
    jo_t j = legacy_ok ();
+   energy_legacy_week (j);
    return legacy_send (req, &j);
 }
 
@@ -2889,6 +3083,10 @@ send_ha_config (void)
    addtemp (daikin.status_known & CONTROL_home, "achome", "AC-Home", "mdi:thermometer");
    addtemp (daikin.status_known & CONTROL_outside, "outside", "Outside", "mdi:thermometer");
    addtemp (daikin.status_known & CONTROL_liquid, "liquid", "Liquid", "mdi:coolant-temperature");
+   addtemp (daikin.status_known & CONTROL_lwt, "lwt", "Leaving water", "mdi:water-thermometer");
+   addtemp (daikin.status_known & CONTROL_rwt, "rwt", "Return water", "mdi:water-thermometer");
+   addtemp (daikin.status_known & CONTROL_dhw, "dhw", "Hot water", "mdi:water-boiler");
+   addtemp (daikin.status_known & CONTROL_discharge, "discharge", "Discharge", "mdi:coolant-temperature");
    addfreq (daikin.status_known & CONTROL_comp, "comp", "Compressor", hacomprpm ? "rpm" : "Hz", "mdi:sine-wave");
    addfreq (daikin.status_known & CONTROL_fanrpm, "fanfreq", "Fan", hafanrpm ? "rpm" : "Hz", "mdi:fan");
    addswitch (haswitches && (daikin.status_known & CONTROL_power), "power", "Power", "mdi:power");
@@ -2982,6 +3180,29 @@ send_ha_config (void)
       }
       free (topic);
    }
+   void addenergy (const char *tag, const char *name, const char *field)
+   {                            // Energy by use, from energy metering
+      if (asprintf (&topic, "%s/sensor/%s%s/config", topicha, revk_id, tag) >= 0)
+      {
+         if (!(daikin.status_known & CONTROL_Wh))
+            revk_mqtt_send_str (topic);
+         else
+         {
+            jo_t j = make (tag, NULL);
+            jo_string (j, "name", name);
+            jo_string (j, "dev_cla", "energy");
+            jo_string (j, "stat_t", hastatus);
+            jo_string (j, "unit_of_meas", "kWh");
+            jo_string (j, "state_class", "total_increasing");
+            jo_stringf (j, "val_tpl", "{{(value_json.energy.%s|float)/1000}}", field);
+            revk_mqtt_send (NULL, 1, topic, &j);
+         }
+         free (topic);
+      }
+   }
+   addenergy ("heatenergy", "Heating energy", "heat");
+   addenergy ("coolenergy", "Cooling energy", "cool");
+   addenergy ("fanenergy", "Fan energy", "fan");
    // TODO change above over gradually to new HA library stuff to make way neater
    ha_config_sensor ("ram",.name = "RAM",.field = "mem",.unit = "B",.delete = !haram);
    ha_config_sensor ("spi",.name = "PSRAM",.field = "spi",.unit = "B",.delete = !haram);
@@ -3025,10 +3246,20 @@ revk_state_extra (jo_t j)
       jo_litf (j, "outside", "%.2f", daikin.outside);
    if (daikin.status_known & CONTROL_liquid)
       jo_litf (j, "liquid", "%.2f", daikin.liquid);
+   if (daikin.status_known & CONTROL_lwt)
+      jo_litf (j, "lwt", "%.2f", daikin.lwt);
+   if (daikin.status_known & CONTROL_rwt)
+      jo_litf (j, "rwt", "%.2f", daikin.rwt);
+   if (daikin.status_known & CONTROL_dhw)
+      jo_litf (j, "dhw", "%.2f", daikin.dhw);
+   if (daikin.status_known & CONTROL_discharge)
+      jo_litf (j, "discharge", "%.2f", daikin.discharge);
    if (daikin.status_known & CONTROL_demand)
       jo_int (j, "demand", daikin.demand);
    if ((daikin.status_known & CONTROL_Wh) && daikin.Wh)
       jo_int (j, "Wh", daikin.Wh);
+   if (daikin.status_known & CONTROL_Wh)
+      energy_json (j);
    if (daikin.status_known & CONTROL_fanrpm)
    {
       if (hafanrpm)
@@ -3204,6 +3435,665 @@ revk_web_extra (httpd_req_t *req, int page)
    }
 }
 
+// --------------------------------------------------------------------------------
+// Tasks - protocol (app_main), automation and reporting
+
+typedef struct
+{
+   int64_t start;               // Start of this cycle (us)
+   uint32_t cycle;              // Last cycle time (us)
+   uint32_t max;                // Worst cycle time since last report (us)
+   uint32_t late;               // Worst wake up latency since last report (us)
+} task_timing_t;
+
+static task_timing_t tt_protocol,
+  tt_automation,
+  tt_reporting;
+
+static void
+task_begin (task_timing_t * t, int64_t due)
+{                               // Start of cycle, due is when we should have started (0 if event driven)
+   t->start = esp_timer_get_time ();
+   if (due && t->start - due > t->late)
+      t->late = t->start - due;
+}
+
+static void
+task_sleep (task_timing_t * t)
+{                               // Wait for next second, and start cycle
+   int64_t now = esp_timer_get_time ();
+   int64_t due = now - (now % 1000000LL) + 1000000LL;
+   usleep (due - now);
+   task_begin (t, due);
+}
+
+static void
+task_end (task_timing_t * t)
+{                               // End of cycle
+   t->cycle = esp_timer_get_time () - t->start;
+   if (t->cycle > t->max)
+      t->max = t->cycle;
+}
+
+static void
+task_report (jo_t j)
+{                               // Add task timings to report, and reset worst case
+   void add (const char *tag, task_timing_t * t)
+   {
+      jo_object (j, tag);
+      jo_int (j, "cycle", t->cycle);
+      jo_int (j, "max", t->max);
+      jo_int (j, "late", t->late);
+      jo_close (j);
+      t->max = t->late = 0;
+   }
+   jo_object (j, "tasks");
+   add ("protocol", &tt_protocol);
+   add ("automation", &tt_automation);
+   add ("reporting", &tt_reporting);
+   jo_close (j);
+}
+
+// Lock free snapshot of daikin, published by the protocol task after each poll.
+// Changes from other tasks go via daikin_set_*, i.e. control_changed, which the protocol task sends to the aircon.
+static typeof (daikin) daikin_snap;
+static volatile uint32_t daikin_seq;    // Odd while being updated
+static SemaphoreHandle_t daikin_polled; // Given after each publish
+static volatile uint32_t polls; // Polls since (re)connecting
+
+static void
+daikin_publish (void)
+{                               // Protocol task only
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   daikin_seq++;
+   __sync_synchronize ();
+   memcpy (&daikin_snap, &daikin, sizeof (daikin));
+   __sync_synchronize ();
+   daikin_seq++;
+   xSemaphoreGive (daikin.mutex);
+   xSemaphoreGive (daikin_polled);
+}
+
+static void
+daikin_snapshot (typeof (daikin) * s)
+{                               // Consistent copy, without blocking the protocol task
+   uint32_t seq;
+   do
+   {
+      while ((seq = daikin_seq) & 1)
+         usleep (1000);
+      __sync_synchronize ();
+      memcpy (s, &daikin_snap, sizeof (*s));
+      __sync_synchronize ();
+   }
+   while (seq != daikin_seq);
+}
+
+static void
+daikin_schedule (const typeof (daikin) * snap)
+{                               // Weekly schedule, and holiday, called each poll
+   static uint32_t hash = 0;
+   static int lastweek = -1;
+   static time_t due = 0,       // When next event due, 0 if none
+      began = 0;                // Warm-up started, 0 if not tracking
+   static float start = 0;      // Warm-up start temp
+   static uint8_t hot = 0,      // Warm-up is heating
+      away = 0;                 // Holiday active
+   time_t clock = time (0);
+   if (clock < 1000000000)
+      return;                   // Clock not set
+   struct tm tm;
+   localtime_r (&clock, &tm);
+   int week = tm.tm_wday * 1440 + tm.tm_hour * 60 + tm.tm_min;
+   float env = ((snap->status_known & CONTROL_env) ? snap->env : (snap->status_known & CONTROL_home) ? snap->home : NAN);
+   void plan (time_t from)
+   {                            // Next event strictly after from
+      struct tm t;
+      localtime_r (&from, &t);
+      schedule_next (&sched, t.tm_wday * 1440 + t.tm_hour * 60 + t.tm_min);
+      due = 0;
+      if (sched.nextin > 0)
+      {                         // Local time, so allows for DST changes
+         t.tm_min += sched.nextin;
+         t.tm_sec = 0;
+         t.tm_isdst = -1;
+         due = mktime (&t);
+      }
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      *sched_nexttext = 0;
+      if (due)
+      {
+         struct tm d;
+         localtime_r (&due, &d);
+         char text[40];
+         schedule_text (&sched.event[sched.next], text, sizeof (text));
+         snprintf (sched_nexttext, sizeof (sched_nexttext), "%.3s %s", "SunMonTueWedThuFriSat" + d.tm_wday * 3, text);
+      }
+      xSemaphoreGive (daikin.mutex);
+   }
+   if (week != lastweek || sched_reload)
+   {                            // Each minute, settings changed, and holiday
+      if (!sched.heatrate && !sched.coolrate)
+      {                         // Learned rates, as saved
+         sched.heatrate = (float) schedheatrate / schedheatrate_scale;
+         sched.coolrate = (float) schedcoolrate / schedcoolrate_scale;
+      }
+      uint32_t h = 0;
+      for (int i = 0; i < SCHEDULE_MAX; i++)
+         for (const char *p = schedule[i]; p && *p; p++)
+            h = h * 31 + *p;
+      if (h != hash || sched_reload || due > clock + SCHEDULE_WEEK * 60)
+      {                         // Changed, or clock went back
+         hash = h;
+         const char *err = schedule_load (&sched, (const char *const *) schedule, SCHEDULE_MAX);
+         if (err && sched_reload)
+         {
+            jo_t j = jo_object_alloc ();
+            jo_string (j, "error", err);
+            revk_error ("schedule", &j);
+         }
+         plan (clock);
+      }
+      sched_reload = 0;
+      lastweek = week;
+      char today[11];
+      strftime (today, sizeof (today), "%F", &tm);
+      uint8_t was = away;
+      away = (!strcmp (holiday, "on") || (*holiday && strcmp (today, holiday) <= 0));
+      if (away && !was)
+      {                         // Holiday starts, off
+         daikin_set_v (power, 0);
+         began = 0;
+      }
+   }
+   if (began)
+   {                            // Learn warm-up rate
+      if (!snap->power || snap->heat != hot || isnan (env) || clock > began + schedmaxlead * 60 * 2)
+         began = 0;             // Gave up
+      else if (hot ? env >= snap->mintarget : env <= snap->maxtarget)
+      {                         // Reached target range
+         schedule_learn (&sched, hot, hot ? env - start : start - env, clock - began);
+         began = 0;
+         jo_t j = jo_object_alloc ();
+         jo_litf (j, hot ? "schedheatrate" : "schedcoolrate", "%.1f", hot ? sched.heatrate : sched.coolrate);
+         revk_settings_store (j, NULL, 1);
+         jo_free (&j);
+      }
+   }
+   if (!due)
+      return;
+   const schedule_event_t *e = &sched.event[sched.next];
+   if (clock + (schedpreheat ? schedule_lead (&sched, e, snap->heat, env, schedmaxlead * 60) : 0) < due)
+      return;                   // Not yet
+   if (!away)
+   {                            // Apply event, as control message
+      jo_t j = jo_object_alloc ();
+      if (e->power >= 0)
+         jo_bool (j, "power", e->power);
+      if (e->mode)
+         jo_stringf (j, "mode", "%c", e->mode);
+      if (e->fan)
+         jo_stringf (j, "fan", "%c", e->fan);
+      if (e->target)
+         jo_litf (j, autoe && autor ? "autot" : "temp", "%.1f", e->target / 10.0);
+      jo_close (j);
+      jo_rewind (j);
+      daikin_control (j, 1);
+      jo_free (&j);
+      began = 0;
+      if (e->target && e->power && autoe && autor && !isnan (env) && (!e->mode || e->mode == 'H' || e->mode == 'C'))
+      {                         // Track warm-up, to learn rate
+         hot = (e->mode == 'H' || (!e->mode && snap->heat));
+         if (hot ? env < e->target / 10.0 - 0.5 : env > e->target / 10.0 + 0.5)
+         {
+            start = env;
+            began = clock;
+         }
+      }
+   }
+   plan (due);
+}
+
+static void
+daikin_automation (void)
+{                               // Faikout auto, auto on/off, hvac_action
+   static typeof (daikin) snap;
+   static automation_t a = { 0 };
+   uint32_t now = uptime ();
+   // Basic temp tracking, from a consistent snapshot
+   daikin_snapshot (&snap);
+   daikin_schedule (&snap);
+   automation_config_t c = {
+      .switchtemp = (float) switchtemp / switchtemp_scale,
+      .pushtemp = (float) pushtemp / pushtemp_scale,
+      .autoptemp = (float) autoptemp / autoptemp_scale,
+      .heatover = heatover,
+      .heatback = heatback,
+      .coolover = coolover,
+      .coolback = coolback,
+      .tmin = tmin,
+      .tmax = tmax,
+      .tcoolmin = tcoolmin,
+      .theatmax = theatmax,
+      .tempstep = proto_type () == PROTO_TYPE_CN_WIRED ? 1 : proto_type () == PROTO_TYPE_S21 ? 0.5 : 0,
+      .tpredicts = tpredicts,
+      .tpredictt = tpredictt,
+      .tsample = tsample,
+      .tempnoflap = tempnoflap,
+      .mpchorizon = mpchorizon,
+      .mpcstart = (float) mpcstart / mpcstart_scale,
+      .auto0 = auto0,
+      .auto1 = auto1,
+      .autofmax = autofmax,
+      .thermref = thermref,
+      .autoe = autoe,
+      .autop = autop,
+      .lockmode = lockmode,
+      .nofanauto = nofanauto,
+      .fan5 = fan_5_auto (),
+      .thermostat = thermostat,
+      .temptrack = temptrack,
+      .tempadjust = tempadjust,
+      .noled = noled,
+      .autolcontrol = autolcontrol,
+      .mpc = mpce,
+   };
+   static tune_t tune = { 0 };
+   if (tunee)
+   {                            // Auto tuner, values it is using, loaded from settings at start, or when changed
+      float v[TUNE_PARAMS] = {
+         [TUNE_HEATOVER] = heatover,
+         [TUNE_HEATBACK] = heatback,
+         [TUNE_COOLOVER] = coolover,
+         [TUNE_COOLBACK] = coolback,
+         [TUNE_SWITCHTEMP] = (float) switchtemp / switchtemp_scale,
+         [TUNE_PUSHTEMP] = (float) pushtemp / pushtemp_scale,
+         [TUNE_THERMREF] = thermref,
+      };
+      tune_load (&tune, v);
+      tune_apply (&tune, &c);
+   } else
+      tune.loaded = 0;
+   automation_unit_t u = {
+      .env = snap.env,
+      .home = (snap.status_known & CONTROL_home) ? snap.home : NAN,
+      .inlet = (snap.status_known & CONTROL_inlet) ? snap.inlet : NAN,
+      .outside = (snap.status_known & CONTROL_outside) ? snap.outside : NAN,
+      .liquid = (snap.status_known & CONTROL_liquid) ? snap.liquid : NAN,
+      .mintarget = snap.mintarget,
+      .maxtarget = snap.maxtarget,
+      .temp = snap.temp,
+      .controlvalid = snap.controlvalid,
+      .hhmm = -1,
+      .comp = (snap.status_known & CONTROL_comp) ? snap.comp : -1,
+      .mode = snap.mode,
+      .fan = snap.fan,
+      .power = snap.power,
+      .heat = snap.heat,
+      .antifreeze = snap.antifreeze,
+      .slave = snap.slave,
+      .led = snap.led,
+      .control = snap.control,
+      .remote = snap.remote,
+      .shutdown = revk_shutting_down (NULL) ? 1 : 0,
+      .action = snap.action,
+   };
+   {
+      time_t now = time (0);
+      struct tm tm;
+      localtime_r (&now, &tm);
+      u.hhmm = tm.tm_hour * 100 + tm.tm_min;
+   }
+   if (grouptopic)
+   {                            // Group mode and our turn to start
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      group_apply (&group, revk_id, now, &u);
+      xSemaphoreGive (daikin.mutex);
+   }
+   {                            // Demand response
+      static demand_t d = { 0 };
+      static uint8_t demand = 100,
+         econo = 0;             // As before we shed
+      demand_config_t dc = {
+         .pricelow = (float) drpricelow / drpricelow_scale,
+         .pricehigh = (float) drpricehigh / drpricehigh_scale,
+         .offset = (float) droffset / droffset_scale,
+         .comfort = (float) drcomfort / drcomfort_scale,
+         .min = drmin,
+      };
+      demand_log_t l;
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      demand_signal_t s = drsignal;
+      float power = energy_power ((daikin.status_known & CONTROL_comp) ? daikin.comp : 0,
+                                  (daikin.status_known & CONTROL_fanrpm) ? daikin.fanrpm : 0);
+      xSemaphoreGive (daikin.mutex);
+      uint8_t was = d.out.active;
+      if (demand_run (&d, &dc, &s, power, u.env, u.mintarget, u.maxtarget, u.heat, now, &l))
+      {                         // Compliance log
+         jo_t j = jo_object_alloc ();
+         jo_int (j, "seconds", l.seconds);
+         if (l.capwh)
+         {
+            jo_litf (j, "cap", "%.0f", l.capwh * 3600 / l.seconds);
+            jo_int (j, "over", l.over);
+         }
+         jo_litf (j, "power", "%.0f", l.wh * 3600 / l.seconds);
+         jo_litf (j, "Wh", "%.1f", l.wh);
+         jo_litf (j, "shed", "%.0f", l.shed * 100 / l.seconds);
+         if (l.comfort)
+            jo_int (j, "comfort", l.comfort);
+         revk_info ("dr", &j);
+      }
+      if (d.out.active && !was)
+      {                         // Save, to restore at end
+         demand = ((snap.status_known & CONTROL_demand) ? snap.demand : 100);
+         econo = snap.econo;
+      }
+      if (d.out.active || was)
+      {
+         uint8_t dv = (d.out.active ? d.out.demand : demand),
+            ev = (d.out.active ? d.out.econo : econo);
+         if ((snap.status_known & CONTROL_demand) && snap.demand != dv)
+            daikin_set_i (demand, dv);
+         if ((snap.status_known & CONTROL_econo) && snap.econo != ev)
+            daikin_set_v (econo, ev);
+      }
+      if (d.out.offset && !isnan (u.mintarget) && !isnan (u.maxtarget))
+      {                         // Shift target range, for this run only
+         u.mintarget += (u.heat ? -d.out.offset : d.out.offset);
+         u.maxtarget += (u.heat ? -d.out.offset : d.out.offset);
+      }
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      drout = d.out;
+      xSemaphoreGive (daikin.mutex);
+   }
+   const automation_unit_t was = u;
+   automation_report_t r;
+   automation_run (&a, &c, &u, now, &r);
+   if (tunee && !drout.active)
+   {                            // Auto tuner, not while demand response is moving target
+      char reason[120];
+      uint8_t tuned = tune_run (&tune, &r, &u, isnan (was.env) ? was.home : was.env, was.mintarget, was.maxtarget, tunereports, reason, sizeof (reason));
+      if (tuned)
+      {
+         jo_t j = jo_object_alloc ();
+         jo_string (j, "reason", reason);
+         for (int p = 0; p < TUNE_PARAMS; p++)
+            jo_litf (j, tune_name (p), "%g", tune.value[p]);
+         revk_info ("tune", &j);
+      }
+      if (tuned == 1)
+      {                         // Save
+         jo_t j = jo_object_alloc ();
+         for (int p = 0; p < TUNE_PARAMS; p++)
+            jo_litf (j, tune_name (p), "%g", tune.base[p]);
+         revk_settings_store (j, NULL, 1);
+         jo_free (&j);
+      }
+   }
+   uint8_t lead = 0;
+   if (grouptopic)
+   {                            // Announce to group, and plan if leader
+      static group_member_t last = { 0 };
+      static uint32_t announced = 0;
+      group_member_t m;
+      group_announce (&u, revk_id, (snap.status_known & CONTROL_comp) ? snap.comp > 0 : -1, &m);
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      group_heard (&group, &m, now);
+      lead = group_leader (&group, revk_id, now);
+      group_plan_t prev = group.plan;
+      if (lead)
+         group_lead (&group, now, groupstagger);
+      group_plan_t p = group.plan;
+      xSemaphoreGive (daikin.mutex);
+      if (memcmp (&m, &last, sizeof (m)) || (lead && memcmp (&p, &prev, sizeof (p))) || announced + GROUP_PERIOD <= now)
+      {
+         last = m;
+         announced = now;
+         jo_t j = jo_object_alloc ();
+         jo_string (j, "id", m.id);
+         jo_bool (j, "heat", m.heat);
+         jo_bool (j, "want", m.want);
+         jo_bool (j, "running", m.running);
+         if (m.slave)
+            jo_bool (j, "slave", 1);
+         if (m.antifreeze)
+            jo_bool (j, "antifreeze", 1);
+         if (lead)
+         {
+            jo_object (j, "plan");
+            jo_string (j, "grant", p.grant);
+            if (p.mode)
+               jo_bool (j, "heat", p.heat);
+            jo_close (j);
+         }
+         revk_mqtt_send (NULL, 0, grouptopic, &j);
+      }
+   }
+   // Apply changes
+   if (u.mode != was.mode)
+      daikin_set_v (mode, u.mode);
+   if (u.fan != was.fan)
+      daikin_set_v (fan, u.fan);
+   if (u.power != was.power)
+      daikin_set_v (power, u.power);
+   if (u.led != was.led)
+      daikin_set_v (led, u.led);
+   if (u.temp != was.temp)
+      daikin_set_t (temp, u.temp);
+   if (u.control != was.control)
+      report_uint8 (control, u.control);
+   daikin.action = u.action;
+   if (!u.controlvalid && was.controlvalid)
+   {                            // End of auto mode and no env data either
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      if (daikin.controlvalid == was.controlvalid)
+      {                         // Not updated since
+         daikin.controlvalid = 0;
+         daikin.status_known &= ~CONTROL_env;
+         daikin.status_changed = 1;
+         daikin.env = NAN;
+         daikin.remote = 0;
+      }
+      xSemaphoreGive (daikin.mutex);
+   }
+   if (isnan (u.mintarget) && !isnan (was.mintarget))
+   {                            // Stopped controlling
+      xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+      daikin.mintarget = NAN;
+      daikin.maxtarget = NAN;
+      xSemaphoreGive (daikin.mutex);
+   }
+   if (r.valid)
+   {                            // Report for sample period
+      jo_t j = jo_object_alloc ();
+      jo_bool (j, "hot", r.hot);
+      jo_int (j, "approaching", r.approaching);
+      jo_int (j, "beyond", r.beyond);
+      jo_int (j, r.initial ? "initial-samples" : "samples", r.samples);
+      jo_int (j, "period", tsample);
+      jo_litf (j, "temp", "%.2f", r.temp);
+      jo_litf (j, "min", "%.2f", r.min);
+      jo_litf (j, "max", "%.2f", r.max);
+      if (r.setmode)
+         jo_stringf (j, "set-mode", "%c", r.setmode);
+      if (r.setfan >= 0)
+         jo_int (j, "set-fan", r.setfan);
+      if (r.setpower >= 0)
+         jo_bool (j, "set-power", r.setpower);
+      if (r.defrosts || r.excluded)
+      {                         // Defrost, excluded from samples
+         jo_object (j, "defrost");
+         if (r.defrost)
+            jo_bool (j, "now", 1);
+         jo_int (j, "excluded", r.excluded);
+         jo_int (j, "count", r.defrosts);
+         if (r.defrostlen)
+            jo_int (j, "duration", r.defrostlen);
+         if (r.defrostgap)
+            jo_int (j, "interval", r.defrostgap / 60);
+         jo_close (j);
+      }
+      if (r.mpc)
+      {                         // Model predictive control estimates
+         jo_object (j, "mpc");
+         jo_int (j, "updates", r.mpcupdates);
+         if (isfinite (r.mpctau))
+            jo_litf (j, "tau", "%.0f", r.mpctau);
+         jo_litf (j, "rate", "%.2f", r.mpcrate);
+         jo_litf (j, "drift", "%.2f", r.mpcdrift);
+         jo_int (j, "wait", r.mpcwait);
+         jo_int (j, "run", r.mpcrun);
+         jo_int (j, "fan", r.mpcfan);
+         jo_litf (j, "predict", "%.2f", r.mpcpredict);
+         jo_litf (j, "cost", "%.2f", r.mpccost);
+         jo_close (j);
+      }
+      if (grouptopic)
+      {                         // Group coordination
+         jo_object (j, "group");
+         jo_bool (j, "leader", lead);
+         if (u.group)
+            jo_string (j, "mode", u.groupheat ? "H" : "C");
+         jo_bool (j, "hold", u.hold);
+         jo_bool (j, "want", u.want);
+         jo_close (j);
+      }
+      revk_info ("automation", &j);
+   }
+}
+
+static sketch_t *
+sketch_alloc (void)
+{                               // Percentile sketch for a field, allocated on first use
+   sketch_t *s = mallocspi (sizeof (*s));
+   if (s)
+      sketch_reset (s);
+   return s;
+}
+
+static esp_err_t
+web_metrics (httpd_req_t *req)
+{                               // Bus metrics since last periodic report
+   jo_t j = jo_object_alloc ();
+   jo_int (j, "uptime", uptime ());
+   metrics_json (j, 0);
+   char *js = jo_finisha (&j);
+   httpd_resp_set_type (req, "application/json");
+   httpd_resp_sendstr (req, js ? : "{}");
+   free (js);
+   return ESP_OK;
+}
+
+static void
+daikin_reporting (void)
+{                               // Periodic stats and HA config
+   if (reporting && !revk_link_down () && b.protocol_set)
+   {                            // Environment logging
+      time_t clock = time (0);
+      static time_t last = 0;
+      if (clock / reporting != last / reporting)
+      {
+         last = clock;
+         xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+         jo_t j = NULL;
+         if (daikin.statscount)
+         {
+            j = jo_comms_alloc ();
+            {                   // Timestamp
+               struct tm tm;
+               gmtime_r (&clock, &tm);
+               jo_stringf (j, "ts", "%04d-%02d-%02dT%02d:%02d:%02dZ", tm.tm_year + 1900,
+                           tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+            }
+            if (percentiles)
+            {                   // p5/p50/p95 for values that changed in the period, clipped to min/max
+               jo_object (j, "percentiles");
+#define	t(name)		if(daikin.sketch##name&&daikin.sketch##name->count&&daikin.min##name!=daikin.max##name){jo_array(j,#name);	\
+			for(int q=0;q<3;q++){jo_litf(j,NULL,"%.2f",fmaxf(daikin.min##name,fminf(daikin.max##name,sketch_quantile(daikin.sketch##name,pq[q]))));}jo_close(j);}	\
+			if(daikin.sketch##name)sketch_reset(daikin.sketch##name);
+#define	i(name)		if(daikin.sketch##name&&daikin.sketch##name->count&&daikin.min##name!=daikin.max##name){jo_array(j,#name);	\
+			for(int q=0;q<3;q++){jo_int(j,NULL,lroundf(fmaxf(daikin.min##name,fminf(daikin.max##name,sketch_quantile(daikin.sketch##name,pq[q])))));}jo_close(j);}	\
+			if(daikin.sketch##name)sketch_reset(daikin.sketch##name);
+               static const float pq[] = { 0.05, 0.5, 0.95 };
+#include "acextras.m"
+               jo_close (j);
+            }
+#define	b(name)		if(daikin.status_known&CONTROL_##name){if(!daikin.total##name)jo_bool(j,#name,0);else if(fixstatus||daikin.total##name==daikin.statscount)jo_bool(j,#name,1);else jo_litf(j,#name,"%.2f",(float)daikin.total##name/daikin.statscount);} \
+		  	daikin.total##name=0;
+#define	t(name)		if(daikin.count##name&&!isnan(daikin.total##name)){if(fixstatus||daikin.min##name==daikin.max##name)jo_litf(j,#name,"%.2f",daikin.min##name);	\
+		  	else {jo_array(j,#name);jo_litf(j,NULL,"%.2f",daikin.min##name);jo_litf(j,NULL,"%.2f",daikin.total##name/daikin.count##name);jo_litf(j,NULL,"%.2f",daikin.max##name);jo_close(j);}}	\
+		  	daikin.min##name=NAN;daikin.total##name=0;daikin.max##name=NAN;daikin.count##name=0;
+#define	r(name)		if(!isnan(daikin.min##name)&&!isnan(daikin.max##name)){if(fixstatus||daikin.min##name==daikin.max##name)jo_litf(j,#name,"%.2f",daikin.min##name);	\
+			else {jo_array(j,#name);jo_litf(j,NULL,"%.2f",daikin.min##name);jo_litf(j,NULL,"%.2f",daikin.max##name);jo_close(j);}}
+#define	i(name)		if(daikin.status_known&CONTROL_##name){if(fixstatus||daikin.min##name==daikin.max##name)jo_int(j,#name,daikin.total##name/daikin.statscount);     \
+                  else {jo_array(j,#name);jo_int(j,NULL,daikin.min##name);jo_int(j,NULL,daikin.total##name/daikin.statscount);jo_int(j,NULL,daikin.max##name);jo_close(j);}       \
+                  daikin.min##name=0;daikin.total##name=0;daikin.max##name=0;}
+#define e(name,values)  if((daikin.status_known&CONTROL_##name)&&daikin.name<sizeof(CONTROL_##name##_VALUES)-1)jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[daikin.name]);
+#include "acextras.m"
+            if (recover.resync || recover.retry || recover.restart)
+            {                   // Comms recovery counts since boot
+               jo_object (j, "recover");
+               jo_int (j, "resync", recover.resync);
+               jo_int (j, "retry", recover.retry);
+               jo_int (j, "restart", recover.restart);
+               jo_close (j);
+            }
+            task_report (j);
+            daikin.statscount = 0;
+         }
+         xSemaphoreGive (daikin.mutex);
+         if (j)
+         {
+            revk_mqtt_send_clients (revk_app, 0, NULL, &j, 1);
+            ha_status ();
+         }
+      }
+   }
+   if (metrics && !revk_link_down () && b.protocol_set)
+   {                            // Bus metrics, reset each report
+      time_t clock = time (0);
+      static time_t last = 0;
+      if (!last)
+         last = clock;
+      if (clock / metrics != last / metrics)
+      {
+         last = clock;
+         jo_t j = jo_object_alloc ();
+         metrics_json (j, 1);
+         revk_info ("metrics", &j);
+      }
+   }
+   if (daikin.ha_send && (b.loopback || (polls > 10 && b.protocol_set && daikin.talking)))
+   {
+      send_ha_config ();
+      ha_status ();             // Update status now sent
+   }
+}
+
+static void
+automation_task (void *pvParameters)
+{
+   while (1)
+   {                            // Run after each poll
+      xSemaphoreTake (daikin_polled, portMAX_DELAY);
+      task_begin (&tt_automation, 0);
+      daikin_automation ();
+      task_end (&tt_automation);
+   }
+}
+
+static void
+reporting_task (void *pvParameters)
+{
+   while (1)
+   {
+      task_sleep (&tt_reporting);
+      daikin_reporting ();
+      task_end (&tt_reporting);
+   }
+}
+
 // --------------------------------------------------------------------------------
 // Main
 void
@@ -3220,6 +4110,7 @@ app_main ()
    }
 #endif
    daikin.mutex = xSemaphoreCreateMutex ();
+   daikin_polled = xSemaphoreCreateBinary ();
    b.startup = 1;
    daikin.status_known = CONTROL_online;
 #define	t(name)	daikin.name=NAN;
@@ -3268,7 +4159,16 @@ app_main ()
    revk_blink_do ();            // Show LED ASAP
 
    if (*autotopic)
-      revk_mqtt_sub (0, autotopic, autosub, *autopayload ? autopayload : "env");
+      revk_mqtt_sub (0, autotopic, autosub, (void *) 0);
+   for (int t = 0; t < FUSION_TOPICS - 1; t++)
+      if (*fusiontopic[t])
+         revk_mqtt_sub (0, fusiontopic[t], autosub, (void *) (intptr_t) (t + 1));
+
+   if (*drtopic)
+      revk_mqtt_sub (0, drtopic, drsub, NULL);
+
+   if (*groupname && asprintf (&grouptopic, "%s/group/%s", revk_app, groupname) >= 0)
+      revk_mqtt_sub (0, grouptopic, groupsub, NULL);
 
    if (udp_discovery)
       revk_task ("daikin_discovery", legacy_discovery_task, NULL, 0);
@@ -3282,7 +4182,7 @@ app_main ()
       config.stack_size += 4096;        // Being on the safe side
       // When updating the code below, make sure this is enough
       // Note that we're also adding revk's own web config handlers
-      config.max_uri_handlers = 16 + revk_num_web_handlers ();
+      config.max_uri_handlers = 17 + revk_num_web_handlers ();
       if (!httpd_start (&webserver, &config))
       {
          if (websettings)
@@ -3293,6 +4193,7 @@ app_main ()
          if (webcontrol)
          {
             register_get_uri ("/control", web_control);
+            register_get_uri ("/metrics", web_metrics);
             register_ws_uri ("/status", web_status);
             register_get_uri ("/common/basic_info", legacy_web_get_basic_info);
             register_get_uri ("/aircon/get_model_info", legacy_web_get_model_info);
@@ -3331,6 +4232,8 @@ app_main ()
       b.protocol_set = 1;       // Fixed protocol - do not change
    else
       proto--;                  // We start by moving forward if protocol not set
+   revk_task ("automation", automation_task, NULL, 8);
+   revk_task ("reporting", reporting_task, NULL, 8);
    while (1)
    {                            // Main loop
       // We're (re)starting comms from scratch, so set "talking" flag.
@@ -3391,18 +4294,19 @@ app_main ()
       }
       if (!b.loopback)
          daikin.ha_send = 1;
-      int poll = 0;
+      polls = 0;
       do
       {
          // Polling loop. We exit from here only if we get a protocol error
-         poll++;
+         polls++;
          if (proto_type () != PROTO_TYPE_CN_WIRED)
          {
             /* wait for next second. For CN_WIRED we don't need to actively poll the
                A/C, so we don't need this delay. We just keep reading, packets should
                come once per second, and that's our timing */
-            usleep (1000000LL - (esp_timer_get_time () % 1000000LL));
-         }
+            task_sleep (&tt_protocol);
+         } else
+            task_begin (&tt_protocol, 0);
 #ifdef ELA
          if (ble_sensor_enabled ())
          {                      // Automatic external temperature logic - only really useful if autor/autot set, or Faikout remote
@@ -3421,15 +4325,10 @@ app_main ()
             }
             if (bletemp && !bletemp->missing && bletemp->tempset)
             {                   // Use temp
-               float env = bletemp->temp / 100.0;
-               if (daikin.env != env)
-               {
-                  daikin.status_changed = 1;
-                  daikin.env = env;
-               }
-               daikin.status_known |= CONTROL_env;      // So we report it
-            } else
-               daikin.status_known &= ~CONTROL_env;     // So we don't report it
+               xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+               fusion_set (&fusion, FUSION_BLE, bletemp->temp / 100.0, uptime ());
+               xSemaphoreGive (daikin.mutex);
+            }
             if (bletemp && !bletemp->missing && bletemp->humset)
             {                   // Use temp
                float hum = bletemp->hum / 100.0;
@@ -3501,24 +4400,9 @@ app_main ()
          {
             if (proto_type () == PROTO_TYPE_ALTHERMA_S)
             {
-#define poll(a)                         \
-   static uint8_t a=2;                  \
-   if(a){                               \
-      int r=daikin_as_poll(*#a); \
-      if (r==RES_OK)                          \
-         a=100;                         \
-      else if(r==RES_NAK)                     \
-         a--;                           \
-   }                                          \
-   if(!daikin.talking)                        \
-      a=2;
-               poll (U);
-               poll (T);
-               poll (P);
-               poll (S);
+               daikin_as_poll_due ();
                if (daikin.talking)
                   b.startup = 0;        // End of startup
-#undef poll
             } else if (proto_type () == PROTO_TYPE_CN_WIRED)
             {                   // CN WIRED
                uint8_t buf[CNW_PKT_LEN];
@@ -3619,7 +4503,7 @@ app_main ()
                      poll (D, H, 4, 1000);
                   }
                }
-               if (s21.rgfan)
+               if (ac.rgfan)
                   poll (R, G, 0,);      // Needed to confirm fan changes.
 
                static uint8_t rcycle = 0;       // R polling one per cycle
@@ -3642,7 +4526,7 @@ app_main ()
                   break;
                case 5:
                   poll (R, N, 0,);      // Angle
-                  if (!s21extra && s21.rgfan)
+                  if (!s21extra && ac.rgfan)
                   {
                      rcycle = 0;        // End as RG done anyway
                      if (daikin.talking)
@@ -3650,7 +4534,7 @@ app_main ()
                   }
                   break;
                case 6:
-                  if (!s21.rgfan)
+                  if (!ac.rgfan)
                      poll (R, G, 0,);   // Fan
                   if (!s21extra)
                   {
@@ -3659,7 +4543,7 @@ app_main ()
                         b.startup = 0;  // End of startup
                      break;
                   }
-                  if (s21.rgfan)
+                  if (ac.rgfan)
                      break;
                   rcycle++;
                   __attribute__((fallthrough));
@@ -3718,6 +4602,23 @@ app_main ()
                   jo_free (&debugsend);
                   b.dumping = dump;     // Back to setting
                }
+               if (b.probe)
+               {                // Raw response to each command, or null for NAK, none if no response
+                  b.probe = 0;
+                  probe.j = jo_object_alloc ();
+                  for (int i = 0; i < sizeof (s21probe) / sizeof (*s21probe) && daikin.talking; i++)
+                  {
+                     const char *c = s21probe[i];
+                     int l = strlen (c);
+                     strcpy (probe.cmd, c);
+                     probe.got = 0;
+                     if (l == 1)
+                        daikin_s21_command (c[0], c[0], 0, NULL);       // M and V, repeated as the unit ignores it
+                     else
+                        daikin_s21_command (c[0], c[1], l - 2, (char *) c + 2);
+                  }
+                  revk_info ("probe", &probe.j);
+               }
 #undef poll
                if (debug)
                   revk_info ("s21", &s21debug);
@@ -3725,23 +4626,14 @@ app_main ()
                if (daikin.control_changed & (CONTROL_power | CONTROL_mode | CONTROL_temp | CONTROL_fan))
                {                // D1
                   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  temp[0] = daikin.power ? '1' : '0';
-                  temp[1] = ("64300002"[daikin.mode]);  // FHCA456D mapped to AXDCHXF
-                  if (daikin.mode == 1 || daikin.mode == 2 || daikin.mode == 3)
-                     temp[2] = s21_encode_target_temp (daikin.temp);
-                  else
-                     temp[2] = AC_MIN_TEMP_VALUE;       // No temp in other modes
-                  temp[3] = ("A34567B"[daikin.fan]);
+                  acproto_s21_d1 (ac_settings (), temp);
                   daikin_s21_command ('D', '1', S21_PAYLOAD_LEN, temp);
                   xSemaphoreGive (daikin.mutex);
                }
                if (daikin.control_changed & (CONTROL_swingh | CONTROL_swingv))
                {                // D5
                   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  temp[0] = '0' + (daikin.swingh ? 2 : 0) + (daikin.swingv ? 1 : 0) + (daikin.swingh && daikin.swingv ? 4 : 0);
-                  temp[1] = (daikin.swingh || daikin.swingv ? '?' : '0');
-                  temp[2] = '0';
-                  temp[3] = '0';
+                  acproto_s21_d5 (ac_settings (), temp);
                   daikin_s21_command ('D', '5', S21_PAYLOAD_LEN, temp);
                   xSemaphoreGive (daikin.mutex);
                }
@@ -3751,14 +4643,7 @@ app_main ()
                   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
                   if (!s21.F6.bad)
                   {
-                     temp[0] = '0' + (daikin.powerful ? 2 : 0) + (daikin.comfort ? 0x40 : 0) + (daikin.quiet ? 0x80 : 0);
-                     temp[1] = '0' + (daikin.streamer ? 0x80 : 0);
-                     temp[2] = '0';
-                     // If sensor, the 8 is sensor, if not, then 4 and 8 are LED, with 4=high, 8=low, 12=off
-                     if (noled || !nosensor)
-                        temp[3] = '0' + (daikin.sensor ? 0x08 : 0) + (daikin.led ? 0x04 : 0);   // Messy but gives some controls
-                     else
-                        temp[3] = '0' + (daikin.led ? dark ? 8 : 4 : 12);
+                     acproto_s21_d6 (ac_settings (), temp);
                      // FIXME: ATX20K2V1B responds NAK to this command, but also doesn't react on D3.
                      // Looks like it supports something else, we don't know what.
                      // https://github.com/revk/ESP32-Faikout/issues/441
@@ -3773,10 +4658,7 @@ app_main ()
                      // This suggestion must be true, because otherwise commit 0c5f769, which
                      // introduced support for F3, wouldn't have worked, being overriden by F6
                      // due to how poll sequence is organized.
-                     temp[0] = '0';
-                     temp[1] = '0';
-                     temp[2] = '0';
-                     temp[3] = '0' + (daikin.powerful ? 2 : 0);
+                     acproto_s21_d3 (ac_settings (), temp);
                      daikin_s21_command ('D', '3', S21_PAYLOAD_LEN, temp);
                   }
                   xSemaphoreGive (daikin.mutex);
@@ -3784,10 +4666,7 @@ app_main ()
                if (daikin.control_changed & (CONTROL_demand | CONTROL_econo))
                {                // D7
                   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  temp[0] = '0' + 100 - daikin.demand;
-                  temp[1] = '0' + (daikin.econo ? 2 : 0);
-                  temp[2] = '0';
-                  temp[3] = '0';
+                  acproto_s21_d7 (ac_settings (), temp);
                   daikin_s21_command ('D', '7', S21_PAYLOAD_LEN, temp);
                   xSemaphoreGive (daikin.mutex);
                }
@@ -3801,20 +4680,8 @@ app_main ()
                if (daikin.control_changed)
                {
                   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  ca[0] = 2 + daikin.power;
-                  ca[1] = 0x10 + daikin.mode;
-                  if (daikin.mode >= 1 && daikin.mode <= 3)
-                  {             // Temp
-                     int t = lroundf (daikin.temp * 10);
-                     ca[3] = t / 10;
-                     ca[4] = 0x80 + (t % 10);
-                  } else
-                     daikin.control_changed &= ~CONTROL_temp;
-                  if (daikin.mode == 1 || daikin.mode == 2)
-                     cb[0] = daikin.mode;
-                  else
-                     cb[0] = 6;
-                  cb[1] = 0x80 + ((daikin.fan & 7) << 4);
+                  if (!acproto_x50a_control (ac_settings (), ca, cb))
+                     daikin.control_changed &= ~CONTROL_temp;   // No temp in this mode
                   xSemaphoreGive (daikin.mutex);
                }
                daikin_x50a_command (0xCA, sizeof (ca), ca);
@@ -3838,16 +4705,60 @@ app_main ()
             }
             ha_status ();
          }
+         xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+         {                      // Reference temperature, from sensor fusion
+            static float reported = NAN;
+            uint32_t now = uptime ();
+            fusion_config_t c = {
+               .weight = {[FUSION_BLE] = fusionble,[FUSION_CONTROL] = fusioncontrol,[FUSION_HOME] = fusionhome,[FUSION_INLET] =
+                          fusioninlet},
+               .halflife = fusionhalflife,
+               .maxage = tcontrol,
+               .outlier = (float) fusionoutlier / fusionoutlier_scale,
+            };
+            for (int t = 0; t < FUSION_TOPICS; t++)
+               c.weight[FUSION_TOPIC + t] = fusionmqtt;
+            if (daikin.status_known & CONTROL_home)
+               fusion_set (&fusion, FUSION_HOME, daikin.home, now);
+            if (daikin.status_known & CONTROL_inlet)
+               fusion_set (&fusion, FUSION_INLET, daikin.inlet, now);
+            float env = fusion_run (&fusion, &c, now, &daikin.confidence);
+            if (isnan (env))
+            {
+               if (daikin.status_known & CONTROL_env)
+                  daikin.status_changed = 1;
+               daikin.status_known &= ~CONTROL_env;     // So we don't report it
+               daikin.env = reported = NAN;
+            } else
+            {
+               daikin.env = roundf (env * 100) / 100;
+               if (!(daikin.status_known & CONTROL_env) || isnan (reported) || fabsf (daikin.env - reported) >= 0.05)
+               {                // Not every small change as weights age
+                  daikin.status_changed = 1;
+                  reported = daikin.env;
+               }
+               daikin.status_known |= CONTROL_env;      // So we report it
+            }
+         }
          // Stats
 #define b(name)         if(daikin.name)daikin.total##name++;
 #define t(name)		if(!isnan(daikin.name)){if(!daikin.count##name||daikin.min##name>daikin.name)daikin.min##name=daikin.name;	\
 	 		if(!daikin.count##name||daikin.max##name<daikin.name)daikin.max##name=daikin.name;	\
-	 		daikin.total##name+=daikin.name;daikin.count##name++;}
+	 		daikin.total##name+=daikin.name;daikin.count##name++;	\
+			if(percentiles&&(daikin.sketch##name||(daikin.sketch##name=sketch_alloc())))sketch_add(daikin.sketch##name,daikin.name,0.1);}
 #define i(name)		if(!daikin.statscount||daikin.min##name>daikin.name)daikin.min##name=daikin.name;	\
 	 		if(!daikin.statscount||daikin.max##name<daikin.name)daikin.max##name=daikin.name;	\
-	 		daikin.total##name+=daikin.name;
+	 		daikin.total##name+=daikin.name;	\
+			if(percentiles&&(daikin.sketch##name||(daikin.sketch##name=sketch_alloc())))sketch_add(daikin.sketch##name,daikin.name,1);
 #include "acextras.m"
          daikin.statscount++;
+         int wh = ((daikin.status_known & CONTROL_Wh) ? daikin.Wh : -1);
+         uint8_t use = (!daikin.power ? ENERGY_FAN : daikin.mode == FAIKIN_MODE_HEAT ? ENERGY_HEAT : daikin.mode == FAIKIN_MODE_COOL
+                        || daikin.mode == FAIKIN_MODE_DRY ? ENERGY_COOL : daikin.mode == FAIKIN_MODE_AUTO ? daikin.heat ? ENERGY_HEAT : ENERGY_COOL : ENERGY_FAN);
+         int comp = ((daikin.status_known & CONTROL_comp) ? daikin.comp : 0);
+         int fanrpm = ((daikin.status_known & CONTROL_fanrpm) ? daikin.fanrpm : 0);
+         xSemaphoreGive (daikin.mutex);
+         energy_poll (wh, use, comp, fanrpm);
          if (!daikin.control_changed)
             daikin.control_count = 0;
          else if (daikin.control_count++ > 10)
@@ -3867,402 +4778,8 @@ app_main ()
             revk_blink (18, 2, b.loopback ? "G" : "R");
          else
             revk_blink (0, 0, b.loopback ? "RGB" : !daikin.online ? "M" : dark ? "" : !daikin.power ? "y" : daikin.mode == 0 ? "O" : daikin.mode == 7 ? "C" : daikin.heat ? "R" : "B"); // FHCA456D
-         uint32_t now = uptime ();
-         // Basic temp tracking
-         xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-         uint8_t hot = daikin.heat;     // Are we in heating mode?
-         float min = daikin.mintarget;
-         float max = daikin.maxtarget;
-         float measured_temp = daikin.env;
-         if (isnan (measured_temp))     // No env temp available, so use A/C internal temp
-            measured_temp = daikin.home;
-         xSemaphoreGive (daikin.mutex);
-         // Predict temperature changes
-         // Take 2 delta temps of the last 3 measured env temperatures
-         // If there is no opposite movement (both cooler or both hotter or at least no change),
-         //  push (increase or decrease) the measured env temp by adding the two deltatemps 
-         //  multiplied with a factor. 
-         // This "predicted" env temp is used for all further calculations.
-         // E.g.: temps [19.5, 19.6, 19.8] (with 19.8 as the most recent value)
-         //       leads to deltas [0.1, 0.2]
-         //       new "predicted" env temp is (19.8+(0.1+0.2)*2)=20.4 (*2 is calculated from tpredictt and tpredicts)
-         // tpredicts is the "sample time" for the calculation (it must be taken *2, because the deltas are calculated over 2 cycles)
-         // tpredictt is the time in the future where the predicted env temp would be reached.
-         if (tpredicts && !isnan (measured_temp))
-         {
-            static uint32_t lasttime = 0;
-            if (now / tpredicts != lasttime / tpredicts)
-            {                   // Every minute - predictive
-               lasttime = now;
-               daikin.env_delta_prev = daikin.env_delta;        // Save last delta
-               daikin.env_delta = measured_temp - daikin.env_prev;      // Delta from currently measured temperature and previously measured temperature
-               // daikin.env_delta < 0 means the room is cooling down
-               // daikin.env_delta > 0 means the room is heating up
-               daikin.env_prev = measured_temp; // Save current temperature for next cycle
-            }
-            // Two subsequent temperature changes in the same direction ("no change" is ok as well)
-            if ((daikin.env_delta <= 0 && daikin.env_delta_prev <= 0) || (daikin.env_delta >= 0 && daikin.env_delta_prev >= 0))
-               measured_temp += (daikin.env_delta + daikin.env_delta_prev) * tpredictt / (tpredicts * 2);       // Predict
-         }
-         // Apply adjustment
-         if (!thermostat && daikin.control && daikin.power && !isnan (min) && !isnan (max))
-         {
-            if (hot)
-            {
-               max += (float) switchtemp / switchtemp_scale;    // Overshoot for switching (heating)
-               min += (float) pushtemp / pushtemp_scale;        // Adjust target
-            } else
-            {
-               min -= (float) switchtemp / switchtemp_scale;    // Overshoot for switching (cooling)
-               max -= (float) pushtemp / pushtemp_scale;        // Adjust target
-            }
-         }
-
-         void samplestart (void)
-         {                      // Start sampling for fan/switch controls
-            daikin.sample = 0;  // Start sample period
-         }
-
-
-         void controlstart (void)
-         {                      // Start controlling
-            if (daikin.control)
-               return;
-            daikin.hysteresis = 0;
-            report_uint8 (control, 1);
-            samplestart ();
-            // Switch modes (heating or cooling) depending on currently measured 
-            //  temperature related to min/max
-            if (!lockmode)
-            {
-               if (hot && measured_temp > max)
-               {
-                  hot = 0;
-                  daikin_set_e (mode, "C");     // Set cooling as over temp
-               } else if (!hot && measured_temp < min)
-               {
-                  hot = 1;
-                  daikin_set_e (mode, "H");     // Set heating as under temp
-               }
-            }
-            // Force high fan at the beginning if not fan in AUTO 
-            //  and temperature not close to target temp
-            // TODO: Use of switchtemp for different purposes is confusing (ref. min/max a couple of lines above)
-            if (!nofanauto && daikin.fan
-                && ((hot && measured_temp < min - 2 * (float) switchtemp / switchtemp_scale)
-                    || (!hot && measured_temp > max + 2 * (float) switchtemp / switchtemp_scale)))
-            {
-               daikin.fansaved = daikin.fan;    // Save for when we get to temp
-               daikin_set_v (fan, autofmax);    // Max fan at start
-            }
-         }
-         // END OF controlstart()
-
-
-         void controlstop (void)
-         {                      // Stop controlling
-            if (!daikin.control)
-               return;
-            report_uint8 (control, 0);
-            if (daikin.fansaved)
-            {                   // Restore saved fan setting (if was set, which nofanauto would not do)
-               daikin_set_v (fan, daikin.fansaved);
-               daikin.fansaved = 0;
-            }
-            // We were controlling, so set to a non controlling mode, best guess at sane settings for now
-            if (!isnan (daikin.mintarget) && !isnan (daikin.maxtarget))
-               daikin_set_t (temp, daikin.heat ? daikin.maxtarget : daikin.mintarget);
-            daikin.mintarget = NAN;
-            daikin.maxtarget = NAN;
-         }
-         // END OF controlstop()
-
-
-         if (!daikin.remote && autoe && (auto0 || auto1) && (auto0 != auto1))
-         {                      // Auto on/off, 00:00 is not considered valid, use 00:01. Also setting same on and off is not considered valid
-            static int last = 0;
-            time_t now = time (0);
-            struct tm tm;
-            localtime_r (&now, &tm);
-            int hhmm = tm.tm_hour * 100 + tm.tm_min;
-            if (auto0 && last < auto0 && hhmm >= auto0)
-               daikin_set_v (power, 0); // Auto off, simple
-            if (auto1 && last < auto1 && hhmm >= auto1)
-            {                   // Auto on - and consider mode change is not on Auto
-               daikin_set_v (power, 1);
-               if (!lockmode && daikin.mode != 3 && !isnan (measured_temp) && !isnan (min) && !isnan (max)
-                   && ((hot && measured_temp > max) || (!hot && measured_temp < min)))
-                  daikin_set_e (mode, hot ? "C" : "H"); // Swap mode
-            }
-            last = hhmm;
-         }
-         // Monitoring and automation
-         if (!isnan (measured_temp) && !isnan (min) && !isnan (max) && tsample)
-         {                      // Monitoring and automation
-            if (daikin.power && daikin.lastheat != hot)
-            {                   // If we change mode, start samples again
-               daikin.lastheat = hot;
-               samplestart ();
-            }
-
-            if (!daikin.sample)
-            {
-               // TODO: Wouldn't this be better in samplestart()?
-               daikin.countApproaching = daikin.countApproachingPrev = daikin.countBeyond = daikin.countBeyondPrev = daikin.countTotal = daikin.countTotalPrev = 0;     // Reset sample counts
-            } else
-            {
-               daikin.countTotal++;     // Total
-               if ((hot && measured_temp < min) || (!hot && measured_temp > max))
-                  daikin.countApproaching++;    // Approaching temp
-               else if ((hot && measured_temp > max) || (!hot && measured_temp < min))
-                  daikin.countBeyond++; // Beyond
-            }
-
-            // New sample Cycle
-            if (daikin.sample <= now)
-            {                   // New sample, consider some changes
-               // daikin.countTotalPrev is Total Counter of previous cycle
-               int count_approaching_2_samples = daikin.countApproaching + daikin.countApproachingPrev; // Approaching counter of this and previous cycle
-               int countBeyond2Samples = daikin.countBeyond + daikin.countBeyondPrev;   // Beyond counter of this and previous cycle
-               int count_total_2_samples = daikin.countTotal + daikin.countTotalPrev;   // Total counter of this and previous cycle (includes neither approaching or beyond, i.e. in range)
-               // Prepare reporting structure for "automation"
-               jo_t j = jo_object_alloc ();
-               jo_bool (j, "hot", hot);
-               if (count_total_2_samples)
-               {
-                  jo_int (j, "approaching", count_approaching_2_samples);
-                  jo_int (j, "beyond", countBeyond2Samples);
-                  jo_int (j, daikin.countTotalPrev ? "samples" : "initial-samples", count_total_2_samples);
-               }
-               jo_int (j, "period", tsample);
-               jo_litf (j, "temp", "%.2f", measured_temp);
-               jo_litf (j, "min", "%.2f", min);
-               jo_litf (j, "max", "%.2f", max);
-               if (daikin.countTotalPrev)       // Skip first cycle
-               {                // Power, mode, fan, automation
-                  if (daikin.power)     // Daikin is on
-                  {
-                     int step = fan_5_auto ()? 1 : 2;
-                     // A lot more beyond than total counts and no approaching in the last two cycles
-                     // Time to switch modes (heating/cooling) and reduce fan to minimum
-                     if ((countBeyond2Samples * 2 > count_total_2_samples || daikin.slave) && !count_approaching_2_samples)
-                     {          // Mode switch
-                        if (!lockmode)
-                        {
-                           jo_string (j, "set-mode", hot ? "C" : "H");
-                           daikin_set_e (mode, hot ? "C" : "H");        // Swap mode
-                           if (!nofanauto && step && daikin.fan > 1 && daikin.fan <= 5)
-                           {
-                              jo_int (j, "set-fan", 1);
-                              daikin_set_v (fan, 1);
-                           }
-                        }
-                     }
-                     // Less approaching, but still close to min in heating or max in cooling
-                     // Time to reduce the fan a bit
-                     else
-                        if (!nofanauto && count_approaching_2_samples * 10 < count_total_2_samples * 7
-                            && step && daikin.fan > 1 && daikin.fan <= 5)
-                     {
-                        jo_int (j, "set-fan", daikin.fan - step);
-                        daikin_set_v (fan, daikin.fan - step);  // Reduce fan
-                     }
-                     // A lot of approaching means still far away from desired temp
-                     // Time to increase the fan speed
-                     else
-                        if (!nofanauto && !daikin.slave
-                            && count_approaching_2_samples * 10 > count_total_2_samples * 9
-                            && step && daikin.fan >= 1 && daikin.fan < autofmax)
-                     {
-                        jo_int (j, "set-fan", daikin.fan + step);
-                        daikin_set_v (fan, daikin.fan + step);  // Increase fan
-                     }
-                     // No Approaching and no Beyond, so it's in desired range (autot +/- autor)
-                     // Only affects if autop is active
-                     // Turn off as 100% in band for last two period
-                     else
-                        if (((autoe && autop) || (daikin.remote && autoptemp)) && !count_approaching_2_samples
-                            && !countBeyond2Samples)
-                     {          // Auto off
-                        jo_bool (j, "set-power", 0);
-                        daikin_set_v (power, 0);        // Turn off as 100% in band for last two period
-                     }
-                  }
-                  // Daikin is off
-                  else if (((autoe && autop) || (daikin.remote && autoptemp))   // AutoP Mode only
-                           && (daikin.countApproaching == daikin.countTotal || daikin.countBeyond == daikin.countTotal) // full cycle approaching or full cycle beyond
-                           && (measured_temp >= max + (float) autoptemp / autoptemp_scale       // temp out of desired range
-                               || measured_temp <= min - (float) autoptemp / autoptemp_scale) && (!lockmode || countBeyond2Samples != count_total_2_samples))   // temp out of desired range
-                  {             // Auto on (don't auto on if would reverse mode and lockmode)
-                     jo_bool (j, "set-power", 1);
-                     daikin_set_v (power, 1);   // Turn on as 100% out of band for last two period
-                     if (countBeyond2Samples == count_total_2_samples)
-                     {
-                        jo_string (j, "set-mode", hot ? "C" : "H");
-                        daikin_set_e (mode, hot ? "C" : "H");   // Swap mode
-                     }
-                  }
-               }
-               if (count_total_2_samples)       // after a cycle, send automation data  
-                  revk_info ("automation", &j);
-               else
-                  jo_free (&j);
-               // Next sample
-               daikin.countApproachingPrev = daikin.countApproaching;
-               daikin.countBeyondPrev = daikin.countBeyond;
-               daikin.countTotalPrev = daikin.countTotal;
-               daikin.countApproaching = daikin.countBeyond = daikin.countTotal = 0;    // Reset counter
-               daikin.sample = now + tsample;   // Set time for next sample cycle
-            }
-         }
-         // End Control due to timeout
-         if (daikin.controlvalid && now > daikin.controlvalid)
-         {                      // End of auto mode and no env data either
-            daikin.controlvalid = 0;
-            daikin.status_known &= ~CONTROL_env;
-            daikin.status_changed = 1;
-            daikin.env = NAN;
-            daikin.remote = 0;
-            controlstop ();
-         }
-         // Local auto controls
-         if (daikin.power && daikin.controlvalid && !revk_shutting_down (NULL))
-         {                      // Local auto controls
-            // Get the settings atomically
-            if (isnan (min) || isnan (max))
-               controlstop ();
-            else
-            {                   // Control
-               controlstart (); // Will do nothing if control already active
-               // What the A/C is using as current temperature
-               float reference = NAN;
-               if ((daikin.status_known & (CONTROL_home | CONTROL_inlet)) == (CONTROL_home | CONTROL_inlet))    // Both values are known
-                  reference = (daikin.home * thermref + daikin.inlet * (100 - thermref)) / 100; // thermref is how much inlet and home are used as reference
-               else if (daikin.status_known & CONTROL_home)
-                  reference = daikin.home;
-               else if (daikin.status_known & CONTROL_inlet)
-                  reference = daikin.inlet;
-               // It looks like the ducted units are using inlet in some way, even when field settings say controller.
-               if (daikin.mode == 3)
-                  daikin_set_e (mode, hot ? "H" : "C"); // Out of auto
-               // Temp set
-               float set = (min + max) / 2.0;   // Target temp we will be setting (before adjust for reference error and before limiting)
-               if (thermostat)
-                  set = (((hot && daikin.hysteresis) || (!hot && !daikin.hysteresis)) ? max : min);
-               if (temptrack)
-                  set = reference;      // Base target on current Daikin measured temp instead.
-               else if (tempadjust)
-                  set += reference - measured_temp;     // Adjust for reference not being measured_temp
-               if ((hot && measured_temp < (daikin.hysteresis ? max : min))
-                   || (!hot && measured_temp > (daikin.hysteresis ? min : max)))
-               {                // Apply heat/cool - i.e. force heating or cooling to definitely happen
-                  if (thermostat)
-                     daikin.hysteresis = 1;     // We're on, so keep going to "beyond"
-                  if (hot)
-                  {
-                     set += heatover;   // Ensure heating by applying A/C offset to force it
-                     daikin.action = HVAC_HEATING;
-                  } else
-                  {
-                     set -= coolover;   // Ensure cooling by applying A/C offset to force it
-                     daikin.action = HVAC_COOLING;
-                  }
-                  if (!noled && autolcontrol)
-                  {
-                     daikin_set_v (led, 1);
-                  }
-               } else
-               {                // At or beyond temp - stop heat/cool - try and ensure it stops heating or cooling
-                  daikin.action = HVAC_IDLE;
-                  daikin.hysteresis = 0;        // We're off, so keep falling back until "approaching" (default when thermostat not set)
-                  if (daikin.fansaved)
-                  {
-                     daikin_set_v (fan, daikin.fansaved);       // revert fan speed (if set, which nofanauto would not do)
-                     daikin.fansaved = 0;
-                     samplestart ();    // Initial phase complete, start samples again.
-                  }
-                  if (hot)
-                     set -= heatback;   // Heating mode but apply negative offset to not actually heat any more than this
-                  else
-                     set += coolback;   // Cooling mode but apply positive offset to not actually cool any more than this
-                  if (!noled && autolcontrol)
-                  {
-                     daikin_set_v (led, 0);
-                  }
-               }
-
-               // Limit settings to acceptable values
-               if (proto_type () == PROTO_TYPE_CN_WIRED)
-                  set = roundf (set);   // CN_WIRED only does 1C steps
-               else if (proto_type () == PROTO_TYPE_S21)
-                  set = roundf (set * 2.0) / 2.0;       // S21 only does 0.5C steps
-               if (set < (hot ? tmin : tcoolmin))
-                  set = (hot ? tmin : tcoolmin);
-               if (set > (hot ? theatmax : tmax))
-                  set = (hot ? theatmax : tmax);
-               static uint32_t flap = 0;
-               static uint8_t lastaction = 0;
-               static float lastset = 0;
-               if (!isnan (set) && (daikin.action != lastaction || (set != lastset && now > flap)))
-               {
-                  flap = now + tempnoflap;      // Hold off changes for preset time, unless change of mode
-                  lastaction = daikin.action;
-                  lastset = set;
-                  daikin_set_t (temp, set);     // Apply temperature setting
-               }
-            }
-         } else
-         {
-            controlstop ();
-            // Just based on mode
-            daikin.action = (!daikin.power ? HVAC_OFF : daikin.antifreeze ? HVAC_DEFROSTING : daikin.mode == FAIKIN_MODE_HEAT ? HVAC_HEATING :  //
-                             daikin.mode == FAIKIN_MODE_COOL ? HVAC_COOLING :   //
-                             daikin.mode == FAIKIN_MODE_AUTO ? HVAC_IDLE :      //
-                             daikin.mode == FAIKIN_MODE_DRY ? HVAC_DRYING :     //
-                             daikin.mode == FAIKIN_MODE_FAN ? HVAC_FAN :        //
-                             HVAC_IDLE);
-         }
-         // End of local auto controls
-
-         if (reporting && !revk_link_down () && b.protocol_set)
-         {                      // Environment logging
-            time_t clock = time (0);
-            static time_t last = 0;
-            if (clock / reporting != last / reporting)
-            {
-               last = clock;
-               if (daikin.statscount)
-               {
-                  jo_t j = jo_comms_alloc ();
-                  {             // Timestamp
-                     struct tm tm;
-                     gmtime_r (&clock, &tm);
-                     jo_stringf (j, "ts", "%04d-%02d-%02dT%02d:%02d:%02dZ", tm.tm_year + 1900,
-                                 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-                  }
-#define	b(name)		if(daikin.status_known&CONTROL_##name){if(!daikin.total##name)jo_bool(j,#name,0);else if(fixstatus||daikin.total##name==daikin.statscount)jo_bool(j,#name,1);else jo_litf(j,#name,"%.2f",(float)daikin.total##name/daikin.statscount);} \
-		  	daikin.total##name=0;
-#define	t(name)		if(daikin.count##name&&!isnan(daikin.total##name)){if(fixstatus||daikin.min##name==daikin.max##name)jo_litf(j,#name,"%.2f",daikin.min##name);	\
-		  	else {jo_array(j,#name);jo_litf(j,NULL,"%.2f",daikin.min##name);jo_litf(j,NULL,"%.2f",daikin.total##name/daikin.count##name);jo_litf(j,NULL,"%.2f",daikin.max##name);jo_close(j);}}	\
-		  	daikin.min##name=NAN;daikin.total##name=0;daikin.max##name=NAN;daikin.count##name=0;
-#define	r(name)		if(!isnan(daikin.min##name)&&!isnan(daikin.max##name)){if(fixstatus||daikin.min##name==daikin.max##name)jo_litf(j,#name,"%.2f",daikin.min##name);	\
-			else {jo_array(j,#name);jo_litf(j,NULL,"%.2f",daikin.min##name);jo_litf(j,NULL,"%.2f",daikin.max##name);jo_close(j);}}
-#define	i(name)		if(daikin.status_known&CONTROL_##name){if(fixstatus||daikin.min##name==daikin.max##name)jo_int(j,#name,daikin.total##name/daikin.statscount);     \
-                        else {jo_array(j,#name);jo_int(j,NULL,daikin.min##name);jo_int(j,NULL,daikin.total##name/daikin.statscount);jo_int(j,NULL,daikin.max##name);jo_close(j);}       \
-                        daikin.min##name=0;daikin.total##name=0;daikin.max##name=0;}
-#define e(name,values)  if((daikin.status_known&CONTROL_##name)&&daikin.name<sizeof(CONTROL_##name##_VALUES)-1)jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[daikin.name]);
-#include "acextras.m"
-                  revk_mqtt_send_clients (revk_app, 0, NULL, &j, 1);
-                  daikin.statscount = 0;
-                  ha_status ();
-               }
-            }
-         }
-         if (daikin.ha_send && (b.loopback || (poll > 10 && b.protocol_set && daikin.talking)))
-         {
-            send_ha_config ();
-            ha_status ();       // Update status now sent
-         }
+         daikin_publish ();     // Automation runs on this
+         task_end (&tt_protocol);
       }
       while (daikin.talking);
       // We're here if protocol has been broken. We'll reconfigure the UART
@@ -40,5 +40,9 @@ t(liquid)
 i(anglev)
 t(hum)
 i(Wh)
+t(lwt)
+t(rwt)
+t(dhw)
+t(discharge)
 
 #include "accontrols.m"
@@ -0,0 +1,376 @@
+/* Faikout aircon payloads */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "daikin_s21.h"
+#include "acproto.h"
+
+#define	report_uint8(name,val)	p->report_uint8(p->ctx,CONTROL_##name##_pos,val)
+#define	report_int(name,val)	p->report_int(p->ctx,CONTROL_##name##_pos,val)
+#define	report_float(name,val)	p->report_float(p->ctx,CONTROL_##name##_pos,val)
+#define	report_bool(name,val)	report_uint8(name,(val)?1:0)
+#define	get(name)		p->get(p->ctx,CONTROL_##name##_pos)
+#define	need(n)			do{if(len<(n)){p->need=(n);return ACPROTO_SHORT;}}while(0)
+
+int
+acproto_s21_response (acproto_t * p, uint8_t cmd, uint8_t cmd2, int len, const uint8_t * payload)
+{
+   // Remember to add to polling if we add more handlers
+   if (cmd == 'G')
+      switch (cmd2)
+      {
+      case '1':                // 'G1' - basic status
+         need (S21_PAYLOAD_LEN);
+         report_uint8 (online, 1);
+         report_bool (power, payload[0] == '1');
+         report_uint8 (mode, "30721003"[payload[1] & 0x7] - '0');       // FHCA456D mapped from AXDCHXF
+         report_uint8 (heat, get (mode) == FAIKIN_MODE_HEAT);   // Crude - TODO find if anything actually tells us this
+         if (get (mode) == FAIKIN_MODE_HEAT || get (mode) == FAIKIN_MODE_COOL || get (mode) == FAIKIN_MODE_AUTO)
+            report_float (temp, s21_decode_target_temp (payload[2]));
+         else if (!isnan (get (temp)))
+            report_float (temp, get (temp));    // Does not have temp in other modes
+         if (!p->rgfan)
+         {                      // RG is better, so we only look at G1 if RG does not work
+            if (payload[3] != 'A')      // Set fan speed
+               report_uint8 (fan, "00012345"[payload[3] & 0x7] - '0');  // XXX12345 mapped to A12345Q
+            else if (get (fan) == 6)
+               report_uint8 (fan, 6);   // Quiet mode set (it returns as auto, so we assume it should be quiet if fan speed is low)
+            else
+               report_uint8 (fan, 0);   // Auto as fan too fast to be quiet mode
+         }
+         break;
+      case '3':                // Seems to be an alternative to G6
+         // If F6 is supported, F3 does not provide "powerful" flag even if supported.
+         // We may still get G3 response for debug or from injection via MQTT "send".
+         if (p->f6bad)
+         {
+            need (S21_PAYLOAD_LEN);
+            report_bool (powerful, payload[3] & 0x02);
+         }
+         break;
+      case '5':                // 'G5' - swing status
+         need (1);
+         if (!p->noswingv)
+            report_bool (swingv, payload[0] & 1);
+         if (!p->noswingh)
+            report_bool (swingh, payload[0] & 2);
+         break;
+      case '6':                // 'G6' - "powerful" mode and some others
+         need (S21_PAYLOAD_LEN);
+         if (!p->nopowerful)
+            report_bool (powerful, payload[0] & 0x02);
+         if (!p->nocomfort)
+            report_bool (comfort, payload[0] & 0x40);
+         if (!p->noquiet)
+            report_bool (quiet, payload[0] & 0x80);
+         if (!p->nostreamer)
+            report_bool (streamer, payload[1] & 0x80);
+         if (!p->nosensor)
+            report_bool (sensor, payload[3] & 0x08);
+         if (!p->noled)
+            report_bool (led, (payload[3] & 0x0C) != 0x0C);
+         break;
+      case '7':                // 'G7' - "demand" and "eco" mode
+         need (2);
+         if (!p->nodemand && payload[0] != '1')
+            report_int (demand, 100 - (payload[0] - '0'));
+         if (!p->noecono)
+            report_bool (econo, payload[1] & 0x02);
+         break;
+      case '8':
+         need (2);
+         p->protocol_ver = payload[1] & (~0x30);
+         break;
+      case '9':
+         need (2);
+         report_float (home, (float) ((signed) payload[0] - 0x80) / 2);
+         report_float (outside, (float) ((signed) payload[1] - 0x80) / 2);
+         break;
+      case 'C':
+         if (len > 0)
+         {
+            // Normally response length would be 4, but let's try being more creative
+            // and future-proof. Accept the whole payload whatever it is.
+            char model[20];
+            int limit = len >= sizeof (model) ? sizeof (model) - 1 : len;
+            for (int i = 0; i < limit; i++)     // The string is provided in reverse
+               model[i] = payload[len - i - 1];
+            model[limit] = 0;
+            p->report_string (p->ctx, CONTROL_model_pos, model);
+         }
+         break;
+      case 'M':                // Power meter
+         need (S21_PAYLOAD_LEN);
+         report_int (Wh, s21_decode_hex_sensor (payload) * 100);        // 100Wh units
+         break;
+      }
+   if (cmd == 'S')
+   {
+      if (cmd2 == 'G')
+      {                         // One byte response!
+         need (1);
+         if (strchr ("34567AB", payload[0]))
+         {                      // Sensible FAN, else us F1
+            if (payload[0] >= '3' && payload[0] <= '7')
+               report_uint8 (fan, payload[0] - '3' + 1);        // 1-5
+            else if (payload[0] == 'A')
+               report_uint8 (fan, 0);   // Auto
+            else if (payload[0] == 'B')
+               report_uint8 (fan, 6);   // Quiet
+            p->rgfan = 1;
+         } else
+            p->rgfan = 0;
+      } else if (cmd2 == 'L' || cmd2 == 'd' || cmd2 == 'D' || cmd2 == 'N' || cmd2 == 'M')
+      {                         // These responses are always only 3 bytes long
+         need (3);
+         int v = s21_decode_int_sensor (payload, len);
+         switch (cmd2)
+         {
+         case 'L':             // Fan
+            report_int (fanrpm, v * 10);
+            break;
+         case 'd':             // Compressor
+            report_int (comp, v);
+            break;
+         case 'N':             // Angle vertical swing
+            report_int (anglev, v);
+            break;
+         }
+      } else
+      {
+         need (S21_PAYLOAD_LEN);
+         float t = s21_decode_float_sensor (payload);
+         if (t < 100)           // Sanity check
+         {
+            switch (cmd2)
+            {                   // Temperatures (guess)
+            case 'H':          // 'SH' - home temp
+               report_float (home, t);
+               break;
+            case 'a':          // 'Sa' - outside temp
+               report_float (outside, t);
+               break;
+            case 'I':          // 'SI' - liquid ???
+               report_float (liquid, t);
+               break;
+            case 'N':          // ?
+               break;
+            case 'X':          // ?
+               break;
+            }
+         }
+      }
+   }
+   return ACPROTO_OK;
+}
+
+int
+acproto_x50a_response (acproto_t * p, uint8_t cmd, int len, const uint8_t * payload)
+{
+   if (cmd == 0xAA)
+   {                            // Initialisation response
+      need (1);
+      if (!*payload)
+         return ACPROTO_NOTREADY;
+      return ACPROTO_OK;
+   }
+   if (cmd == 0xBA)
+   {
+      need (20);
+      char model[20];
+      memcpy (model, payload, sizeof (model) - 1);      // Payload may fill it, with no NULL
+      model[sizeof (model) - 1] = 0;
+      p->report_string (p->ctx, CONTROL_model_pos, model);
+      return ACPROTO_OK;
+   }
+   if (cmd == 0xCA)
+   {                            // Main status settings
+      need (10);
+      report_uint8 (online, 1);
+      report_uint8 (power, payload[0]);
+      report_uint8 (mode, payload[1]);
+      report_uint8 (heat, payload[2] == 1);
+      report_uint8 (slave, payload[9]);
+      report_uint8 (fan, (payload[6] >> 4) & 7);
+      return ACPROTO_OK;
+   }
+   if (cmd == 0xCB)
+   {                            // We get all this from CA
+      need (2);
+      return ACPROTO_OK;
+   }
+   if (cmd == 0xBD)
+   {                            // Looks like temperatures - we assume 0000 is not set
+      need (29);
+      float t;
+      if ((t = (int16_t) (payload[0] + (payload[1] << 8)) / 128.0) && t < 100)
+         report_float (inlet, t);
+      if ((t = (int16_t) (payload[2] + (payload[3] << 8)) / 128.0) && t < 100)
+         report_float (home, t);
+      if ((t = (int16_t) (payload[4] + (payload[5] << 8)) / 128.0) && t < 100)
+         report_float (liquid, t);
+      if ((t = (int16_t) (payload[8] + (payload[9] << 8)) / 128.0) && t < 100)
+         report_float (temp, t);
+      return ACPROTO_OK;
+   }
+   if (cmd == 0xBE)
+   {                            // Status/flags?
+      need (9);
+      report_int (fanrpm, (payload[2] + (payload[3] << 8)));
+      // Flag4 ?
+      if (!p->noflap)
+         report_uint8 (flap, payload[5]);
+      if (!p->noantifreeze)
+         report_uint8 (antifreeze, payload[6]);
+      // Flag7 ?
+      // Flag8 ?
+      // Flag9 ?
+      // 0001B0040100000001
+      // 010476050101000001
+      // 010000000100000001
+      return ACPROTO_OK;
+   }
+   return ACPROTO_OK;
+}
+
+void
+acproto_cn_wired_fan (acproto_t * p, const uint8_t * packet)
+{
+   int8_t new_fan = cnw_decode_fan (packet);
+
+   if (new_fan != FAIKIN_FAN_INVALID)
+      report_uint8 (fan, new_fan);
+   // Powerful is a dedicated flag for us, because this is how
+   // other protocols handle it
+   report_bool (powerful, packet[CNW_FAN_OFFSET] == CNW_FAN_POWERFUL);
+}
+
+int
+acproto_cn_wired_packet (acproto_t * p, const uint8_t * packet)
+{
+   int8_t new_mode;
+
+   switch (packet[CNW_CRC_TYPE_OFFSET] & CNW_TYPE_MASK)
+   {
+   case CNW_SENSOR_REPORT:
+      report_float (home, decode_bcd (packet[CNW_TEMP_OFFSET]));
+      break;
+   case CNW_MODE_CHANGED:
+      new_mode = cnw_decode_mode (packet);
+      report_uint8 (power, !(packet[CNW_MODE_OFFSET] & CNW_MODE_POWEROFF));
+      if (new_mode != FAIKIN_MODE_INVALID)
+         report_uint8 (mode, new_mode);
+      report_uint8 (heat, get (mode) == FAIKIN_MODE_HEAT);
+      report_float (temp, decode_bcd (packet[CNW_TEMP_OFFSET]));
+      acproto_cn_wired_fan (p, packet);
+      report_bool (swingv, packet[CNW_SPECIALS_OFFSET] & CNW_V_SWING);
+      if (!p->noled)
+         report_bool (led, packet[CNW_SPECIALS_OFFSET] & CNW_LED_ON);
+      break;
+   default:
+      // From testing with people we know there are also packets of other types.
+      // Example of a type 2 packet: 0038000000000022
+      // We currently don't know what they mean.
+      return ACPROTO_UNKNOWN;
+   }
+   return ACPROTO_OK;
+}
+
+void
+acproto_s21_d1 (acproto_t * p, char *payload)
+{
+   int mode = get (mode);
+   payload[0] = get (power) ? '1' : '0';
+   payload[1] = ("64300002"[mode & 7]); // FHCA456D mapped to AXDCHXF
+   if (mode == 1 || mode == 2 || mode == 3)
+      payload[2] = s21_encode_target_temp (get (temp));
+   else
+      payload[2] = AC_MIN_TEMP_VALUE;   // No temp in other modes
+   payload[3] = ("A34567B"[(int) get (fan) % 7]);
+}
+
+void
+acproto_s21_d3 (acproto_t * p, char *payload)
+{
+   payload[0] = '0';
+   payload[1] = '0';
+   payload[2] = '0';
+   payload[3] = '0' + (get (powerful) ? 2 : 0);
+}
+
+void
+acproto_s21_d5 (acproto_t * p, char *payload)
+{
+   int swingh = get (swingh),
+      swingv = get (swingv);
+   payload[0] = '0' + (swingh ? 2 : 0) + (swingv ? 1 : 0) + (swingh && swingv ? 4 : 0);
+   payload[1] = (swingh || swingv ? '?' : '0');
+   payload[2] = '0';
+   payload[3] = '0';
+}
+
+void
+acproto_s21_d6 (acproto_t * p, char *payload)
+{
+   payload[0] = '0' + (get (powerful) ? 2 : 0) + (get (comfort) ? 0x40 : 0) + (get (quiet) ? 0x80 : 0);
+   payload[1] = '0' + (get (streamer) ? 0x80 : 0);
+   payload[2] = '0';
+   // If sensor, the 8 is sensor, if not, then 4 and 8 are LED, with 4=high, 8=low, 12=off
+   if (p->noled || !p->nosensor)
+      payload[3] = '0' + (get (sensor) ? 0x08 : 0) + (get (led) ? 0x04 : 0);    // Messy but gives some controls
+   else
+      payload[3] = '0' + (get (led) ? p->dark ? 8 : 4 : 12);
+}
+
+void
+acproto_s21_d7 (acproto_t * p, char *payload)
+{
+   payload[0] = '0' + 100 - (int) get (demand);
+   payload[1] = '0' + (get (econo) ? 2 : 0);
+   payload[2] = '0';
+   payload[3] = '0';
+}
+
+int
+acproto_x50a_control (acproto_t * p, uint8_t * ca, uint8_t * cb)
+{
+   int mode = get (mode),
+      temp = 0;
+   ca[0] = 2 + (int) get (power);
+   ca[1] = 0x10 + mode;
+   if (mode >= 1 && mode <= 3)
+   {                            // Temp
+      int t = lroundf (get (temp) * 10);
+      ca[3] = t / 10;
+      ca[4] = 0x80 + (t % 10);
+      temp = 1;
+   }
+   if (mode == 1 || mode == 2)
+      cb[0] = mode;
+   else
+      cb[0] = 6;
+   cb[1] = 0x80 + (((int) get (fan) & 7) << 4);
+   return temp;
+}
+
+int
+acproto_legacy_mode (const char *v)
+{
+   int n = atoi (v);
+   static const int8_t modes[] = { 3, 3, 7, 2, 1, -1, 0, 3 };   // AADCH-FA
+   return (n >= 0 && n <= 7) ? modes[n] : -1;
+}
+
+int
+acproto_legacy_fan (const char *v)
+{
+   if (*v == 'A')
+      return 0;
+   if (*v == 'B')
+      return 6;
+   if (*v >= '3' && *v <= '7')
+      return *v - '2';
+   return -1;
+}
@@ -0,0 +1,81 @@
+#ifndef _ACPROTO_H
+#define _ACPROTO_H
+
+// Aircon payloads, S21, X50A and CN_WIRED, decoding replies and encoding controls, through a state struct
+// This has no ESP-IDF calls, so the firmware's own decoding can also be run on a host, against a simulator or a fuzzer
+
+#include <stdint.h>
+
+enum
+{                               // Number the control fields, CONTROL_xxx_pos
+#define	b(name)		CONTROL_##name##_pos,
+#define	t(name)		b(name)
+#define	r(name)		b(name)
+#define	i(name)		b(name)
+#define	e(name,values)	b(name)
+#define	s(name,len)	b(name)
+#include "acextras.m"
+};
+
+enum
+{                               // Outcome of decoding
+   ACPROTO_OK,                  // Decoded, or not a reply we decode
+   ACPROTO_SHORT,               // Payload too short, need is what was needed
+   ACPROTO_NOTREADY,            // X50A aircon not ready
+   ACPROTO_UNKNOWN,             // CN_WIRED packet of unknown type
+};
+
+typedef struct
+{                               // Aircon state, and how to report it
+   // Settings of the same name, set by caller
+   uint8_t noswingv:1;
+   uint8_t noswingh:1;
+   uint8_t nopowerful:1;
+   uint8_t nocomfort:1;
+   uint8_t noquiet:1;
+   uint8_t nostreamer:1;
+   uint8_t nosensor:1;
+   uint8_t noled:1;
+   uint8_t nodemand:1;
+   uint8_t noecono:1;
+   uint8_t noflap:1;
+   uint8_t noantifreeze:1;
+   uint8_t dark:1;              // LED dark rather than bright when on
+   // Protocol state
+   uint8_t f6bad:1;             // F6 not supported, so G3 has powerful, set by caller
+   uint8_t rgfan:1;             // RG gives fan, so G1 fan is not used
+   uint8_t protocol_ver;        // From G8
+   int need;                    // Length needed, for ACPROTO_SHORT
+   // Report a status value, pos is CONTROL_xxx_pos
+   void (*report_uint8) (void *ctx, int pos, uint8_t val);
+   void (*report_int) (void *ctx, int pos, int val);
+   void (*report_float) (void *ctx, int pos, float val);
+   void (*report_string) (void *ctx, int pos, const char *val);
+   // Current value, which may be a control being set rather than what was last reported
+   float (*get) (void *ctx, int pos);
+   void *ctx;
+} acproto_t;
+
+// Decode S21 reply payload, cmd and cmd2 are the reply (e.g. G1)
+int acproto_s21_response (acproto_t * p, uint8_t cmd, uint8_t cmd2, int len, const uint8_t * payload);
+// Decode X50A reply payload
+int acproto_x50a_response (acproto_t * p, uint8_t cmd, int len, const uint8_t * payload);
+// Decode CN_WIRED packet (CNW_PKT_LEN, checksum already checked)
+int acproto_cn_wired_packet (acproto_t * p, const uint8_t * packet);
+// Report fan and powerful from a CN_WIRED packet, received or sent
+void acproto_cn_wired_fan (acproto_t * p, const uint8_t * packet);
+
+// Encode S21 control payloads (S21_PAYLOAD_LEN) from current values
+void acproto_s21_d1 (acproto_t * p, char *payload);     // power, mode, temp, fan
+void acproto_s21_d3 (acproto_t * p, char *payload);     // powerful, where no F6
+void acproto_s21_d5 (acproto_t * p, char *payload);     // swing
+void acproto_s21_d6 (acproto_t * p, char *payload);     // powerful, comfort, quiet, streamer, sensor, led
+void acproto_s21_d7 (acproto_t * p, char *payload);     // demand, econo
+// Encode X50A CA (17 bytes) and CB (2 bytes) from current values, returns 0 if mode has no temp
+int acproto_x50a_control (acproto_t * p, uint8_t * ca, uint8_t * cb);
+
+// Legacy (BRP) set_control_info values, returns -1 if not valid
+int acproto_legacy_mode (const char *v);        // mode, to FHCA456D
+int acproto_legacy_fan (const char *v);         // f_rate, to A12345Q
+
+#endif
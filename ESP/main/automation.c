@@ -0,0 +1,574 @@
+/* Faikout auto control logic */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <math.h>
+#include <string.h>
+#include "automation.h"
+
+#define	MPC_LAMBDA	0.995   // RLS forgetting factor, about 3 hours of steps
+
+static float
+mpc_effort (uint8_t fan)
+{                               // Relative output for fan setting, auto/quiet assumed middling
+   return fan >= 1 && fan <= 5 ? 0.5 + 0.1 * fan : 0.8;
+}
+
+static void
+mpc_update (automation_mpc_t * m, float y)
+{                               // Recursive least squares update of theta, for dT of y, from m->phi
+   float *phi = m->phi;
+   float Pphi[3];
+   float denom = MPC_LAMBDA;
+   for (int i = 0; i < 3; i++)
+   {
+      Pphi[i] = 0;
+      for (int j = 0; j < 3; j++)
+         Pphi[i] += m->P[i][j] * phi[j];
+      denom += phi[i] * Pphi[i];
+   }
+   float e = y;
+   for (int i = 0; i < 3; i++)
+      e -= m->theta[i] * phi[i];
+   float trace = 0;
+   for (int i = 0; i < 3; i++)
+   {
+      m->theta[i] += Pphi[i] / denom * e;
+      trace += m->P[i][i];
+   }
+   float lambda = (trace > 1e4 ? 1 : MPC_LAMBDA);       // Don't let covariance wind up when not excited
+   for (int i = 0; i < 3; i++)
+      for (int j = 0; j < 3; j++)
+         m->P[i][j] = (m->P[i][j] - Pphi[i] * Pphi[j] / denom) / lambda;
+   m->updates++;
+}
+
+static void
+mpc_plan (automation_mpc_t * m, const automation_config_t * c, uint8_t fan, uint8_t running, uint8_t hot, float temp,
+          float outside, float min, float max)
+{                               // Pick fan, and when to run and for how long, to minimise deviation and starts over the horizon
+   int steps = c->mpchorizon / MPC_STEP;
+   if (steps < 1)
+      steps = 1;
+   if (steps > 240)
+      steps = 240;
+   int g = (steps + 19) / 20;   // Granularity of plans, to limit the search
+   float centre = (min + max) / 2;
+   float cost (uint8_t f, int wait, int run, float *end)
+   {                            // Cost of waiting, then running fan f for run steps, then idle
+      float t = temp,
+         cost = (run && (wait || !running) ? c->mpcstart : 0) + (run && f != fan ? c->mpcstart / 20 : 0),
+         q = (hot ? 1 : -1) * mpc_effort (f);
+      for (int k = 0; k < steps; k++)
+      {
+         uint8_t on = (k >= wait && k < wait + run);
+         t += m->theta[0] * (outside - t) + m->theta[1] * (on ? q : 0) + m->theta[2];
+         float d = (t < min ? min - t : t > max ? t - max : 0),
+            e = (t - centre) / 2;
+         cost += d * d + e * e + (on ? mpc_effort (f) / 100 : 0);       // Outside range, off centre, plus a little energy
+      }
+      *end = t;
+      return cost;
+   }
+   uint8_t step = c->fan5 ? 1 : 2;
+   uint8_t lo = 1,
+      hi = c->autofmax;
+   if (c->nofanauto || fan < 1 || fan > 5)
+      lo = hi = fan;            // Fan is not ours to change
+   m->cost = cost (fan, 0, 0, &m->predict);
+   m->wait = 0;
+   m->run = 0;
+   m->fan = fan;
+   for (uint8_t f = lo; f <= hi; f += step)
+      for (int wait = 0; wait < steps; wait += g)
+         for (int run = g; run <= steps - wait; run += g)
+         {
+            float end,
+              cc = cost (f, wait, run, &end);
+            if (cc < m->cost)
+            {
+               m->cost = cc;
+               m->predict = end;
+               m->wait = wait;
+               m->run = run;
+               m->fan = f;
+            }
+         }
+   if (m->wait)
+      m->run = 0;               // Not running yet
+}
+
+static uint8_t
+mpc_step (automation_mpc_t * m, const automation_config_t * c, automation_unit_t * u, float temp, uint8_t hot,
+          uint32_t now)
+{                               // Update model and plan each MPC_STEP, return 1 if plan is to be used
+   if (!c->mpc || isnan (temp) || isnan (u->mintarget) || isnan (u->maxtarget))
+   {
+      m->valid = 0;
+      return 0;
+   }
+   if (!m->updates && !m->P[0][0])
+   {                            // Initial model, slow room, weak aircon, to be learned
+      memset (m, 0, sizeof (*m));
+      m->theta[0] = 0.002;
+      m->theta[1] = 0.05;
+      for (int i = 0; i < 3; i++)
+         m->P[i][i] = 100;
+   }
+   float outside = (isnan (u->outside) ? 0 : u->outside);       // Else c absorbs it
+   uint8_t use = (m->updates >= MPC_LEARN && m->theta[0] >= 0 && m->theta[1] > 0);
+   if (m->next > now)
+      return use;
+   m->next = now + MPC_STEP;
+   if (m->valid && m->efforts)
+   {                            // Learn from last step, using average effort actually applied over it
+      m->phi[1] = m->effort / m->efforts;
+      mpc_update (m, temp - m->last);
+   }
+   use = (m->updates >= MPC_LEARN && m->theta[0] >= 0 && m->theta[1] > 0);
+   if (use)
+      mpc_plan (m, c, u->fan, u->action == HVAC_HEATING || u->action == HVAC_COOLING, hot, temp, outside, u->mintarget,
+                u->maxtarget);
+   else
+   {                            // Learning, existing logic applies
+      m->wait = m->run = 0;
+      m->fan = u->fan;
+   }
+   m->last = temp;
+   m->phi[0] = outside - temp;
+   m->phi[2] = 1;
+   m->effort = 0;
+   m->efforts = 0;
+   m->valid = u->control;       // Only learn from what we are controlling
+   return use;
+}
+
+static uint8_t
+defrosting (const automation_unit_t * u, uint8_t hot)
+{                               // Anti-freeze, or heating with compressor running but indoor coil colder than the room (reverse cycle)
+   if (u->antifreeze)
+      return 1;
+   if (!hot || !u->power || u->comp <= 0 || isnan (u->liquid))
+      return 0;
+   float room = (isnan (u->inlet) ? u->home : u->inlet);
+   return !isnan (room) && u->liquid < room - DEFROST_LIQUID;
+}
+
+void
+automation_run (automation_t * a, const automation_config_t * c, automation_unit_t * u, uint32_t now,
+                automation_report_t * r)
+{                               // Faikout auto, auto on/off, hvac_action
+   memset (r, 0, sizeof (*r));
+   u->want = 0;
+   uint8_t hot = u->heat;       // Are we in heating mode?
+   float min = u->mintarget;
+   float max = u->maxtarget;
+   float measured_temp = u->env;
+   if (isnan (measured_temp))   // No env temp available, so use A/C internal temp
+      measured_temp = u->home;
+   uint8_t canswap (void)
+   {                            // Can swap heat/cool, not locked, and not against group mode
+      return !c->lockmode && !(u->group && u->groupheat == hot);
+   }
+   // Defrost (or anti-freeze), and recovery after it, is excluded from samples, prediction and model, as temps dip
+   if (defrosting (u, hot))
+   {
+      if (!a->defrost)
+      {                         // Start
+         a->defrost = (now ? : 1);
+         if (a->defrostlast)
+         {
+            a->defrostgaps++;
+            a->defrostgaptime += now - a->defrostlast;
+         }
+         a->defrostlast = (now ? : 1);
+         a->defrosts++;
+      }
+      a->defrostwindow = now + DEFROST_RECOVER;
+   } else if (a->defrost)
+   {                            // End
+      a->defrosttime += now - a->defrost;
+      a->defrost = 0;
+   }
+   if (!u->power || !hot)
+      a->defrostlast = 0;       // Only measure intervals over continuous heating
+   uint8_t defrost = (a->defrostwindow > now);
+   uint8_t mpc = mpc_step (&a->mpc, c, u, measured_temp, hot, now);    // Model predictive control, if enabled and learned
+   if (defrost)
+      a->mpc.valid = 0;         // Don't learn from this step
+   if (mpc && !defrost && u->control && canswap () && !a->mpc.wait && !a->mpc.run
+       && ((hot && a->mpc.predict > u->maxtarget + c->switchtemp) || (!hot && a->mpc.predict < u->mintarget - c->switchtemp)))
+   {                            // Model says we will end up beyond the other side of the target range without running, so swap mode
+      hot = !hot;
+      u->mode = (hot ? FAIKIN_MODE_HEAT : FAIKIN_MODE_COOL);
+   }
+   // Predict temperature changes
+   // Take 2 delta temps of the last 3 measured env temperatures
+   // If there is no opposite movement (both cooler or both hotter or at least no change),
+   //  push (increase or decrease) the measured env temp by adding the two deltatemps
+   //  multiplied with a factor.
+   // This "predicted" env temp is used for all further calculations.
+   // E.g.: temps [19.5, 19.6, 19.8] (with 19.8 as the most recent value)
+   //       leads to deltas [0.1, 0.2]
+   //       new "predicted" env temp is (19.8+(0.1+0.2)*2)=20.4 (*2 is calculated from tpredictt and tpredicts)
+   // tpredicts is the "sample time" for the calculation (it must be taken *2, because the deltas are calculated over 2 cycles)
+   // tpredictt is the time in the future where the predicted env temp would be reached.
+   if (c->tpredicts && !isnan (measured_temp) && defrost)
+   {                            // Start again after defrost
+      a->predicted = now;
+      a->env_prev = measured_temp;
+      a->env_delta = a->env_delta_prev = 0;
+   } else if (c->tpredicts && !isnan (measured_temp))
+   {
+      if (now / c->tpredicts != a->predicted / c->tpredicts)
+      {                         // Every minute - predictive
+         a->predicted = now;
+         a->env_delta_prev = a->env_delta;      // Save last delta
+         a->env_delta = measured_temp - a->env_prev;    // Delta from currently measured temperature and previously measured temperature
+         // env_delta < 0 means the room is cooling down
+         // env_delta > 0 means the room is heating up
+         a->env_prev = measured_temp;   // Save current temperature for next cycle
+      }
+      // Two subsequent temperature changes in the same direction ("no change" is ok as well)
+      if ((a->env_delta <= 0 && a->env_delta_prev <= 0) || (a->env_delta >= 0 && a->env_delta_prev >= 0))
+         measured_temp += (a->env_delta + a->env_delta_prev) * c->tpredictt / (c->tpredicts * 2);    // Predict
+   }
+   // Apply adjustment
+   if (!c->thermostat && u->control && u->power && !isnan (min) && !isnan (max))
+   {
+      if (hot)
+      {
+         max += c->switchtemp;  // Overshoot for switching (heating)
+         min += c->pushtemp;    // Adjust target
+      } else
+      {
+         min -= c->switchtemp;  // Overshoot for switching (cooling)
+         max -= c->pushtemp;    // Adjust target
+      }
+   }
+
+   void samplestart (void)
+   {                            // Start sampling for fan/switch controls
+      a->sample = 0;            // Start sample period
+   }
+
+
+   void controlstart (void)
+   {                            // Start controlling
+      if (u->control)
+         return;
+      a->hysteresis = 0;
+      u->control = 1;
+      samplestart ();
+      // Switch modes (heating or cooling) depending on currently measured
+      //  temperature related to min/max
+      if (canswap ())
+      {
+         if (hot && measured_temp > max)
+         {
+            hot = 0;
+            u->mode = FAIKIN_MODE_COOL; // Set cooling as over temp
+         } else if (!hot && measured_temp < min)
+         {
+            hot = 1;
+            u->mode = FAIKIN_MODE_HEAT; // Set heating as under temp
+         }
+      }
+      // Force high fan at the beginning if not fan in AUTO
+      //  and temperature not close to target temp
+      // TODO: Use of switchtemp for different purposes is confusing (ref. min/max a couple of lines above)
+      if (!mpc && !c->nofanauto && u->fan
+          && ((hot && measured_temp < min - 2 * c->switchtemp) || (!hot && measured_temp > max + 2 * c->switchtemp)))
+      {
+         a->fansaved = u->fan;  // Save for when we get to temp
+         u->fan = c->autofmax;  // Max fan at start
+      }
+   }
+   // END OF controlstart()
+
+
+   void controlstop (void)
+   {                            // Stop controlling
+      if (!u->control)
+         return;
+      u->control = 0;
+      if (a->fansaved)
+      {                         // Restore saved fan setting (if was set, which nofanauto would not do)
+         u->fan = a->fansaved;
+         a->fansaved = 0;
+      }
+      // We were controlling, so set to a non controlling mode, best guess at sane settings for now
+      if (!isnan (u->mintarget) && !isnan (u->maxtarget))
+         u->temp = u->heat ? u->maxtarget : u->mintarget;
+      u->mintarget = NAN;
+      u->maxtarget = NAN;
+   }
+   // END OF controlstop()
+
+
+   if (!u->remote && c->autoe && (c->auto0 || c->auto1) && (c->auto0 != c->auto1) && u->hhmm >= 0)
+   {                            // Auto on/off, 00:00 is not considered valid, use 00:01. Also setting same on and off is not considered valid
+      int hhmm = u->hhmm;
+      if (c->auto0 && a->lasthhmm < c->auto0 && hhmm >= c->auto0)
+         u->power = 0;          // Auto off, simple
+      if (c->auto1 && a->lasthhmm < c->auto1 && hhmm >= c->auto1)
+      {                         // Auto on - and consider mode change is not on Auto
+         u->power = 1;
+         if (canswap () && u->mode != FAIKIN_MODE_AUTO && !isnan (measured_temp) && !isnan (min) && !isnan (max)
+             && ((hot && measured_temp > max) || (!hot && measured_temp < min)))
+            u->mode = hot ? FAIKIN_MODE_COOL : FAIKIN_MODE_HEAT;        // Swap mode
+      }
+      a->lasthhmm = hhmm;
+   }
+   // Monitoring and automation
+   if (!isnan (measured_temp) && !isnan (min) && !isnan (max) && c->tsample)
+   {                            // Monitoring and automation
+      if (u->power && a->lastheat != hot)
+      {                         // If we change mode, start samples again
+         a->lastheat = hot;
+         samplestart ();
+      }
+
+      if (!a->sample)
+      {
+         // TODO: Wouldn't this be better in samplestart()?
+         a->countApproaching = a->countApproachingPrev = a->countBeyond = a->countBeyondPrev = a->countTotal = a->countTotalPrev = 0;  // Reset sample counts
+         a->countDefrost = a->countDefrostPrev = 0;
+      } else if (defrost)
+      {
+         a->countDefrost++;     // Excluded
+         if (a->sample <= now)
+            a->sample = now + 1;        // No changes until after defrost
+      } else
+      {
+         a->countTotal++;       // Total
+         if ((hot && measured_temp < min) || (!hot && measured_temp > max))
+            a->countApproaching++;      // Approaching temp
+         else if ((hot && measured_temp > max) || (!hot && measured_temp < min))
+            a->countBeyond++;   // Beyond
+      }
+
+      // New sample Cycle
+      if (a->sample <= now)
+      {                         // New sample, consider some changes
+         // countTotalPrev is Total Counter of previous cycle
+         int count_approaching_2_samples = a->countApproaching + a->countApproachingPrev;      // Approaching counter of this and previous cycle
+         int countBeyond2Samples = a->countBeyond + a->countBeyondPrev; // Beyond counter of this and previous cycle
+         int count_total_2_samples = a->countTotal + a->countTotalPrev; // Total counter of this and previous cycle (includes neither approaching or beyond, i.e. in range)
+         // Prepare report for "automation"
+         r->hot = hot;
+         r->approaching = count_approaching_2_samples;
+         r->beyond = countBeyond2Samples;
+         r->samples = count_total_2_samples;
+         r->initial = !a->countTotalPrev;
+         r->excluded = a->countDefrost + a->countDefrostPrev;
+         r->defrost = defrost;
+         r->defrosts = a->defrosts;
+         if (a->defrosts > (a->defrost ? 1 : 0))
+            r->defrostlen = a->defrosttime / (a->defrosts - (a->defrost ? 1 : 0));
+         if (a->defrostgaps)
+            r->defrostgap = a->defrostgaptime / a->defrostgaps;
+         r->temp = measured_temp;
+         r->min = min;
+         r->max = max;
+         r->setpower = -1;
+         r->setfan = -1;
+         if (c->mpc && a->mpc.updates)
+         {                      // Model estimates
+            automation_mpc_t *m = &a->mpc;
+            r->mpc = 1;
+            r->mpctau = (m->theta[0] > 0 ? MPC_STEP / m->theta[0] / 60 : INFINITY);
+            r->mpcrate = m->theta[1] * 3600 / MPC_STEP;
+            r->mpcdrift = m->theta[2] * 3600 / MPC_STEP;
+            r->mpcpredict = m->predict;
+            r->mpccost = m->cost;
+            r->mpcupdates = m->updates;
+            r->mpcwait = m->wait * MPC_STEP / 60;
+            r->mpcrun = m->run * MPC_STEP / 60;
+            r->mpcfan = m->fan;
+         }
+         if (a->countTotalPrev) // Skip first cycle
+         {                      // Power, mode, fan, automation
+            if (u->power)       // Daikin is on
+            {
+               int step = c->fan5 ? 1 : 2;
+               // A lot more beyond than total counts and no approaching in the last two cycles
+               // Time to switch modes (heating/cooling) and reduce fan to minimum
+               if (!mpc && (countBeyond2Samples * 2 > count_total_2_samples || u->slave) && !count_approaching_2_samples)
+               {                // Mode switch
+                  if (canswap ())
+                  {
+                     r->setmode = hot ? 'C' : 'H';
+                     u->mode = hot ? FAIKIN_MODE_COOL : FAIKIN_MODE_HEAT;       // Swap mode
+                     if (!c->nofanauto && step && u->fan > 1 && u->fan <= 5)
+                     {
+                        r->setfan = 1;
+                        u->fan = 1;
+                     }
+                  }
+               }
+               // Less approaching, but still close to min in heating or max in cooling
+               // Time to reduce the fan a bit
+               else
+                  if (!mpc && !c->nofanauto && count_approaching_2_samples * 10 < count_total_2_samples * 7
+                      && step && u->fan > 1 && u->fan <= 5)
+               {
+                  r->setfan = u->fan - step;
+                  u->fan -= step;       // Reduce fan
+               }
+               // A lot of approaching means still far away from desired temp
+               // Time to increase the fan speed
+               else
+                  if (!mpc && !c->nofanauto && !u->slave
+                      && count_approaching_2_samples * 10 > count_total_2_samples * 9
+                      && step && u->fan >= 1 && u->fan < c->autofmax)
+               {
+                  r->setfan = u->fan + step;
+                  u->fan += step;       // Increase fan
+               }
+               // No Approaching and no Beyond, so it's in desired range (autot +/- autor)
+               // Only affects if autop is active
+               // Turn off as 100% in band for last two period
+               else
+                  if (((c->autoe && c->autop) || (u->remote && c->autoptemp)) && !count_approaching_2_samples
+                      && !countBeyond2Samples)
+               {                // Auto off
+                  r->setpower = 0;
+                  u->power = 0; // Turn off as 100% in band for last two period
+               }
+            }
+            // Daikin is off
+            else if (((c->autoe && c->autop) || (u->remote && c->autoptemp))   // AutoP Mode only
+                     && (a->countApproaching == a->countTotal || a->countBeyond == a->countTotal)       // full cycle approaching or full cycle beyond
+                     && (measured_temp >= max + c->autoptemp    // temp out of desired range
+                         || measured_temp <= min - c->autoptemp) && (!c->lockmode || countBeyond2Samples != count_total_2_samples))        // temp out of desired range
+            {                   // Auto on (don't auto on if would reverse mode and lockmode)
+               r->setpower = 1;
+               u->power = 1;    // Turn on as 100% out of band for last two period
+               if (countBeyond2Samples == count_total_2_samples)
+               {
+                  r->setmode = hot ? 'C' : 'H';
+                  u->mode = hot ? FAIKIN_MODE_COOL : FAIKIN_MODE_HEAT;  // Swap mode
+               }
+            }
+         }
+         if (count_total_2_samples)     // after a cycle, report automation data
+            r->valid = 1;
+         // Next sample
+         a->countApproachingPrev = a->countApproaching;
+         a->countBeyondPrev = a->countBeyond;
+         a->countTotalPrev = a->countTotal;
+         a->countDefrostPrev = a->countDefrost;
+         a->countApproaching = a->countBeyond = a->countTotal = a->countDefrost = 0;   // Reset counter
+         a->sample = now + c->tsample;  // Set time for next sample cycle
+      }
+   }
+   // End Control due to timeout
+   if (u->controlvalid && now > u->controlvalid)
+   {                            // End of auto mode and no env data either
+      u->controlvalid = 0;
+      u->env = NAN;
+      u->remote = 0;
+      controlstop ();
+   }
+   // Local auto controls
+   if (u->power && u->controlvalid && !u->shutdown)
+   {                            // Local auto controls
+      if (isnan (min) || isnan (max))
+         controlstop ();
+      else
+      {                         // Control
+         controlstart ();       // Will do nothing if control already active
+         // What the A/C is using as current temperature
+         float reference = NAN;
+         if (!isnan (u->home) && !isnan (u->inlet))     // Both values are known
+            reference = (u->home * c->thermref + u->inlet * (100 - c->thermref)) / 100; // thermref is how much inlet and home are used as reference
+         else if (!isnan (u->home))
+            reference = u->home;
+         else if (!isnan (u->inlet))
+            reference = u->inlet;
+         // It looks like the ducted units are using inlet in some way, even when field settings say controller.
+         if (u->mode == FAIKIN_MODE_AUTO)
+            u->mode = hot ? FAIKIN_MODE_HEAT : FAIKIN_MODE_COOL;        // Out of auto
+         // Temp set
+         float set = (min + max) / 2.0; // Target temp we will be setting (before adjust for reference error and before limiting)
+         if (c->thermostat)
+            set = (((hot && a->hysteresis) || (!hot && !a->hysteresis)) ? max : min);
+         if (c->temptrack)
+            set = reference;    // Base target on current Daikin measured temp instead.
+         else if (c->tempadjust)
+            set += reference - measured_temp;   // Adjust for reference not being measured_temp
+         u->want = (mpc ? a->mpc.run > 0 : ((hot && measured_temp < (a->hysteresis ? max : min))
+                                            || (!hot && measured_temp > (a->hysteresis ? min : max))));
+         if (u->want && (!u->hold || u->action == HVAC_HEATING || u->action == HVAC_COOLING))
+         {                      // Apply heat/cool - i.e. force heating or cooling to definitely happen
+            if (mpc && !c->nofanauto && a->mpc.fan != u->fan)
+            {                   // Fan as planned, restored when we stop controlling
+               if (!a->fansaved)
+                  a->fansaved = u->fan;
+               u->fan = a->mpc.fan;
+            }
+            if (c->thermostat)
+               a->hysteresis = 1;       // We're on, so keep going to "beyond"
+            if (hot)
+            {
+               set += c->heatover;      // Ensure heating by applying A/C offset to force it
+               u->action = HVAC_HEATING;
+            } else
+            {
+               set -= c->coolover;      // Ensure cooling by applying A/C offset to force it
+               u->action = HVAC_COOLING;
+            }
+            if (!c->noled && c->autolcontrol)
+               u->led = 1;
+         } else
+         {                      // At or beyond temp - stop heat/cool - try and ensure it stops heating or cooling
+            u->action = HVAC_IDLE;
+            a->hysteresis = 0;  // We're off, so keep falling back until "approaching" (default when thermostat not set)
+            if (a->fansaved && !mpc)
+            {
+               u->fan = a->fansaved;    // revert fan speed (if set, which nofanauto would not do)
+               a->fansaved = 0;
+               samplestart ();  // Initial phase complete, start samples again.
+            }
+            if (hot)
+               set -= c->heatback;      // Heating mode but apply negative offset to not actually heat any more than this
+            else
+               set += c->coolback;      // Cooling mode but apply positive offset to not actually cool any more than this
+            if (!c->noled && c->autolcontrol)
+               u->led = 0;
+         }
+
+         // Limit settings to acceptable values
+         if (c->tempstep > 0)
+            set = roundf (set / c->tempstep) * c->tempstep;     // e.g. CN_WIRED only does 1C steps, S21 only does 0.5C steps
+         if (set < (hot ? c->tmin : c->tcoolmin))
+            set = (hot ? c->tmin : c->tcoolmin);
+         if (set > (hot ? c->theatmax : c->tmax))
+            set = (hot ? c->theatmax : c->tmax);
+         if (!isnan (set) && (u->action != a->lastaction || (set != a->lastset && now > a->flap)))
+         {
+            a->flap = now + c->tempnoflap;      // Hold off changes for preset time, unless change of mode
+            a->lastaction = u->action;
+            a->lastset = set;
+            u->temp = set;      // Apply temperature setting
+         }
+      }
+      if (c->mpc)
+      {                         // Effort applied, for model
+         a->mpc.effort +=
+            (u->action == HVAC_HEATING ? 1 : u->action == HVAC_COOLING ? -1 : 0) * mpc_effort (u->fan);
+         a->mpc.efforts++;
+      }
+   } else
+   {
+      a->mpc.valid = 0;
+      controlstop ();
+      // Just based on mode
+      u->action = (!u->power ? HVAC_OFF : u->antifreeze ? HVAC_DEFROSTING : u->mode == FAIKIN_MODE_HEAT ? HVAC_HEATING :        //
+                   u->mode == FAIKIN_MODE_COOL ? HVAC_COOLING : //
+                   u->mode == FAIKIN_MODE_AUTO ? HVAC_IDLE :    //
+                   u->mode == FAIKIN_MODE_DRY ? HVAC_DRYING :   //
+                   u->mode == FAIKIN_MODE_FAN ? HVAC_FAN :      //
+                   HVAC_IDLE);
+   }
+}
@@ -0,0 +1,182 @@
+#ifndef _AUTOMATION_H
+#define _AUTOMATION_H
+
+// Faikout auto control logic
+// This is pure, no I/O, no RTOS, no settings, so it can also be run on a host in a room simulator
+
+#include <stdint.h>
+
+#include "faikin_enums.h"
+
+enum
+{                               // hvac_action
+   HVAC_OFF,
+   HVAC_PREHEATING,
+   HVAC_HEATING,
+   HVAC_COOLING,
+   HVAC_DRYING,
+   HVAC_FAN,
+   HVAC_IDLE,
+   HVAC_DEFROSTING,
+};
+
+typedef struct
+{                               // Settings (temperatures in C, times in seconds)
+   float switchtemp;            // Increase max (heating) or decrease min (cooling)
+   float pushtemp;              // Increase min (heating) or decrease max (cooling)
+   float autoptemp;             // Auto power on/off by temperature deviation by this amount
+   float heatover;              // Offsets applied to target sent to aircon
+   float heatback;
+   float coolover;
+   float coolback;
+   float tmin;                  // Limits of target sent to aircon
+   float tmax;
+   float tcoolmin;
+   float theatmax;
+   float tempstep;              // Steps of target the aircon can do, 0 for any
+   uint32_t tpredicts;          // Temp prediction sample time
+   uint32_t tpredictt;          // Temp prediction total time factor
+   uint32_t tsample;            // Sample period for making adjustments
+   uint32_t tempnoflap;         // Min time between target temp changes
+   uint32_t mpchorizon;         // Model predictive control horizon
+   float mpcstart;              // Model predictive control cost of a compressor start (C^2 minutes)
+   uint16_t auto0;              // HHMM auto off
+   uint16_t auto1;              // HHMM auto on
+   uint8_t autofmax;            // Max fan when starting way off target
+   uint8_t thermref;            // Percentage inlet rather than home temp used by aircon
+   uint8_t autoe:1;             // Enable auto time and power operations
+   uint8_t autop:1;             // Enable auto power on/off
+   uint8_t lockmode:1;          // Do not switch heat/cool
+   uint8_t nofanauto:1;         // Do not change fan
+   uint8_t fan5:1;              // Fan is 5 level (steps of 1, else 2)
+   uint8_t thermostat:1;        // Simple thermostat mode
+   uint8_t temptrack:1;         // Target based on aircon measured temp
+   uint8_t tempadjust:1;        // Adjust target for aircon measured temp
+   uint8_t noled:1;             // No LED control
+   uint8_t autolcontrol:1;      // LED follows HVAC action
+   uint8_t mpc:1;               // Model predictive control
+} automation_config_t;
+
+typedef struct
+{                               // The aircon, as seen by automation, and changed by it
+   float env;                   // External measured temp, NAN if none
+   float home;                  // Aircon measured temps, NAN if not known
+   float inlet;
+   float outside;               // Outside temp, NAN if not known
+   float liquid;                // Indoor coil liquid temp, NAN if not known
+   float mintarget;             // Target range, NAN if none
+   float maxtarget;
+   float temp;                  // Target sent to aircon
+   uint32_t controlvalid;       // uptime to which target range is valid, 0 for none
+   int16_t hhmm;                // Local time HHMM, -1 if not known
+   int16_t comp;                // Compressor frequency, -1 if not known
+   uint8_t mode;                // FAIKIN_MODE_...
+   uint8_t fan;                 // FAIKIN_FAN_...
+   uint8_t power:1;
+   uint8_t heat:1;              // Aircon is heating
+   uint8_t antifreeze:1;
+   uint8_t slave:1;
+   uint8_t led:1;
+   uint8_t control:1;           // We are controlling
+   uint8_t remote:1;            // Remote control via MQTT
+   uint8_t shutdown:1;          // Shutting down, so no control
+   uint8_t action:3;            // HVAC_...
+   uint8_t group:1;             // Group mode applies (see group.h)
+   uint8_t groupheat:1;         // Group mode is heat, so don't swap against it
+   uint8_t hold:1;              // Group says don't start heating/cooling yet
+   uint8_t want:1;              // Set if we want to be heating/cooling (even if held)
+} automation_unit_t;
+
+typedef struct
+{                               // Sample period report
+   float temp;                  // Measured (predicted) temp
+   float min;                   // Adjusted target range
+   float max;
+   uint32_t approaching;        // Counts over last two sample periods
+   uint32_t beyond;
+   uint32_t samples;
+   uint32_t excluded;           // Samples excluded as defrost, over last two sample periods
+   uint32_t defrosts;           // Defrosts seen
+   uint32_t defrostlen;         // Mean defrost duration (s)
+   uint32_t defrostgap;         // Mean interval between defrost starts (s), 0 if not known
+   int8_t setpower;             // Changes made, -1 for none
+   int8_t setfan;
+   char setmode;                // Mode set, 0 for none
+   uint8_t valid:1;             // Report is valid, i.e. end of a sample period
+   uint8_t initial:1;           // Initial samples
+   uint8_t hot:1;
+   uint8_t mpc:1;               // Model predictive control estimates valid
+   uint8_t defrost:1;           // In defrost, or recovering from it
+   float mpctau;                // Room time constant (minutes)
+   float mpcrate;               // Heating/cooling rate at full effort (C/hour)
+   float mpcdrift;              // Drift from other gains (C/hour)
+   float mpcpredict;            // Predicted temp at end of horizon
+   float mpccost;               // Cost of chosen plan
+   uint32_t mpcupdates;         // Model updates
+   uint16_t mpcwait;            // Chosen plan, wait for (minutes)
+   uint16_t mpcrun;             // Chosen plan, then run for (minutes)
+   uint8_t mpcfan;              // Chosen plan, fan
+} automation_report_t;
+
+#define	DEFROST_LIQUID	5       // Heating with compressor running and liquid this much below room is reverse cycle (C)
+#define	DEFROST_RECOVER	300     // Time after defrost still excluded (seconds)
+
+#define	MPC_STEP	60      // Model step (seconds)
+#define	MPC_LEARN	30      // Model updates before it is used
+
+typedef struct
+{                               // Model predictive control, first order room model fitted by recursive least squares
+   // dT = a * (outside - T) + b * effort + c, per MPC_STEP, effort is +/- fan factor when heating/cooling
+   float theta[3];              // a, b, c
+   float P[3][3];               // Covariance
+   float phi[3];                // Regressors for last step
+   float last;                  // Temp at last step
+   float predict;               // Predicted temp at end of horizon for plan
+   float cost;                  // Cost of plan
+   float effort;                // Total effort applied this step
+   uint32_t next;               // uptime for next step
+   uint32_t updates;            // Model updates
+   uint16_t efforts;            // Count of effort
+   uint16_t wait;               // Plan, steps to wait
+   uint16_t run;                // Plan, steps to run (0 if waiting)
+   uint8_t fan;                 // Plan, fan
+   uint8_t valid:1;             // phi/last valid
+} automation_mpc_t;
+
+typedef struct
+{                               // Automation state, zero to start
+   float env_prev;              // Predictive, last period value
+   float env_delta;             // Predictive, diff to last
+   float env_delta_prev;        // Predictive, previous diff
+   float lastset;               // Last target set
+   uint32_t predicted;          // Last uptime predictive period
+   uint32_t sample;             // Last uptime sampled
+   uint32_t countApproaching,
+     countApproachingPrev;      // Count of "approaching temp", and previous sample
+   uint32_t countBeyond,
+     countBeyondPrev;           // Count of "beyond temp", and previous sample
+   uint32_t countTotal,
+     countTotalPrev;            // Count total, and previous sample
+   uint32_t countDefrost,
+     countDefrostPrev;          // Count excluded as defrost, and previous sample
+   uint32_t defrost;            // uptime defrost started, 0 if not in defrost
+   uint32_t defrostwindow;      // uptime to which samples are excluded (defrost and recovery)
+   uint32_t defrostlast;        // uptime last defrost started, 0 if none
+   uint32_t defrosts;           // Defrosts seen
+   uint32_t defrostgaps;        // Intervals seen (between defrosts)
+   uint32_t defrosttime;        // Total defrost time (s)
+   uint32_t defrostgaptime;     // Total interval time (s)
+   uint32_t flap;               // uptime to which target changes held off
+   int16_t lasthhmm;            // Last HHMM for auto on/off
+   uint8_t fansaved;            // Saved fan we override at start
+   uint8_t lastaction:3;        // Last action when target set
+   uint8_t lastheat:1;          // Last heat mode
+   uint8_t hysteresis:1;        // Thermostat hysteresis state
+   automation_mpc_t mpc;        // Model predictive control
+} automation_t;
+
+// Run automation at uptime now (seconds), updating a and u, and filling in r (r->valid if sample period report)
+void automation_run (automation_t * a, const automation_config_t * c, automation_unit_t * u, uint32_t now,
+                     automation_report_t * r);
+
+#endif
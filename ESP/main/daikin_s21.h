@@ -66,6 +66,23 @@ s21_checksum (uint8_t * buf, int len)
    return c;
 }
 
+static inline int
+is_valid_s21_response (const uint8_t * buf, int rxlen, uint8_t cmd, uint8_t cmd2)
+{
+   return rxlen >= S21_MIN_PKT_LEN && buf[S21_STX_OFFSET] == STX && buf[rxlen - 1] == ETX &&
+      buf[S21_CMD0_OFFSET] == cmd && buf[S21_CMD1_OFFSET] == cmd2;
+}
+
+static inline char
+s21_response_letter (char cmd)
+{                               // What is expected as a response
+   if (cmd == 'A')
+      return 'C';
+   if (cmd == 'M' || cmd == 'V')
+      return cmd;
+   return cmd + 1;
+}
+
 // Target temperature is encoded as one character
 static inline float
 s21_decode_target_temp (unsigned char v)
@@ -79,11 +96,12 @@ s21_encode_target_temp (float temp)
    return lroundf ((temp - 18.0) * 2) + AC_MIN_TEMP_VALUE;
 }
 
+// 3 digits, reversed, then a sign if len allows (some replies are only the 3 digits)
 static inline int
-s21_decode_int_sensor (const unsigned char *payload)
+s21_decode_int_sensor (const unsigned char *payload, int len)
 {
    int v = (payload[0] - '0') + (payload[1] - '0') * 10 + (payload[2] - '0') * 100;
-   if (payload[3] == '-')
+   if (len > 3 && payload[3] == '-')
       v = -v;
    return v;
 }
@@ -99,7 +117,7 @@ s21_decode_hex_sensor (const unsigned char *payload)
 static inline float
 s21_decode_float_sensor (const unsigned char *payload)
 {
-   return (float) s21_decode_int_sensor (payload) * 0.1;
+   return (float) s21_decode_int_sensor (payload, S21_PAYLOAD_LEN) * 0.1;
 }
 
 // Convert between Daikin and Faikin fan speed enums
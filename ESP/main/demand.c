@@ -0,0 +1,91 @@
+/* Faikout demand response */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <math.h>
+#include <string.h>
+#include "demand.h"
+
+#define	DEMAND_RELEASE	1       // Demand (%) increase per step when well under cap
+#define	DEMAND_ALPHA	0.1     // Power filter per second
+
+uint8_t
+demand_run (demand_t * d, const demand_config_t * c, const demand_signal_t * s, float power, float env, float min,
+            float max, uint8_t hot, uint32_t now, demand_log_t * log)
+{
+   uint32_t dt = (d->last && now > d->last ? now - d->last : 0);
+   if (dt > 10)
+      dt = 10;                  // Missed, don't over count
+   d->last = now;
+   uint8_t active = (s->until > now && (!isnan (s->cap) || !isnan (s->price)));
+   if (!isnan (power))
+      d->power = (d->power && dt ? d->power + (power - d->power) * DEMAND_ALPHA * dt : power);
+   if (d->power > d->peak)
+      d->peak = d->power;       // Peak in step, as compressor cycles, and it is peaks the cap is for
+   // Comfort, stop shedding if too far out of range
+   uint8_t comfort = (active && d->shed > 0 && !isnan (env) && !isnan (min) && !isnan (max)
+                      && (hot ? env < min - c->comfort : env > max + c->comfort));
+   if (!active)
+   {
+      d->shed = 0;
+      d->step = 0;
+      d->peak = 0;
+   } else if (comfort)
+      d->peak = 0;              // Hold shed level for when back in comfort range
+   else if (d->step <= now)
+   {                            // Control step
+      d->step = now + DEMAND_STEP;
+      float shed = 0;
+      if (!isnan (s->price) && c->pricehigh > c->pricelow)
+         shed = (s->price - c->pricelow) / (c->pricehigh - c->pricelow);
+      if (!isnan (s->cap) && s->cap > 0 && d->peak && c->min < 100)
+      {                         // Scale demand down to cap when over, release slowly when well under, so holds what keeps under cap
+         float demand = 100 - d->shed * (100 - c->min);
+         if (d->peak > s->cap)
+            demand = demand * s->cap / d->peak;
+         else if (d->peak < s->cap * 0.9)
+            demand += DEMAND_RELEASE;
+         d->shed = (100 - demand) / (100 - c->min);
+      } else
+         d->shed = 0;
+      d->peak = 0;
+      if (shed > d->shed)
+         d->shed = shed;
+      if (d->shed < 0)
+         d->shed = 0;
+      if (d->shed > 1)
+         d->shed = 1;
+   }
+   float shed = (comfort ? 0 : d->shed);
+   demand_out_t *o = &d->out;
+   o->active = active;
+   o->comfort = comfort;
+   o->demand = 100 - (int) roundf (shed * (100 - c->min) / 5) * 5;        // Steps of 5%
+   o->econo = (shed >= 0.5);
+   o->offset = shed * c->offset;
+   // Compliance
+   if (active && dt)
+   {
+      d->log.seconds += dt;
+      d->log.shed += shed * dt;
+      if (!isnan (power))
+         d->log.wh += power * dt / 3600;
+      if (!isnan (s->cap))
+      {
+         d->log.capwh += s->cap * dt / 3600;
+         if (d->power > s->cap)
+            d->log.over += dt;
+      }
+      if (comfort)
+         d->log.comfort += dt;
+   }
+   if (!d->logged)
+      d->logged = now;
+   if (d->logged + DEMAND_LOG > now && !(d->log.seconds && !active))
+      return 0;
+   d->logged = now;             // Log period, or signal ended
+   if (!d->log.seconds)
+      return 0;
+   *log = d->log;
+   memset (&d->log, 0, sizeof (d->log));
+   return 1;
+}
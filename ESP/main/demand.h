@@ -0,0 +1,64 @@
+#ifndef _DEMAND_H
+#define _DEMAND_H
+
+// Demand response, follows a power cap or price signal by setting demand, econo and a target offset, within comfort bounds
+// This is pure, no I/O, so it can also be run on a host in a room simulator
+
+#include <stdint.h>
+
+#define	DEMAND_STEP	60      // Control step (s)
+#define	DEMAND_LOG	300     // Compliance log period (s)
+
+typedef struct
+{                               // Signal, from grid flexibility scheme
+   float cap;                   // Power cap (W), NAN for none
+   float price;                 // Price, NAN for none
+   uint32_t until;              // uptime signal valid until, 0 for none
+} demand_signal_t;
+
+typedef struct
+{                               // Settings
+   float pricelow;              // Price at or below which no shedding
+   float pricehigh;             // Price at or above which full shedding
+   float offset;                // Target offset at full shedding (C)
+   float comfort;               // Stop shedding if this far beyond the target range (C)
+   uint8_t min;                 // Demand (%) at full shedding
+} demand_config_t;
+
+typedef struct
+{                               // Output
+   uint8_t demand;              // Demand (%), 100 for normal
+   float offset;                // Target offset (C, positive), lower for heating, raise for cooling
+   uint8_t econo:1;             // Econo mode
+   uint8_t active:1;            // Signal active
+   uint8_t comfort:1;           // Not shedding, to stay in comfort bounds
+} demand_out_t;
+
+typedef struct
+{                               // Compliance, over log period
+   uint32_t seconds;            // Time signal active
+   uint32_t over;               // Time over cap
+   float wh;                    // Energy used (Wh)
+   float capwh;                 // Energy allowed by cap (Wh)
+   uint32_t comfort;            // Time comfort overrode shedding
+   float shed;                  // Sum of shed level per second
+} demand_log_t;
+
+typedef struct
+{                               // State, zero to start
+   float shed;                  // Shed level 0-1
+   float power;                 // Filtered power (W)
+   float peak;                  // Peak filtered power this step (W)
+   uint32_t step;               // uptime of next control step
+   uint32_t last;               // uptime of last run
+   uint32_t logged;             // uptime of last log
+   demand_log_t log;
+   demand_out_t out;
+} demand_t;
+
+// Run each poll, power is estimated use (W), env and min/max are the comfort range (NAN if none), hot if heating
+// Returns 1 if log is due, copied to *log and reset
+uint8_t demand_run (demand_t * d, const demand_config_t * c, const demand_signal_t * s, float power, float env, float min,
+                    float max, uint8_t hot, uint32_t now, demand_log_t * log);
+
+#endif
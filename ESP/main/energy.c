@@ -0,0 +1,270 @@
+/* Faikout energy metering */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include "revk.h"
+#include "nvs.h"
+#include <math.h>
+#include "energy.h"
+
+#define	ENERGY_STEP	100     // Counter resolution (Wh)
+#define	ENERGY_WRAP	(0x10000*ENERGY_STEP)   // Counter is 16 bits of steps
+#define	ENERGY_IDLE	0.25    // Activity weight for standby, compared to compressor Hz
+#define	ENERGY_FANRPM	500     // Fan RPM that weighs the same as 1Hz of compressor
+#define	ENERGY_MAGIC	0xE4E60001
+
+typedef struct
+{                               // Stored in NVS (Wh)
+   uint32_t magic;
+   uint32_t total[ENERGY_USES]; // Lifetime
+   int32_t day;                 // Day number of week[0]
+   uint32_t week[14][ENERGY_USES];      // [0] is today, going back
+   int16_t year;                // Year of month[1]
+   uint32_t month[2][12][ENERGY_USES];  // [0] last year, [1] this year
+} energy_store_t;
+
+static energy_store_t *store = NULL;
+static SemaphoreHandle_t mutex = NULL;
+static int last = -1;           // Last counter
+static float activity[ENERGY_USES];     // Activity since last step
+static float rate = 0;          // Learned Wh per activity
+static uint32_t shown[ENERGY_USES];     // Reported totals, never go down
+static uint32_t hour[ENERGY_USES];      // This hour
+static int64_t lastpoll = 0;
+static int8_t lasthour = -1;
+static uint8_t dirty = 0;
+
+static void
+energy_load (void)
+{
+   nvs_handle_t h;
+   size_t len = sizeof (*store);
+   memset (store, 0, sizeof (*store));
+   if (nvs_open ("energy", NVS_READONLY, &h) == ESP_OK)
+   {
+      if (nvs_get_blob (h, "store", store, &len) != ESP_OK || len != sizeof (*store) || store->magic != ENERGY_MAGIC)
+         memset (store, 0, sizeof (*store));    // New, or changed format
+      nvs_close (h);
+   }
+   store->magic = ENERGY_MAGIC;
+   memcpy (shown, store->total, sizeof (shown));
+}
+
+static void
+energy_save (void)
+{                               // Only called hourly, or on shutdown, to limit flash wear
+   nvs_handle_t h;
+   if (nvs_open ("energy", NVS_READWRITE, &h) != ESP_OK)
+      return;
+   if (nvs_set_blob (h, "store", store, sizeof (*store)) == ESP_OK)
+      nvs_commit (h);
+   nvs_close (h);
+   dirty = 0;
+}
+
+static int32_t
+energy_day (struct tm *tm)
+{                               // Local day number
+   struct tm t = *tm;
+   t.tm_hour = 12;
+   t.tm_min = t.tm_sec = 0;
+   return mktime (&t) / 86400;
+}
+
+static void
+energy_roll (struct tm *tm)
+{                               // Move days and years on
+   int32_t day = energy_day (tm);
+   if (store->day != day)
+   {
+      int shift = day - store->day;
+      if (!store->day || shift < 0 || shift >= 14)
+         memset (store->week, 0, sizeof (store->week));
+      else
+      {
+         memmove (store->week[shift], store->week[0], sizeof (store->week[0]) * (14 - shift));
+         memset (store->week, 0, sizeof (store->week[0]) * shift);
+      }
+      store->day = day;
+      dirty = 1;
+   }
+   int16_t year = tm->tm_year + 1900;
+   if (store->year != year)
+   {
+      if (store->year + 1 == year)
+         memcpy (store->month[0], store->month[1], sizeof (store->month[0]));
+      else
+         memset (store->month[0], 0, sizeof (store->month[0]));
+      memset (store->month[1], 0, sizeof (store->month[1]));
+      store->year = year;
+      dirty = 1;
+   }
+}
+
+static void
+energy_step (uint32_t wh, uint8_t use, struct tm *tm)
+{                               // Counter moved on by wh, attribute by activity since last step
+   float total = 0;
+   for (int u = 0; u < ENERGY_USES; u++)
+      total += activity[u];
+   if (total > 0)
+      rate = (rate ? rate * 0.7 + wh / total * 0.3 : wh / total);
+   uint32_t left = wh;
+   for (int u = 0; u < ENERGY_USES; u++)
+   {
+      uint32_t share = (total <= 0 ? (u == use ? wh : 0) : u == ENERGY_USES - 1 ? left : wh * activity[u] / total);
+      if (share > left)
+         share = left;
+      left -= share;
+      store->total[u] += share;
+      hour[u] += share;
+      if (tm)
+      {
+         store->week[0][u] += share;
+         store->month[1][tm->tm_mon][u] += share;
+      }
+      if (shown[u] < store->total[u])
+         shown[u] = store->total[u];
+      activity[u] = 0;
+   }
+   dirty = 1;
+}
+
+void
+energy_poll (int wh, uint8_t use, int comp, int fanrpm)
+{
+   if (use >= ENERGY_USES)
+      use = ENERGY_FAN;
+   if (!mutex)
+   {
+      mutex = xSemaphoreCreateMutex ();
+      store = mallocspi (sizeof (*store));
+      if (store)
+         energy_load ();
+   }
+   if (!store)
+      return;
+   xSemaphoreTake (mutex, portMAX_DELAY);
+   int64_t now = esp_timer_get_time ();
+   float dt = (lastpoll ? (now - lastpoll) / 1000000.0 : 0);
+   if (dt > 10)
+      dt = 10;                  // Missed polls, don't over count
+   lastpoll = now;
+   time_t clock = time (0);
+   struct tm tm,
+    *tmp = NULL;
+   if (clock > 1000000000)
+   {                            // Clock is set
+      localtime_r (&clock, &tm);
+      tmp = &tm;
+      energy_roll (tmp);
+   }
+   if (wh < 0)
+      last = -1;
+   else
+   {
+      activity[use] += dt * ((comp > 0 ? comp : 0) + (fanrpm > 0 ? (float) fanrpm / ENERGY_FANRPM : 0) + ENERGY_IDLE);
+      if (last >= 0 && wh != last)
+      {
+         int delta = wh - last;
+         if (delta < 0 && last - wh > ENERGY_WRAP / 2)
+            delta += ENERGY_WRAP;       // Wrapped
+         if (delta > 0)
+            energy_step (delta, use, tmp);
+         else
+            memset (activity, 0, sizeof (activity));    // Counter reset, start again
+      } else if (last < 0)
+         memset (activity, 0, sizeof (activity));       // First reading, start from here
+      last = wh;
+      if (rate)
+      {                         // Interpolate between steps, but never beyond the next step
+         float total = 0;
+         for (int u = 0; u < ENERGY_USES; u++)
+            total += activity[u];
+         float scale = (total * rate > ENERGY_STEP - 1 ? (ENERGY_STEP - 1) / total : rate);
+         for (int u = 0; u < ENERGY_USES; u++)
+         {
+            uint32_t v = store->total[u] + activity[u] * scale;
+            if (shown[u] < v)
+               shown[u] = v;
+         }
+      }
+   }
+   if (tmp && lasthour != tm.tm_hour)
+   {                            // Hourly report and save
+      if (lasthour >= 0)
+      {
+         jo_t j = jo_object_alloc ();
+         jo_int (j, "heat", hour[ENERGY_HEAT]);
+         jo_int (j, "cool", hour[ENERGY_COOL]);
+         jo_int (j, "fan", hour[ENERGY_FAN]);
+         revk_info ("energy", &j);
+      }
+      memset (hour, 0, sizeof (hour));
+      lasthour = tm.tm_hour;
+      if (dirty)
+         energy_save ();
+   } else if (dirty && revk_shutting_down (NULL))
+      energy_save ();
+   xSemaphoreGive (mutex);
+}
+
+float
+energy_power (int comp, int fanrpm)
+{
+   if (!rate)
+      return NAN;
+   return rate * 3600 * ((comp > 0 ? comp : 0) + (fanrpm > 0 ? (float) fanrpm / ENERGY_FANRPM : 0) + ENERGY_IDLE);
+}
+
+void
+energy_json (jo_t j)
+{
+   // Always, zeros until counted, as HA sensors are announced once metering is known
+   if (mutex)
+      xSemaphoreTake (mutex, portMAX_DELAY);
+   jo_object (j, "energy");
+   jo_int (j, "heat", shown[ENERGY_HEAT]);
+   jo_int (j, "cool", shown[ENERGY_COOL]);
+   jo_int (j, "fan", shown[ENERGY_FAN]);
+   jo_close (j);
+   if (mutex)
+      xSemaphoreGive (mutex);
+}
+
+static void
+energy_list (jo_t j, const char *tag, int n, uint32_t (*v)[ENERGY_USES], uint8_t use)
+{                               // Legacy list, in 0.1kWh
+   char buf[14 * 11 + 1],
+    *p = buf;
+   for (int i = 0; i < n; i++)
+      p += sprintf (p, "%s%lu", i ? "/" : "", (unsigned long) (v ? (v[i][use] + 50) / 100 : 0));
+   jo_string (j, tag, buf);
+}
+
+void
+energy_legacy_week (jo_t j)
+{                               // ret=OK,s_dayw=2,week_heat=0/0/0/0/0/0/0/0/0/0/0/0/0/0,week_cool=...
+   if (mutex && store)
+      xSemaphoreTake (mutex, portMAX_DELAY);
+   time_t clock = time (0);
+   struct tm tm;
+   localtime_r (&clock, &tm);
+   jo_int (j, "s_dayw", tm.tm_wday);
+   energy_list (j, "week_heat", 14, store ? store->week : NULL, ENERGY_HEAT);
+   energy_list (j, "week_cool", 14, store ? store->week : NULL, ENERGY_COOL);
+   if (mutex && store)
+      xSemaphoreGive (mutex);
+}
+
+void
+energy_legacy_year (jo_t j)
+{
+   if (mutex && store)
+      xSemaphoreTake (mutex, portMAX_DELAY);
+   energy_list (j, "curr_year_heat", 12, store ? store->month[1] : NULL, ENERGY_HEAT);
+   energy_list (j, "prev_year_heat", 12, store ? store->month[0] : NULL, ENERGY_HEAT);
+   energy_list (j, "curr_year_cool", 12, store ? store->month[1] : NULL, ENERGY_COOL);
+   energy_list (j, "prev_year_cool", 12, store ? store->month[0] : NULL, ENERGY_COOL);
+   if (mutex && store)
+      xSemaphoreGive (mutex);
+}
@@ -0,0 +1,24 @@
+#ifndef _ENERGY_H
+#define _ENERGY_H
+
+// Energy metering, from the aircon's 100Wh counter, attributed to heat/cool/fan and stored by day and month in NVS
+
+enum
+{                               // What energy is used for
+   ENERGY_HEAT,
+   ENERGY_COOL,
+   ENERGY_FAN,                  // Fan, and standby
+   ENERGY_USES
+};
+
+// Call each poll, wh is counter (Wh) or -1 if not known, use is ENERGY_..., comp and fanrpm for interpolation
+void energy_poll (int wh, uint8_t use, int comp, int fanrpm);
+// Estimated power now (W), from learned Wh per activity, NAN if not learned yet
+float energy_power (int comp, int fanrpm);
+// Lifetime Wh per use, interpolated between counter steps, as "energy" object, zeros if nothing counted yet
+void energy_json (jo_t j);
+// Legacy BRP fields
+void energy_legacy_week (jo_t j);
+void energy_legacy_year (jo_t j);
+
+#endif
@@ -0,0 +1,89 @@
+/* Faikout auto sensor fusion */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <math.h>
+#include <string.h>
+#include "fusion.h"
+
+void
+fusion_set (fusion_t * f, uint8_t source, float value, uint32_t now)
+{
+   if (source >= FUSION_MAX || isnan (value))
+      return;
+   f->value[source] = value;
+   f->when[source] = (now ? : 1);
+}
+
+void
+fusion_clear (fusion_t * f, uint8_t source)
+{
+   if (source < FUSION_MAX)
+      f->when[source] = 0;
+}
+
+float
+fusion_run (fusion_t * f, const fusion_config_t * c, uint32_t now, float *confidence)
+{
+   float w[FUSION_MAX] = { 0 };
+   float expect = 0;
+   int n = 0;
+   f->used = f->rejected = 0;
+   for (int s = 0; s < FUSION_MAX; s++)
+      if (f->when[s] && c->weight[s] > 0)
+      {
+         expect += c->weight[s];        // Has reported, so expected
+         uint32_t age = (now > f->when[s] ? now - f->when[s] : 0);
+         if (age > c->maxage)
+            continue;           // Stale
+         w[s] = c->weight[s];
+         if (c->halflife)
+            w[s] *= exp2f (-(float) age / c->halflife);
+         n++;
+      }
+   if (n >= 3 && c->outlier > 0)
+   {                            // Weighted median, then reject those too far from it
+      float total = 0,
+         median = NAN;
+      for (int s = 0; s < FUSION_MAX; s++)
+         total += w[s];
+      uint16_t done = 0;
+      float sum = 0;
+      while (sum < total / 2)
+      {                         // Lowest not yet counted, a simple select as so few
+         int low = -1;
+         for (int s = 0; s < FUSION_MAX; s++)
+            if (w[s] > 0 && !(done & (1 << s)) && (low < 0 || f->value[s] < f->value[low]))
+               low = s;
+         if (low < 0)
+            break;
+         done |= (1 << low);
+         sum += w[low];
+         median = f->value[low];
+      }
+      for (int s = 0; s < FUSION_MAX; s++)
+         if (w[s] > 0 && fabsf (f->value[s] - median) > c->outlier)
+         {
+            w[s] = 0;
+            f->rejected |= (1 << s);
+         }
+   }
+   float total = 0,
+      value = 0;
+   for (int s = 0; s < FUSION_MAX; s++)
+      if (w[s] > 0)
+      {
+         total += w[s];
+         value += w[s] * f->value[s];
+         f->used |= (1 << s);
+      }
+   if (confidence)
+      *confidence = (expect > 0 ? total / expect : 0);
+   return total > 0 ? value / total : NAN;
+}
+
+const char *
+fusion_name (uint8_t source)
+{
+   static const char *const names[FUSION_MAX] = { "ble", "control", "home", "inlet", "topic1", "topic2", "topic3", "topic4" };
+   return source < FUSION_MAX ? names[source] : "";
+}
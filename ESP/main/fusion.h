@@ -0,0 +1,47 @@
+#ifndef _FUSION_H
+#define _FUSION_H
+
+// Sensor fusion, for Faikout auto reference temperature (env) from several sources
+// Each source has a weight, which halves with age, readings too old are dropped, and outliers from the weighted median rejected
+// This is pure, no I/O, so it can also be run on a host in a room simulator
+
+#include <stdint.h>
+
+#define	FUSION_TOPICS	4       // MQTT topics (auto.topic and fusion.topic)
+
+enum
+{                               // Sources
+   FUSION_BLE,                  // BLE sensor
+   FUSION_CONTROL,              // env in control message
+   FUSION_HOME,                 // Aircon home temp
+   FUSION_INLET,                // Aircon inlet temp
+   FUSION_TOPIC,                // MQTT topics, FUSION_TOPICS of them
+   FUSION_MAX = FUSION_TOPIC + FUSION_TOPICS
+};
+
+typedef struct
+{                               // Fusion settings
+   float weight[FUSION_MAX];    // Weight per source, 0 to not use
+   uint32_t halflife;           // Age at which weight is halved (s), 0 for no decay
+   uint32_t maxage;             // Readings older than this are dropped (s)
+   float outlier;               // Reject readings more than this from weighted median (C), 0 for none, needs 3 or more readings
+} fusion_config_t;
+
+typedef struct
+{                               // Fusion state, zero to start
+   float value[FUSION_MAX];     // Last reading
+   uint32_t when[FUSION_MAX];   // uptime of last reading, 0 for none
+   uint16_t used;               // Bit map of sources used in last result
+   uint16_t rejected;           // Bit map of sources rejected as outliers in last result
+} fusion_t;
+
+// New reading from a source, at uptime now
+void fusion_set (fusion_t * f, uint8_t source, float value, uint32_t now);
+// Forget a source
+void fusion_clear (fusion_t * f, uint8_t source);
+// Fused value, NAN if none, and confidence 0-1 (fresh weight used, over weight of all sources that have reported)
+float fusion_run (fusion_t * f, const fusion_config_t * c, uint32_t now, float *confidence);
+// Source name, for reporting
+const char *fusion_name (uint8_t source);
+
+#endif
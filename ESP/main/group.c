@@ -0,0 +1,148 @@
+/* Faikout auto group coordination */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <string.h>
+#include "group.h"
+
+static uint8_t
+alive (const group_t * g, int i, uint32_t now)
+{
+   return *g->unit[i].m.id && g->unit[i].seen + GROUP_TIMEOUT > now;
+}
+
+void
+group_heard (group_t * g, const group_member_t * m, uint32_t now)
+{
+   int i,
+     free = -1;
+   for (i = 0; i < GROUP_MAX; i++)
+   {
+      if (!strcmp (g->unit[i].m.id, m->id))
+         break;
+      if (free < 0 && !alive (g, i, now))
+         free = i;
+   }
+   if (i == GROUP_MAX)
+   {                            // New unit
+      if (free < 0)
+         return;                // Too many
+      i = free;
+      memset (&g->unit[i], 0, sizeof (g->unit[i]));
+   }
+   if (m->want && (!g->unit[i].m.want || !g->unit[i].since))
+      g->unit[i].since = now;   // Queue order
+   if (m->running && !g->unit[i].m.running)
+      g->unit[i].started = now;
+   g->unit[i].m = *m;
+   g->unit[i].seen = now;
+}
+
+void
+group_plan_heard (group_t * g, const group_plan_t * p, uint32_t now)
+{
+   g->plan = *p;
+   g->planned = now;
+}
+
+uint8_t
+group_leader (const group_t * g, const char *self, uint32_t now)
+{                               // Lowest ID, so all agree without an election
+   for (int i = 0; i < GROUP_MAX; i++)
+      if (alive (g, i, now) && strcmp (g->unit[i].m.id, self) < 0)
+         return 0;
+   return 1;
+}
+
+void
+group_lead (group_t * g, uint32_t now, uint32_t stagger)
+{
+   group_plan_t *p = &g->plan;
+   int heat = 0,
+      cool = 0,
+      slave = -1,
+      defrost = 0,
+      grant = -1;
+   uint32_t started = 0;
+   for (int i = 0; i < GROUP_MAX; i++)
+      if (alive (g, i, now))
+      {
+         group_member_t *m = &g->unit[i].m;
+         if (m->slave && slave < 0)
+            slave = i;
+         if (m->antifreeze)
+            defrost = 1;
+         if (m->running)
+         {                      // Running counts most
+            if (m->heat)
+               heat += 100;
+            else
+               cool += 100;
+         } else if (m->want)
+         {
+            if (m->heat)
+               heat++;
+            else
+               cool++;
+         }
+         if (*p->grant && !strcmp (p->grant, m->id))
+            grant = i;
+         if (g->unit[i].started > started)
+            started = g->unit[i].started;
+      }
+   // Mode, a slave unit means the outdoor unit is committed to the other mode
+   if (slave >= 0)
+   {
+      p->mode = 1;
+      p->heat = !g->unit[slave].m.heat;
+   } else if (heat != cool)
+   {
+      p->mode = 1;
+      p->heat = (heat > cool);
+   } else if (!heat)
+      p->mode = 0;              // No one cares, else tie, so leave as was
+   // Grant, one start at a time, and stagger
+   if (grant >= 0 && (g->unit[grant].m.running || !g->unit[grant].m.want || g->granted + GROUP_GRANT < now))
+      grant = -1;               // Started, or gave up
+   if (grant < 0)
+      *p->grant = 0;
+   if (grant < 0 && !defrost && started + stagger <= now)
+   {                            // Next in queue, that is in group mode
+      for (int i = 0; i < GROUP_MAX; i++)
+         if (alive (g, i, now))
+         {
+            group_member_t *m = &g->unit[i].m;
+            if (m->want && !m->running && (!p->mode || m->heat == p->heat)
+                && (grant < 0 || g->unit[i].since < g->unit[grant].since))
+               grant = i;
+         }
+      if (grant >= 0)
+      {
+         strcpy (p->grant, g->unit[grant].m.id);
+         g->granted = now;
+      }
+   }
+   g->planned = now;
+}
+
+void
+group_apply (const group_t * g, const char *self, uint32_t now, automation_unit_t * u)
+{
+   u->group = u->groupheat = u->hold = 0;
+   if (!g->planned || g->planned + GROUP_TIMEOUT < now)
+      return;                   // No leader, so work alone
+   u->group = g->plan.mode;
+   u->groupheat = g->plan.heat;
+   u->hold = strcmp (g->plan.grant, self) ? 1 : 0;
+}
+
+void
+group_announce (const automation_unit_t * u, const char *self, int8_t comp, group_member_t * m)
+{
+   memset (m, 0, sizeof (*m));
+   strncpy (m->id, self, sizeof (m->id) - 1);
+   m->heat = (u->mode == FAIKIN_MODE_HEAT || (u->mode != FAIKIN_MODE_COOL && u->mode != FAIKIN_MODE_DRY && u->heat));
+   m->running = (u->power && (u->action == HVAC_HEATING || u->action == HVAC_COOLING) && comp);
+   m->want = (u->want || m->running);
+   m->slave = u->slave;
+   m->antifreeze = u->antifreeze;
+}
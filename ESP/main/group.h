@@ -0,0 +1,61 @@
+#ifndef _GROUP_H
+#define _GROUP_H
+
+// Faikout auto group, for indoor units sharing an outdoor unit
+// Each unit announces what it is doing, the leader (lowest ID heard) plans a group mode and staggers compressor starts
+// This is pure, no I/O, so it can also be run on a host in a room simulator
+
+#include <stdint.h>
+
+#include "automation.h"
+
+#define	GROUP_MAX	8       // Units in a group
+#define	GROUP_PERIOD	10      // Announce at least this often (s)
+#define	GROUP_TIMEOUT	(3*GROUP_PERIOD)        // Forget units, and plans, not heard for this long (s)
+#define	GROUP_GRANT	300     // Max time for a granted unit to actually start, allowing for compressor restart guard (s)
+
+typedef struct
+{                               // Announcement from a unit
+   char id[13];                 // Unit ID
+   uint8_t heat:1;              // In heat mode (else cool)
+   uint8_t want:1;              // Wants to heat/cool
+   uint8_t running:1;           // Heating/cooling (compressor running, if known)
+   uint8_t slave:1;             // Aircon reports another unit has the mode
+   uint8_t antifreeze:1;        // Defrosting
+} group_member_t;
+
+typedef struct
+{                               // Plan from leader
+   char grant[13];              // Unit that may start heating/cooling, "" for none
+   uint8_t mode:1;              // Group mode set
+   uint8_t heat:1;              // Group mode is heat (else cool)
+} group_plan_t;
+
+typedef struct
+{                               // Group state, zero to start
+   struct
+   {
+      group_member_t m;
+      uint32_t seen;            // uptime last heard
+      uint32_t since;           // uptime started wanting
+      uint32_t started;         // uptime started running
+   } unit[GROUP_MAX];
+   group_plan_t plan;           // Current plan
+   uint32_t planned;            // uptime plan made or heard
+   uint32_t granted;            // Leader, uptime of grant
+} group_t;
+
+// Announcement heard (including our own) at uptime now
+void group_heard (group_t * g, const group_member_t * m, uint32_t now);
+// Plan heard from leader
+void group_plan_heard (group_t * g, const group_plan_t * p, uint32_t now);
+// Return 1 if self is leader
+uint8_t group_leader (const group_t * g, const char *self, uint32_t now);
+// Leader makes a new plan, with stagger seconds between compressor starts
+void group_lead (group_t * g, uint32_t now, uint32_t stagger);
+// Set group, groupheat and hold for automation (not applied if no recent plan)
+void group_apply (const group_t * g, const char *self, uint32_t now, automation_unit_t * u);
+// Announcement for this unit after automation, comp is 1 if compressor running, 0 if not, -1 if not known
+void group_announce (const automation_unit_t * u, const char *self, int8_t comp, group_member_t * m);
+
+#endif
@@ -0,0 +1,147 @@
+/* Faikout bus metrics */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include "revk.h"
+#include "metrics.h"
+
+#define	METRICS_MAX	48      // Command codes tracked
+#define	METRICS_SUB	4       // Histogram buckets per power of 2
+#define	METRICS_BUCKETS	(24*METRICS_SUB)        // 1uS to 16s
+
+typedef struct
+{
+   const char *proto;           // Protocol name (static)
+   uint8_t cmd;
+   uint8_t cmd2;
+   uint32_t count[METRIC_OUTCOMES];     // Outcomes
+   uint32_t requests;           // Total requests
+   uint32_t min;                // Latency (uS)
+   uint32_t max;
+   uint64_t total;
+   uint16_t hist[METRICS_BUCKETS];      // Log bucketed latency, for percentiles
+} metric_t;
+
+static metric_t *table = NULL;
+static uint8_t entries = 0;
+static SemaphoreHandle_t mutex = NULL;
+
+static int
+metrics_bucket (uint32_t us)
+{                               // Log scale bucket, METRICS_SUB per power of 2
+   if (us < METRICS_SUB)
+      return us;
+   int b = 31 - __builtin_clz (us);     // Power of 2
+   int s = (us >> (b - 2)) & (METRICS_SUB - 1); // Next 2 bits
+   b = b * METRICS_SUB + s - (METRICS_SUB * 2 - METRICS_SUB);
+   if (b >= METRICS_BUCKETS)
+      b = METRICS_BUCKETS - 1;
+   return b;
+}
+
+static uint32_t
+metrics_bucket_top (int b)
+{                               // Upper bound of bucket (uS)
+   if (b < METRICS_SUB)
+      return b;
+   b += METRICS_SUB;
+   int p = b / METRICS_SUB;
+   int s = b % METRICS_SUB;
+   return ((uint32_t) (METRICS_SUB + s + 1) << (p - 2)) - 1;
+}
+
+void
+metrics_record (const char *proto, uint8_t cmd, uint8_t cmd2, int64_t start, uint8_t outcome)
+{
+   uint32_t us = esp_timer_get_time () - start;
+   if (outcome >= METRIC_OUTCOMES)
+      outcome = METRIC_BAD;
+   if (!mutex)
+   {
+      mutex = xSemaphoreCreateMutex ();
+      table = mallocspi (METRICS_MAX * sizeof (*table));
+   }
+   if (!table)
+      return;                   // No memory
+   xSemaphoreTake (mutex, portMAX_DELAY);
+   metric_t *m = NULL;
+   for (int i = 0; i < entries && !m; i++)
+      if (table[i].cmd == cmd && table[i].cmd2 == cmd2 && !strcmp (table[i].proto, proto))
+         m = &table[i];
+   if (!m && entries < METRICS_MAX)
+   {
+      m = &table[entries++];
+      memset (m, 0, sizeof (*m));
+      m->proto = proto;
+      m->cmd = cmd;
+      m->cmd2 = cmd2;
+   }
+   if (m)
+   {
+      m->count[outcome]++;
+      if (!m->requests++ || us < m->min)
+         m->min = us;
+      if (us > m->max)
+         m->max = us;
+      m->total += us;
+      int b = metrics_bucket (us);
+      if (m->hist[b] < 0xFFFF)
+         m->hist[b]++;
+   }
+   xSemaphoreGive (mutex);
+}
+
+void
+metrics_json (jo_t j, uint8_t reset)
+{
+   if (!mutex || !table)
+      return;
+   xSemaphoreTake (mutex, portMAX_DELAY);
+   jo_array (j, "metrics");
+   for (int i = 0; i < entries; i++)
+   {
+      metric_t *m = &table[i];
+      if (!m->requests)
+         continue;
+      jo_object (j, NULL);
+      jo_string (j, "proto", m->proto);
+      if (isprint (m->cmd) && (!m->cmd2 || isprint (m->cmd2)))
+         jo_stringf (j, "cmd", m->cmd2 ? "%c%c" : "%c", m->cmd, m->cmd2);
+      else if (m->cmd2)
+         jo_stringf (j, "cmd", "%02X%02X", m->cmd, m->cmd2);
+      else
+         jo_stringf (j, "cmd", "%02X", m->cmd);
+      jo_int (j, "req", m->requests);
+      static const char *const outcomes[] = { "ack", "nak", "timeout", "badsum", "bad" };
+      for (int o = 0; o < METRIC_OUTCOMES; o++)
+         if (m->count[o] || o == METRIC_ACK)
+            jo_int (j, outcomes[o], m->count[o]);
+      jo_int (j, "min", m->min);
+      jo_int (j, "avg", m->total / m->requests);
+      {                         // p99 from histogram
+         uint32_t total = 0,
+            want = 0;
+         for (int b = 0; b < METRICS_BUCKETS; b++)
+            total += m->hist[b];
+         want = total - total / 100;
+         total = 0;
+         int b;
+         for (b = 0; b < METRICS_BUCKETS - 1; b++)
+            if ((total += m->hist[b]) >= want)
+               break;
+         uint32_t p99 = metrics_bucket_top (b);
+         if (p99 > m->max)
+            p99 = m->max;
+         jo_int (j, "p99", p99);
+      }
+      jo_int (j, "max", m->max);
+      jo_close (j);
+      if (reset)
+      {
+         memset (m->count, 0, sizeof (m->count));
+         memset (m->hist, 0, sizeof (m->hist));
+         m->requests = m->min = m->max = m->total = 0;
+      }
+   }
+   jo_close (j);
+   xSemaphoreGive (mutex);
+}
@@ -0,0 +1,21 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+// Bus transaction metrics, per protocol and command code
+
+enum
+{                               // Outcome of a transaction
+   METRIC_ACK,                  // Good response
+   METRIC_NAK,                  // Explicit NAK
+   METRIC_TIMEOUT,              // No (or incomplete) response
+   METRIC_BADSUM,               // Bad checksum
+   METRIC_BAD,                  // Other protocol error
+   METRIC_OUTCOMES
+};
+
+// Record a transaction started at start (esp_timer_get_time), cmd2 is 0 if not used
+void metrics_record (const char *proto, uint8_t cmd, uint8_t cmd2, int64_t start, uint8_t outcome);
+// Add metrics for all commands to j as an array, and reset if requested
+void metrics_json (jo_t j, uint8_t reset);
+
+#endif
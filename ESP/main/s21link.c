@@ -0,0 +1,70 @@
+/* Faikout S21 link layer */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <string.h>
+#include "daikin_s21.h"
+#include "s21link.h"
+
+int
+s21link_frame (uint8_t * buf, uint8_t cmd, uint8_t cmd2, const char *payload, int payload_len)
+{
+   int txlen = S21_MIN_PKT_LEN + payload_len;
+   buf[S21_STX_OFFSET] = STX;
+   buf[S21_CMD0_OFFSET] = cmd;
+   if (payload_len >= 0)
+      buf[S21_CMD1_OFFSET] = cmd2;
+   if (payload_len > 0)
+      memcpy (buf + S21_PAYLOAD_OFFSET, payload, payload_len);
+   buf[S21_PAYLOAD_OFFSET + payload_len] = s21_checksum (buf, txlen);
+   buf[S21_PAYLOAD_OFFSET + payload_len + 1] = ETX;
+   return txlen;
+}
+
+int
+s21link_receive (s21link_t * l, uint8_t cmd, uint8_t * buf, int size, int *rxlen, uint8_t * other)
+{
+   uint8_t temp = 0;
+   int len = l->read (l->ctx, &temp, 1);
+   *rxlen = 0;
+   // Wait ACK. Apparently some models omit it so we allow for a message anyway
+   if (len == 0)
+      return S21LINK_TIMEOUT;
+   if (len != 1 || (temp != ACK && temp != STX))
+   {
+      if (len == 1 && temp == NAK)
+         return S21LINK_NAK;
+      *other = temp;
+      return S21LINK_NOACK;
+   }
+   if (temp == STX)
+      *buf = temp;              // No ACK, response started instead.
+   else
+   {
+      if (cmd == 'D')
+         return S21LINK_ACK;    // No response expected
+      do
+         if (l->read (l->ctx, buf, 1) != 1)
+            return S21LINK_NOREPLY;
+      while (*buf != STX);
+   }
+   // Receive the rest of response till ETX
+   len = 1;
+   while (len < size)
+   {
+      if (l->read (l->ctx, buf + len, 1) != 1)
+      {
+         *rxlen = len;
+         return S21LINK_NOREPLY;
+      }
+      len++;
+      if (buf[len - 1] == ETX)
+         break;
+   }
+   *rxlen = len;
+   // Send ACK regardless of packet quality. If we don't ack due to checksum error,
+   // for example, the response will be sent again.
+   // Note not all ACs do that. My FTXF20D doesn't - Sonic-Amiga
+   temp = ACK;
+   l->write (l->ctx, &temp, 1);
+   return S21LINK_REPLY;
+}
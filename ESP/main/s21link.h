@@ -0,0 +1,31 @@
+#ifndef _S21LINK_H
+#define _S21LINK_H
+
+// S21 link layer, framing, ACK/NAK, and reading a reply, over a UART given as callbacks
+// This has no ESP-IDF calls, so the firmware's own exchange can also be run on a host against the simulator
+
+#include <stdint.h>
+
+enum
+{                               // Outcome of s21link_receive
+   S21LINK_REPLY,               // Reply frame (not yet checked), ACK sent
+   S21LINK_ACK,                 // ACK and no reply, as for D commands
+   S21LINK_NAK,                 // Explicit NAK
+   S21LINK_NOACK,               // Something other than ACK, NAK or STX
+   S21LINK_TIMEOUT,             // Nothing
+   S21LINK_NOREPLY,             // ACK then no reply, or reply incomplete
+};
+
+typedef struct
+{                               // Platform UART
+   int (*read) (void *ctx, uint8_t * buf, int len);     // Read with timeout, returns bytes read, 0 if timed out
+   void (*write) (void *ctx, const uint8_t * buf, int len);
+   void *ctx;
+} s21link_t;
+
+// Build a frame in buf for cmd, cmd2 and payload, payload_len -1 for single character commands, returns length
+int s21link_frame (uint8_t * buf, uint8_t cmd, uint8_t cmd2, const char *payload, int payload_len);
+// Wait for ACK and a reply to cmd, into buf (size bytes), sets rxlen to what was received, and other for S21LINK_NOACK
+int s21link_receive (s21link_t * l, uint8_t cmd, uint8_t * buf, int size, int *rxlen, uint8_t * other);
+
+#endif
@@ -0,0 +1,257 @@
+/* Faikout weekly schedule */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include "schedule.h"
+
+static const char days[] = "sunmontuewedthufrisat";
+static const char *const dayname[] = { "sunday", "monday", "tuesday", "wednesday", "thursday", "friday", "saturday" };
+
+static int
+schedule_day (const char *p, int len)
+{                               // Day number from name, 3 letters or in full, -1 if not valid
+   for (int d = 0; d < 7; d++)
+      if ((len == 3 && !strncasecmp (p, days + d * 3, 3)) || (len == strlen (dayname[d]) && !strncasecmp (p, dayname[d], len)))
+         return d;
+   return -1;
+}
+
+static const char *
+schedule_days (const char *p, int len, uint8_t * map)
+{                               // Days, e.g. mon-fri,sun or daily
+   *map = 0;
+   if ((len == 1 && *p == '*') || (len == 5 && !strncasecmp (p, "daily", len)))
+   {
+      *map = 0x7F;
+      return NULL;
+   }
+   if (len == 8 && !strncasecmp (p, "weekdays", len))
+   {
+      *map = 0x3E;
+      return NULL;
+   }
+   if (len == 8 && !strncasecmp (p, "weekends", len))
+   {
+      *map = 0x41;
+      return NULL;
+   }
+   const char *e = p + len;
+   while (p < e)
+   {
+      const char *c = p;
+      while (c < e && *c != ',')
+         c++;
+      const char *r = p;
+      while (r < c && *r != '-')
+         r++;
+      int from = schedule_day (p, r - p),
+         to = from;
+      if (r < c)
+         to = schedule_day (r + 1, c - r - 1);
+      if (from < 0 || to < 0)
+         return "Bad day, expecting e.g. mon-fri,sun or daily";
+      for (int d = from;; d = (d + 1) % 7)
+      {                         // Can wrap, e.g. fri-mon
+         *map |= (1 << d);
+         if (d == to)
+            break;
+      }
+      p = c + (c < e);
+   }
+   return NULL;
+}
+
+const char *
+schedule_parse (const char *text, schedule_event_t * e)
+{
+   memset (e, 0, sizeof (*e));
+   e->power = -1;
+   if (!text)
+      return "No event";
+   int n = 0;
+   while (*text)
+   {
+      while (isspace ((int) *text))
+         text++;
+      if (!*text)
+         break;
+      const char *p = text;
+      while (*text && !isspace ((int) *text))
+         text++;
+      int len = text - p;
+      if (!n)
+      {                         // Days
+         const char *err = schedule_days (p, len, &e->days);
+         if (err)
+            return err;
+      } else if (n == 1)
+      {                         // Time
+         int h = 0,
+            m = 0;
+         if (len == 5 && isdigit ((int) p[0]) && isdigit ((int) p[1]) && p[2] == ':' && isdigit ((int) p[3])
+             && isdigit ((int) p[4]))
+         {
+            h = atoi (p);
+            m = atoi (p + 3);
+         } else if (len == 4 && isdigit ((int) p[0]) && isdigit ((int) p[1]) && isdigit ((int) p[2]) && isdigit ((int) p[3]))
+         {
+            h = atoi (p) / 100;
+            m = atoi (p) % 100;
+         } else
+            return "Bad time, expecting HH:MM";
+         if (h > 23 || m > 59)
+            return "Bad time, expecting HH:MM";
+         e->minute = h * 60 + m;
+      } else if (len == 2 && !strncasecmp (p, "on", len))
+         e->power = 1;
+      else if (len == 3 && !strncasecmp (p, "off", len))
+         e->power = 0;
+      else if (len == 4 && !strncasecmp (p, "heat", len))
+         e->mode = 'H';
+      else if (len == 4 && !strncasecmp (p, "cool", len))
+         e->mode = 'C';
+      else if (len == 4 && !strncasecmp (p, "auto", len))
+         e->mode = 'A';
+      else if (len == 3 && !strncasecmp (p, "dry", len))
+         e->mode = 'D';
+      else if (len == 3 && !strncasecmp (p, "fan", len))
+         e->mode = 'F';
+      else if (len == 4 && !strncasecmp (p, "fan", 3) && strchr ("A12345Q", toupper ((int) p[3])))
+         e->fan = toupper ((int) p[3]);
+      else if (isdigit ((int) *p))
+      {                         // Target
+         char *end;
+         float t = strtof (p, &end);
+         if (end != text || t < 5 || t > 40)
+            return "Bad target, expecting C, e.g. 21.5";
+         e->target = lroundf (t * 10);
+      } else
+         return "Unknown action, expecting on, off, heat, cool, auto, dry, fan, fanA, fan1-fan5, fanQ, or target";
+      n++;
+   }
+   if (n < 2)
+      return "Expecting days and time, e.g. mon-fri 06:30 on heat 21";
+   if (n == 2)
+      return "No action";
+   return NULL;
+}
+
+const char *
+schedule_load (schedule_t * s, const char *const *text, int n)
+{
+   const char *err = NULL;
+   s->count = 0;
+   for (int i = 0; i < n && s->count < SCHEDULE_MAX; i++)
+   {
+      if (!text[i] || !*text[i])
+         continue;
+      schedule_event_t e;
+      const char *er = schedule_parse (text[i], &e);
+      if (er)
+      {
+         if (!err)
+            err = er;
+         continue;
+      }
+      int p = s->count++;
+      while (p && s->event[p - 1].minute > e.minute)
+      {                         // Insert sorted, stable, so same time applied in order given
+         s->event[p] = s->event[p - 1];
+         p--;
+      }
+      s->event[p] = e;
+   }
+   s->nextin = -1;
+   return err;
+}
+
+void
+schedule_next (schedule_t * s, int week)
+{
+   s->nextin = -1;
+   int day = week / 1440,
+      minute = week % 1440;
+   for (int d = 0; d <= 7; d++)
+   {                            // Today (later), each day on, and today again (earlier) next week
+      int wday = (day + d) % 7;
+      for (int i = 0; i < s->count; i++)
+      {
+         const schedule_event_t *e = &s->event[i];
+         if (!(e->days & (1 << wday)))
+            continue;
+         int in = d * 1440 + e->minute - minute;
+         if (in <= 0)
+            continue;
+         s->next = i;
+         s->nextin = in;
+         return;
+      }
+   }
+}
+
+uint32_t
+schedule_lead (const schedule_t * s, const schedule_event_t * e, uint8_t hot, float env, uint32_t maxlead)
+{
+   if (!e->target || !e->power || isnan (env))
+      return 0;
+   if (e->mode == 'H')
+      hot = 1;
+   else if (e->mode == 'C')
+      hot = 0;
+   else if (e->mode)
+      return 0;                 // Not heating or cooling
+   float rate = (hot ? s->heatrate : s->coolrate),
+      rise = (hot ? 1 : -1) * (e->target / 10.0 - env);
+   if (rate <= 0 || rise <= 0)
+      return 0;
+   float lead = rise / rate * 3600;
+   return lead > maxlead ? maxlead : lead;
+}
+
+void
+schedule_learn (schedule_t * s, uint8_t hot, float rise, uint32_t seconds)
+{
+   if (rise < 0.5 || seconds < 300)
+      return;                   // Too small to tell
+   float rate = rise * 3600 / seconds,
+      *r = (hot ? &s->heatrate : &s->coolrate);
+   *r = (*r > 0 ? *r * 0.7 + rate * 0.3 : rate);
+}
+
+void
+schedule_text (const schedule_event_t * e, char *buf, int len)
+{
+   char *p = buf,
+      *end = buf + len;
+   void add (const char *fmt, ...)
+   {
+      va_list ap;
+      va_start (ap, fmt);
+      if (p < end)
+         p += vsnprintf (p, end - p, fmt, ap);
+      va_end (ap);
+   }
+   if (e->days == 0x7F)
+      add ("daily");
+   else if (e->days == 0x3E)
+      add ("mon-fri");
+   else
+      for (int d = 0; d < 7; d++)
+         if (e->days & (1 << d))
+            add ("%s%.3s", p > buf ? "," : "", days + d * 3);
+   add (" %02d:%02d", e->minute / 60, e->minute % 60);
+   if (e->power >= 0)
+      add (" %s", e->power ? "on" : "off");
+   if (e->mode)
+      add (" %s", e->mode == 'H' ? "heat" : e->mode == 'C' ? "cool" : e->mode == 'A' ? "auto" : e->mode == 'D' ? "dry" : "fan");
+   if (e->target)
+      add (" %.1f", e->target / 10.0);
+   if (e->fan)
+      add (" fan%c", e->fan);
+}
@@ -0,0 +1,47 @@
+#ifndef _SCHEDULE_H
+#define _SCHEDULE_H
+
+// Weekly schedule of events (power, mode, fan, target), e.g. "mon-fri 06:30 on heat 21 fan3"
+// Events are parsed to a table sorted by time of day, and the next event precomputed so checking is O(1) per tick
+// Pre-heat/cool lead time is from learned warm-up rates, so the target is reached at the scheduled time
+// This is pure, no I/O, so it can also be run on a host
+
+#include <stdint.h>
+
+#define	SCHEDULE_MAX	16      // Events (schedule setting array)
+#define	SCHEDULE_WEEK	(7*1440)        // Minutes in a week
+
+typedef struct
+{                               // Event
+   uint16_t minute;             // Minute of day
+   uint8_t days;                // Bit map, bit 0 is Sunday (as tm_wday)
+   int8_t power;                // 1 on, 0 off, -1 no change
+   char mode;                   // Mode character (FHCA456D), 0 no change
+   char fan;                    // Fan character (A12345Q), 0 no change
+   int16_t target;              // Target (C*10), 0 no change
+} schedule_event_t;
+
+typedef struct
+{                               // Schedule, zero to start
+   schedule_event_t event[SCHEDULE_MAX];        // Sorted by minute
+   uint8_t count;               // Events in table
+   uint8_t next;                // Next event, if nextin
+   int16_t nextin;              // Minutes from when schedule_next called to next event, -1 for none
+   float heatrate;              // Learned warm-up rate (C/hour), 0 if not known
+   float coolrate;
+} schedule_t;
+
+// Parse event text, return NULL if OK, else error
+const char *schedule_parse (const char *text, schedule_event_t * e);
+// Load events from text (NULL/empty skipped), sorted, return NULL if OK, else first error (bad events are skipped)
+const char *schedule_load (schedule_t * s, const char *const *text, int n);
+// Work out next event strictly after minute of week (day*1440+hour*60+minute), sets next and nextin
+void schedule_next (schedule_t * s, int week);
+// Lead time (seconds) to start event early so env reaches its target on time, hot if heating, maxlead in seconds
+uint32_t schedule_lead (const schedule_t * s, const schedule_event_t * e, uint8_t hot, float env, uint32_t maxlead);
+// Learn warm-up rate, having gone rise (C, positive) in seconds
+void schedule_learn (schedule_t * s, uint8_t hot, float rise, uint32_t seconds);
+// Event as text
+void schedule_text (const schedule_event_t * e, char *buf, int len);
+
+#endif
@@ -0,0 +1,74 @@
+/* Faikout quantile sketch */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <math.h>
+#include <string.h>
+#include "sketch.h"
+
+static void
+sketch_grow (sketch_t * s, uint8_t down)
+{                               // Double bin width, merging pairs into one half, extending range down or up
+   uint16_t merged[SKETCH_BINS / 2];
+   for (int b = 0; b < SKETCH_BINS / 2; b++)
+   {
+      uint32_t n = s->bin[b * 2] + s->bin[b * 2 + 1];
+      merged[b] = (n > 0xFFFF ? 0xFFFF : n);
+   }
+   memset (s->bin, 0, sizeof (s->bin));
+   if (down)
+   {                            // Old range is top half
+      memcpy (s->bin + SKETCH_BINS / 2, merged, sizeof (merged));
+      s->base -= s->width * SKETCH_BINS;
+   } else
+      memcpy (s->bin, merged, sizeof (merged));
+   s->width *= 2;
+}
+
+void
+sketch_add (sketch_t * s, float v, float res)
+{
+   if (isnan (v) || isinf (v))
+      return;
+   if (!s->width)
+   {                            // First value in middle
+      s->width = res;
+      s->base = v - res * SKETCH_BINS / 2;
+   }
+   while (v < s->base && s->width < 1e6)
+      sketch_grow (s, 1);
+   while (v >= s->base + s->width * SKETCH_BINS && s->width < 1e6)
+      sketch_grow (s, 0);
+   int b = (v - s->base) / s->width;
+   if (b < 0)
+      b = 0;
+   if (b >= SKETCH_BINS)
+      b = SKETCH_BINS - 1;
+   if (s->bin[b] < 0xFFFF)
+      s->bin[b]++;
+   s->count++;
+}
+
+float
+sketch_quantile (const sketch_t * s, float q)
+{                               // Interpolated within the bin
+   uint32_t total = 0;
+   for (int b = 0; b < SKETCH_BINS; b++)
+      total += s->bin[b];
+   if (!total)
+      return NAN;
+   float want = q * total,
+      sum = 0;
+   for (int b = 0; b < SKETCH_BINS; b++)
+   {
+      if (s->bin[b] && sum + s->bin[b] >= want)
+         return s->base + s->width * (b + (want - sum) / s->bin[b]);
+      sum += s->bin[b];
+   }
+   return s->base + s->width * SKETCH_BINS;
+}
+
+void
+sketch_reset (sketch_t * s)
+{
+   memset (s, 0, sizeof (*s));
+}
@@ -0,0 +1,26 @@
+#ifndef _SKETCH_H
+#define _SKETCH_H
+
+// Fixed memory quantile sketch, for percentiles of a value over a reporting period
+// A histogram of SKETCH_BINS equal width bins, which doubles its width (merging pairs) to cover new values
+
+#include <stdint.h>
+
+#define	SKETCH_BINS	64      // Bins, must be even
+
+typedef struct
+{
+   float base;                  // Value at bottom of bin 0
+   float width;                 // Bin width, 0 if no values yet
+   uint32_t count;              // Values added
+   uint16_t bin[SKETCH_BINS];   // Counts per bin, saturating
+} sketch_t;
+
+// Add a value, res is the initial bin width (i.e. resolution) to use for the first value
+void sketch_add (sketch_t * s, float v, float res);
+// Estimate quantile q (0.0 to 1.0), NAN if no values
+float sketch_quantile (const sketch_t * s, float q);
+// Clear for next period
+void sketch_reset (sketch_t * s);
+
+#endif
@@ -0,0 +1,207 @@
+/* Faikout auto tuner */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include "tune.h"
+
+#define	TUNE_BETTER	0.95    // Trial must cost this much of base, or less, to be kept
+#define	TUNE_SETTLE	1       // Sample periods at start of trial not counted, as settling from last
+
+static const struct
+{
+   const char *name;            // Setting
+   float min,
+     max;                       // Safe bounds
+   float step;                  // Initial step
+   float minstep;               // Smallest step, and resolution of setting
+   uint8_t heat:1;              // Applies when heating
+   uint8_t cool:1;              // Applies when cooling
+} params[TUNE_PARAMS] = {
+   [TUNE_HEATOVER] = {"heatover", 0, 10, 2, 1, 1, 0},
+   [TUNE_HEATBACK] = {"heatback", 0, 10, 2, 1, 1, 0},
+   [TUNE_COOLOVER] = {"coolover", 0, 10, 2, 1, 0, 1},
+   [TUNE_COOLBACK] = {"coolback", 0, 10, 2, 1, 0, 1},
+   [TUNE_SWITCHTEMP] = {"switchtemp", 0, 2, 0.2, 0.1, 1, 1},
+   [TUNE_PUSHTEMP] = {"pushtemp", 0, 1, 0.2, 0.1, 1, 1},
+   [TUNE_THERMREF] = {"thermref", 0, 100, 20, 10, 1, 1},
+};
+
+const char *
+tune_name (uint8_t param)
+{
+   return param < TUNE_PARAMS ? params[param].name : "";
+}
+
+static uint8_t
+tune_try (tune_t * t)
+{                               // Set value for trial of param in dir, return 0 if no change possible
+   memcpy (t->value, t->base, sizeof (t->value));
+   uint8_t p = t->param;
+   if (!t->dir || !(t->hot ? params[p].heat : params[p].cool))
+      return 0;
+   float v = t->base[p] + t->dir * t->step[p];
+   v = roundf (v / params[p].minstep) * params[p].minstep;
+   if (v < params[p].min)
+      v = params[p].min;
+   if (v > params[p].max)
+      v = params[p].max;
+   if (fabsf (v - t->base[p]) < params[p].minstep / 2)
+      return 0;                 // At limit
+   t->value[p] = v;
+   return 1;
+}
+
+static void
+tune_next (tune_t * t)
+{                               // Next trial, other direction, or next parameter, or measure base again after a round
+   for (int tries = 0; tries < TUNE_PARAMS * 2; tries++)
+   {
+      if (t->dir > 0)
+         t->dir = -1;
+      else
+      {
+         if (t->round >= TUNE_PARAMS)
+            break;
+         t->param = (t->param + 1) % TUNE_PARAMS;
+         t->round++;
+         t->dir = 1;
+      }
+      if (tune_try (t))
+         return;
+   }
+   t->dir = 0;                  // Measure base
+   t->round = 0;
+   memcpy (t->value, t->base, sizeof (t->value));
+}
+
+static void
+tune_restart (tune_t * t)
+{                               // Start trial again
+   t->sq = t->out = t->cost = 0;
+   t->seconds = 0;
+   t->reports = 0;
+   t->started = 0;
+}
+
+void
+tune_load (tune_t * t, const float *value)
+{
+   if (t->loaded)
+   {                            // Only if changed, allowing for setting resolution
+      int p;
+      for (p = 0; p < TUNE_PARAMS && fabsf (t->base[p] - value[p]) < params[p].minstep / 2; p++);
+      if (p == TUNE_PARAMS)
+         return;
+   }
+   memcpy (t->base, value, sizeof (t->base));
+   memcpy (t->value, value, sizeof (t->value));
+   for (int p = 0; p < TUNE_PARAMS; p++)
+      if (!t->step[p])
+         t->step[p] = params[p].step;
+   t->basecost = NAN;
+   t->dir = 0;
+   t->round = 0;
+   t->loaded = 1;
+   tune_restart (t);
+}
+
+void
+tune_apply (const tune_t * t, automation_config_t * c)
+{
+   if (!t->loaded)
+      return;
+   c->heatover = t->value[TUNE_HEATOVER];
+   c->heatback = t->value[TUNE_HEATBACK];
+   c->coolover = t->value[TUNE_COOLOVER];
+   c->coolback = t->value[TUNE_COOLBACK];
+   c->switchtemp = t->value[TUNE_SWITCHTEMP];
+   c->pushtemp = t->value[TUNE_PUSHTEMP];
+   c->thermref = lroundf (t->value[TUNE_THERMREF]);
+}
+
+uint8_t
+tune_run (tune_t * t, const automation_report_t * r, const automation_unit_t * u, float temp, float min, float max,
+          uint8_t reports, char *text, int len)
+{
+   if (!t->loaded || !reports)
+      return 0;
+   if (!u->control || !u->power || isnan (temp) || isnan (min) || isnan (max) || (t->started && u->heat != t->hot))
+   {                            // Not controlling, or mode changed, so start trial again when we are
+      if (t->started)
+         tune_restart (t);
+      return 0;
+   }
+   if (!t->started && t->hot != u->heat)
+   {                            // Trials are for heating or cooling parameters
+      t->hot = u->heat;
+      if (t->dir && !tune_try (t))
+         tune_next (t);
+   }
+   t->started = 1;
+   if (t->reports >= TUNE_SETTLE)
+   {                            // Error from middle of target range, and time out of it (not approaching/beyond as range is adjusted by switchtemp/pushtemp)
+      t->seconds++;
+      float e = temp - (min + max) / 2;
+      t->sq += e * e;
+      if (temp < min || temp > max)
+         t->out++;
+   }
+   if (!r->valid)
+      return 0;
+   // Sample period report, changes made
+   if (t->reports++ < TUNE_SETTLE)
+      return 0;
+   if (r->setfan >= 0)
+      t->cost += 0.1;
+   if (r->setpower >= 0)
+      t->cost += 0.5;
+   if (r->setmode)
+      t->cost += 1;
+   if (t->reports < reports + TUNE_SETTLE)
+      return 0;
+   float cost = (t->sq + t->out) / t->seconds + t->cost / reports;
+   tune_restart (t);
+   uint8_t p = t->param,
+      ret = 2;
+   int l = 0;
+   if (!t->dir)
+   {                            // Base measured
+      l = snprintf (text, len, "Base cost %.3f", cost);
+      t->basecost = cost;
+      tune_next (t);
+   } else if (cost <= t->basecost * TUNE_BETTER)
+   {                            // Better, keep, and try further the same way
+      l = snprintf (text, len, "Kept %s %g to %g, cost %.3f to %.3f", params[p].name, t->base[p], t->value[p], t->basecost,
+                    cost);
+      t->base[p] = t->value[p];
+      t->basecost = cost;
+      t->step[p] *= 1.5;
+      if (t->step[p] > (params[p].max - params[p].min) / 4)
+         t->step[p] = (params[p].max - params[p].min) / 4;
+      if (!tune_try (t))
+         tune_next (t);
+      ret = 1;
+   } else
+   {
+      l = snprintf (text, len, "Not kept %s %g, cost %.3f not better than %.3f", params[p].name, t->value[p], cost,
+                    t->basecost);
+      if (t->dir < 0)
+      {                         // Neither way better, smaller steps next time
+         t->step[p] /= 2;
+         if (t->step[p] < params[p].minstep)
+            t->step[p] = params[p].minstep;
+      }
+      tune_next (t);
+   }
+   p = t->param;
+   if (l >= 0 && l < len)
+   {
+      if (t->dir)
+         snprintf (text + l, len - l, ", trying %s %g to %g", params[p].name, t->base[p], t->value[p]);
+      else
+         snprintf (text + l, len - l, ", measuring base");
+   }
+   return ret;
+}
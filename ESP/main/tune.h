@@ -0,0 +1,55 @@
+#ifndef _TUNE_H
+#define _TUNE_H
+
+// Faikout auto tuner, adjusts heat.over, heat.back, cool.over, cool.back, switchtemp, pushtemp and thermref
+// Gradient-free coordinate search: each trial runs a parameter one step up or down for some sample periods, and is kept if
+// it cost less (time out of target range, squared error from the middle of it, fan/mode/power changes)
+// This is pure, no I/O, so it can also be run on a host in a room simulator
+
+#include <stdint.h>
+#include "automation.h"
+
+enum
+{                               // Parameters tuned
+   TUNE_HEATOVER,
+   TUNE_HEATBACK,
+   TUNE_COOLOVER,
+   TUNE_COOLBACK,
+   TUNE_SWITCHTEMP,
+   TUNE_PUSHTEMP,
+   TUNE_THERMREF,
+   TUNE_PARAMS
+};
+
+typedef struct
+{                               // State, zero to start, then tune_load
+   float value[TUNE_PARAMS];    // Values to use now (base, or base with one trial step)
+   float base[TUNE_PARAMS];     // Accepted values
+   float step[TUNE_PARAMS];     // Step for each parameter
+   float basecost;              // Cost of base, NAN if to be measured
+   float sq;                    // Sum of squared error this trial
+   float cost;                  // Sum of per report costs this trial
+   uint32_t out;                // Seconds out of target range this trial
+   uint32_t seconds;            // Seconds this trial (once settled)
+   uint16_t reports;            // Sample period reports this trial
+   uint8_t param;               // Parameter being tried
+   int8_t dir;                  // Direction being tried, 0 if measuring base
+   uint8_t round;               // Parameters tried since base measured
+   uint8_t started:1;           // Trial started
+   uint8_t hot:1;               // Heating, when trial started
+   uint8_t loaded:1;            // Loaded
+} tune_t;
+
+// Load values (as settings), e.g. at start or if settings changed
+void tune_load (tune_t * t, const float *value);
+// Apply current values to automation config
+void tune_apply (const tune_t * t, automation_config_t * c);
+// Run each second, after automation_run, with r from it, and temp and target range (NAN if none) it used
+// reports is sample period reports per trial
+// Returns 1 if base changed (to be saved), 2 if trial changed, with reason in text, else 0
+uint8_t tune_run (tune_t * t, const automation_report_t * r, const automation_unit_t * u, float temp, float min, float max,
+                  uint8_t reports, char *text, int len);
+// Name of a parameter, as setting
+const char *tune_name (uint8_t param);
+
+#endif
@@ -0,0 +1,59 @@
+/* Faikout X50A link layer */
+/* Copyright ©2022 Adrian Kennard, Andrews & Arnold Ltd. See LICENCE file for details .GPL 3.0 */
+
+#include <string.h>
+#include "x50alink.h"
+
+int
+x50alink_frame (uint8_t * buf, uint8_t cmd, const uint8_t * payload, int txlen)
+{
+   buf[0] = 0x06;
+   buf[1] = cmd;
+   buf[2] = txlen + 6;
+   buf[3] = 1;
+   buf[4] = 0;
+   if (txlen)
+      memcpy (buf + 5, payload, txlen);
+   uint8_t c = 0;
+   for (int i = 0; i < 5 + txlen; i++)
+      c += buf[i];
+   buf[5 + txlen] = ~c;
+   return 6 + txlen;
+}
+
+int
+x50alink_receive (x50alink_t * l, uint8_t cmd, uint8_t * buf, int size, int *rxlen)
+{
+   // Wait for reply, 06 cmd len ..., where len is the whole frame, so read exactly that
+   int len = 0,
+      skip = 0;
+   *rxlen = 0;
+   while ((len < 3 || len < buf[2]) && len < size)
+   {
+      if (l->read (l->ctx, buf + len, 1, len) != 1)
+         break;
+      if (!len && *buf != 0x06 && skip++ < size)
+         continue;              // Resync on header
+      len++;
+      if (len == 3 && buf[2] < 6)
+         break;                 // Silly length, checked below
+   }
+   *rxlen = len;
+   if (!len)
+      return X50ALINK_TIMEOUT;
+   if (len < 3 || (buf[2] >= 6 && len < buf[2]))
+      return X50ALINK_PARTIAL;  // Drop it and resync on next header
+   // Check checksum
+   uint8_t c = 0;
+   for (int i = 0; i < len; i++)
+      c += buf[i];
+   if (c != 0xFF)
+      return X50ALINK_BADSUM;
+   if (len < 6 || buf[0] != 0x06 || buf[1] != cmd || buf[2] != len || buf[3] != 1)
+      return X50ALINK_BAD;
+   if (!buf[4])
+      return X50ALINK_LOOPBACK; // Tx sends 00 here, rx is 06
+   if (buf[1] == 0xFF)
+      return X50ALINK_FAULT;
+   return X50ALINK_REPLY;
+}
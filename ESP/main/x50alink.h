@@ -0,0 +1,32 @@
+#ifndef _X50ALINK_H
+#define _X50ALINK_H
+
+// X50A link layer, framing, and reading a reply by its length header, over a UART given as callbacks
+// This has no ESP-IDF calls, so the firmware's own exchange can also be run on a host against the simulator
+
+#include <stdint.h>
+
+enum
+{                               // Outcome of x50alink_receive
+   X50ALINK_REPLY,              // Reply frame, checked, payload is buf+5, rxlen-6 bytes
+   X50ALINK_TIMEOUT,            // Nothing
+   X50ALINK_PARTIAL,            // Header only or short
+   X50ALINK_BADSUM,             // Bad checksum
+   X50ALINK_BAD,                // Bad header, command, length or form
+   X50ALINK_LOOPBACK,           // Our own frame, Tx looped back to Rx
+   X50ALINK_FAULT,              // Error report (FF)
+};
+
+typedef struct
+{                               // Platform UART
+   int (*read) (void *ctx, uint8_t * buf, int len, int started);        // Read with timeout, shorter once a reply has started, returns bytes read, 0 if timed out
+   void (*write) (void *ctx, const uint8_t * buf, int len);
+   void *ctx;
+} x50alink_t;
+
+// Build a frame in buf for cmd and payload, returns length
+int x50alink_frame (uint8_t * buf, uint8_t cmd, const uint8_t * payload, int txlen);
+// Read a reply to cmd, into buf (size bytes), sets rxlen to what was received
+int x50alink_receive (x50alink_t * l, uint8_t cmd, uint8_t * buf, int size, int *rxlen);
+
+#endif
@@ -0,0 +1,232 @@
+# This script builds a faikin-s21 .settings profile from a capture of a real A/C, so it
+# does not have to be made up by hand
+# Usage: build_profile.py <capture> [<capture>...] > <model>.settings
+# A capture can be any of:
+# - The reply to the Faikin probe command, i.e. mosquitto_sub -v -t info/<Faikin name>/probe,
+#   after sending command/<Faikin name>/probe (all known commands, in one go)
+# - MQTT log with dump on, i.e. mosquitto_sub -v -t 'info/<Faikin name>/#', over a while,
+#   so ranges of varying values are seen
+# - Raw binary capture of the serial line, both directions (e.g. a logic analyser or
+#   a tap on a pass through module)
+# NAKed commands become nak lines, sensors the initial state, with the range seen as a comment
+
+import json
+import sys
+
+STX = 0x02
+ETX = 0x03
+ACK = 0x06
+NAK = 0x15
+
+# Raw values the simulator has, and their length, as in faikin-s21.h
+raw_len = {
+    "F2": 4, "F3": 4, "F4": 4, "FB": 4, "FG": 4, "FK": 4, "FN": 4, "FP": 4, "FQ": 4, "FR": 4,
+    "FS": 4, "FT": 4, "FV": 4, "M": 4, "V": 4, "VS000M": 14,
+    "FU00": 32, "FU02": 32, "FU04": 32, "FU05": 32, "FU15": 32, "FU25": 32, "FU35": 32, "FU45": 32,
+    "FY10": 8, "FY20": 4,
+    "FX00": 2, "FX10": 2, "FX20": 4, "FX30": 2, "FX40": 2, "FX50": 2, "FX60": 4, "FX70": 4,
+    "FX80": 4, "FX90": 4, "FXA0": 4, "FXB0": 2, "FXC0": 2, "FXD0": 8, "FXE0": 8, "FXF0": 8,
+    "FX01": 8, "FX11": 8, "FX21": 2, "FX31": 8, "FX41": 8, "FX51": 4, "FX61": 2, "FX71": 2, "FX81": 2
+}
+
+replies = {} # Command -> list of payloads seen, in order
+naks = set()
+frames = 0
+
+def checksum(frame):
+    s = sum(frame[1:-2]) & 0xFF
+    return s + 2 if s == STX or s == ETX or s == ACK else s
+
+def query_cmd(frame):
+    # Command, including any payload, of a query frame, e.g. FU55
+    return norm(frame[1:-2].decode("ascii", "replace"))
+
+def norm(cmd):
+    # M and V are sent twice by Faikin, as it assumes at least 2-char code
+    if len(cmd) == 2 and cmd[0] in "MV" and cmd[1] == cmd[0]:
+        return cmd[0]
+    return cmd
+
+def answers(sent, sentlen, frame):
+    # Frame is the reply to the query sent, which was sentlen bytes
+    if not sent or len(frame) < 4:
+        return False
+    if sent[0] in "MV":
+        return frame[1] == ord(sent[0]) and len(frame) > sentlen
+    return frame[1] == ord(sent[0]) + 1 and frame[2:1 + len(sent)] == sent[1:].encode("ascii")
+
+def reply_cmd(frame):
+    # Deduce originating command from response, as collect_profile.py.
+    # Replies to M and V don't have 1st byte incremented
+    if frame[1:3] == b"VS":
+        return "VS000M"
+    if frame[1] == 0x4D or frame[1] == 0x56: # M or V
+        return chr(frame[1])
+    cmd = chr(frame[1] - 1) + chr(frame[2])
+    if cmd in ("FU", "FX", "FY"):
+        # These commands are 4-char long
+        cmd = chr(frame[1] - 1) + frame[2:5].decode("ascii", "replace")
+    return cmd
+
+def reply(cmd, frame):
+    global frames
+    if len(frame) < 5 or frame[0] != STX or frame[-1] != ETX or checksum(frame) != frame[-2]:
+        return
+    if not cmd:
+        cmd = reply_cmd(frame)
+        if not cmd.isalnum():
+            return
+    off = 3 if cmd == "VS000M" else 1 + len(cmd)
+    replies.setdefault(cmd, []).append(bytearray(frame[off:-2]))
+    frames += 1
+
+def load_json(obj, state):
+    if "dump" in obj:
+        frame = bytes.fromhex(obj["dump"])
+        if state["topic"].endswith("/tx"):
+            state["sent"] = query_cmd(frame)
+            state["sentlen"] = len(frame)
+        else:
+            reply(state["sent"] if answers(state["sent"], state["sentlen"], frame) else None, frame)
+            state["sent"] = None
+    elif "nak" in obj and "cmd" in obj:
+        naks.add(norm(obj["cmd"] + obj.get("text", "")))
+        state["sent"] = None
+    elif not state["topic"] or state["topic"].endswith("/probe"):
+        # Probe reply, command -> reply frame, or null for NAK
+        for cmd, hex in obj.items():
+            if hex is None:
+                naks.add(cmd)
+            elif isinstance(hex, str) and len(cmd) <= 6:
+                try:
+                    reply(cmd, bytes.fromhex(hex))
+                except ValueError:
+                    pass
+
+def load_text(text):
+    state = {"topic": "", "sent": None, "sentlen": 0}
+    for line in text.splitlines():
+        line = line.strip()
+        if not line.startswith("{"):
+            # mosquitto_sub -v, topic then payload
+            topic, _, line = line.partition(" ")
+            state["topic"] = topic
+        try:
+            obj = json.loads(line)
+        except ValueError:
+            continue
+        if isinstance(obj, dict):
+            load_json(obj, state)
+
+def load_binary(data):
+    # Both directions interleaved, a frame is a reply if it answers the query before
+    sent = None
+    sentlen = 0
+    i = 0
+    while i < len(data):
+        b = data[i]
+        if b == NAK and sent:
+            naks.add(sent)
+            sent = None
+        if b != STX:
+            i += 1
+            continue
+        e = data.find(bytes([ETX]), i + 1)
+        if e < 0:
+            break
+        frame = data[i:e + 1]
+        i = e + 1
+        if len(frame) < 4 or checksum(frame) != frame[-2]:
+            continue
+        if answers(sent, sentlen, frame):
+            reply(sent, frame)
+            sent = None
+        else:
+            sent = query_cmd(frame)
+            sentlen = len(frame)
+
+def temp(p):
+    # Sign and 3 digits, reversed, tenths of C
+    return int(p[::-1].decode("ascii")) / 10
+
+def dec(p):
+    # 3 digits, reversed
+    return int(p[::-1].decode("ascii"))
+
+def hexval(p):
+    # 4 hex digits, reversed
+    return int(p[::-1].decode("ascii"), 16)
+
+# State option, command, decode, format
+sensors = [
+    ["home", "RH", temp, "%.1f"],
+    ["outside", "Ra", temp, "%.1f"],
+    ["inlet", "RI", temp, "%.1f"],
+    ["fanrpm", "RL", dec, "%d"],
+    ["comprpm", "Rd", dec, "%d"],
+    ["hum_sensor", "Re", dec, "%d"],
+    ["consumption", "FM", hexval, "%d"],
+]
+
+def print_profile(names):
+    print("# Built by build_profile.py from %s, %d replies" % (" ".join(names), frames))
+    if "FY00" in replies:
+        ver = replies["FY00"][-1].decode("ascii")
+        protocol = ver[2] + "." + ver[1] + ver[0]
+        if ver[3] != "0":
+            protocol = ver[3] + protocol
+        print("protocol", protocol)
+    elif "F8" in replies:
+        print("protocol", "%d.00" % (replies["F8"][-1][1] & ~0x30))
+    if "FC" in replies:
+        print("model", replies["FC"][-1][::-1].decode("ascii"))
+    if "F1" in replies:
+        p = replies["F1"][0]
+        fan = {ord("A"): 0, ord("B"): 6}.get(p[3], p[3] - ord("3") + 1)
+        print("power %d\nmode %d\ntemp %.1f\nfan %d" % (p[0] - 0x30, p[1] - 0x30, 18 + 0.5 * (p[2] - 0x40), fan))
+    for name, cmd, decode, fmt in sensors:
+        try:
+            seen = [decode(p) for p in replies.get(cmd, [])]
+        except ValueError:
+            print("# %s: unexpected %s reply" % (name, cmd))
+            continue
+        if not seen:
+            continue
+        if min(seen) != max(seen):
+            print(("# %s seen " + fmt + " to " + fmt) % (name, min(seen), max(seen)))
+        print(name, fmt % seen[0])
+    for cmd, size in raw_len.items():
+        if cmd not in replies:
+            continue
+        p = replies[cmd][0]
+        if cmd == "F4" and p[2] & (1 << 5):
+            # Reset 'error 252' flag
+            print("# F4 unit error bit was set, reset")
+            p[2] &= ~(1 << 5)
+        varies = [i for i in range(len(p)) if any(len(q) > i and q[i] != p[i] for q in replies[cmd])]
+        for i in varies:
+            seen = [q[i] for q in replies[cmd] if len(q) > i]
+            print("# %s byte %d seen 0x%02X to 0x%02X" % (cmd, i, min(seen), max(seen)))
+        if len(p) != size:
+            print("# %s reply is %d bytes, simulator has %d: %s" % (cmd, len(p), size, " ".join("0x%02X" % x for x in p)))
+            continue
+        print(cmd, " ".join("0x%02X" % x for x in p))
+    for cmd in sorted(naks):
+        if cmd not in replies:
+            print("nak", cmd)
+
+if len(sys.argv) < 2:
+    print("Usage: {} <capture> [<capture>...]".format(sys.argv[0]))
+    sys.exit(255)
+
+for name in sys.argv[1:]:
+    with open(name, "rb") as f:
+        data = f.read()
+    try:
+        load_text(data.decode("ascii"))
+    except UnicodeDecodeError:
+        load_binary(data)
+    if not frames and not naks:
+        load_binary(data)
+
+print_profile(sys.argv[1:])
@@ -0,0 +1,236 @@
+/* Daikin heat pump simulator for Altherma_S protocol testing */
+/* The register map is provisional, as in the firmware, not from documentation */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "osal.h"
+
+#define AS_STX   0x02 // Query is STX, register, ~checksum
+#define AS_NAK   0x15 // Unknown register
+#define AS_LEN   18   // Reply is register, 16 data bytes, ~checksum
+
+const char *port = NULL; // Serial port to use
+static int debug = 0;    // Dump registers (short form)
+static int dump  = 0;    // Raw dump
+
+// Simulated state. Temperatures are multiplied by 10, as on the wire.
+static int power      = 1;
+static int heat       = 1;
+static int antifreeze = 0;
+static int lwt        = 350;
+static int rwt        = 300;
+static int dhw        = 480;
+static int home       = 215;
+static int liquid     = 320;
+static int outside    = 65;
+static int discharge  = 620;
+static int comp       = 48;
+static int fanrpm     = 650;
+static int temp       = 350;
+static const char *nak = ""; // Registers to reject, e.g. "S"
+
+static void usage(const char *progname)
+{
+   printf("Usage: %s <simulator options> <state options>\n"
+          "Available simulator options:\n"
+          " -p or --port <name> - serial port to use (mandatory option)\n"
+          " -v or --debug - Enable dumping all registers\n"
+          " -V or --verbose - Enable dumping all protocol data\n"
+          "Available state options:\n"
+          " --power <0|1>, --heat <0|1>, --antifreeze <0|1>\n"
+          " --lwt, --rwt, --dhw, --home, --liquid, --outside, --discharge, --temp <C>\n"
+          " --comp <Hz>, --fanrpm <rpm>\n"
+          " --nak <registers> - Registers to reject with NAK, e.g. S\n", progname);
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "%s option requires a value\n", argv[0]);
+      exit(255);
+   }
+
+   return argv[1];
+}
+
+static int get_temp_arg(int argc, const char **argv)
+{
+   return (int)(atof(get_string_arg(argc, argv)) * 10);
+}
+
+static unsigned int parse_option(const char *progname, int argc, const char **argv)
+{
+   const char *opt = argv[0];
+
+   if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+      usage(progname);
+      exit(255);
+   } else if (!strcmp(opt, "-p") || !strcmp(opt, "--port")) {
+      port = get_string_arg(argc, argv);
+   } else if (!strcmp(opt, "-v") || !strcmp(opt, "--debug")) {
+      debug = 1;
+      return 1;
+   } else if (!strcmp(opt, "-V") || !strcmp(opt, "--verbose")) {
+      dump = 1;
+      return 1;
+   } else if (!strcmp(opt, "--power")) {
+      power = atoi(get_string_arg(argc, argv));
+   } else if (!strcmp(opt, "--heat")) {
+      heat = atoi(get_string_arg(argc, argv));
+   } else if (!strcmp(opt, "--antifreeze")) {
+      antifreeze = atoi(get_string_arg(argc, argv));
+   } else if (!strcmp(opt, "--lwt")) {
+      lwt = get_temp_arg(argc, argv);
+   } else if (!strcmp(opt, "--rwt")) {
+      rwt = get_temp_arg(argc, argv);
+   } else if (!strcmp(opt, "--dhw")) {
+      dhw = get_temp_arg(argc, argv);
+   } else if (!strcmp(opt, "--home")) {
+      home = get_temp_arg(argc, argv);
+   } else if (!strcmp(opt, "--liquid")) {
+      liquid = get_temp_arg(argc, argv);
+   } else if (!strcmp(opt, "--outside")) {
+      outside = get_temp_arg(argc, argv);
+   } else if (!strcmp(opt, "--discharge")) {
+      discharge = get_temp_arg(argc, argv);
+   } else if (!strcmp(opt, "--temp")) {
+      temp = get_temp_arg(argc, argv);
+   } else if (!strcmp(opt, "--comp")) {
+      comp = atoi(get_string_arg(argc, argv));
+   } else if (!strcmp(opt, "--fanrpm")) {
+      fanrpm = atoi(get_string_arg(argc, argv));
+   } else if (!strcmp(opt, "--nak")) {
+      nak = get_string_arg(argc, argv);
+   } else {
+      fprintf(stderr, "%s: unknown option\n", opt);
+      exit(255);
+   }
+   return 2;
+}
+
+static void put_temp(unsigned char *p, int t)
+{
+   p[0] = t;
+   p[1] = t >> 8;
+}
+
+static void as_reply(int p, const unsigned char *buf, int len)
+{
+   if (dump) {
+      printf("[32;1mTx");
+      for (int i = 0; i < len; i++)
+         printf(" %02X", buf[i]);
+      printf("\n");
+   }
+   write(p, buf, len);
+}
+
+int main(int argc, const char *argv[])
+{
+   const char *progname = *argv++;
+
+   argc--;
+   while (argc) {
+      int nargs = parse_option(progname, argc, argv);
+      argc -= nargs;
+      argv += nargs;
+   }
+
+   if (!port) {
+      fprintf(stderr, "Serial port is not given; use -p or --port option\n");
+      return 255;
+   }
+
+   int p = open(port, O_RDWR);
+
+   if (p < 0) {
+      fprintf(stderr, "Cannot open %s: %s", port, strerror(errno));
+      exit(255);
+   }
+
+   if (set_serial(p, 9600, CS8, EVENPARITY, ONESTOPBIT)) {
+      fputs("Failed to set up serial port\n", stderr);
+      exit(255);
+   }
+
+   while (1) {
+      unsigned char buf[3];
+      int len = 0;
+
+      while (len < sizeof(buf)) {
+         int l = wait_read(p, len ? 100 : 1000);
+         if (l <= 0)
+            break;
+         l = read(p, buf + len, 1);
+         if (l < 0) {
+            perror("Error reading from serial port");
+            exit(255);
+         }
+         if (l == 0)
+            continue;
+         if (!len && *buf != AS_STX) {
+            printf("Garbage byte received: 0x%02X\n", *buf);
+            continue;
+         }
+         len += l;
+      }
+      if (len < sizeof(buf))
+         continue;
+      if (dump)
+         printf("[31mRx %02X %02X %02X\n", buf[0], buf[1], buf[2]);
+
+      uint8_t cs = ~(uint8_t)(buf[0] + buf[1]);
+      if (cs != buf[2]) {
+         printf("Bad checksum: 0x%02X vs 0x%02X\n", cs, buf[2]);
+         continue;
+      }
+
+      unsigned char res[AS_LEN] = {0};
+      uint8_t reg = buf[1];
+
+      res[0] = reg;
+      switch (reg) {
+      case 'P':
+         res[1] = (power ? 0x01 : 0) | (heat ? 0x02 : 0) | (antifreeze ? 0x04 : 0);
+         break;
+      case 'T':
+         put_temp(res + 1, lwt);
+         put_temp(res + 3, rwt);
+         put_temp(res + 5, dhw);
+         put_temp(res + 7, home);
+         put_temp(res + 9, liquid);
+         break;
+      case 'U':
+         put_temp(res + 1, outside);
+         put_temp(res + 3, discharge);
+         res[9] = comp;
+         res[10] = fanrpm / 10;
+         break;
+      case 'S':
+         put_temp(res + 1, temp);
+         break;
+      default:
+         res[0] = AS_NAK;
+         printf("Unknown register %02X\n", reg);
+      }
+      if (reg && strchr(nak, reg))
+         res[0] = AS_NAK;
+      if (debug)
+         printf("[31;1mRx %c[0m -> %s\n", isprint(reg) ? reg : '?', res[0] == AS_NAK ? "NAK" : "OK");
+
+      cs = 0;
+      for (int i = 0; i < AS_LEN - 1; i++)
+         cs += res[i];
+      res[AS_LEN - 1] = ~cs;
+      as_reply(p, res, AS_LEN);
+   }
+
+   return 0;
+}
@@ -0,0 +1,685 @@
+/* Room thermal model running the Faikout auto control logic, for tuning settings offline */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "main/automation.h"
+#include "main/group.h"
+#include "main/fusion.h"
+#include "main/demand.h"
+#include "main/tune.h"
+
+static int debug = 0;      // Show automation reports
+static int logperiod = 0;  // Log state every this many seconds
+
+// Faikout settings, defaults as settings.def, S21 unit
+static automation_config_t config = {
+   .switchtemp = 0.5,
+   .pushtemp   = 0.1,
+   .autoptemp  = 0.5,
+   .heatover   = 6,
+   .heatback   = 6,
+   .coolover   = 6,
+   .coolback   = 6,
+   .tmin       = 16,
+   .tmax       = 32,
+   .tcoolmin   = 16,
+   .theatmax   = 32,
+   .tempstep   = 0.5,
+   .tpredicts  = 30,
+   .tpredictt  = 120,
+   .tsample    = 900,
+   .autofmax   = 5,
+   .thermref   = 50,
+   .autoe      = 1,
+   .fan5       = 1,
+   .tempadjust = 1,
+   .mpchorizon = 3600,
+   .mpcstart   = 2,
+};
+
+// Faikout auto target
+static float target = 21;    // autot
+static float margin = 0.5;   // autor
+
+// Room and aircon model
+static double days     = 7;     // Simulated time
+static double room     = 18;    // Initial room temp (C)
+static double outside  = 5;     // Mean outside temp (C)
+static double swing    = 4;     // Outside daily swing either side of mean (C)
+static double mass     = 1500;  // Thermal mass (kJ/K)
+static double loss     = 50;    // Heat loss to outside (W/K)
+static double gains    = 200;   // Internal gains, people, computers, sun (W)
+static double capacity = 2500;  // Aircon max heating/cooling (W)
+static double cop      = 3.5;   // Coefficient of performance for energy estimate
+static double bias     = 0;     // Aircon home sensor reads this much above the room (C)
+static double noise    = 0;     // Env sensor random noise (C)
+static int minrun      = 180;   // Compressor minimum run and rest time (s)
+static int fan         = 3;     // Initial fan
+static int heat        = 1;     // Initial mode
+
+// Several indoor units on one outdoor unit
+static int units       = 1;     // Indoor units, each in its own room
+static double spread   = 0;     // Targets spread over this range across units (C)
+static int group       = 0;     // Faikout auto group coordination
+static int stagger     = 60;    // group.stagger (s)
+
+// Reference temperature sensors, fused as the fusion.* settings
+static int sensors     = 1;     // Env sensors per room, BLE then MQTT topics
+static int period      = 1;     // Sensor report period (s)
+static double dead     = 0;     // First sensor stops reporting after this many hours
+static double wild     = 0;     // First sensor reads 5C high after this many hours
+// Demand response, as dr.* settings, signal sent daily for peak hours
+static double cap      = 0;     // Power cap per unit (W)
+static double price    = 0;     // Price
+static int peak        = 16;    // Signal starts at this hour
+static int peakhours   = 3;     // Signal lasts this many hours
+// Auto tuner, as tune.* settings
+static int tune        = 0;     // Sample period reports per trial, 0 for no tuning
+// Defrost, outdoor unit reverses to defrost its coil when heating in the cold
+static double defrost  = 0;     // Compressor running minutes between defrosts, when outside below 5C
+static int defrostlen  = 300;   // Defrost time (s)
+static int hidedefrost = 0;     // Aircon does not report antifreeze, liquid or compressor
+static demand_config_t drconfig = {
+   .pricelow = 0,
+   .pricehigh = 0,
+   .offset = 2,
+   .comfort = 1,
+   .min = 40,
+};
+
+static fusion_config_t fusion = {
+   .weight = {[FUSION_BLE] = 10, [FUSION_CONTROL] = 10, [FUSION_TOPIC ... FUSION_MAX - 1] = 10},
+   .halflife = 300,
+   .maxage = 600,            // t.control
+   .outlier = 2,
+};
+
+static void usage(const char *progname)
+{
+	printf("Usage: %s <options>\n"
+	       "Simulation options:\n"
+	       " -v or --debug - Show automation reports\n"
+	       " -l or --log <seconds> - Log room state every this many seconds\n"
+	       " --days <days> - Simulated time\n"
+	       "Room options:\n"
+	       " --room, --outside, --swing <C> - Initial room temp, mean outside temp, daily swing\n"
+	       " --mass <kJ/K>, --loss <W/K>, --gains <W> - Thermal mass, loss to outside, internal gains\n"
+	       " --capacity <W>, --cop <n> - Aircon capacity and efficiency\n"
+	       " --bias <C> - Aircon sensor reading above room, --noise <C> - env sensor noise\n"
+	       " --minrun <s> - Compressor minimum run and rest time\n"
+	       " --fan <1-5|0>, --cool - Initial fan setting, start in cooling\n"
+	       "Faikout options:\n"
+	       " --target <C>, --margin <C> - autot and autor\n"
+	       " --switchtemp, --pushtemp, --autoptemp <C>\n"
+	       " --heatover, --heatback, --coolover, --coolback <C>\n"
+	       " --tpredicts, --tpredictt, --tsample, --tempnoflap <s>\n"
+	       " --autofmax <n>, --thermref <%%>, --tempstep <C>\n"
+	       " --autop, --lockmode, --nofanauto, --thermostat, --temptrack, --notempadjust, --fan3\n"
+	       " --mpc - Model predictive control, --horizon <s>, --startcost <C^2 minutes>\n"
+	       "Multi-split options:\n"
+	       " --units <n> - Indoor units sharing one outdoor unit, rooms differ in gains and start temp\n"
+	       " --spread <C> - Spread of targets across units, --group - Faikout auto group, --stagger <s>\n"
+	       "Sensor fusion options:\n"
+	       " --sensors <n> - Env sensors per room (0 for none), --period <s> - how often each reports\n"
+	       " --dead <hours>, --wild <hours> - First sensor stops, or reads 5C high, after this time\n"
+	       " --fusehome <n> - fusion.home weight, --halflife <s>, --outlier <C>\n"
+	       "Demand response options:\n"
+	       " --cap <W> - Power cap, --price <n> - price signal, daily from --peak <hour> for --peakhours <n>\n"
+	       " --pricelow, --pricehigh <n>, --droffset, --drcomfort <C>, --drmin <%%> - dr.* settings\n"
+	       "Tuner options:\n"
+	       " --tune <n> - Auto tune heat/cool over/back, switchtemp, pushtemp, thermref, n sample periods per trial\n"
+	       "Defrost options:\n"
+	       " --defrost <minutes> - Compressor running time between defrosts below 5C outside, --defrostlen <s>\n"
+	       " --hidedefrost - Aircon does not report antifreeze, liquid or compressor, so defrost is not detected\n", progname);
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "%s option requires a value\n", argv[0]);
+		exit (255);
+	}
+
+	return argv[1];
+}
+
+static double get_double_arg(int argc, const char **argv)
+{
+	return atof(get_string_arg(argc, argv));
+}
+
+static unsigned int parse_option(const char *progname, int argc, const char **argv)
+{
+	const char *opt = argv[0];
+
+	if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+		usage(progname);
+		exit(255);
+	} else if (!strcmp(opt, "-v") || !strcmp(opt, "--debug")) {
+		debug = 1;
+		return 1;
+	} else if (!strcmp(opt, "-l") || !strcmp(opt, "--log")) {
+		logperiod = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--days")) {
+		days = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--room")) {
+		room = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--outside")) {
+		outside = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--swing")) {
+		swing = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--mass")) {
+		mass = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--loss")) {
+		loss = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--gains")) {
+		gains = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--capacity")) {
+		capacity = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--cop")) {
+		cop = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--bias")) {
+		bias = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--noise")) {
+		noise = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--minrun")) {
+		minrun = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--fan")) {
+		fan = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--cool")) {
+		heat = 0;
+		return 1;
+	} else if (!strcmp(opt, "--target")) {
+		target = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--margin")) {
+		margin = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--switchtemp")) {
+		config.switchtemp = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--pushtemp")) {
+		config.pushtemp = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--autoptemp")) {
+		config.autoptemp = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--heatover")) {
+		config.heatover = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--heatback")) {
+		config.heatback = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--coolover")) {
+		config.coolover = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--coolback")) {
+		config.coolback = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--tpredicts")) {
+		config.tpredicts = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--tpredictt")) {
+		config.tpredictt = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--tsample")) {
+		config.tsample = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--tempnoflap")) {
+		config.tempnoflap = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--autofmax")) {
+		config.autofmax = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--thermref")) {
+		config.thermref = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--tempstep")) {
+		config.tempstep = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--autop")) {
+		config.autop = 1;
+		return 1;
+	} else if (!strcmp(opt, "--lockmode")) {
+		config.lockmode = 1;
+		return 1;
+	} else if (!strcmp(opt, "--nofanauto")) {
+		config.nofanauto = 1;
+		return 1;
+	} else if (!strcmp(opt, "--thermostat")) {
+		config.thermostat = 1;
+		return 1;
+	} else if (!strcmp(opt, "--temptrack")) {
+		config.temptrack = 1;
+		return 1;
+	} else if (!strcmp(opt, "--notempadjust")) {
+		config.tempadjust = 0;
+		return 1;
+	} else if (!strcmp(opt, "--mpc")) {
+		config.mpc = 1;
+		return 1;
+	} else if (!strcmp(opt, "--horizon")) {
+		config.mpchorizon = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--startcost")) {
+		config.mpcstart = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--units")) {
+		units = atoi(get_string_arg(argc, argv));
+		if (units < 1 || units > GROUP_MAX) {
+			fprintf(stderr, "--units must be 1 to %d\n", GROUP_MAX);
+			exit(255);
+		}
+	} else if (!strcmp(opt, "--spread")) {
+		spread = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--group")) {
+		group = 1;
+		return 1;
+	} else if (!strcmp(opt, "--stagger")) {
+		stagger = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--sensors")) {
+		sensors = atoi(get_string_arg(argc, argv));
+		if (sensors < 0 || sensors > 1 + FUSION_TOPICS) {
+			fprintf(stderr, "--sensors must be 0 to %d\n", 1 + FUSION_TOPICS);
+			exit(255);
+		}
+	} else if (!strcmp(opt, "--period")) {
+		period = atoi(get_string_arg(argc, argv));
+		if (period < 1)
+			period = 1;
+	} else if (!strcmp(opt, "--dead")) {
+		dead = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--wild")) {
+		wild = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--fusehome")) {
+		fusion.weight[FUSION_HOME] = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--halflife")) {
+		fusion.halflife = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--outlier")) {
+		fusion.outlier = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--cap")) {
+		cap = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--price")) {
+		price = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--peak")) {
+		peak = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--peakhours")) {
+		peakhours = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--pricelow")) {
+		drconfig.pricelow = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--pricehigh")) {
+		drconfig.pricehigh = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--droffset")) {
+		drconfig.offset = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--drcomfort")) {
+		drconfig.comfort = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--drmin")) {
+		drconfig.min = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--tune")) {
+		tune = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--defrost")) {
+		defrost = get_double_arg(argc, argv);
+	} else if (!strcmp(opt, "--defrostlen")) {
+		defrostlen = atoi(get_string_arg(argc, argv));
+	} else if (!strcmp(opt, "--hidedefrost")) {
+		hidedefrost = 1;
+		return 1;
+	} else if (!strcmp(opt, "--fan3")) {
+		config.fan5 = 0;
+		return 1;
+	} else {
+		fprintf(stderr, "%s: unknown option\n", opt);
+		exit(255);
+	}
+	return 2;
+}
+
+static double outside_temp(uint32_t now)
+{
+	// Coldest before dawn, warmest mid afternoon
+	return outside + swing * sin(2 * M_PI * ((now % 86400) / 86400.0 - 0.375));
+}
+
+struct room
+{
+   char id[13];              // Unit ID, for group
+   automation_t a;
+   automation_unit_t u;
+   group_t g;                // This unit's view of the group
+   fusion_t f;               // Env sensors
+   demand_t d;               // Demand response
+   tune_t t;                 // Auto tuner
+   double power;             // Electrical power last second (W)
+   double temp;              // Room temp
+   double target;
+   double gains;
+   // The aircon's own view: it runs its compressor to get its sensor to the target it is sent
+   int running;              // Compressor running
+   uint32_t changed;         // When compressor last started or stopped
+   int cooling;              // Direction when in auto mode
+   uint32_t runfor;          // Compressor running time since last defrost (s)
+   uint32_t defrosting;      // Defrost until
+};
+
+int
+main(int argc, const char *argv[])
+{
+   const char *progname = *argv++;
+
+   argc--;
+   while (argc) {
+      int nargs = parse_option(progname, argc, argv);
+      argc -= nargs;
+      argv += nargs;
+   }
+
+   struct room rooms[GROUP_MAX] = {0};
+   for (int n = 0; n < units; n++)
+   {
+      struct room *rm = &rooms[n];
+      double k = (units > 1 ? (double)n / (units - 1) - 0.5 : 0);   // -0.5 to 0.5 across units
+      snprintf(rm->id, sizeof(rm->id), "ROOM%d", n);
+      rm->temp = room + k;
+      rm->target = target + spread * k;
+      rm->gains = gains * (1 + k);
+      rm->u = (automation_unit_t) {
+         .env = NAN,
+         .home = NAN,
+         .inlet = NAN,
+         .outside = NAN,
+         .liquid = NAN,
+         .mintarget = NAN,
+         .maxtarget = NAN,
+         .temp = rm->target,
+         .mode = heat ? FAIKIN_MODE_HEAT : FAIKIN_MODE_COOL,
+         .fan = fan,
+         .power = 1,
+         .comp = -1,
+      };
+   }
+   int outdoor = -1;         // Outdoor unit mode from last second, -1 idle, 0 heating, 1 cooling
+
+   // Results
+   double err_sum = 0, err_sq = 0, outside_band = 0, thermal = 0, electrical = 0, runtime = 0, conflict = 0, noenv = 0, confidence = 0;
+   double dr_wh = 0, dr_capwh = 0, dr_err = 0, defrost_err = 0;
+   unsigned int tune_changes = 0;
+   unsigned int defrosts = 0, defrost_changes = 0, defrost_after = 0;
+   uint32_t dr_seconds = 0, dr_over = 0, dr_comfort = 0;
+   unsigned int mode_switches = 0, power_cycles = 0, compressor_cycles = 0, fan_changes = 0, temp_changes = 0, close_starts = 0;
+   uint32_t end = days * 86400, laststart = 0;
+
+   if (logperiod)
+      printf("time,%soutside,room,env,home,power,mode,fan,temp,action,output\n", units > 1 ? "unit," : "");
+
+   for (uint32_t now = 1; now <= end; now++)
+   {
+      double out = outside_temp(now);
+      int busy = -1;         // Outdoor mode this second
+      for (int n = 0; n < units; n++)
+      {
+         struct room *rm = &rooms[n];
+         automation_unit_t *u = &rm->u;
+         // Sensors
+         u->home = rm->temp + bias;
+         for (int s = 0; s < sensors; s++)
+            if (!((now + s) % period) && !(!s && dead && now >= dead * 3600))
+            {
+               double env = rm->temp + (noise ? noise * (2.0 * rand() / RAND_MAX - 1) : 0);
+               if (!s && wild && now >= wild * 3600)
+                  env += 5;
+               fusion_set(&rm->f, s ? FUSION_TOPIC + s - 1 : FUSION_BLE, roundf(env * 10) / 10, now);  // Typical BLE sensor resolution
+            }
+         fusion_set(&rm->f, FUSION_HOME, u->home, now);
+         float c;
+         u->env = fusion_run(&rm->f, &fusion, now, &c);
+         confidence += c;
+         if (isnan(u->env))
+            noenv++;
+         u->inlet = rm->temp;
+         u->outside = roundf(out * 2) / 2;   // Aircon outside sensor is coarse
+         u->heat = (u->mode == FAIKIN_MODE_HEAT);
+         u->hhmm = (now % 86400) / 3600 * 100 + (now % 3600) / 60;
+         // Faikout auto, as main loop when autot/autor set
+         u->mintarget = rm->target - margin;
+         u->maxtarget = rm->target + margin;
+         u->controlvalid = now + 10;
+         if (cap || price)
+         {  // Demand response, signal for peak hours
+            int hour = (now % 86400) / 3600;
+            demand_signal_t sig = {
+               .cap = cap ? cap : NAN,
+               .price = price ? price : NAN,
+               .until = (hour >= peak && hour < peak + peakhours) ? now + 60 : 0,
+            };
+            demand_log_t l;
+            if (demand_run(&rm->d, &drconfig, &sig, rm->power, u->env, u->mintarget, u->maxtarget, u->heat, now, &l))
+            {
+               dr_seconds += l.seconds;
+               dr_over += l.over;
+               dr_comfort += l.comfort;
+               dr_wh += l.wh;
+               dr_capwh += l.capwh;
+               if (debug)
+                  printf("%6.2fd dr: %us power=%.0fW cap=%.0fW over=%us shed=%.0f%% comfort=%us\n", now / 86400.0, l.seconds,
+                         l.wh * 3600 / l.seconds, l.capwh * 3600 / l.seconds, l.over, l.shed * 100 / l.seconds, l.comfort);
+            }
+            if (rm->d.out.active)
+            {
+               u->mintarget += (u->heat ? -rm->d.out.offset : rm->d.out.offset);
+               u->maxtarget += (u->heat ? -rm->d.out.offset : rm->d.out.offset);
+               dr_err += fabs(rm->temp - rm->target);
+            }
+         }
+
+         if (group)
+            group_apply(&rm->g, rm->id, now, u);
+         automation_unit_t was = *u;
+         automation_report_t r;
+         automation_config_t uc = config;
+         if (tune)
+         {  // Settings as tuned so far
+            float v[TUNE_PARAMS] = {
+               [TUNE_HEATOVER] = config.heatover,
+               [TUNE_HEATBACK] = config.heatback,
+               [TUNE_COOLOVER] = config.coolover,
+               [TUNE_COOLBACK] = config.coolback,
+               [TUNE_SWITCHTEMP] = config.switchtemp,
+               [TUNE_PUSHTEMP] = config.pushtemp,
+               [TUNE_THERMREF] = config.thermref,
+            };
+            if (!rm->t.loaded)
+               tune_load(&rm->t, v);
+            tune_apply(&rm->t, &uc);
+         }
+         float min = u->mintarget, max = u->maxtarget;
+         automation_run(&rm->a, &uc, u, now, &r);
+         char reason[120];
+         uint8_t tuned = (tune ? tune_run(&rm->t, &r, u, isnan(u->env) ? u->home : u->env, min, max, tune, reason, sizeof(reason)) : 0);
+         if (tuned)
+         {
+            if (tuned == 1)
+               tune_changes++;
+            if (debug)
+               printf("%6.2fd tune: %s\n", now / 86400.0, reason);
+         }
+         if (group)
+         {  // Announce to all, as over MQTT, and plan if leader
+            group_member_t m;
+            group_announce(u, rm->id, rm->running, &m);
+            for (int o = 0; o < units; o++)
+               group_heard(&rooms[o].g, &m, now);
+            if (group_leader(&rm->g, rm->id, now))
+            {
+               group_lead(&rm->g, now, stagger);
+               for (int o = 0; o < units; o++)
+                  if (o != n)
+                     group_plan_heard(&rooms[o].g, &rm->g.plan, now);
+            }
+         }
+
+         if (u->mode != was.mode)
+            mode_switches++;
+         if (u->power != was.power)
+            power_cycles++;
+         if (u->fan != was.fan)
+            fan_changes++;
+         if ((u->fan != was.fan || u->mode != was.mode) && defrost_after > now)
+            defrost_changes++;  // Fan or mode change in or just after defrost
+         if (u->temp != was.temp)
+            temp_changes++;
+         if (debug && r.valid)
+         {
+            printf("%6.2fd ", now / 86400.0);
+            if (units > 1)
+               printf("%s ", rm->id);
+            printf("%s temp=%.2f min=%.2f max=%.2f approaching=%u beyond=%u samples=%u",
+                   r.hot ? "hot " : "cold", r.temp, r.min, r.max, r.approaching, r.beyond, r.samples);
+            if (r.setmode)
+               printf(" set-mode=%c", r.setmode);
+            if (r.setfan >= 0)
+               printf(" set-fan=%d", r.setfan);
+            if (r.setpower >= 0)
+               printf(" set-power=%d", r.setpower);
+            if (r.defrosts || r.excluded)
+               printf(" defrost: excluded=%u count=%u duration=%us interval=%um", r.excluded, r.defrosts, r.defrostlen,
+                      r.defrostgap / 60);
+            if (r.mpc)
+               printf(" mpc: tau=%.0fm rate=%.2fC/h drift=%.2fC/h wait=%um run=%um fan=%u predict=%.2f", r.mpctau, r.mpcrate,
+                      r.mpcdrift, r.mpcwait, r.mpcrun, r.mpcfan, r.mpcpredict);
+            if (group)
+               printf(" group: mode=%c hold=%d want=%d", u->group ? u->groupheat ? 'H' : 'C' : '-', u->hold, u->want);
+            printf("\n");
+         }
+
+         // Aircon
+         double output = 0;     // Heat in to room (W)
+         rm->power = 10;        // Standby
+         u->slave = 0;
+         if (u->power && (u->mode == FAIKIN_MODE_HEAT || u->mode == FAIKIN_MODE_COOL || u->mode == FAIKIN_MODE_AUTO))
+         {
+            double sensor = rm->temp + bias;
+            if (u->mode == FAIKIN_MODE_AUTO)
+            {
+               if (sensor > u->temp + 1)
+                  rm->cooling = 1;
+               else if (sensor < u->temp - 1)
+                  rm->cooling = 0;
+            } else
+               rm->cooling = (u->mode == FAIKIN_MODE_COOL);
+            double demand = rm->cooling ? sensor - u->temp : u->temp - sensor;
+            int other = (busy >= 0 ? busy : outdoor);
+            if (other >= 0 && other != rm->cooling)
+            {  // Outdoor unit is doing the other mode, so this unit cannot run, and reports it
+               u->slave = 1;
+               conflict++;
+               if (rm->running)
+               {
+                  rm->running = 0;
+                  rm->changed = now;
+               }
+            } else if (now >= rm->changed + minrun && rm->running != (rm->running ? demand >= -0.5 : demand > 0.5))
+            {  // Inverter, modulates down to 30%, stops when 0.5C past target, restarts 0.5C before
+               rm->running = !rm->running;
+               rm->changed = now;
+               if (rm->running)
+               {
+                  compressor_cycles++;
+                  if (laststart && now < laststart + stagger)
+                     close_starts++;
+                  laststart = now;
+               }
+            }
+            if (rm->running)
+            {
+               double fraction = 0.3 + demand / 3;
+               if (fraction > 1)
+                  fraction = 1;
+               if (fraction < 0.3)
+                  fraction = 0.3;
+               if (rm->d.out.active)
+               {  // Demand limits output, econo a bit more
+                  double limit = rm->d.out.demand / 100.0 * (rm->d.out.econo ? 0.8 : 1);
+                  if (fraction > limit)
+                     fraction = limit;
+               }
+               double fanfactor = (u->fan >= 1 && u->fan <= 5) ? 0.5 + 0.1 * u->fan : 1.0;
+               output = capacity * fraction * fanfactor;
+               if (defrost && !rm->cooling && out < 5 && !rm->defrosting && ++rm->runfor >= defrost * 60)
+               {  // Start defrost
+                  rm->defrosting = now + defrostlen;
+                  rm->runfor = 0;
+                  defrosts++;
+               }
+               if (rm->defrosting)
+                  output = -capacity * 0.2;     // Reverse cycle, indoor fan stopped, but coil takes some heat from the room
+               thermal += output / 3600;
+               electrical += output / cop / 3600;
+               rm->power = output / cop;
+               runtime++;
+               if (rm->cooling)
+                  output = -output;
+               busy = rm->cooling;
+            }
+         } else if (rm->running)
+         {
+            rm->running = 0;
+            rm->changed = now;
+         }
+         if (rm->defrosting && (rm->defrosting <= now || !rm->running))
+         {
+            rm->defrosting = 0;
+            defrost_after = now + 2 * config.tsample;
+         }
+         if (rm->defrosting)
+         {
+            defrost_after = now + 2 * config.tsample;
+            defrost_err += fabs(rm->temp - rm->target);
+         }
+         if (!hidedefrost && defrost)
+         {  // What the aircon reports
+            u->antifreeze = (rm->defrosting ? 1 : 0);
+            u->comp = (rm->running ? 30 : 0);
+            u->liquid = (rm->defrosting ? 0 : rm->running && !rm->cooling ? rm->temp + 15 : rm->temp);
+         }
+
+         // Room
+         rm->temp += (output + rm->gains - loss * (rm->temp - out)) / (mass * 1000);
+
+         // Comfort, distance from target, and time outside the band
+         double err = rm->temp - rm->target;
+         err_sum += fabs(err);
+         err_sq += err * err;
+         if (fabs(err) > margin)
+            outside_band++;
+
+         if (logperiod && !(now % logperiod))
+         {
+            printf("%u,", now);
+            if (units > 1)
+               printf("%d,", n);
+            printf("%.2f,%.2f,%.1f,%.2f,%d,%d,%d,%.1f,%d,%.0f\n", out, rm->temp, u->env, u->home,
+                   u->power, u->mode, u->fan, u->temp, u->action, output);
+         }
+      }
+      outdoor = busy;
+   }
+
+   double total = (double)end * units;
+   printf("Simulated %.1f days", end / 86400.0);
+   if (units > 1)
+      printf(", %d units%s", units, group ? " in a group" : "");
+   printf("\n");
+   printf("Comfort: mean error %.2fC, rms error %.2fC, outside %.1f±%.1fC %.1f%% of time\n",
+          err_sum / total, sqrt(err_sq / total), target, margin, outside_band * 100 / total);
+   printf("Changes: %u mode switches, %u power on/off, %u fan changes, %u target changes\n",
+          mode_switches, power_cycles, fan_changes, temp_changes);
+   printf("Compressor: %u starts, running %.1f%% of time\n", compressor_cycles, runtime * 100 / total);
+   printf("Energy: %.1fkWh delivered, %.1fkWh used (COP %.1f)\n", thermal / 1000, electrical / 1000, cop);
+   if (dr_seconds)
+      printf("Demand response: %.1f hours, mean power %.0fW, cap %.0fW, over cap %.1f%% of time, comfort override %.1f%%, mean error %.2fC\n",
+             dr_seconds / 3600.0, dr_wh * 3600 / dr_seconds, dr_capwh * 3600 / dr_seconds, dr_over * 100.0 / dr_seconds,
+             dr_comfort * 100.0 / dr_seconds, dr_err / dr_seconds);
+   if (tune)
+   {
+      printf("Tuned: %u changes", tune_changes);
+      for (int p = 0; p < TUNE_PARAMS; p++)
+         printf(", %s %g", tune_name(p), rooms[0].t.base[p]);
+      printf("\n");
+   }
+   if (defrosts)
+      printf("Defrost: %u defrosts, %u fan/mode changes in or soon after\n", defrosts, defrost_changes);
+   if (sensors > 1 || dead || wild || fusion.weight[FUSION_HOME])
+      printf("Sensors: %d per room, no env %.1f%% of time, mean confidence %.0f%%\n", sensors, noenv * 100 / total,
+             confidence * 100 / total);
+   if (units > 1)
+      printf("Outdoor: %.1f%% of unit time in mode conflict, %u starts within %ds of another\n", conflict * 100 / total,
+             close_starts, stagger);
+
+   return 0;
+}
@@ -10,15 +10,41 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <math.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#endif
 
 #include "main/daikin_s21.h"
 #include "faikin-s21.h"
 #include "osal.h"
+#include "fault.h"
 
 const char *port     = NULL; // Serial port to use
-const char *settings = NULL; // Settings file to load
+const char *settings[256];    // Settings files to load, in turn for each unit with --units
+static int nsettings = 0;
+static int units     = 0;    // Units in one process, each on its own pty, 0 for one on -p or --pty
+const char *shmname = SHARED_MEM_NAME; // Shared memory name, for control tool
 static int debug     = 0;    // Dump commands and responses (short form)
 static int dump      = 0;    // Raw dump
+static int pty       = 0;    // Use a pty rather than a serial port
+static int nothrottle = 0;   // No line rate throttle on pty
+static struct throttle rx, tx; // Line rate throttle
+
+// Plant model, evolves home, outside, inlet, fan and compressor rpm, and consumption
+static int plant       = 0;     // Enabled
+static double speed    = 1;     // Simulated seconds per real second
+static double swing    = 4;     // Outside daily swing either side of initial outside (C)
+static double mass     = 1500;  // Room thermal mass (kJ/K)
+static double loss     = 50;    // Room heat loss to outside (W/K)
+static double gains    = 200;   // Internal gains (W)
+static double capacity = 2500;  // Max heating/cooling (W)
+static double cop      = 3.5;   // Coefficient of performance
+static int minrun      = 180;   // Compressor minimum run and rest time (s)
 
 // Initial state of a simulated A/C. Defaults are chosen to be distinct;
 // can be changed via command line.
@@ -114,10 +140,20 @@ static void usage(const char *progname)
 {
 	printf("Usage: %s <simulator options> <state options>\n"
 	       "Available simulator options:\n"
-		   " -p or --port <name> - serial port to use (mandatory option)\n"
-		   " -s or --settings <filename> - Load initial state data from the file\n"
+		   " -p or --port <name> - serial port to use (mandatory option, unless --pty)\n"
+		   " --pty - Create a pseudo terminal and print its path, instead of a serial port, paced at the line rate\n"
+		   " --nothrottle - No line rate pacing on --pty\n"
+		   " --units <n> - Simulate n units, each on its own pty, with state in a shared memory array\n"
+		   " -s or --settings <filename> - Load initial state data from the file, can be repeated, used in turn by --units\n"
+		   " -n or --name <name> - Shared memory name, to run several simulators (default %s)\n"
+		   " --plant - Model the room and aircon, so home, outside, inlet, fan and compressor rpm and consumption evolve\n"
+		   " --speed <n> - Simulated seconds per real second for --plant\n"
+		   " --mass <kJ/K>, --loss <W/K>, --gains <W> - Room thermal mass, loss to outside, internal gains\n"
+		   " --capacity <W>, --cop <n>, --minrun <s> - Aircon capacity, efficiency, compressor minimum run and rest\n"
+		   " --swing <C> - Outside daily swing either side of the initial outside temperature\n"
 		   " -v or --debug - Enable dumping all commands\n" 
-		   " -V or --verbose - Enable dumping all protocol data\n", progname);
+		   " -V or --verbose - Enable dumping all protocol data\n", progname, SHARED_MEM_NAME);
+	fault_help();
 	state_options_help();
 	printf("State options, given on command line, override options, specified in the settings file\n");
 }
@@ -132,9 +168,15 @@ static const char *get_string_arg(int argc, const char **argv)
 	return argv[1];
 }
 
+static double get_double_arg(int argc, const char **argv)
+{
+	return atof(get_string_arg(argc, argv));
+}
+
 static unsigned int parse_program_option(const char *progname, int argc, const char **argv)
 {
 	const char *opt;
+	int n;
 
 	if (argc < 1)
 		return 0;
@@ -147,8 +189,51 @@ static unsigned int parse_program_option(const char *progname, int argc, const c
 	} else if (!strcmp(opt, "-p") || !strcmp(opt, "--port")) {
 		port = get_string_arg(argc, argv);
 		return 2;
+	} else if (!strcmp(opt, "--pty")) {
+		pty = 1;
+		return 1;
+	} else if (!strcmp(opt, "--nothrottle")) {
+		nothrottle = 1;
+		return 1;
+	} else if (!strcmp(opt, "--units")) {
+		units = atoi(get_string_arg(argc, argv));
+		return 2;
 	} else if (!strcmp(opt, "-s") || !strcmp(opt, "--settings")) {
-		settings = get_string_arg(argc, argv);
+		if (nsettings == sizeof(settings) / sizeof(*settings)) {
+			fprintf(stderr, "Too many settings files\n");
+			exit(255);
+		}
+		settings[nsettings++] = get_string_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "--plant")) {
+		plant = 1;
+		return 1;
+	} else if (!strcmp(opt, "--speed")) {
+		speed = get_double_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "--swing")) {
+		swing = get_double_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "--mass")) {
+		mass = get_double_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "--loss")) {
+		loss = get_double_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "--gains")) {
+		gains = get_double_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "--capacity")) {
+		capacity = get_double_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "--cop")) {
+		cop = get_double_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "--minrun")) {
+		minrun = atoi(get_string_arg(argc, argv));
+		return 2;
+	} else if (!strcmp(opt, "-n") || !strcmp(opt, "--name")) {
+		shmname = get_string_arg(argc, argv);
 		return 2;
 	} else if (!strcmp(opt, "-v") || !strcmp(opt, "--debug")) {
 		debug = 1;
@@ -156,8 +241,10 @@ static unsigned int parse_program_option(const char *progname, int argc, const c
 	} else if (!strcmp(opt, "-V") || !strcmp(opt, "--verbose")) {
 		dump = 1;
 		return 1;
+	} else if ((n = fault_option(argc, argv))) {
+		return n;
 	} else if (opt[0] == '-') {
-		fprintf(stderr, "%s: unknown option\n");
+		fprintf(stderr, "%s: unknown option\n", opt);
 		exit(255);
 	}
 	return 0;
@@ -224,13 +311,193 @@ static void hexdump(const char *header, const unsigned char *buf, unsigned int l
    }
 }
 
-static void serial_write(int p, const unsigned char *response, unsigned int pkt_len)
+// Plant model state, one per unit
+struct plant
+{
+   unsigned long long last;  // time_us() stepped to
+   unsigned int t;           // Simulated time of day (s)
+   double room;              // Room temp (C)
+   double mean;              // Mean outside temp (C)
+   double coil;              // Indoor coil temp (C), reported as inlet
+   double wh;                // Energy not yet counted in consumption (Wh)
+   int running;              // Compressor running
+   int cooling;              // Last heat/cool choice in auto
+   unsigned int changed;     // Simulated seconds since compressor started or stopped
+   int home, outside;        // As last set in state, to spot changes from s21-control
+};
+
+// Step the plant model to now, called before each command so state is current when reported
+static void plant_run(struct plant *pl, struct S21State *state)
+{
+   unsigned long long now = time_us();
+   unsigned int steps;
+
+   if (!pl->last) {
+      time_t clock = time(NULL);
+      struct tm *tm = localtime(&clock);
+
+      pl->t = tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec;
+      pl->changed = minrun;
+      pl->last = now;
+      pl->home = state->home + 1;
+      pl->outside = state->outside + 1;
+   }
+   if (state->home != pl->home) {
+      // Set, e.g. by s21-control, so room starts from there
+      pl->room = state->home / 10.0;
+      pl->coil = state->inlet / 10.0;
+      pl->home = state->home;
+   }
+   if (state->outside != pl->outside) {
+      pl->mean = state->outside / 10.0 - swing * sin(2 * M_PI * (pl->t / 86400.0 - 0.375));
+      pl->outside = state->outside;
+   }
+   steps = (now - pl->last) * speed / 1000000;
+   if (!steps)
+      return;
+   pl->last += steps * 1000000 / speed;
+   if (steps > 86400)
+      steps = 86400; // Idle a long time, a day is enough to settle
+
+   while (steps--) {
+      double out = pl->mean + swing * sin(2 * M_PI * (pl->t / 86400.0 - 0.375));
+      double output = 0; // Heat in to room (W)
+      double fraction = 0;
+      double watts = 5;  // Standby
+      int cool = -1;     // Compressor wanted for cooling (1) or heating (0)
+
+      pl->t = (pl->t + 1) % 86400;
+      pl->changed++;
+      if (state->power) {
+         if (state->mode == 1)
+            cool = 0;
+         else if (state->mode == 2 || state->mode == 7)
+            cool = 1;
+         else if (state->mode == 3) {
+            if (pl->room > state->temp + 1)
+               pl->cooling = 1;
+            else if (pl->room < state->temp - 1)
+               pl->cooling = 0;
+            cool = pl->cooling;
+         }
+      }
+      if (cool >= 0) {
+         double demand = cool ? pl->room - state->temp : state->temp - pl->room;
+
+         // Inverter, modulates down to 30%, stops when 0.5C past target, restarts 0.5C before
+         if (pl->changed >= minrun && pl->running != (pl->running ? demand >= -0.5 : demand > 0.5)) {
+            pl->running = !pl->running;
+            pl->changed = 0;
+            if (debug)
+               printf("Plant: compressor %s, room %.1f outside %.1f\n", pl->running ? "started" : "stopped", pl->room, out);
+         }
+         if (pl->running) {
+            fraction = 0.3 + demand / 3;
+            if (state->powerful || fraction > 1)
+               fraction = 1;
+            if (fraction < 0.3)
+               fraction = 0.3;
+            if (state->mode == 7)
+               fraction = 0.3; // Dry, slow cooling
+            if (state->eco && fraction > 0.8)
+               fraction = 0.8;
+            if (state->demand && fraction > state->demand / 100.0)
+               fraction = state->demand / 100.0;
+            double fanfactor = (state->fan >= 1 && state->fan <= 5) ? 0.5 + 0.1 * state->fan : state->fan == 6 ? 0.6 : 1.0;
+            output = capacity * fraction * fanfactor;
+            watts += output / cop;
+            if (cool)
+               output = -output;
+         }
+      } else if (pl->running) {
+         pl->running = 0;
+         pl->changed = 0;
+      }
+      if (state->power)
+         watts += 20; // Indoor fan
+
+      pl->room += (output + gains - loss * (pl->room - out)) / (mass * 1000);
+      pl->coil += ((pl->running ? (cool ? pl->room - 5 - 10 * fraction : pl->room + 10 + 15 * fraction) : pl->room) - pl->coil) / 60;
+      pl->wh += watts / 3600;
+
+      if (!steps) {
+         // What the aircon reports
+         state->home = lround(pl->room * 10);
+         state->outside = lround(out * 2) * 5; // Outside sensor is coarse
+         state->inlet = lround(pl->coil * 10);
+         state->comprpm = pl->running ? lround(20 + 70 * fraction) : 0;
+         if (!state->power)
+            state->fanrpm = 0;
+         else if (state->fan >= 1 && state->fan <= 5)
+            state->fanrpm = 50 + 14 * state->fan;
+         else if (state->fan == 6)
+            state->fanrpm = 45;
+         else
+            state->fanrpm = pl->running ? lround(60 + 60 * fraction) : 45;
+      }
+      while (pl->wh >= 100) {
+         // Counter in 100Wh units
+         state->consumption++;
+         pl->wh -= 100;
+      }
+   }
+   pl->home = state->home;
+   pl->outside = state->outside;
+}
+
+#ifdef __linux__
+// Several units in one process, each on its own pty, served from one epoll loop
+struct unit
+{
+   int fd;
+   struct S21State *state;        // In the shared memory array
+   unsigned char buf[256];        // Frame being received
+   int len;
+   int ack;                       // Reply sent, so expecting ACK
+   struct throttle rx, tx;
+   unsigned char out[512];        // Bytes to send, paced by when
+   unsigned long long when[512];  // When each byte is done on the line (us)
+   int outlen, outpos;
+   struct plant plant;
+};
+
+static struct unit *farm_unit; // Unit being processed, so output is queued for it
+#endif
+
+// Send as is, after delay (ms)
+static void serial_send(int p, const unsigned char *response, unsigned int pkt_len, unsigned int delay)
 {
    int l;
 
    hexdump("Tx", response, pkt_len);
 
-   l = write(p, response, pkt_len);
+#ifdef __linux__
+   if (farm_unit) {
+      struct unit *u = farm_unit;
+      unsigned long long now = time_us() + delay * 1000ULL;
+
+      if (u->tx.us && u->tx.next < now)
+         u->tx.next = now;
+
+      for (l = 0; l < pkt_len && u->outlen < sizeof(u->out); l++) {
+         u->out[u->outlen] = response[l];
+         u->when[u->outlen++] = u->tx.us ? throttle_slot(&u->tx) : now;
+      }
+      return;
+   }
+#endif
+
+   if (delay)
+      usleep(delay * 1000);
+   if (tx.us) {
+      // Paced, a byte at a time
+      for (l = 0; l < pkt_len; l++) {
+         throttle_wait(&tx);
+         if (write(p, response + l, 1) != 1)
+            break;
+      }
+   } else
+      l = write(p, response, pkt_len);
 
    if (l < 0) {
 	  perror("Serial write failed");
@@ -242,6 +509,20 @@ static void serial_write(int p, const unsigned char *response, unsigned int pkt_
    }
 }
 
+// Send, with any faults injected
+static void serial_write(int p, const unsigned char *response, unsigned int pkt_len)
+{
+   unsigned char faulty[256 + 2 * 256];
+   unsigned int delay = 0;
+
+   if (fault_active() && pkt_len <= 256) {
+      // Checksum is before ETX, not in ACK/NAK
+      pkt_len = fault_tx(response, pkt_len, pkt_len > 1 ? 2 : 0, faulty, &delay);
+      response = faulty;
+   }
+   serial_send(p, response, pkt_len, delay);
+}
+
 static void s21_nak(int p, unsigned char *buf, int len)
 {
    static unsigned char response = NAK;
@@ -326,7 +607,7 @@ static void send_temp(int p, unsigned char *response, const unsigned char *cmd,
 {
 	char buf[5];
 	
-	snprintf(buf, sizeof(buf), "%+d", value);
+	snprintf(buf, sizeof(buf), "%+04d", value);
 	if (debug)
 	   printf(" -> %s = %s\n", name, buf);
 
@@ -368,11 +649,826 @@ static void send_hex(int p, unsigned char *response, const unsigned char *cmd, u
     response[S21_PAYLOAD_OFFSET + 0] = buf[3];
 	response[S21_PAYLOAD_OFFSET + 1] = buf[2];
 	response[S21_PAYLOAD_OFFSET + 2] = buf[1];
-	response[S21_PAYLOAD_OFFSET + 2] = buf[0];
+	response[S21_PAYLOAD_OFFSET + 3] = buf[0];
 			
 	s21_reply(p, response, cmd, S21_PAYLOAD_LEN);
 }
 
+// Command is in the list to NAK, matched on the start of the command, e.g. FU55 or RN
+static int s21_naklisted(const struct S21State *state, const unsigned char *buf, int len)
+{
+   const char *p = state->nak;
+
+   while (*p) {
+      int l;
+
+      while (*p == ' ')
+         p++;
+      for (l = 0; p[l] && p[l] != ' '; l++);
+      if (l && S21_CMD0_OFFSET + l <= len - 2 && !memcmp(buf + S21_CMD0_OFFSET, p, l))
+         return 1;
+      p += l;
+   }
+   return 0;
+}
+
+// Process a command frame, return 1 if a reply was sent, which the controller should ACK
+static int s21_command(int p, struct S21State *state, unsigned char *buf, int len)
+{
+   unsigned char response[256];
+
+   unsigned char chksum = s21_checksum(buf, len);
+   if (chksum != buf[len - 2]) {
+      printf("Bad checksum: 0x%02X vs 0x%02X\n", chksum, buf[len - 2]);
+      buf[0] = 0; // Just silently drop the packet. My FTXF20D does this.
+      return 0;
+   }
+
+   if (debug) {
+     if (len < S21_MIN_PKT_LEN) {
+         // It's possible to have 1-character commands. We know 'M' (below)
+         printf("Got command: %c\n", buf[S21_CMD0_OFFSET]);
+     } else {
+         printf("Got command: %c%c", buf[S21_CMD0_OFFSET], buf[S21_CMD1_OFFSET]);
+         hexdump_raw(&buf[S21_PAYLOAD_OFFSET], len - S21_MIN_PKT_LEN);
+         putchar('\n');
+     }
+   }
+
+   if (s21_naklisted(state, buf, len)) {
+      s21_nak(p, buf, len);
+      return 0;
+   }
+
+   if (len > S21_MIN_PKT_LEN && buf[S21_CMD0_OFFSET] == 'D') {
+      // Set value. No response expected, just ACK.
+      s21_ack(p);
+
+      switch (buf[S21_CMD1_OFFSET]) {
+      case '1':
+         state->power = buf[S21_PAYLOAD_OFFSET + 0] - '0'; // ASCII char
+         state->mode  = buf[S21_PAYLOAD_OFFSET + 1] - '0'; // See AC_MODE_*
+         state->temp  = s21_decode_target_temp(buf[S21_PAYLOAD_OFFSET + 2]);
+         state->fan   = s21_decode_fan(buf[S21_PAYLOAD_OFFSET + 3]);
+
+         printf(" Set power %d mode %d temp %.1f fan %d\n", state->power, state->mode, state->temp, state->fan);
+         break;
+      case '5':
+         state->swing = buf[S21_PAYLOAD_OFFSET + 0] - '0'; // ASCII char
+         state->humidity = buf[S21_PAYLOAD_OFFSET + 2];
+         // Payload offset 1 equals to '?' for "on" and '0' for "off
+
+         printf(" Set swing %d humidity %d byte[1] 0x%02X byte[3] 0x%02X\n", state->swing, state->humidity,
+                buf[S21_PAYLOAD_OFFSET + 1], buf[S21_PAYLOAD_OFFSET + 3]);
+         break;
+      case '6':
+         state->powerful = (buf[S21_PAYLOAD_OFFSET] & 0x02) ? 1 : 0;
+         state->comfort  = (buf[S21_PAYLOAD_OFFSET] & 0x40) ? 1 : 0;
+         state->quiet    = (buf[S21_PAYLOAD_OFFSET] & 0x80) ? 1 : 0;
+         state->streamer = (buf[S21_PAYLOAD_OFFSET + 1] & 0x80) ? 1 : 0;
+         state->sensor   = (buf[S21_PAYLOAD_OFFSET + 3] & 0x08) ? 1 : 0;
+         state->led      = (buf[S21_PAYLOAD_OFFSET + 3] & 0x04) ? 1 : 0;
+
+         printf(" Set powerful %d comfort %d quiet %d streamer %d sensor %d led %d\n",
+                state->powerful, state->comfort, state->quiet, state->streamer,
+                state->sensor, state->led);
+         break;
+      case '7':
+          state->demand = buf[S21_PAYLOAD_OFFSET] - 0x30;
+          state->eco = buf[S21_PAYLOAD_OFFSET + 1]  == '2'; // '2' or '0'
+
+          printf(" Set demand %d eco %d spare bytes", state->demand, state->eco);
+          hexdump_raw(&buf[S21_PAYLOAD_OFFSET + 2], S21_PAYLOAD_LEN - 2);
+          putchar('\n');
+          break;
+      default:
+         printf(" Set unknown:");
+         hexdump_raw(buf, len);
+         printf("\n");
+         break;
+      }
+
+      buf[0] = 0;
+      return 0;
+   }
+
+   if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
+       buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'U' && buf[S21_V3_CMD3_OFFSET] == '5') {
+      // FYx5 - v3.40 commands
+      switch (buf[S21_V3_CMD2_OFFSET])
+      {
+      case '0':
+         // FY05 - Model name, encoded as ASCII. Strangely, in "straight"
+         unknown_v3_cmd(p, response, buf, state->FU05, sizeof(state->FU05));
+         break;
+      case '1':
+         unknown_v3_cmd(p, response, buf, state->FU15, sizeof(state->FU15));
+         break;
+      case '2':
+         unknown_v3_cmd(p, response, buf, state->FU25, sizeof(state->FU25));
+         break;
+      case '3':
+         unknown_v3_cmd(p, response, buf, state->FU35, sizeof(state->FU35));
+         break;
+      case '4':
+         unknown_v3_cmd(p, response, buf, state->FU45, sizeof(state->FU45));
+         break;
+      default:
+         s21_nak(p, buf, len);
+         return 0;
+      }
+   } else if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
+       buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'U' && buf[S21_V3_CMD2_OFFSET] == '0') {
+      // FY0x are protocol v3 commands. 4-character codes.
+      switch (buf[S21_V3_CMD3_OFFSET])
+      {
+      case '0':
+         // FU00 - Special modes availability
+         // byte 0 - "Powerful" mode availability flag. 0x33 - enabled, 0x30 - disabled
+         // byte 1 - "Econo" mode availability flag. 0x33 - enabled, 0x30 - disabled
+         // byte 3 - unknown. Set to 0x33 (enabled) on FTXF20D5V1B, but no mode_info flag was found.
+         // byte 3 - unknown
+         // byte 4 - unknown. Set to 0x33 (enabled) on FTXF20D5V1B, but no mode_info flag was found.
+         // byte 5 - "Streamer" mode availability flag. 0x33 - enabled, 0x30 - disabled
+         // the rest - unknown, could be reserved.
+         unknown_v3_cmd(p, response, buf, state->FU00, sizeof(state->FU00));
+         break;
+      case '2':
+         // FU02 - temperature ranges (perhaps). Displayed in /aircon/get_model_info:
+         // byte 1 - Unknown parameter (atlmt_h). Valid values are from 0xA0 to 0xB0 (inclusive).
+         //          Actual value is calculated as: atlmt_l = (byte - 0xA0) / 2.0.
+         //          If byte value is outside of the valid range, atlmt_h=0 is shown.
+         // byte 2 - Maximum allowed temperature for Heat mode (hmlmt_l). Valid values
+         //          are from 0x30 to 0x6F (inclusive); Actual value is calculated as:
+         //          hmlmt_l = (byte - 0x30) / 2.0 + 10.0. If byte value is outside of
+         //          the valid range, the hmlmt_t parameter is not shown.
+         unknown_v3_cmd(p, response, buf, state->FU02, sizeof(state->FU02));
+         break;
+      case '4':
+         unknown_v3_cmd(p, response, buf, state->FU04, sizeof(state->FU04));
+         break;
+      default:
+         s21_nak(p, buf, len);
+         return 0;
+     }
+   } else if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
+              buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'Y' && buf[S21_V3_CMD3_OFFSET] == '0') {
+     char fmt_buffer[5];
+     // FYx0 v3 commands. BRP069B41 polls these only once per session and caches values, so
+     // these are clearly some immutable identification codes.
+     switch (buf[S21_V3_CMD2_OFFSET])
+     {
+     case '0':
+         // FY00 - protocol version for v3+. Inverted spelling of XXYY, where XX = major, YY - minor
+         // F8 command still replies v2 for newer protocols; real v2 is detected by responding NAK
+         // to this command.
+         snprintf(fmt_buffer, sizeof(fmt_buffer), "%02u%02u", state->protocol_major, state->protocol_minor);
+         if (debug)
+             printf(" -> Protocol version (new) = %s\n", fmt_buffer);
+
+         // Order traditionally inverted
+         response[S21_V3_PAYLOAD_OFFSET + 0] = fmt_buffer[3];
+         response[S21_V3_PAYLOAD_OFFSET + 1] = fmt_buffer[2];
+         response[S21_V3_PAYLOAD_OFFSET + 2] = fmt_buffer[1];
+         response[S21_V3_PAYLOAD_OFFSET + 3] = fmt_buffer[0];
+
+         s21_v3_reply(p, response, buf, S21_PAYLOAD_LEN);
+         break;
+     case '1':
+         unknown_v3_cmd(p, response, buf, state->FY10, sizeof(state->FY10));
+         break;
+     case '2':
+         unknown_v3_cmd(p, response, buf, state->FY20, sizeof(state->FY20));
+         break;
+     default:
+         s21_nak(p, buf, len);
+         return 0;
+     }
+   } else if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
+              buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'X' && buf[S21_V3_CMD3_OFFSET] == '0') {
+      // FXx0
+      switch (buf[S21_V3_CMD2_OFFSET])
+      {
+      case '0':
+         unknown_v3_cmd(p, response, buf, state->FX00, sizeof(state->FX00));
+         break;
+      case '1':
+         unknown_v3_cmd(p, response, buf, state->FX10, sizeof(state->FX10));
+         break;
+      case '2':
+         unknown_v3_cmd(p, response, buf, state->FX20, sizeof(state->FX20));
+         break;
+      case '3':
+         unknown_v3_cmd(p, response, buf, state->FX30, sizeof(state->FX30));
+         break;
+      case '4':
+         unknown_v3_cmd(p, response, buf, state->FX40, sizeof(state->FX40));
+         break;
+      case '5':
+         unknown_v3_cmd(p, response, buf, state->FX50, sizeof(state->FX50));
+         break;
+      case '6':
+         unknown_v3_cmd(p, response, buf, state->FX60, sizeof(state->FX60));
+         break;
+      case '7':
+         unknown_v3_cmd(p, response, buf, state->FX70, sizeof(state->FX70));
+         break;
+      case '8':
+         unknown_v3_cmd(p, response, buf, state->FX80, sizeof(state->FX80));
+         break;
+      case '9':
+         unknown_v3_cmd(p, response, buf, state->FX90, sizeof(state->FX90));
+         break;
+      case 'A':
+         unknown_v3_cmd(p, response, buf, state->FXA0, sizeof(state->FXA0));
+         break;
+      case 'B':
+         unknown_v3_cmd(p, response, buf, state->FXB0, sizeof(state->FXB0));
+         break;
+      case 'C':
+         unknown_v3_cmd(p, response, buf, state->FXC0, sizeof(state->FXC0));
+         break;
+      case 'D':
+         unknown_v3_cmd(p, response, buf, state->FXD0, sizeof(state->FXD0));
+         break;
+      case 'E':
+         unknown_v3_cmd(p, response, buf, state->FXE0, sizeof(state->FXE0));
+         break;
+      case 'F':
+         unknown_v3_cmd(p, response, buf, state->FXF0, sizeof(state->FXF0));
+         break;
+      default:
+         s21_nak(p, buf, len);
+         return 0;
+      }
+   } else if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
+              buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'X' && buf[S21_V3_CMD3_OFFSET] == '1') {
+      // FXx1
+      switch (buf[S21_V3_CMD2_OFFSET])
+      {
+      case '0':
+         unknown_v3_cmd(p, response, buf, state->FX01, sizeof(state->FX01));
+         break;
+      case '1':
+         unknown_v3_cmd(p, response, buf, state->FX11, sizeof(state->FX11));
+         break;
+      case '2':
+         unknown_v3_cmd(p, response, buf, state->FX21, sizeof(state->FX21));
+         break;
+      case '3':
+         unknown_v3_cmd(p, response, buf, state->FX31, sizeof(state->FX31));
+         break;
+      case '4':
+         unknown_v3_cmd(p, response, buf, state->FX41, sizeof(state->FX41));
+         break;
+      case '5':
+         unknown_v3_cmd(p, response, buf, state->FX51, sizeof(state->FX51));
+         break;
+      case '6':
+         unknown_v3_cmd(p, response, buf, state->FX61, sizeof(state->FX61));
+         break;
+      case '7':
+         unknown_v3_cmd(p, response, buf, state->FX71, sizeof(state->FX71));
+         break;
+      case '8':
+         unknown_v3_cmd(p, response, buf, state->FX81, sizeof(state->FX81));
+         break;
+      default:
+         s21_nak(p, buf, len);
+         return 0;
+      }
+   } else if (len >= S21_FRAMING_LEN + 6 && !memcmp(&buf[S21_CMD0_OFFSET], "VS000M", 6)) {
+      // This is sent by BRP069B41 for protocol v3. Note non-standard response form
+      // (no first byte increment). Purpose is currently unknown.
+      if (debug) {
+         printf(" -> unknown ('VS000M') =");
+         hexdump_raw(state->VS000M, sizeof(state->VS000M));
+         putchar('\n');
+      }
+
+      response[S21_CMD0_OFFSET] = 'V';
+      response[S21_CMD1_OFFSET] = 'S';
+
+      memcpy(&response[S21_PAYLOAD_OFFSET], state->VS000M, sizeof(state->VS000M));
+      s21_nonstd_reply(p, response, 2 + sizeof(state->VS000M));
+   } else if (len > S21_FRAMING_LEN && buf[S21_CMD0_OFFSET] == 'M') {
+     // One-character command.
+     // This is sent by BRP069B41 for protocol < v3 and response is mandatory.
+     // The controller loops forever if NAK is received.
+     // I experimentally found out that the A/C just swallows any extra bytes
+     // and always responds with the same data.
+     // All my AC's (v2 and v3) respond with ASCII 'FFFF', however from reverse
+     // engineering thread we know that v0 conditioners have 4 hex digits here,
+     // which look similar to FC response from v2 conditioners; and they don't
+     // support F8. Therefore our best guess is that this command returns
+     // model code for v0/v1 protocol. 'M' very well stands for 'Model'.
+     if (debug)
+         printf(" -> unknown ('M') = 0x%02X 0x%02X 0x%02X 0x%02X\n",
+                state->M[0], state->M[1], state->M[2], state->M[3]);
+
+     response[S21_CMD0_OFFSET] = 'M';
+     response[2] = state->M[0];
+     response[3] = state->M[1];
+     response[4] = state->M[2];
+     response[5] = state->M[3];
+
+     s21_nonstd_reply(p, response, 5);
+   } else if (len >= S21_MIN_PKT_LEN && buf[S21_CMD0_OFFSET] == 'F') {
+      // Query control settings, common commands.
+      switch (buf[S21_CMD1_OFFSET]) {
+      case '1':
+         if (debug)
+            printf(" -> power %d mode %d temp %.1f\n", state->power, state->mode, state->temp);
+         response[3] = state->power + '0'; // sent as ASCII
+         response[4] = state->mode + '0';
+         // 18.0 + 0.5 * (signed) (payload[2] - '@')
+         response[5] = s21_encode_target_temp(state->temp);
+         response[6] = s21_encode_fan(state->fan);
+
+         s21_reply(p, response, buf, S21_PAYLOAD_LEN);
+         break;
+      case '2':
+         // Optional features. Displayed in /aircon/get_model_info:
+         // byte 0:
+         // - bit 0 - set to 1 on CTXM60RVMA, CTXM35RVMA. BRP069B41 apparently ignores it.
+         // - bit 2 - Swing (any kind) is avaiiable
+         // - bit 3 - Horizontal swing is available. 0 = vertical only
+         //   Swing options are only effective when "enable fan controls" bit in FK command
+         //   is reported as 1.
+         // byte 1:
+         // - bit 3: 0 => type=C, 1 => type=N - unknown
+         // byte 2:
+         // - bit 7: Becomes 1 after DJ command is issued
+         // byte 3: Something about humidity sensor, complicated:
+         // - bit 1: humd=<bool> - "Humidify" operation mode is available
+         // - bit 4: Humidity setting is available for "heat" and "auto" modes
+         //   0 => s_humd=165 when bit 1 == 1, or s_humd=0 when bit 1 == 0
+         //   1 => s_humd=183 when bit 1 == 1, or s_humd=146 when bit 1 == 0
+         //   s_humd is forced to 16 regardless of bits 1 and 4 when byte 2 bit 1
+         //   in FK command (see below) is set to 1
+         // Some known responses:
+         // CTXM60RVMA, CTXM35RVMA : 3D 3B 00 80
+         // FTXF20D5V1B, ATX20K2V1B: 34 3A 00 80
+         unknown_cmd(p, response, buf, state->F2, S21_PAYLOAD_LEN);
+         break;
+      case '3':
+         // Actually on/off timer. Still part of the profile because we may be
+         // interested in byte 3; and also default values are different per unit.
+         unknown_cmd(p, response, buf, state->F3, S21_PAYLOAD_LEN);
+         break;
+      case '4':
+         // byte[2] - A/C sometimes reports 0xA0, which then self-resets to 0x80
+         // - bit 5: if set to 1, BRP069B41 stops controlling the A/C and sets
+         //          error code 252. Some sort of "not ready" flag
+         // - bit 7: BRP069B41 seems to ignore it.
+         unknown_cmd(p, response, buf, state->F4, S21_PAYLOAD_LEN);
+         break;
+      case '5':
+         if (debug)
+            printf(" -> swing %d\n", state->swing);
+         response[3] = '0' + state->swing;
+         response[4] = 0x3F;
+         response[5] = state->humidity;
+         response[6] = 0x80;
+
+         s21_reply(p, response, buf, S21_PAYLOAD_LEN);
+         break;
+      case '6':
+         if (debug)
+            printf(" -> powerful ('F6') %d\n", state->powerful);
+         response[S21_PAYLOAD_OFFSET] = '0'; // Powerful, comfort, quiet
+         response[S21_PAYLOAD_OFFSET + 1] = '0'; // Streamer
+         response[S21_PAYLOAD_OFFSET + 2] = '0'; // Reserved ?
+         response[S21_PAYLOAD_OFFSET + 3] = '0'; // Sensor, LED
+         if (state->powerful)
+            response[S21_PAYLOAD_OFFSET] |= 0x02;
+         if (state->comfort)
+            response[S21_PAYLOAD_OFFSET] |= 0x40;
+         if (state->quiet)
+            response[S21_PAYLOAD_OFFSET] |= 0x80;
+         if (state->streamer)
+             response[S21_PAYLOAD_OFFSET + 1] |= 0x80;
+         if (state->sensor)
+             response[S21_PAYLOAD_OFFSET + 3] |= 0x08;
+         if (state->led)
+             response[S21_PAYLOAD_OFFSET + 3] |= 0x0C;
+
+         s21_reply(p, response, buf, S21_PAYLOAD_LEN);
+         break;
+      case '7':
+         // F7 - demand and eco modes
+         // Demand mode setting is a "percentage of energy saving", i. e. 0 stands for off,
+         // and 100 stands for theoretical maximum ("save 100%").
+         if (debug)
+            printf(" -> demand %d eco %d\n", state->demand, state->eco);
+         response[3] = 0x30 + state->demand;
+         response[4] = state->eco ? '2' : '0';
+         response[5] = 0x30;
+         response[6] = 0x30;
+
+         s21_reply(p, response, buf, S21_PAYLOAD_LEN);
+         break;
+     case '8':
+         // 'F8' - Protocol version prior to v3. For v3 (and, supposedly, above) frozen at '2';
+         // real version number can be obtained from FY00 command. Real old version A/Cs (for
+         // example my ATX20K2V1B, protocol v2) set payload bytes 2 and 3 to 0x00, not '0', but
+         // it doesn't seem to affect interpretation by BRP069B41, so we don't bother.
+         // payload[0] could in theory be minor number, but again, BRP doesn't honor it as such,
+         // neither we have seen any A/C which reports something other from '0' there.
+         response[S21_PAYLOAD_OFFSET + 0] = '0';
+         response[S21_PAYLOAD_OFFSET + 1] = state->protocol_major > 2 ? '2' : '0' + state->protocol_major;
+         response[S21_PAYLOAD_OFFSET + 2] = '0';
+         response[S21_PAYLOAD_OFFSET + 3] = '0';
+
+         if (debug)
+            printf(" -> Protocol version (old) = 0x%c\n", response[S21_PAYLOAD_OFFSET + 1] );
+
+         s21_reply(p, response, buf, S21_PAYLOAD_LEN);
+         break;
+      case '9':
+         // In debug log temperature values will appear multiplied by 2
+         response[3] = state->home / 5 + 0x80;
+         response[4] = state->outside / 5 + 0x80; // This is from Faikin sources, but FTXF20D returnx 0xFF here
+         response[5] = 0xFF; // Copied from FTFX20D
+         response[6] = 0x30; // Copied from FTFX20D
+
+         if (debug)
+            printf(" -> home = 0x%02X (%.1f) outside = 0x%02X (%.1f)\n",
+                   response[3], state->home / 10.0, response[4], state->outside / 10.0);
+
+         s21_reply(p, response, buf, S21_PAYLOAD_LEN);
+         break;
+      case 'C':
+         // Protocol v2 - model code. Reported as "model=" in aircon/get_model_info.
+         // One of few commands, which is only sent by controller once after bootup.
+         // Even if communication is broken, then recovered (sim restarted), it won't
+         // be sent again. Controller reboot would be required to accept the new value.
+         if (debug)
+            printf(" -> model = %.4s\n", state->model);
+
+         response[3] = state->model[3];
+         response[4] = state->model[2];
+         response[5] = state->model[1];
+         response[6] = state->model[0];
+
+         s21_reply(p, response, buf, S21_PAYLOAD_LEN);
+         break;
+      case 'M':
+         // Protocol v2 - power consumption in 100 Wh units
+         send_hex(p, response, buf, state->consumption, "Power comsumption");
+         break;
+      // All unknown_cmd's below are queried by BRP069B41 for protocol version 2.
+      // They are all mandatory; if we respond NAK, the controller keeps retrying
+      // this command and doesn't proceed.
+      // All response values are taken from FTXF20D
+      case 'B':
+         unknown_cmd(p, response, buf, state->FB, S21_PAYLOAD_LEN);
+         break;
+      case 'G':
+         // byte[1] of the payload is a hexadecimal character from '0' to 'F'.
+         // Found to increment every time any key is pushed on RC. After 'F' rolls
+         // over to '1'
+         // Other bytes are always 30 xx 30 30
+         unknown_cmd(p, response, buf, state->FG, S21_PAYLOAD_LEN);
+         break;
+      case 'K':
+         // Optional v2+ features. Displayed in /aircon/get_model_info:
+         // byte 0:
+         // - bit 2: acled=<bool>. LED control available ?
+         // - bit 3: land=<bool>
+         // - bit 6: disable en_rtemp_a, i. e. en_rtemp_a=!bit. Only for protocol v3; ignored on lower versions
+         //          When set to 0 (enabled), atlmt_l=0,atlmt_h=0 parameters are also displayed by the controller.
+         // byte 1:
+         // - bit 0: elec=<bool>
+         // - bit 2: temp_rng=<bool>
+         // - bit 3: m_dtct=<bool>. Motion detector AKA "intelligent eye(tm): is available
+         // byte 2:
+         // - bit 0: Japanese market ?? But we don't know a real difference
+         //   0 -> ac_dst=jp
+         //   1 -> ac_dst=--
+         // - bit 1: When set to 1, target humidity setting is not available. Forces s_humd=16
+         //          regardless of respective F2 bits
+         // - bit 2: Fan controls available
+         //    0 -> en_frate=0 en_fdir=0 s_fdir=0
+         //    1 -> en_frate=1 en_fdir=1 s_fdir=3
+         //    When set to 1, actual values of en_fdir and s_fdir are encoded in F2 command byte 0
+         //    (see above).
+         //    When this bit is changed to 0 on the fly using s21-control, the "Online controller"
+         //    app always shows "fan off", and attempts to control it do nothing. If the app is restarted,
+         //    it doesn't show fan controls (neither speed nor swing) at all for this unit.
+         // - bit 3: disp_dry=<bool>
+         // byte 3:
+         // - bit 0: Protocol v3: demand mode available. Ignored on <= v2.
+         // FTXF20D values: 0x71, 0x73, 0x35, 0x31
+         unknown_cmd(p, response, buf, state->FK, S21_PAYLOAD_LEN);
+         break;
+      case 'N':
+         // FN - unknown, reported as first 4 bytes of itelc= in /aircon/get_monitordata
+         unknown_cmd(p, response, buf, state->FN, S21_PAYLOAD_LEN);
+         break;
+      case 'P':
+         unknown_cmd(p, response, buf, state->FP, S21_PAYLOAD_LEN);
+         break;
+      case 'Q':
+         unknown_cmd(p, response, buf, state->FQ, S21_PAYLOAD_LEN);
+         break;
+      case 'R':
+         unknown_cmd(p, response, buf, state->FR, S21_PAYLOAD_LEN);
+         break;
+      case 'S':
+         unknown_cmd(p, response, buf, state->FS, S21_PAYLOAD_LEN);
+         break;
+      case 'T':
+         unknown_cmd(p, response, buf, state->FT, S21_PAYLOAD_LEN);
+         break;
+      case 'V':
+         // This one is not sent by BRP069B41, but i quickly got tired of adding these
+         // one by one and simply ran all the alphabet up to FZZ on my FTXF20D, so here it is.
+         unknown_cmd(p, response, buf, state->FV, S21_PAYLOAD_LEN);
+         break;
+      default:
+         // Respond NAK to an unknown command. My FTXF20D does the same.
+         s21_nak(p, buf, len);
+         return 0;
+      }
+   } else if (len >= S21_MIN_PKT_LEN && buf[S21_CMD0_OFFSET] == 'R') {
+      // Query sensors
+      switch (buf[S21_CMD1_OFFSET]) {
+      case 'H':
+         send_temp(p, response, buf, state->home, "home");
+         break;
+      case 'I':
+         send_temp(p, response, buf, state->inlet, "inlet");
+         break;
+      case 'a':
+         send_temp(p, response, buf, state->outside, "outside");
+         break;
+      case 'L':
+         send_int(p, response, buf, state->fanrpm, "fanrpm");
+         break;
+      case 'd':
+         send_int(p, response, buf, state->comprpm, "compressor rpm");
+         break;
+      case 'e':
+         // Indoor humidity sensor. Known to report 50% if the sensor is not present in the A/C.
+         // BRP069B41 should support it (it has hhum= parameter in /aircom/get_sensor_info),
+         // but so far i was unable to get the controller reading it. Looks like something else
+         // is missing, some feature bits, we don't know which ones.
+         send_int(p, response, buf, state->hum_sensor, "indoor humidity");
+         break;
+      case 'N':
+         // Target temperature. Reported in /aircon/get_monitordata as trtmp=
+         // The temperature the indoor unit is actually trying to match, accounts
+         // for any powerful mode or intelligent eye modifiers or similar.
+         // Heuristics are detailled in service manuals:
+         // https://www.daikinac.com/content/assets/DOC/ServiceManuals/SiUS091133-FTXS-LFDXS-L-Inverter-Pair-Service-Manual.pdf#page=38
+         send_temp(p, response, buf, 235, "unknown ('RN')");
+         break;
+      case 'X':
+         // According to https://github.com/revk/ESP32-Faikin/issues/408#issue-2437817696,
+         // louver vertical angle. Reported in /aircon/get_monitordata as fangl=
+         send_temp(p, response, buf, 215, "unknown ('RX')");
+         break;
+      default:
+         s21_nak(p, buf, len);
+         return 0;
+      }
+   } else {
+       s21_nak(p, buf, len);
+       return 0;
+   }
+
+   return 1;
+}
+
+// Handle a frame on a consistent copy of the unit's state, so a control tool changing several fields at once is never
+// seen half done, then write back only what changed, so a control tool's changes meanwhile are kept
+static int s21_frame(int p, struct S21State *shm, struct S21State *state, struct plant *pl, unsigned char *buf, int len)
+{
+   struct S21State now, before;
+   unsigned int changes = shmem_changes(shm);
+   int r;
+
+   shmem_read(shm, state, &now, sizeof(now));
+   before = now;
+   if (plant)
+      plant_run(pl, &now);
+   r = s21_command(p, &now, buf, len);
+   shmem_merge(shm, state, &before, &now, sizeof(now));
+   shmem_seen(shm, changes);
+   return r;
+}
+
+#ifdef __linux__
+static int changefd = -1; // Kicked by the watcher thread when a control tool changes state
+
+// epoll cannot wait on a futex, so a thread does, and kicks an eventfd
+static void *watcher(void *shm)
+{
+   unsigned int changes = shmem_changes(shm);
+
+   while (1) {
+      uint64_t one = 1;
+
+      changes = shmem_wait_changes(shm, changes, 0);
+      if (write(changefd, &one, sizeof(one)) < 0)
+         break;
+   }
+   return NULL;
+}
+
+static void watch_changes(struct S21State *shm)
+{
+   pthread_t t;
+
+   changefd = eventfd(0, EFD_NONBLOCK);
+   if (changefd < 0 || pthread_create(&t, NULL, watcher, shm)) {
+      perror("Cannot watch for control changes");
+      exit(255);
+   }
+}
+
+// Eventfd kicked, returns changes to report as seen, or 0 if none
+static unsigned int changes_pending(struct S21State *shm)
+{
+   uint64_t n;
+
+   if (read(changefd, &n, sizeof(n)) != sizeof(n))
+      return 0;
+   if (debug)
+      printf("State changed by control tool\n");
+   return shmem_changes(shm);
+}
+
+// Control tool changed state, take it in now rather than on the next frame, e.g. so the plant model restarts from a new
+// home at once
+static void control_changed(struct S21State *shm, struct S21State *state, struct plant *pl)
+{
+   struct S21State now, before;
+
+   if (!plant)
+      return;
+   shmem_read(shm, state, &now, sizeof(now));
+   before = now;
+   plant_run(pl, &now);
+   shmem_merge(shm, state, &before, &now, sizeof(now));
+}
+
+// Wait for serial input, taking in control tool changes meanwhile
+static void wait_input(int p, struct S21State *shm, struct plant *pl)
+{
+   struct pollfd f[2] = {{.fd = p, .events = POLLIN}, {.fd = changefd, .events = POLLIN}};
+   unsigned int changes;
+
+   while (poll(f, 2, -1) >= 0 && !f[0].revents)
+      if ((changes = changes_pending(shm))) {
+         control_changed(shm, shm, pl);
+         shmem_seen(shm, changes);
+      }
+}
+
+static void farm_byte(struct S21State *shm, struct unit *u, int n, unsigned char c)
+{
+   if (u->ack) {
+      u->ack = 0;
+      hexdump("Rx", &c, 1);
+      if (c != STX) {
+         if (debug && c != ACK)
+            printf("Unit %d protocol error: expected ACK, got 0x%02X\n", n, c);
+         return;
+      }
+      if (debug)
+         printf("Unit %d controller didn't ACK our response, next frame started!\n", n);
+   }
+   if (!u->len && c != STX) {
+      printf("Unit %d garbage byte received: 0x%02X\n", n, c);
+      return;
+   }
+   u->buf[u->len++] = c;
+   if (c != ETX && u->len < sizeof(u->buf))
+      return;
+   if (debug || dump)
+      printf("Unit %d:\n", n);
+   hexdump("Rx", u->buf, u->len);
+   if (fault_echo()) {
+      farm_unit = u;
+      serial_send(u->fd, u->buf, u->len, 0);
+      farm_unit = NULL;
+      u->len = 0;
+      return;
+   }
+   farm_unit = u;
+   u->ack = s21_frame(u->fd, shm, u->state, &u->plant, u->buf, u->len);
+   farm_unit = NULL;
+   u->len = 0;
+}
+
+static void farm_flush(struct unit *u, unsigned long long now)
+{
+   int n = 0;
+
+   while (u->outpos + n < u->outlen && u->when[u->outpos + n] <= now)
+      n++;
+   if (n) {
+      int l = write(u->fd, u->out + u->outpos, n);
+
+      if (l > 0)
+         u->outpos += l;
+      else if (l < 0)
+         u->outpos = u->outlen;  // Not being read, so lost, as on a real line
+   }
+   if (u->outpos == u->outlen)
+      u->outpos = u->outlen = 0;
+}
+
+static void farm(struct S21State *state)
+{
+   struct unit *unit = calloc(units, sizeof(*unit));
+   int ep = epoll_create1(0);
+
+   if (!unit || ep < 0) {
+      perror("Cannot set up units");
+      exit(255);
+   }
+   for (int n = 0; n < units; n++) {
+      struct unit *u = &unit[n];
+      char name[64];
+      struct epoll_event ev = {.events = EPOLLIN, .data.ptr = u };
+
+      u->fd = open_pty(name, sizeof(name));
+      if (u->fd < 0 || set_serial(u->fd, 2400, CS8, EVENPARITY, TWOSTOPBITS))
+         exit(255);
+      fcntl(u->fd, F_SETFL, fcntl(u->fd, F_GETFL) | O_NONBLOCK);
+      u->state = &state[n];
+      if (!nothrottle) {
+         throttle_init(&u->rx, 2400, CS8, EVENPARITY, TWOSTOPBITS);
+         throttle_init(&u->tx, 2400, CS8, EVENPARITY, TWOSTOPBITS);
+      }
+      if (epoll_ctl(ep, EPOLL_CTL_ADD, u->fd, &ev)) {
+         perror("Cannot add pty to epoll");
+         exit(255);
+      }
+      printf("PTY %d: %s\n", n, name);
+   }
+   fflush(stdout);
+
+   struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL };
+
+   watch_changes(state);
+   if (epoll_ctl(ep, EPOLL_CTL_ADD, changefd, &ev)) {
+      perror("Cannot add eventfd to epoll");
+      exit(255);
+   }
+
+   while (1) {
+      struct epoll_event ev[64];
+      unsigned long long now = time_us(), next = 0;
+
+      // Send what is due, and find when more is
+      for (int n = 0; n < units; n++) {
+         struct unit *u = &unit[n];
+
+         farm_flush(u, now);
+         if (u->outlen && (!next || u->when[u->outpos] < next))
+            next = u->when[u->outpos];
+      }
+      int timeout = next ? (next > now ? (next - now + 999) / 1000 : 0) : -1;
+      int e = epoll_wait(ep, ev, sizeof(ev) / sizeof(*ev), timeout);
+
+      if (e < 0 && errno != EINTR) {
+         perror("epoll_wait");
+         exit(255);
+      }
+      for (int k = 0; k < e; k++) {
+         struct unit *u = ev[k].data.ptr;
+         unsigned char b[256];
+         unsigned int changes;
+
+         if (!u) {
+            if ((changes = changes_pending(state))) {
+               for (int n = 0; n < units; n++)
+                  control_changed(state, unit[n].state, &unit[n].plant);
+               shmem_seen(state, changes);
+            }
+            continue;
+         }
+         int l = read(u->fd, b, sizeof(b));
+
+         for (int i = 0; i < l; i++) {
+            if (u->rx.us) {
+               // Reply cannot start until this byte is done on the line
+               unsigned long long done = throttle_slot(&u->rx);
+
+               if (u->tx.next < done)
+                  u->tx.next = done;
+            }
+            farm_byte(state, u, u - unit, b[i]);
+         }
+      }
+   }
+}
+#endif
+
 int
 main(int argc, const char *argv[])
 {
@@ -389,14 +1485,46 @@ main(int argc, const char *argv[])
 	  }
    } while (nargs);
 
-   if (!port) {
-	  fprintf(stderr, "Serial port is not given; use -p or --port option\n");
+   if (!port && !pty && !units) {
+	  fprintf(stderr, "Serial port is not given; use -p or --port option, or --pty\n");
 	  return 255;
    }
 
-   // Load settings file first
-   if (settings) {
-	  load_settings(settings);
+   if (units) {
+#ifdef __linux__
+      // Each unit from the defaults, its settings file, then the command line
+      struct S21State defaults = init_state, *all = calloc(units, sizeof(*all));
+
+      for (int n = 0; all && n < units; n++) {
+         init_state = defaults;
+         if (nsettings)
+            load_settings(settings[n % nsettings]);
+         for (int a = 0; a < argc; a += nargs) {
+            nargs = parse_item(argc - a, argv + a, &init_state);
+            if (nargs == -1) {
+               fprintf(stderr, "Invalid state option given on command line\n");
+               return 255;
+            }
+         }
+         all[n] = init_state;
+      }
+
+      struct S21State *state = all ? create_shmem(shmname, all, sizeof(*all), units, SHARED_MEM_VERSION) : NULL;
+
+      if (!state) {
+         fputs("Failed to create shared memory\n", stderr);
+         exit(255);
+      }
+      farm(state);
+#else
+      fputs("--units needs epoll, so Linux only\n", stderr);
+      return 255;
+#endif
+   }
+
+   // Load settings files first
+   for (int n = 0; n < nsettings; n++) {
+	  load_settings(settings[n]);
    }
 
    // Whatever specified on the command line, overrides settings file
@@ -411,14 +1539,25 @@ main(int argc, const char *argv[])
    }
 
    // Create shared memory and initialize it with contents of init_state
-   struct S21State *state = create_shmem(SHARED_MEM_NAME, &init_state, sizeof(init_state));
+   struct S21State *state = create_shmem(shmname, &init_state, sizeof(init_state), 1, SHARED_MEM_VERSION);
 
    if (!state) {
 	  fputs("Failed to create shared memory\n", stderr);
 	  exit(255);
    }
 
-   int p = open(port, O_RDWR);
+   int p;
+   char ptyname[64];
+
+   if (pty) {
+      p = open_pty(ptyname, sizeof(ptyname));
+      if (p < 0)
+         exit(255);
+      port = ptyname;
+      printf("PTY: %s\n", port);
+      fflush(stdout);
+   } else
+      p = open(port, O_RDWR);
 
    if (p < 0) {
       fprintf(stderr, "Cannot open %s: %s", port, strerror(errno));
@@ -429,12 +1568,18 @@ main(int argc, const char *argv[])
 	  fputs("Failed to set up serial port\n", stderr);
 	  exit(255);
    }
+   if (pty && !nothrottle) {
+      throttle_init(&rx, 2400, CS8, EVENPARITY, TWOSTOPBITS);
+      throttle_init(&tx, 2400, CS8, EVENPARITY, TWOSTOPBITS);
+   }
 
    unsigned char buf[256];
-   unsigned char response[256];
-   unsigned char chksum;
+   struct plant pl = {0};
 
    buf[0] = 0;
+#ifdef __linux__
+   watch_changes(state);
+#endif
 
    while (1)
    {
@@ -443,6 +1588,9 @@ main(int argc, const char *argv[])
 
       while (len < sizeof(buf))
       {
+#ifdef __linux__
+         wait_input(p, state, &pl);
+#endif
          int l = read(p, buf + len, 1);
 
 		 if (l < 0) {
@@ -451,6 +1599,7 @@ main(int argc, const char *argv[])
 		 }
 		 if (l == 0)
 		    continue;
+		 throttle_wait(&rx);
 		 if (len == 0 && *buf != STX) {
 			printf("Garbage byte received: 0x%02X\n", *buf);
 			continue;
@@ -464,565 +1613,20 @@ main(int argc, const char *argv[])
 	 
 	  hexdump("Rx", buf, len);
 
-      chksum = s21_checksum(buf, len);
-      if (chksum != buf[len - 2]) {
-		 printf("Bad checksum: 0x%02X vs 0x%02X\n", chksum, buf[len - 2]);
-		 buf[0] = 0; // Just silently drop the packet. My FTXF20D does this.
-		 continue;
-	  }
-
-      if (debug) {
-		if (len < S21_MIN_PKT_LEN) {
-			// It's possible to have 1-character commands. We know 'M' (below)
-			printf("Got command: %c\n", buf[S21_CMD0_OFFSET]);
-		} else {
-         	printf("Got command: %c%c", buf[S21_CMD0_OFFSET], buf[S21_CMD1_OFFSET]);
-		 	hexdump_raw(&buf[S21_PAYLOAD_OFFSET], len - S21_MIN_PKT_LEN);
-		 	putchar('\n');
-		}
-	  }
-
-	  if (len > S21_MIN_PKT_LEN && buf[S21_CMD0_OFFSET] == 'D') {
-		 // Set value. No response expected, just ACK.
-		 s21_ack(p);
-
-		 switch (buf[S21_CMD1_OFFSET]) {
-	     case '1':
-		    state->power = buf[S21_PAYLOAD_OFFSET + 0] - '0'; // ASCII char
-			state->mode  = buf[S21_PAYLOAD_OFFSET + 1] - '0'; // See AC_MODE_*
-			state->temp  = s21_decode_target_temp(buf[S21_PAYLOAD_OFFSET + 2]);
-			state->fan   = s21_decode_fan(buf[S21_PAYLOAD_OFFSET + 3]);
-
-			printf(" Set power %d mode %d temp %.1f fan %d\n", state->power, state->mode, state->temp, state->fan);
-			break;
-		 case '5':
-		    state->swing = buf[S21_PAYLOAD_OFFSET + 0] - '0'; // ASCII char
-			state->humidity = buf[S21_PAYLOAD_OFFSET + 2];
-			// Payload offset 1 equals to '?' for "on" and '0' for "off
-
-			printf(" Set swing %d humidity %d byte[1] 0x%02X byte[3] 0x%02X\n", state->swing, state->humidity,
-			       buf[S21_PAYLOAD_OFFSET + 1], buf[S21_PAYLOAD_OFFSET + 3]);
-			break;
-		 case '6':
-		    state->powerful = (buf[S21_PAYLOAD_OFFSET] & 0x02) ? 1 : 0;
-			state->comfort  = (buf[S21_PAYLOAD_OFFSET] & 0x40) ? 1 : 0;
-			state->quiet    = (buf[S21_PAYLOAD_OFFSET] & 0x80) ? 1 : 0;
-			state->streamer = (buf[S21_PAYLOAD_OFFSET + 1] & 0x80) ? 1 : 0;
-			state->sensor   = (buf[S21_PAYLOAD_OFFSET + 3] & 0x08) ? 1 : 0;
-			state->led      = (buf[S21_PAYLOAD_OFFSET + 3] & 0x04) ? 1 : 0;
-
-			printf(" Set powerful %d comfort %d quiet %d streamer %d sensor %d led %d\n",
-			       state->powerful, state->comfort, state->quiet, state->streamer,
-				   state->sensor, state->led);
-			break;
-		 case '7':
-		 	 state->demand = buf[S21_PAYLOAD_OFFSET] - 0x30;
-		 	 state->eco = buf[S21_PAYLOAD_OFFSET + 1]  == '2'; // '2' or '0'
-
-			 printf(" Set demand %d eco %d spare bytes", state->demand, state->eco);
-			 hexdump_raw(&buf[S21_PAYLOAD_OFFSET + 2], S21_PAYLOAD_LEN - 2);
-			 putchar('\n');
-		     break;
-		 default:
-            printf(" Set unknown:");
-		    hexdump_raw(buf, len);
-			printf("\n");
-		    break;
-		 }
-
-	     buf[0] = 0;
-		 continue;
-	  }
-
-	  if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
-	      buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'U' && buf[S21_V3_CMD3_OFFSET] == '5') {
-		 // FYx5 - v3.40 commands
-		 switch (buf[S21_V3_CMD2_OFFSET])
-		 {
-		 case '0':
-		    // FY05 - Model name, encoded as ASCII. Strangely, in "straight"
-			unknown_v3_cmd(p, response, buf, state->FU05, sizeof(state->FU05));
-			break;
-		 case '1':
-			unknown_v3_cmd(p, response, buf, state->FU15, sizeof(state->FU15));
-			break;
-		 case '2':
-			unknown_v3_cmd(p, response, buf, state->FU25, sizeof(state->FU25));
-			break;
-		 case '3':
-			unknown_v3_cmd(p, response, buf, state->FU35, sizeof(state->FU35));
-			break;
-		 case '4':
-			unknown_v3_cmd(p, response, buf, state->FU45, sizeof(state->FU45));
-			break;
-		 default:
-			s21_nak(p, buf, len);
-			continue;
-		 }
-	  } else if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
-	      buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'U' && buf[S21_V3_CMD2_OFFSET] == '0') {
-		 // FY0x are protocol v3 commands. 4-character codes.
-		 switch (buf[S21_V3_CMD3_OFFSET])
-		 {
-		 case '0':
-		    // FU00 - Special modes availability
-            // byte 0 - "Powerful" mode availability flag. 0x33 - enabled, 0x30 - disabled
-            // byte 1 - "Econo" mode availability flag. 0x33 - enabled, 0x30 - disabled
-            // byte 3 - unknown. Set to 0x33 (enabled) on FTXF20D5V1B, but no mode_info flag was found.
-            // byte 3 - unknown
-            // byte 4 - unknown. Set to 0x33 (enabled) on FTXF20D5V1B, but no mode_info flag was found.
-            // byte 5 - "Streamer" mode availability flag. 0x33 - enabled, 0x30 - disabled
-            // the rest - unknown, could be reserved.
-			unknown_v3_cmd(p, response, buf, state->FU00, sizeof(state->FU00));
-			break;
-		 case '2':
-		 	// FU02 - temperature ranges (perhaps). Displayed in /aircon/get_model_info:
-			// byte 1 - Unknown parameter (atlmt_h). Valid values are from 0xA0 to 0xB0 (inclusive).
-			//          Actual value is calculated as: atlmt_l = (byte - 0xA0) / 2.0.
-			//          If byte value is outside of the valid range, atlmt_h=0 is shown.
-			// byte 2 - Maximum allowed temperature for Heat mode (hmlmt_l). Valid values
-			//          are from 0x30 to 0x6F (inclusive); Actual value is calculated as:
-			//          hmlmt_l = (byte - 0x30) / 2.0 + 10.0. If byte value is outside of
-			//          the valid range, the hmlmt_t parameter is not shown.
-			unknown_v3_cmd(p, response, buf, state->FU02, sizeof(state->FU02));
-			break;
-		 case '4':
-			unknown_v3_cmd(p, response, buf, state->FU04, sizeof(state->FU04));
-			break;
-		 default:
-			s21_nak(p, buf, len);
-			continue;
-		}
-	  } else if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
-	             buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'Y' && buf[S21_V3_CMD3_OFFSET] == '0') {
-		char fmt_buffer[5];
-		// FYx0 v3 commands. BRP069B41 polls these only once per session and caches values, so
-		// these are clearly some immutable identification codes.
-		switch (buf[S21_V3_CMD2_OFFSET])
-		{
-		case '0':
-		    // FY00 - protocol version for v3+. Inverted spelling of XXYY, where XX = major, YY - minor
-			// F8 command still replies v2 for newer protocols; real v2 is detected by responding NAK
-			// to this command.
-			snprintf(fmt_buffer, sizeof(fmt_buffer), "%02u%02u", state->protocol_major, state->protocol_minor);
-			if (debug)
-	   			printf(" -> Protocol version (new) = %s\n", fmt_buffer);
-
-			// Order traditionally inverted
-			response[S21_V3_PAYLOAD_OFFSET + 0] = fmt_buffer[3];
-			response[S21_V3_PAYLOAD_OFFSET + 1] = fmt_buffer[2];
-			response[S21_V3_PAYLOAD_OFFSET + 2] = fmt_buffer[1];
-			response[S21_V3_PAYLOAD_OFFSET + 3] = fmt_buffer[0];
-
-			s21_v3_reply(p, response, buf, S21_PAYLOAD_LEN);
-			break;
-		case '1':
-			unknown_v3_cmd(p, response, buf, state->FY10, sizeof(state->FY10));
-			break;
-		case '2':
-			unknown_v3_cmd(p, response, buf, state->FY20, sizeof(state->FY20));
-			break;
-		default:
-			s21_nak(p, buf, len);
-			continue;
-		}
-	  } else if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
-	             buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'X' && buf[S21_V3_CMD3_OFFSET] == '0') {
-		 // FXx0
-	     switch (buf[S21_V3_CMD2_OFFSET])
-		 {
-		 case '0':
-			unknown_v3_cmd(p, response, buf, state->FX00, sizeof(state->FX00));
-			break;
-		 case '1':
-		    unknown_v3_cmd(p, response, buf, state->FX10, sizeof(state->FX10));
-		    break;
-		 case '2':
-			unknown_v3_cmd(p, response, buf, state->FX20, sizeof(state->FX20));
-			break;
-		 case '3':
-			unknown_v3_cmd(p, response, buf, state->FX30, sizeof(state->FX30));
-			break;
-		 case '4':
-			unknown_v3_cmd(p, response, buf, state->FX40, sizeof(state->FX40));
-			break;
-		 case '5':
-			unknown_v3_cmd(p, response, buf, state->FX50, sizeof(state->FX50));
-			break;
-		 case '6':
-			unknown_v3_cmd(p, response, buf, state->FX60, sizeof(state->FX60));
-			break;
-		 case '7':
-			unknown_v3_cmd(p, response, buf, state->FX70, sizeof(state->FX70));
-			break;
-		 case '8':
-			unknown_v3_cmd(p, response, buf, state->FX80, sizeof(state->FX80));
-			break;
-		 case '9':
-			unknown_v3_cmd(p, response, buf, state->FX90, sizeof(state->FX90));
-			break;
-		 case 'A':
-			unknown_v3_cmd(p, response, buf, state->FXA0, sizeof(state->FXA0));
-			break;
-		 case 'B':
-			unknown_v3_cmd(p, response, buf, state->FXB0, sizeof(state->FXB0));
-			break;
-		 case 'C':
-			unknown_v3_cmd(p, response, buf, state->FXC0, sizeof(state->FXC0));
-			break;
-		 case 'D':
-			unknown_v3_cmd(p, response, buf, state->FXD0, sizeof(state->FXD0));
-			break;
-		 case 'E':
-			unknown_v3_cmd(p, response, buf, state->FXE0, sizeof(state->FXE0));
-			break;
-		 case 'F':
-			unknown_v3_cmd(p, response, buf, state->FXF0, sizeof(state->FXF0));
-			break;
-		 default:
-			s21_nak(p, buf, len);
-		    continue;;
-		 }
-	  } else if (state->protocol_major > 2 && len >= S21_MIN_V3_PKT_LEN &&
-	             buf[S21_CMD0_OFFSET] == 'F' && buf[S21_CMD1_OFFSET] == 'X' && buf[S21_V3_CMD3_OFFSET] == '1') {
-		 // FXx1
-	     switch (buf[S21_V3_CMD2_OFFSET])
-		 {
-		 case '0':
-			unknown_v3_cmd(p, response, buf, state->FX01, sizeof(state->FX01));
-			break;
-		 case '1':
-		    unknown_v3_cmd(p, response, buf, state->FX11, sizeof(state->FX11));
-		    break;
-		 case '2':
-			unknown_v3_cmd(p, response, buf, state->FX21, sizeof(state->FX21));
-			break;
-		 case '3':
-			unknown_v3_cmd(p, response, buf, state->FX31, sizeof(state->FX31));
-			break;
-		 case '4':
-			unknown_v3_cmd(p, response, buf, state->FX41, sizeof(state->FX41));
-			break;
-		 case '5':
-			unknown_v3_cmd(p, response, buf, state->FX51, sizeof(state->FX51));
-			break;
-		 case '6':
-			unknown_v3_cmd(p, response, buf, state->FX61, sizeof(state->FX61));
-			break;
-		 case '7':
-			unknown_v3_cmd(p, response, buf, state->FX71, sizeof(state->FX71));
-			break;
-		 case '8':
-			unknown_v3_cmd(p, response, buf, state->FX81, sizeof(state->FX81));
-			break;
-		 default:
-			s21_nak(p, buf, len);
-		    continue;
-		 }
-	  } else if (len >= S21_FRAMING_LEN + 6 && !memcmp(&buf[S21_CMD0_OFFSET], "VS000M", 6)) {
-		 // This is sent by BRP069B41 for protocol v3. Note non-standard response form
-		 // (no first byte increment). Purpose is currently unknown.
-		 if (debug) {
-			printf(" -> unknown ('VS000M') =");
-			hexdump_raw(state->VS000M, sizeof(state->VS000M));
-			putchar('\n');
-		 }
-
-		 response[S21_CMD0_OFFSET] = 'V';
-    	 response[S21_CMD1_OFFSET] = 'S';
-
-   		 memcpy(&response[S21_PAYLOAD_OFFSET], state->VS000M, sizeof(state->VS000M));
-		 s21_nonstd_reply(p, response, 2 + sizeof(state->VS000M));
-	  } else if (len > S21_FRAMING_LEN && buf[S21_CMD0_OFFSET] == 'M') {
-		// One-character command.
-		// This is sent by BRP069B41 for protocol < v3 and response is mandatory.
-		// The controller loops forever if NAK is received.
-		// I experimentally found out that the A/C just swallows any extra bytes
-		// and always responds with the same data.
-		// All my AC's (v2 and v3) respond with ASCII 'FFFF', however from reverse
-		// engineering thread we know that v0 conditioners have 4 hex digits here,
-		// which look similar to FC response from v2 conditioners; and they don't
-		// support F8. Therefore our best guess is that this command returns
-		// model code for v0/v1 protocol. 'M' very well stands for 'Model'.
-		if (debug)
-		    printf(" -> unknown ('M') = 0x%02X 0x%02X 0x%02X 0x%02X\n",
-	               state->M[0], state->M[1], state->M[2], state->M[3]);
-
-		response[S21_CMD0_OFFSET] = 'M';
-		response[2] = state->M[0];
-		response[3] = state->M[1];
-		response[4] = state->M[2];
-		response[5] = state->M[3];
-
-		s21_nonstd_reply(p, response, 5);
-      } else if (len >= S21_MIN_PKT_LEN && buf[S21_CMD0_OFFSET] == 'F') {
-		 // Query control settings, common commands.
-		 switch (buf[S21_CMD1_OFFSET]) {
-	     case '1':
-		    if (debug)
-		       printf(" -> power %d mode %d temp %.1f\n", state->power, state->mode, state->temp);
-		    response[3] = state->power + '0'; // sent as ASCII
-			response[4] = state->mode + '0';
-			// 18.0 + 0.5 * (signed) (payload[2] - '@')
-			response[5] = s21_encode_target_temp(state->temp);
-			response[6] = s21_encode_fan(state->fan);
-
-			s21_reply(p, response, buf, S21_PAYLOAD_LEN);
-			break;
-		 case '2':
-		    // Optional features. Displayed in /aircon/get_model_info:
-			// byte 0:
-			// - bit 0 - set to 1 on CTXM60RVMA, CTXM35RVMA. BRP069B41 apparently ignores it.
-			// - bit 2 - Swing (any kind) is avaiiable
-			// - bit 3 - Horizontal swing is available. 0 = vertical only
-			//   Swing options are only effective when "enable fan controls" bit in FK command
-			//   is reported as 1.
-			// byte 1:
-			// - bit 3: 0 => type=C, 1 => type=N - unknown
-			// byte 2:
-			// - bit 7: Becomes 1 after DJ command is issued
-			// byte 3: Something about humidity sensor, complicated:
-			// - bit 1: humd=<bool> - "Humidify" operation mode is available
-			// - bit 4: Humidity setting is available for "heat" and "auto" modes
-			//   0 => s_humd=165 when bit 1 == 1, or s_humd=0 when bit 1 == 0
-			//   1 => s_humd=183 when bit 1 == 1, or s_humd=146 when bit 1 == 0
-            //   s_humd is forced to 16 regardless of bits 1 and 4 when byte 2 bit 1
-			//   in FK command (see below) is set to 1
-			// Some known responses:
-			// CTXM60RVMA, CTXM35RVMA : 3D 3B 00 80
-			// FTXF20D5V1B, ATX20K2V1B: 34 3A 00 80
-			unknown_cmd(p, response, buf, state->F2, S21_PAYLOAD_LEN);
-			break;
-		 case '3':
-		 	// Actually on/off timer. Still part of the profile because we may be
-			// interested in byte 3; and also default values are different per unit.
-		 	unknown_cmd(p, response, buf, state->F3, S21_PAYLOAD_LEN);
-			break;
-		 case '4':
-		 	// byte[2] - A/C sometimes reports 0xA0, which then self-resets to 0x80
-			// - bit 5: if set to 1, BRP069B41 stops controlling the A/C and sets
-			//          error code 252. Some sort of "not ready" flag
-			// - bit 7: BRP069B41 seems to ignore it.
-			unknown_cmd(p, response, buf, state->F4, S21_PAYLOAD_LEN);
-			break;
-		 case '5':
-		    if (debug)
-		       printf(" -> swing %d\n", state->swing);
-		    response[3] = '0' + state->swing;
-			response[4] = 0x3F;
-			response[5] = state->humidity;
-			response[6] = 0x80;
-
-			s21_reply(p, response, buf, S21_PAYLOAD_LEN);
-			break;
-		 case '6':
-		    if (debug)
-		       printf(" -> powerful ('F6') %d\n", state->powerful);
-			response[S21_PAYLOAD_OFFSET] = '0'; // Powerful, comfort, quiet
-			response[S21_PAYLOAD_OFFSET + 1] = '0'; // Streamer
-			response[S21_PAYLOAD_OFFSET + 2] = '0'; // Reserved ?
-			response[S21_PAYLOAD_OFFSET + 3] = '0'; // Sensor, LED
-			if (state->powerful)
-		       response[S21_PAYLOAD_OFFSET] |= 0x02;
-			if (state->comfort)
-			   response[S21_PAYLOAD_OFFSET] |= 0x40;
-            if (state->quiet)
-			   response[S21_PAYLOAD_OFFSET] |= 0x80;
-			if (state->streamer)
-				response[S21_PAYLOAD_OFFSET + 1] |= 0x80;
-			if (state->sensor)
-				response[S21_PAYLOAD_OFFSET + 3] |= 0x08;
-			if (state->led)
-				response[S21_PAYLOAD_OFFSET + 3] |= 0x0C;
-			
-			s21_reply(p, response, buf, S21_PAYLOAD_LEN);
-			break;
-		 case '7':
-		    // F7 - demand and eco modes
-			// Demand mode setting is a "percentage of energy saving", i. e. 0 stands for off,
-			// and 100 stands for theoretical maximum ("save 100%").
-		    if (debug)
-		       printf(" -> demand %d eco %d\n", state->demand, state->eco);
-		    response[3] = 0x30 + state->demand;
-			response[4] = state->eco ? '2' : '0';
-			response[5] = 0x30;
-			response[6] = 0x30;
-
-			s21_reply(p, response, buf, S21_PAYLOAD_LEN);
-			break;
-		case '8':
-			// 'F8' - Protocol version prior to v3. For v3 (and, supposedly, above) frozen at '2';
-			// real version number can be obtained from FY00 command. Real old version A/Cs (for
-			// example my ATX20K2V1B, protocol v2) set payload bytes 2 and 3 to 0x00, not '0', but
-			// it doesn't seem to affect interpretation by BRP069B41, so we don't bother.
-			// payload[0] could in theory be minor number, but again, BRP doesn't honor it as such,
-			// neither we have seen any A/C which reports something other from '0' there.
-		    response[S21_PAYLOAD_OFFSET + 0] = '0';
-			response[S21_PAYLOAD_OFFSET + 1] = state->protocol_major > 2 ? '2' : '0' + state->protocol_major;
-			response[S21_PAYLOAD_OFFSET + 2] = '0';
-			response[S21_PAYLOAD_OFFSET + 3] = '0';
-
-		    if (debug)
-		       printf(" -> Protocol version (old) = 0x%c\n", response[S21_PAYLOAD_OFFSET + 1] );
-
-			s21_reply(p, response, buf, S21_PAYLOAD_LEN);
-			break;
-		 case '9':
-			// In debug log temperature values will appear multiplied by 2
-		    response[3] = state->home / 5 + 0x80;
-			response[4] = state->outside / 5 + 0x80; // This is from Faikin sources, but FTXF20D returnx 0xFF here
-			response[5] = 0xFF; // Copied from FTFX20D
-			response[6] = 0x30; // Copied from FTFX20D
-
-		    if (debug)
-		       printf(" -> home = 0x%02X (%.1f) outside = 0x%02X (%.1f)\n",
-			          response[3], state->home / 10.0, response[4], state->outside / 10.0);
-
-			s21_reply(p, response, buf, S21_PAYLOAD_LEN);
-			break;
-		 case 'C':
-		    // Protocol v2 - model code. Reported as "model=" in aircon/get_model_info.
-			// One of few commands, which is only sent by controller once after bootup.
-			// Even if communication is broken, then recovered (sim restarted), it won't
-			// be sent again. Controller reboot would be required to accept the new value.
-		 	if (debug)
-		       printf(" -> model = %.4s\n", state->model);
-
-		    response[3] = state->model[3];
-			response[4] = state->model[2];
-			response[5] = state->model[1];
-			response[6] = state->model[0];
-
-			s21_reply(p, response, buf, S21_PAYLOAD_LEN);
-			break;
-		 case 'M':
-		 	// Protocol v2 - power consumption in 100 Wh units
-		 	send_hex(p, response, buf, state->power, "Power comsumption");
-			break;
-		 // All unknown_cmd's below are queried by BRP069B41 for protocol version 2.
-		 // They are all mandatory; if we respond NAK, the controller keeps retrying
-		 // this command and doesn't proceed.
-		 // All response values are taken from FTXF20D
-		 case 'B':
-			unknown_cmd(p, response, buf, state->FB, S21_PAYLOAD_LEN);
-			break;
-		 case 'G':
-		 	// byte[1] of the payload is a hexadecimal character from '0' to 'F'.
-			// Found to increment every time any key is pushed on RC. After 'F' rolls
-			// over to '1'
-			// Other bytes are always 30 xx 30 30
-			unknown_cmd(p, response, buf, state->FG, S21_PAYLOAD_LEN);
-			break;
-		 case 'K':
-		    // Optional v2+ features. Displayed in /aircon/get_model_info:
-			// byte 0:
-			// - bit 2: acled=<bool>. LED control available ?
-			// - bit 3: land=<bool>
-			// - bit 6: disable en_rtemp_a, i. e. en_rtemp_a=!bit. Only for protocol v3; ignored on lower versions
-			//          When set to 0 (enabled), atlmt_l=0,atlmt_h=0 parameters are also displayed by the controller.
-			// byte 1:
-			// - bit 0: elec=<bool>
-			// - bit 2: temp_rng=<bool>
-			// - bit 3: m_dtct=<bool>. Motion detector AKA "intelligent eye(tm): is available
-			// byte 2:
-			// - bit 0: Japanese market ?? But we don't know a real difference
-			//   0 -> ac_dst=jp
-			//   1 -> ac_dst=--
-			// - bit 1: When set to 1, target humidity setting is not available. Forces s_humd=16
-			//          regardless of respective F2 bits
-			// - bit 2: Fan controls available
-			//    0 -> en_frate=0 en_fdir=0 s_fdir=0
-			//    1 -> en_frate=1 en_fdir=1 s_fdir=3
-			//    When set to 1, actual values of en_fdir and s_fdir are encoded in F2 command byte 0
-			//    (see above).
-			//    When this bit is changed to 0 on the fly using s21-control, the "Online controller"
-			//    app always shows "fan off", and attempts to control it do nothing. If the app is restarted,
-			//    it doesn't show fan controls (neither speed nor swing) at all for this unit.
-			// - bit 3: disp_dry=<bool>
-			// byte 3:
-			// - bit 0: Protocol v3: demand mode available. Ignored on <= v2.
-			// FTXF20D values: 0x71, 0x73, 0x35, 0x31
-			unknown_cmd(p, response, buf, state->FK, S21_PAYLOAD_LEN);
-			break;
-		 case 'N':
-		    // FN - unknown, reported as first 4 bytes of itelc= in /aircon/get_monitordata
-			unknown_cmd(p, response, buf, state->FN, S21_PAYLOAD_LEN);
-			break;
-		 case 'P':
-			unknown_cmd(p, response, buf, state->FP, S21_PAYLOAD_LEN);
-			break;
-		 case 'Q':
-			unknown_cmd(p, response, buf, state->FQ, S21_PAYLOAD_LEN);
-			break;
-		 case 'R':
-			unknown_cmd(p, response, buf, state->FR, S21_PAYLOAD_LEN);
-			break;
-		 case 'S':
-			unknown_cmd(p, response, buf, state->FS, S21_PAYLOAD_LEN);
-			break;
-		 case 'T':
-			unknown_cmd(p, response, buf, state->FT, S21_PAYLOAD_LEN);
-			break;
-		 case 'V':
-		 	// This one is not sent by BRP069B41, but i quickly got tired of adding these
-			// one by one and simply ran all the alphabet up to FZZ on my FTXF20D, so here it is.
-			unknown_cmd(p, response, buf, state->FV, S21_PAYLOAD_LEN);
-			break;
-		 default:
-		    // Respond NAK to an unknown command. My FTXF20D does the same.
-		    s21_nak(p, buf, len);
-		    continue;
-		 }
-	  } else if (len >= S21_MIN_PKT_LEN && buf[S21_CMD0_OFFSET] == 'R') {
-		 // Query sensors
-		 switch (buf[S21_CMD1_OFFSET]) {
-	     case 'H':
-		    send_temp(p, response, buf, state->home, "home");
-		    break;
-	     case 'I':
-		    send_temp(p, response, buf, state->inlet, "inlet");
-		    break;
-	     case 'a':
-		    send_temp(p, response, buf, state->outside, "outside");
-		    break;
-	     case 'L':
-		 	send_int(p, response, buf, state->fanrpm, "fanrpm");
-		    break;
-		 case 'd':
-		 	send_int(p, response, buf, state->comprpm, "compressor rpm");
-			break;
-		 case 'e':
-		    // Indoor humidity sensor. Known to report 50% if the sensor is not present in the A/C.
-			// BRP069B41 should support it (it has hhum= parameter in /aircom/get_sensor_info),
-			// but so far i was unable to get the controller reading it. Looks like something else
-			// is missing, some feature bits, we don't know which ones.
-		 	send_int(p, response, buf, state->hum_sensor, "indoor humidity");
-			break;
-	     case 'N':
-            // Target temperature. Reported in /aircon/get_monitordata as trtmp=
-			// The temperature the indoor unit is actually trying to match, accounts
-			// for any powerful mode or intelligent eye modifiers or similar.
-			// Heuristics are detailled in service manuals:
-			// https://www.daikinac.com/content/assets/DOC/ServiceManuals/SiUS091133-FTXS-LFDXS-L-Inverter-Pair-Service-Manual.pdf#page=38
-		    send_temp(p, response, buf, 235, "unknown ('RN')");
-		    break;
-	     case 'X':
-		    // According to https://github.com/revk/ESP32-Faikin/issues/408#issue-2437817696,
-			// louver vertical angle. Reported in /aircon/get_monitordata as fangl=
-		    send_temp(p, response, buf, 215, "unknown ('RX')");
-		    break;
-		 default:
-		    s21_nak(p, buf, len);
-		    continue;
-		 }
-	  } else {
-		  s21_nak(p, buf, len);
-		  continue;
-	  }
+      if (fault_echo()) {
+         serial_send(p, buf, len, 0);
+         buf[0] = 0;
+         continue;
+      }
+      if (!s21_frame(p, state, state, &pl, buf, len))
+         continue;
 
       // We are here if we just have sent a reply. The controller must ACK it.
 
 	  do {
+#ifdef __linux__
+         wait_input(p, state, &pl);
+#endif
          len = read(p, buf, 1);
 
          if (len < 0) {
@@ -1030,6 +1634,7 @@ main(int argc, const char *argv[])
 		    exit(255);
 	     }
 	  } while (len != 1);
+	  throttle_wait(&rx);
 
       hexdump("Rx", buf, 1);
 
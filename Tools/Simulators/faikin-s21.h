@@ -24,6 +24,7 @@ struct S21State
     unsigned char protocol_major; // Protocol version
     unsigned char protocol_minor;
     char          model[4];       // Reported A/C model code
+    char          nak[128];       // Commands to NAK, e.g. " FU55 RN", as not supported by the model
     // The following aren't understood yet
     unsigned char F2[4];
     unsigned char F3[4];
@@ -81,6 +82,8 @@ struct S21State
 // POSIX shm requires the name to start with '/' for portability reasons.
 // Works also on Windows with no problems, so let it be
 #define SHARED_MEM_NAME "/Faikin-S21"
+// Layout of struct S21State in the shared memory, change when it changes so old control tools are refused
+#define SHARED_MEM_VERSION 1
 
 void state_options_help(void);
 int parse_item(int argc, const char **argv, struct S21State *state);
@@ -3,21 +3,63 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
-#include <popt.h>
 #include <time.h>
 #include <sys/time.h>
 #include <stdlib.h>
 #include <ctype.h>
-#include <popt.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 
+#include "faikin-x50.h"
 #include "osal.h"
+#include "fault.h"
 
-int debug = 0,
-    dump = 0,
-    p = -1;
+const char *port     = NULL; // Serial port to use
+const char *settings = NULL; // Settings file to load
+const char *shmname = SHARED_MEM_NAME; // Shared memory name, for control tool
+static int debug     = 0;    // Dump commands and responses (short form)
+static int dump      = 0;    // Raw dump
+static int pty       = 0;    // Use a pty rather than a serial port
+static int nothrottle = 0;   // No line rate throttle on pty
+static struct throttle rx, tx; // Line rate throttle
+static int p         = -1;
+
+// Initial state of a simulated A/C. Can be changed via settings file or command line.
+static struct X50AState init_state = {
+   .power = 0,
+   .mode  = 3,
+   .comp  = 1,
+   .temp  = 22.5,
+   .fan   = 3,
+   .t     = {1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000},
+   .BA    = {0x46, 0x44, 0x58, 0x4D, 0x32, 0x35, 0x46, 0x33, 0x56, 0x31, 0x42, 0x39, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+             0x1C, 0x00, 0x3E, 0x95, 0x00, 0x70, 0x65, 0x00, 0x01, 0x00},
+   .BB    = {0xD2, 0x89, 0x00, 0x00, 0x2C, 0xD2, 0x11, 0x7D, 0xB0, 0x20, 0x00, 0x10, 0x00, 0x20, 0x00, 0x10, 0x00, 0x05, 0x0C,
+             0x24},
+   .BE    = {0x01, 0x02, 0x43, 0x04, 0x01, 0x01, 0x00, 0x00, 0x01},
+};
+
+// Send, with any faults injected if inject set
+static void serial_send(const unsigned char *buf, int len, int inject) {
+    unsigned char faulty[256 + 2 * 256];
+    unsigned int delay = 0;
+
+    if (inject && fault_active()) {
+        // Checksum is the last byte
+        len = fault_tx(buf, len, 1, faulty, &delay);
+        buf = faulty;
+    }
+    if (delay)
+        usleep(delay * 1000);
+    if (tx.us)
+        for (int i = 0; i < len; i++) {
+            throttle_wait(&tx);
+            write(p, buf + i, 1);
+        }
+    else
+        write(p, buf, len);
+}
 
 void acsend(unsigned char cmd, const unsigned char *payload, int len) {
     if (debug) {
@@ -44,97 +86,208 @@ void acsend(unsigned char cmd, const unsigned char *payload, int len) {
             printf(" %02X", buf[i]);
         printf("\n");
     }
-    write(p, buf, len + 6);
+    serial_send(buf, len + 6, 1);
+}
+
+static void usage(const char *progname)
+{
+	printf("Usage: %s <simulator options> <state options>\n"
+	       "Available simulator options:\n"
+		   " -p or --port <name> - serial port to use (mandatory option, unless --pty)\n"
+		   " --pty - Create a pseudo terminal and print its path, instead of a serial port, paced at the line rate\n"
+		   " --nothrottle - No line rate pacing on --pty\n"
+		   " -s or --settings <filename> - Load initial state data from the file\n"
+		   " -n or --name <name> - Shared memory name, to run several simulators (default %s)\n"
+		   " -v or --debug - Enable dumping all commands\n"
+		   " -V or --verbose - Enable dumping all protocol data\n", progname, SHARED_MEM_NAME);
+	fault_help();
+	state_options_help();
+	printf("State options, given on command line, override options, specified in the settings file\n");
+}
+
+static const char *get_string_arg(int argc, const char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "%s option requires a value\n", argv[0]);
+		exit (255);
+	}
+
+	return argv[1];
+}
+
+static unsigned int parse_program_option(const char *progname, int argc, const char **argv)
+{
+	const char *opt;
+	int n;
+
+	if (argc < 1)
+		return 0;
+
+	opt = argv[0];
+
+	if (!strcmp(opt, "-h") || !strcmp(opt, "--help")) {
+		usage(progname);
+		exit(255);
+	} else if (!strcmp(opt, "-p") || !strcmp(opt, "--port")) {
+		port = get_string_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "--pty")) {
+		pty = 1;
+		return 1;
+	} else if (!strcmp(opt, "--nothrottle")) {
+		nothrottle = 1;
+		return 1;
+	} else if (!strcmp(opt, "-s") || !strcmp(opt, "--settings")) {
+		settings = get_string_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "-n") || !strcmp(opt, "--name")) {
+		shmname = get_string_arg(argc, argv);
+		return 2;
+	} else if (!strcmp(opt, "-v") || !strcmp(opt, "--debug")) {
+		debug = 1;
+		return 1;
+	} else if (!strcmp(opt, "-V") || !strcmp(opt, "--verbose")) {
+		dump = 1;
+		return 1;
+	} else if ((n = fault_option(argc, argv))) {
+		return n;
+	} else if (opt[0] == '-') {
+		fprintf(stderr, "%s: unknown option\n", opt);
+		exit(255);
+	}
+	return 0;
+}
+
+static void load_settings(const char *filename)
+{
+	char line[1024];
+	FILE *f = fopen(filename, "r");
+
+	if (!f) {
+		perror("Failed to open settings file");
+		exit(255);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		// Longest entry is BA, 29 bytes, plus the name
+		const size_t max_command_line_length = 30;
+		char *p = line;
+		const char *argv[max_command_line_length];
+		int argc = 0;
+
+		for (int i = 0; i < max_command_line_length; i++) {
+			while (isspace(*p))
+				p++;
+			if (!*p || *p == '#')
+				break;
+			argv[argc++] = p;
+			while (*p && !isspace(*p))
+				p++;
+			if (!*p)
+				break;
+			*p++ = 0;
+		}
+
+		if (argc) {
+			int nargs = parse_item(argc, argv, &init_state);
+
+			if (nargs < 0) {
+				fprintf(stderr, "Malformed data in settings file");
+				fclose(f);
+				exit(255);
+			}
+		}
+	}
+
+	fclose(f);
 }
 
 int
 main (int argc, const char *argv[])
 {
-   int power = 0;
-   int mode = 3;
-   int comp = 1;
-   float temp = 22.5;
-   int fan = 3;
-   int t1 = 1000,
-      t2 = 1000,
-      t3 = 1000,
-      t4 = 1000,
-      t5 = 1000,
-      t6 = 1000,
-      t7 = 1000,
-      t8 = 1000,
-      t9 = 1000,
-      t10 = 1000,
-      t11 = 1000,
-      t12 = 1000,
-      t13 = 1000;
-   const char *port = NULL;
-   poptContext optCon;
-   {
-      const struct poptOption optionsTable[] = {
-         {"port", 'p', POPT_ARG_STRING, &port, 0, "Port", "/dev/cu.usbserial..."},
-         {"debug", 'v', POPT_ARG_NONE, &debug, 0, "Debug"},
-         {"on", 0, POPT_ARG_NONE, &power, 0, "Power on"},
-         {"mode", 0, POPT_ARG_INT, &mode, 0, "Mode", "0=F,1=H,2=C,3=A,7=D"},
-         {"fan", 0, POPT_ARG_INT, &fan, 0, "Fan", "1-5"},
-         {"temp", 0, POPT_ARG_FLOAT, &temp, 0, "Temp", "C"},
-         {"comp", 0, POPT_ARG_INT, &comp, 0, "Comp", "1=H,2=C"},
-         {"t1", 0, POPT_ARG_INT, &t1, 0, "T1", "N"},
-         {"t2", 0, POPT_ARG_INT, &t2, 0, "T2", "N"},
-         {"t3", 0, POPT_ARG_INT, &t3, 0, "T3", "N"},
-         {"t4", 0, POPT_ARG_INT, &t4, 0, "T4", "N"},
-         {"t5", 0, POPT_ARG_INT, &t5, 0, "T5", "N"},
-         {"t6", 0, POPT_ARG_INT, &t6, 0, "T6", "N"},
-         {"t7", 0, POPT_ARG_INT, &t7, 0, "T7", "N"},
-         {"t8", 0, POPT_ARG_INT, &t8, 0, "T8", "N"},
-         {"t9", 0, POPT_ARG_INT, &t9, 0, "T9", "N"},
-         {"t10", 0, POPT_ARG_INT, &t10, 0, "T10", "N"},
-         {"t11", 0, POPT_ARG_INT, &t11, 0, "T11", "N"},
-         {"t12", 0, POPT_ARG_INT, &t12, 0, "T12", "N"},
-         {"t13", 0, POPT_ARG_INT, &t13, 0, "T13", "N"},
-         {"dump", 'V', POPT_ARG_NONE, &dump, 0, "Dump"},
-         POPT_AUTOHELP {}
-      };
-
-      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
-      //poptSetOtherOptionHelp(optCon, "");
-
-      int c;
-      if ((c = poptGetNextOpt(optCon)) < -1) {
-         fprintf(stderr, "%s: %s\n", poptBadOption(optCon, POPT_BADOPTION_NOALIAS), poptStrerror(c));
-         exit(255);
+   int nargs;
+   const char *progname = *argv++;
+
+   argc--;
+
+   do {
+      nargs = parse_program_option(progname, argc, argv);
+      if (nargs) {
+         argc -= nargs;
+         argv += nargs;
       }
+   } while (nargs);
 
-      if (poptPeekArg (optCon) || !port)
-      {
-         poptPrintUsage (optCon, stderr, 0);
-         return -1;
+   if (!port && !pty) {
+      fprintf(stderr, "Serial port is not given; use -p or --port option, or --pty\n");
+      return 255;
+   }
+
+   // Load settings file first
+   if (settings) {
+      load_settings(settings);
+   }
+
+   // Whatever specified on the command line, overrides settings file
+   while (argc) {
+      nargs = parse_item(argc, argv, &init_state);
+      if (nargs == -1) {
+         fprintf(stderr, "Invalid state option given on command line\n");
+         return 255;
       }
+      argc -= nargs;
+      argv += nargs;
    }
 
-   p = open (port, O_RDWR);
+   // Create shared memory and initialize it with contents of init_state
+   struct X50AState *shm = create_shmem(shmname, &init_state, sizeof(init_state), 1, SHARED_MEM_VERSION);
+
+   if (!shm) {
+      fputs("Failed to create shared memory\n", stderr);
+      exit(255);
+   }
+
+   char ptyname[64];
+   if (pty) {
+      p = open_pty(ptyname, sizeof(ptyname));
+      if (p < 0)
+         exit(255);
+      port = ptyname;
+      printf("PTY: %s\n", port);
+      fflush(stdout);
+   } else
+      p = open (port, O_RDWR);
    if (p < 0) {
       fprintf(stderr, "Cannot open %s: %s", port, strerror(errno));
-	  exit(255);
+      exit(255);
    }
 
-   set_serial(p, 9600, CS8, EVENPARITY, TWOSTOPBITS);
+   if (set_serial(p, 9600, CS8, EVENPARITY, TWOSTOPBITS)) {
+      fputs("Failed to set up serial port\n", stderr);
+      exit(255);
+   }
+   if (pty && !nothrottle) {
+      throttle_init(&rx, 9600, CS8, EVENPARITY, TWOSTOPBITS);
+      throttle_init(&tx, 9600, CS8, EVENPARITY, TWOSTOPBITS);
+   }
 
    while (1)
    {
       unsigned char *payload = NULL,
          cmd = 0;
       int len = 0;
+      unsigned char buf[256];
       {
-         unsigned char buf[256];
-         while (len < sizeof (buf))
+         // Frame is 06 cmd len ..., where len is the whole frame
+         while (len < 3 || len < buf[2])
          {
-            int l = wait_read(p, len  ? 100 : 10);
+            int l = wait_read(p, len  ? 100 : 1000);
             if (l <= 0)
                break;
-            l = read (p, buf + len, sizeof (buf) - len);
+            l = read (p, buf + len, 1);
             if (l <= 0)
                break;
+            throttle_wait (&rx);
             if (!len && *buf != 0x6)
                continue;
             len += l;
@@ -143,7 +296,7 @@ main (int argc, const char *argv[])
             continue;
          if (dump)
          {
-            printf ("[31mRx");
+            printf ("[31mRx");
             for (int i = 0; i < len; i++)
                printf (" %02X", buf[i]);
             printf ("\n");
@@ -153,37 +306,39 @@ main (int argc, const char *argv[])
             c += buf[i];
          if (len < 6 || buf[0] != 6 || buf[2] != len || buf[3] != 1 || buf[4] || c != 0xFF)
             continue;
+         if (fault_echo ())
+         {
+            serial_send (buf, len, 0);
+            continue;
+         }
          cmd = buf[1];
          payload = buf + 5;
          len -= 6;
       }
       if (debug)
       {
-         printf ("[31;1mRx %02X", cmd);
+         printf ("[31;1mRx %02X", cmd);
          for (int i = 0; i < len; i++)
             printf (" %02X", payload[i]);
          printf ("\n");
       }
+      // Work on a consistent copy, so x50-control changing several fields is never seen half done, and write back
+      // only what changed, so its changes meanwhile are kept
+      struct X50AState now, before, *state = &now;
+      unsigned int changes = shmem_changes (shm);
+
+      shmem_read (shm, shm, &now, sizeof (now));
+      before = now;
       switch (cmd)
       {
       case 0xAA:
          acsend (cmd, payload, 1);
          break;
       case 0xBA:
-         {
-            const unsigned char res[] =
-               { 0x46, 0x44, 0x58, 0x4D, 0x32, 0x35, 0x46, 0x33, 0x56, 0x31, 0x42, 0x39, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-0x1C, 0x00, 0x3E, 0x95, 0x00, 0x70, 0x65, 0x00, 0x01, 0x00 };
-            acsend (cmd, res, sizeof (res));
-         }
+         acsend (cmd, state->BA, sizeof (state->BA));
          break;
       case 0xBB:
-         {
-            const unsigned char res[] =
-               { 0xD2, 0x89, 0x00, 0x00, 0x2C, 0xD2, 0x11, 0x7D, 0xB0, 0x20, 0x00, 0x10, 0x00, 0x20, 0x00, 0x10, 0x00, 0x05, 0x0C,
-0x24 };
-            acsend (cmd, res, sizeof (res));
-         }
+         acsend (cmd, state->BB, sizeof (state->BB));
          break;
       case 0xB7:
          acsend (cmd, &cmd, 1);
@@ -193,68 +348,44 @@ main (int argc, const char *argv[])
             unsigned char res[] =
                { 0xBE, 0x0A, 0x6F, 0x0B, 0x7A, 0x01, 0xBE, 0x0A, 0x40, 0x0B, 0xBE, 0x0A, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x05,
 0x00, 0x00, 0x00, 0x05, 0x00, 0x14, 0x00, 0x04, 0x5E, 0x00 };
-            res[0] = t1;
-            res[1] = t1 >> 8;
-            res[2] = t2;
-            res[3] = t2 >> 8;
-            res[4] = t3;
-            res[5] = t3 >> 8;
-            res[6] = t4;
-            res[7] = t4 >> 8;
-            res[8] = t5;
-            res[9] = t5 >> 8;
-            res[10] = t6;
-            res[11] = t6 >> 8;
-            res[12] = t7;
-            res[13] = t7 >> 8;
-            res[14] = t8;
-            res[15] = t8 >> 8;
-            res[16] = t9;
-            res[17] = t9 >> 8;
-            res[18] = t10;
-            res[19] = t10 >> 8;
-            res[20] = t11;
-            res[21] = t11 >> 8;
-            res[22] = t12;
-            res[23] = t12 >> 8;
-            res[24] = t13;
-            res[25] = t13 >> 8;
+            for (int i = 0; i < 13; i++)
+            {
+               res[i * 2] = state->t[i];
+               res[i * 2 + 1] = state->t[i] >> 8;
+            }
             acsend (cmd, res, sizeof (res));
          }
          break;
       case 0xBE:
-         {
-            unsigned char res[] = { 0x01, 0x02, 0x43, 0x04, 0x01, 0x01, 0x00, 0x00, 0x01 };
-            acsend (cmd, res, sizeof (res));
-         }
+         acsend (cmd, state->BE, sizeof (state->BE));
          break;
       case 0xCA:
          {
             if (payload[0])
-               power = (payload[0] & 1);
+               state->power = (payload[0] & 1);
             if (payload[1])
             {
-               mode = (payload[1] & 0xF);
-               comp = (mode == 1 ? 1 : 2);
+               state->mode = (payload[1] & 0xF);
+               state->comp = (state->mode == 1 ? 1 : 2);
             }
             if (payload[3])
-               temp = (payload[3] + (payload[4] & 0x7F) * 0.1);
+               state->temp = (payload[3] + (payload[4] & 0x7F) * 0.1);
             unsigned char res[] =
                { 0x01, 0x02, 0x02, 0x16, 0x00, 0x00, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00 };
-            res[0] = power;
-            res[1] = mode;
-            res[2] = comp;
-            res[3] = (int) temp;
-            res[4] = (int) (temp * 10) % 10;
-            res[5] = 0x10 + fan;
+            res[0] = state->power;
+            res[1] = state->mode;
+            res[2] = state->comp;
+            res[3] = (int) state->temp;
+            res[4] = (int) (state->temp * 10) % 10;
+            res[5] = 0x10 + state->fan;
             acsend (cmd, res, sizeof (res));
          }
          break;
       case 0xCB:
          {
             unsigned char res[] = { 0x06, 0x21 };
-            res[0] = (mode == 1 || mode == 2) ? mode : 6;
-            res[1] = (fan << 4) + 1;
+            res[0] = (state->mode == 1 || state->mode == 2) ? state->mode : 6;
+            res[1] = (state->fan << 4) + 1;
             acsend (cmd, res, sizeof (res));
          }
          break;
@@ -262,7 +393,8 @@ main (int argc, const char *argv[])
          acsend (cmd, NULL, 0);
          printf ("Unknown %02X\n", cmd);
       }
+      shmem_merge (shm, shm, &before, &now, sizeof (now));
+      shmem_seen (shm, changes);
    }
-   poptFreeContext (optCon);
    return 0;
 }
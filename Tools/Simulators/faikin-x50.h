@@ -0,0 +1,22 @@
+struct X50AState
+{
+    int           power;     // Power on
+    int           mode;      // Mode
+    int           comp;      // Compressor mode, 1 = heat, 2 = cool
+    float         temp;      // Set point
+    int           fan;       // Fan speed
+    int           t[13];     // Reported temperatures and sensors in response to BD (raw 16 bit values)
+    // Raw responses, not understood
+    unsigned char BA[29];    // Model etc.
+    unsigned char BB[20];
+    unsigned char BE[9];
+};
+
+// POSIX shm requires the name to start with '/' for portability reasons.
+// Works also on Windows with no problems, so let it be
+#define SHARED_MEM_NAME "/Faikin-X50A"
+// Layout of struct X50AState in the shared memory, change when it changes so old control tools are refused
+#define SHARED_MEM_VERSION 1
+
+void state_options_help(void);
+int parse_item(int argc, const char **argv, struct X50AState *state);
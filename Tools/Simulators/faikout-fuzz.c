@@ -0,0 +1,252 @@
+/* Fuzz target for the Faikout S21 and X50A link layers, and the firmware's own reply and CN_WIRED decoding (acproto.c) */
+/* Built with libFuzzer (make faikout-fuzz), or as a plain program that runs files given, for AFL or to replay a crash */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main/daikin_s21.h"
+#include "main/s21link.h"
+#include "main/x50alink.h"
+#include "main/acproto.h"
+
+// Input is the command sent (2 bytes) then what the aircon sends back, X then the X50A command and what is sent back,
+// C then CN_WIRED packets, or L then legacy mode and f_rate values, NULL separated
+struct input
+{
+   const uint8_t *data;
+   size_t len;
+};
+
+static int fuzz_read(void *ctx, uint8_t *buf, int len)
+{
+   struct input *in = ctx;
+
+   if (len > in->len)
+      len = in->len;
+   memcpy(buf, in->data, len);
+   in->data += len;
+   in->len -= len;
+   return len; // 0 at the end, as a timeout
+}
+
+static int fuzz_x50a_read(void *ctx, uint8_t *buf, int len, int started)
+{
+   return fuzz_read(ctx, buf, len);
+}
+
+static void fuzz_write(void *ctx, const uint8_t *buf, int len)
+{
+}
+
+static volatile int sink; // So decoding is not optimised out
+
+// Status, as the daikin struct, so values decoded feed back in to later decoding and encoding
+static const struct
+{
+   const char *name;
+   char type;
+} fields[] = {
+#define b(name)         {#name, 'b'},
+#define t(name)         {#name, 't'},
+#define r(name)         {#name, 'r'},
+#define i(name)         {#name, 'i'},
+#define e(name,values)  {#name, 'e'},
+#define s(name,len)     {#name, 's'},
+#include "main/acextras.m"
+};
+
+#define FIELDS (sizeof(fields) / sizeof(*fields))
+
+static float state[FIELDS];
+static unsigned long long known;
+
+static void report(int pos, float val)
+{
+   if (pos < 0 || pos >= FIELDS)
+      abort();
+   state[pos] = val;
+   known |= 1ULL << pos;
+}
+
+static void report_uint8(void *ctx, int pos, uint8_t val)
+{
+   report(pos, val);
+}
+
+static void report_int(void *ctx, int pos, int val)
+{
+   report(pos, val);
+}
+
+static void report_float(void *ctx, int pos, float val)
+{
+   report(pos, val);
+}
+
+static void report_string(void *ctx, int pos, const char *val)
+{
+   sink = strlen(val);
+   report(pos, 0);
+}
+
+static float get(void *ctx, int pos)
+{
+   if (pos < 0 || pos >= FIELDS)
+      abort();
+   if (known & (1ULL << pos))
+      return state[pos];
+   // As ac_get(), integers start 0, temperatures unknown
+   return fields[pos].type == 'b' || fields[pos].type == 'e' || fields[pos].type == 'i' ? 0 : NAN;
+}
+
+static acproto_t ac = {         // No no... settings, so everything is decoded, and no F6, so G3 is too
+   .f6bad = 1,
+   .report_uint8 = report_uint8,
+   .report_int = report_int,
+   .report_float = report_float,
+   .report_string = report_string,
+   .get = get,
+};
+
+// Encode controls from whatever was decoded, as the firmware does when changing something
+static void encode(void)
+{
+   char payload[S21_PAYLOAD_LEN];
+   uint8_t ca[17], cb[2];
+
+   acproto_s21_d1(&ac, payload);
+   acproto_s21_d3(&ac, payload);
+   acproto_s21_d5(&ac, payload);
+   acproto_s21_d6(&ac, payload);
+   acproto_s21_d7(&ac, payload);
+   sink = payload[0] + acproto_x50a_control(&ac, ca, cb);
+}
+
+// As daikin_s21_response(), on a copy of just the payload, so any read past it is caught
+static void s21_response(uint8_t cmd, uint8_t cmd2, int len, const uint8_t *buf)
+{
+   uint8_t *payload = malloc(len ? len : 1);
+
+   memcpy(payload, buf, len);
+   sink = acproto_s21_response(&ac, cmd, cmd2, len, payload);
+   free(payload);
+}
+
+// As daikin_s21_exchange() after sending
+static void s21_exchange(uint8_t cmd, uint8_t cmd2, struct input *in)
+{
+   s21link_t l = {fuzz_read, fuzz_write, in};
+   uint8_t buf[256], other;
+   int txlen = S21_MIN_PKT_LEN, rxlen;
+   char r = s21_response_letter(cmd);
+
+   while (1) {
+      if (s21link_receive(&l, cmd, buf, sizeof(buf), &rxlen, &other) != S21LINK_REPLY)
+         return;
+      if (rxlen >= S21_MIN_PKT_LEN)
+         sink = strnlen((char *) buf + 3, rxlen - 5); // Dump
+      if (s21_checksum(buf, rxlen) != buf[rxlen - 2])
+         return;
+      if (rxlen == txlen && is_valid_s21_response(buf, rxlen, cmd, cmd2))
+         return; // Loopback
+      if (!is_valid_s21_response(buf, rxlen, r, cmd2)) {
+         if (buf[1] != r || buf[2] != cmd2)
+            continue;
+         return;
+      }
+      break;
+   }
+   s21_response(buf[S21_CMD0_OFFSET], buf[S21_CMD1_OFFSET], rxlen - S21_MIN_PKT_LEN, buf + S21_PAYLOAD_OFFSET);
+}
+
+// As daikin_x50a_exchange() after sending, and daikin_x50a_response() on a copy of just the payload
+static void x50a_exchange(uint8_t cmd, struct input *in)
+{
+   x50alink_t l = {fuzz_x50a_read, fuzz_write, in};
+   uint8_t buf[256];
+   int rxlen;
+
+   if (x50alink_receive(&l, cmd, buf, sizeof(buf), &rxlen) != X50ALINK_REPLY)
+      return;
+
+   int len = rxlen - 6;
+   uint8_t *payload = malloc(len ? len : 1);
+
+   memcpy(payload, buf + 5, len);
+   sink = acproto_x50a_response(&ac, cmd, len, payload);
+   free(payload);
+}
+
+// As daikin_cn_wired_incoming_packet()
+static void cn_wired_packet(const uint8_t *payload)
+{
+   if (cnw_checksum(payload) != payload[CNW_CRC_TYPE_OFFSET])
+      return;
+   sink = acproto_cn_wired_packet(&ac, payload);
+}
+
+// As legacy_web_set_control_info(), values are NULL terminated strings
+static void legacy_values(const uint8_t *data, size_t len)
+{
+   char *v = malloc(len + 1);
+
+   memcpy(v, data, len);
+   v[len] = 0;
+   sink = acproto_legacy_mode(v);
+   sink = acproto_legacy_fan(v + strlen(v) + (strlen(v) < len));
+   free(v);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+   known = 0; // Each input on its own, so a crash replays
+   ac.rgfan = 0;
+   if (len >= 1 && data[0] == 'C') {
+      // Always whole packets, as cn_wired_read_bytes()
+      for (size_t i = 1; i + CNW_PKT_LEN <= len; i += CNW_PKT_LEN) {
+         uint8_t packet[CNW_PKT_LEN];
+
+         memcpy(packet, data + i, CNW_PKT_LEN);
+         cn_wired_packet(packet);
+      }
+   } else if (len >= 1 && data[0] == 'L') {
+      legacy_values(data + 1, len - 1);
+      return 0;
+   } else if (len >= 2 && data[0] == 'X') {
+      struct input in = {data + 2, len - 2};
+
+      x50a_exchange(data[1], &in);
+   } else if (len >= 2) {
+      struct input in = {data + 2, len - 2};
+
+      s21_exchange(data[0], data[1], &in);
+   } else
+      return 0;
+   encode();
+   return 0;
+}
+
+#ifndef LIBFUZZER
+int main(int argc, const char *argv[])
+{
+   static uint8_t data[65536];
+
+   // Each file, or stdin (as AFL)
+   for (int a = 1; a < argc || a == 1; a++) {
+      FILE *f = argc > 1 ? fopen(argv[a], "rb") : stdin;
+
+      if (!f) {
+         perror(argv[a]);
+         return 255;
+      }
+      size_t len = fread(data, 1, sizeof(data), f);
+
+      if (f != stdin)
+         fclose(f);
+      LLVMFuzzerTestOneInput(data, len);
+   }
+   return 0;
+}
+#endif
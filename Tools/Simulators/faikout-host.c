@@ -0,0 +1,434 @@
+/* Faikout S21 and X50A link layers and payload decoding on a host, polling a simulator or real aircon, for testing and profiling */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "main/daikin_s21.h"
+#include "main/s21link.h"
+#include "main/x50alink.h"
+#include "main/acproto.h"
+#include "osal.h"
+
+static const char *port = NULL;
+static int count = 10;          // Polls of the command list, 0 for forever
+static int interval = 0;        // Between polls (ms)
+static int verbose = 0;
+static int x50a = 0;            // X50A rather than S21
+
+// As the firmware's regular S21 poll
+static const char *poll_default[] = {"F1", "F5", "F6", "F7", "F8", "F9", "FM", "RH", "RI", "Ra", "RL", "Rd"};
+// As the firmware's X50A start up, and regular poll, CA and CB with nothing to change
+static const char *x50a_start[] = {"AA01", "BA", "BB"};
+static const char *x50a_default[] = {"BD", "BE", "CA0000000000000000000000000000000000", "CB0000"};
+
+enum
+{
+   OK, NAKED, NOACK, TIMEOUT, NOREPLY, BADSUM, BAD, OUTCOMES
+};
+
+static const char *outcome_name[OUTCOMES] = {"ok", "nak", "noack", "timeout", "noreply", "badsum", "bad"};
+
+// Status, decoded by the firmware's own acproto.c, as the daikin struct
+static const struct
+{
+   const char *name;
+   char type;
+   const char *values;
+} fields[] = {
+#define b(name)         {#name, 'b'},
+#define t(name)         {#name, 't'},
+#define r(name)         {#name, 'r'},
+#define i(name)         {#name, 'i'},
+#define e(name,values)  {#name, 'e', #values},
+#define s(name,len)     {#name, 's'},
+#include "main/acextras.m"
+};
+
+#define FIELDS (sizeof(fields) / sizeof(*fields))
+
+static float state[FIELDS];     // As reported
+static float want[FIELDS];      // As --set
+static unsigned long long known, wanted;
+static char model[20];
+
+static void report(int pos, float val)
+{
+   state[pos] = val;
+   known |= 1ULL << pos;
+   if (!verbose)
+      return;
+   if (fields[pos].type == 'e' && val >= 0 && val < strlen(fields[pos].values))
+      printf(" %s %c", fields[pos].name, fields[pos].values[(int) val]);
+   else
+      printf(" %s %g", fields[pos].name, val);
+}
+
+static void report_uint8(void *ctx, int pos, uint8_t val)
+{
+   report(pos, val);
+}
+
+static void report_int(void *ctx, int pos, int val)
+{
+   report(pos, val);
+}
+
+static void report_float(void *ctx, int pos, float val)
+{
+   report(pos, val);
+}
+
+static void report_string(void *ctx, int pos, const char *val)
+{
+   strncpy(model, val, sizeof(model) - 1);
+   known |= 1ULL << pos;
+   if (verbose)
+      printf(" %s %s", fields[pos].name, val);
+}
+
+// As the firmware, a control being set is its new value until the aircon reports it
+static float get(void *ctx, int pos)
+{
+   if (wanted & (1ULL << pos))
+      return want[pos];
+   if (known & (1ULL << pos))
+      return state[pos];
+   return NAN;
+}
+
+static acproto_t ac = {        // No no... settings, so everything is decoded
+   .report_uint8 = report_uint8,
+   .report_int = report_int,
+   .report_float = report_float,
+   .report_string = report_string,
+   .get = get,
+};
+
+// POSIX UART for the link layers, timeouts as the firmware
+static int uart_read(void *ctx, uint8_t *buf, int len)
+{
+   int p = *(int *) ctx;
+
+   if (wait_read(p, 500) <= 0)
+      return 0;
+   return read(p, buf, len);
+}
+
+static int x50a_read(void *ctx, uint8_t *buf, int len, int started)
+{
+   int p = *(int *) ctx;
+
+   if (wait_read(p, started ? 50 : 500) <= 0)
+      return 0;
+   return read(p, buf, len);
+}
+
+static void uart_write(void *ctx, const uint8_t *buf, int len)
+{
+   int p = *(int *) ctx;
+
+   if (write(p, buf, len) != len)
+      perror("Serial write failed");
+}
+
+// After decoding, ending the verbose line
+static void decoded(const char *c, int r)
+{
+   if (r == ACPROTO_SHORT && verbose)
+      printf(" short, need %d\n", ac.need);
+   else if (r == ACPROTO_SHORT)
+      printf("%s short, need %d\n", c, ac.need);
+   else if (verbose)
+      printf("\n");
+}
+
+// One command, as daikin_s21_exchange(), payload_len -1 if none given, returns outcome
+static int exchange(s21link_t *l, const char *c, const char *payload, int payload_len)
+{
+   uint8_t buf[256], other = 0;
+   int n = strlen(c), rxlen;
+   uint8_t cmd = c[0], cmd2 = n > 1 ? c[1] : c[0];
+   int txlen;
+
+   if (payload_len < 0) {
+      payload = c + 2;
+      payload_len = n > 2 ? n - 2 : 0;
+   }
+   txlen = s21link_frame(buf, cmd, cmd2, payload, payload_len);
+   l->write(l->ctx, buf, txlen);
+   while (1) {
+      switch (s21link_receive(l, cmd, buf, sizeof(buf), &rxlen, &other)) {
+      case S21LINK_REPLY:
+         break;
+      case S21LINK_ACK:
+         return OK;
+      case S21LINK_NAK:
+         return NAKED;
+      case S21LINK_NOACK:
+         if (verbose)
+            printf("%s noack %02X\n", c, other);
+         return NOACK;
+      case S21LINK_TIMEOUT:
+         return TIMEOUT;
+      default:
+         return NOREPLY;
+      }
+      if (s21_checksum(buf, rxlen) != buf[rxlen - 2])
+         return BADSUM;
+      if (rxlen == txlen && is_valid_s21_response(buf, rxlen, cmd, cmd2))
+         return BAD; // Loopback
+      if (!is_valid_s21_response(buf, rxlen, s21_response_letter(cmd), cmd2)) {
+         if (buf[S21_CMD0_OFFSET] != s21_response_letter(cmd) || buf[S21_CMD1_OFFSET] != cmd2)
+            continue; // Mismatch, wait for another
+         return BAD;
+      }
+      if (verbose)
+         printf("%s", c);
+      decoded(c, acproto_s21_response(&ac, buf[S21_CMD0_OFFSET], buf[S21_CMD1_OFFSET], rxlen - S21_MIN_PKT_LEN,
+                                      buf + S21_PAYLOAD_OFFSET));
+      return OK;
+   }
+}
+
+// One command, as daikin_x50a_exchange(), c is hex, command then payload, returns outcome
+static int x50a_exchange(x50alink_t *l, const char *c, const uint8_t *payload, int payload_len)
+{
+   uint8_t buf[256], data[128];
+   int rxlen, n = 0;
+   unsigned int v;
+
+   while (n < sizeof(data) && sscanf(c + n * 2, "%2x", &v) == 1)
+      data[n++] = v;
+   if (!payload) {
+      payload = data + 1;
+      payload_len = n - 1;
+   }
+   l->write(l->ctx, buf, x50alink_frame(buf, *data, payload, payload_len));
+   switch (x50alink_receive(l, *data, buf, sizeof(buf), &rxlen)) {
+   case X50ALINK_REPLY:
+      break;
+   case X50ALINK_TIMEOUT:
+      return TIMEOUT;
+   case X50ALINK_PARTIAL:
+      return NOREPLY;
+   case X50ALINK_BADSUM:
+      return BADSUM;
+   case X50ALINK_FAULT:
+      return NAKED;
+   default:
+      return BAD;
+   }
+   if (verbose)
+      printf("%s", c);
+   decoded(c, acproto_x50a_response(&ac, *data, rxlen - 6, buf + 5));
+   return OK;
+}
+
+// Set controls as --set, encoded by the firmware's own acproto.c, as it sends them
+static int set(void *link)
+{
+   unsigned long long d1 = (1ULL << CONTROL_power_pos) | (1ULL << CONTROL_mode_pos) | (1ULL << CONTROL_temp_pos) |
+      (1ULL << CONTROL_fan_pos);
+   unsigned long long d5 = (1ULL << CONTROL_swingh_pos) | (1ULL << CONTROL_swingv_pos);
+   unsigned long long d6 = (1ULL << CONTROL_powerful_pos) | (1ULL << CONTROL_comfort_pos) | (1ULL << CONTROL_quiet_pos) |
+      (1ULL << CONTROL_streamer_pos) | (1ULL << CONTROL_sensor_pos) | (1ULL << CONTROL_led_pos);
+   unsigned long long d7 = (1ULL << CONTROL_demand_pos) | (1ULL << CONTROL_econo_pos);
+   char payload[S21_PAYLOAD_LEN];
+   int o = OK;
+
+   if (x50a) {
+      uint8_t ca[17] = {0}, cb[2] = {0};
+
+      acproto_x50a_control(&ac, ca, cb);
+      if ((o = x50a_exchange(link, "CA", ca, sizeof(ca))) == OK)
+         o = x50a_exchange(link, "CB", cb, sizeof(cb));
+      return o;
+   }
+   if (o == OK && (wanted & d1)) {
+      acproto_s21_d1(&ac, payload);
+      o = exchange(link, "D1", payload, sizeof(payload));
+   }
+   if (o == OK && (wanted & d5)) {
+      acproto_s21_d5(&ac, payload);
+      o = exchange(link, "D5", payload, sizeof(payload));
+   }
+   if (o == OK && (wanted & d6)) {
+      acproto_s21_d6(&ac, payload);
+      o = exchange(link, "D6", payload, sizeof(payload));
+   }
+   if (o == OK && (wanted & d7)) {
+      acproto_s21_d7(&ac, payload);
+      o = exchange(link, "D7", payload, sizeof(payload));
+   }
+   return o;
+}
+
+// name=value, value as the firmware's control JSON, a letter for an enum, else a number
+static int parse_set(const char *arg)
+{
+   const char *v = strchr(arg, '=');
+
+   if (v)
+      for (int f = 0; f < FIELDS; f++)
+         if (strlen(fields[f].name) == v - arg && !strncmp(fields[f].name, arg, v - arg)) {
+            const char *found;
+            char *end;
+
+            v++;
+            if (fields[f].type == 'e' && *v && !v[1] && (found = strchr(fields[f].values, *v)))
+               want[f] = found - fields[f].values;
+            else if (fields[f].type == 's' || fields[f].type == 'r' || (want[f] = strtof(v, &end), end == v || *end))
+               break;
+            wanted |= 1ULL << f;
+            return 0;
+         }
+   fprintf(stderr, "Bad --set %s, expecting field=value\n", arg);
+   return -1;
+}
+
+static void status(void)
+{
+   printf("Status:");
+   for (int f = 0; f < FIELDS; f++)
+      if (known & (1ULL << f)) {
+         if (fields[f].type == 's')
+            printf(" %s %s", fields[f].name, model);
+         else if (fields[f].type == 'e' && state[f] >= 0 && state[f] < strlen(fields[f].values))
+            printf(" %s %c", fields[f].name, fields[f].values[(int) state[f]]);
+         else
+            printf(" %s %g", fields[f].name, state[f]);
+      }
+   printf("\n");
+}
+
+int main(int argc, const char *argv[])
+{
+   const char *progname = *argv++;
+   const char **cmds = poll_default;
+   int ncmds = sizeof(poll_default) / sizeof(*poll_default);
+
+   argc--;
+   while (argc && argv[0][0] == '-') {
+      if (!strcmp(argv[0], "-v") || !strcmp(argv[0], "--verbose")) {
+         verbose = 1;
+         argc--;
+         argv++;
+         continue;
+      }
+      if (!strcmp(argv[0], "--x50a")) {
+         x50a = 1;
+         cmds = x50a_default;
+         ncmds = sizeof(x50a_default) / sizeof(*x50a_default);
+         argc--;
+         argv++;
+         continue;
+      }
+      if (argc < 2)
+         break;
+      if (!strcmp(argv[0], "-p") || !strcmp(argv[0], "--port"))
+         port = argv[1];
+      else if (!strcmp(argv[0], "--count"))
+         count = atoi(argv[1]);
+      else if (!strcmp(argv[0], "--interval"))
+         interval = atoi(argv[1]);
+      else if (!strcmp(argv[0], "--set")) {
+         if (parse_set(argv[1]))
+            return 255;
+      } else
+         break;
+      argc -= 2;
+      argv += 2;
+   }
+   if (argc && argv[0][0] == '-')
+      port = NULL;
+   if (!port) {
+      printf("Usage: %s -p <port> [--x50a] [--count <n>] [--interval <ms>] [--set <field>=<value>] [-v] [<command>...]\n"
+             " -p or --port <port> - Serial port, or the pty from faikin-s21 --pty or faikin-x50 --pty\n"
+             " --x50a - X50A protocol, rather than S21\n"
+             " --count <n> - Polls of the commands (default 10), 0 for forever\n"
+             " --interval <ms> - Time between polls\n"
+             " --set <field>=<value> - Set a control after the first poll, and check it is reported, e.g. temp=23.5 or mode=H\n"
+             " -v or --verbose - Show the decoded replies\n"
+             "Commands default to the firmware's poll, e.g. F1 RH FU00, or hex for X50A, e.g. BD CA\n", progname);
+      return 255;
+   }
+   if (wanted && count == 1)
+      count = 2;                // Poll again to see it set
+   if (argc) {
+      cmds = argv;
+      ncmds = argc;
+   }
+
+   int p = open(port, O_RDWR | O_NOCTTY);
+
+   if (p < 0) {
+      fprintf(stderr, "Cannot open %s: %s\n", port, strerror(errno));
+      return 255;
+   }
+   // A Linux pty won't take parity, and has none to get wrong
+   if (set_serial(p, x50a ? 9600 : 2400, CS8, strncmp(port, "/dev/pts/", 9) ? EVENPARITY : 0, x50a ? ONESTOPBIT : TWOSTOPBITS))
+      return 255;
+
+   s21link_t link = {uart_read, uart_write, &p};
+   x50alink_t xlink = {x50a_read, uart_write, &p};
+   unsigned long outcomes[OUTCOMES] = {0}, exchanges = 0;
+   unsigned long long total = 0, min = 0, max = 0;
+
+   if (x50a)
+      for (int i = 0; i < sizeof(x50a_start) / sizeof(*x50a_start); i++)
+         if (x50a_exchange(&xlink, x50a_start[i], NULL, 0) == TIMEOUT) {
+            printf("No reply to %s\n", x50a_start[i]);
+            return 1;
+         }
+   for (int n = 0; !count || n < count; n++) {
+      for (int i = 0; i < ncmds; i++) {
+         unsigned long long start = time_us();
+         int o = x50a ? x50a_exchange(&xlink, cmds[i], NULL, 0) : exchange(&link, cmds[i], NULL, -1);
+         unsigned long long us = time_us() - start;
+
+         if (o != OK && verbose)
+            printf("%s %s\n", cmds[i], outcome_name[o]);
+         outcomes[o]++;
+         exchanges++;
+         total += us;
+         if (!min || us < min)
+            min = us;
+         if (us > max)
+            max = us;
+      }
+      if (!n && wanted) {
+         int o = set(x50a ? (void *) &xlink : (void *) &link);
+
+         if (o != OK)
+            printf("Set %s\n", outcome_name[o]);
+         outcomes[o]++;
+      }
+      if (interval)
+         usleep(interval * 1000);
+   }
+
+   printf("%lu exchanges, latency min %.1fms mean %.1fms max %.1fms", exchanges, min / 1000.0,
+          exchanges ? total / 1000.0 / exchanges : 0, max / 1000.0);
+   for (int o = 0; o < OUTCOMES; o++)
+      if (outcomes[o])
+         printf(", %s %lu", outcome_name[o], outcomes[o]);
+   printf("\n");
+   status();
+
+   // A control set and not then reported by the aircon is a fault
+   int notset = 0;
+
+   for (int f = 0; f < FIELDS; f++)
+      if ((wanted & (1ULL << f)) && (!(known & (1ULL << f)) || lroundf(state[f] * 10) != lroundf(want[f] * 10))) {
+         printf("%s not set\n", fields[f].name);
+         notset++;
+      }
+
+   // NAK is the aircon saying it does not support a command, anything else is a fault, so fail a regression run
+   return outcomes[NOACK] + outcomes[TIMEOUT] + outcomes[NOREPLY] + outcomes[BADSUM] + outcomes[BAD] + notset ? 1 : 0;
+}
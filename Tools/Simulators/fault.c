@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "fault.h"
+#include "osal.h"
+
+enum
+{
+   FAULT_DROP,    // Drop a byte from a frame, an ACK with nothing left, so timeout or missing ACK
+   FAULT_CORRUPT, // Corrupt the checksum, so badsum
+   FAULT_DELAY,   // Delay a frame or ACK
+   FAULT_DUP,     // Send a frame twice
+   FAULT_STALE,   // Send the previous frame, unsolicited, before this one, so mismatch
+   FAULT_INVERT,  // Invert the line for a frame
+   FAULT_ECHO,    // Echo what was received, as a loopback
+   FAULTS
+};
+
+static const char *names[FAULTS] = {"drop", "corrupt", "delay", "dup", "stale", "invert", "echo"};
+
+static double prob[FAULTS];        // Probability per frame
+static unsigned long count[FAULTS]; // Injected
+static unsigned long frames;        // Frames sent
+static unsigned int delayms = 500;  // Delay for FAULT_DELAY
+static unsigned long long start;    // time_us() at first frame
+static unsigned char last[256];     // Previous frame, for FAULT_STALE
+static int lastlen;
+static int active;
+static unsigned int seed;           // Random seed, 0 for time
+
+static void fault_exit(int sig)
+{
+   exit(0); // So atexit() summary is printed
+}
+
+void fault_help(void)
+{
+   printf(" --fault <type> <probability> - Inject faults, per frame, type is drop, corrupt, delay, dup, stale, invert or echo\n"
+          " --faultdelay <ms> - Delay for delay fault (default %u), --faultseed <n> - Random seed\n", delayms);
+}
+
+int fault_option(int argc, const char **argv)
+{
+   if (!strcmp(argv[0], "--faultdelay") && argc >= 2) {
+      delayms = atoi(argv[1]);
+      return 2;
+   }
+   if (!strcmp(argv[0], "--faultseed") && argc >= 2) {
+      seed = atoi(argv[1]);
+      return 2;
+   }
+   if (strcmp(argv[0], "--fault"))
+      return 0;
+   int f;
+   for (f = 0; f < FAULTS && (argc < 3 || strcmp(argv[1], names[f])); f++);
+   if (f == FAULTS) {
+      fprintf(stderr, "--fault needs a type (drop, corrupt, delay, dup, stale, invert or echo) and probability\n");
+      exit(255);
+   }
+   prob[f] = atof(argv[2]);
+   if (!active) {
+      active = 1;
+      atexit(fault_summary);
+      signal(SIGINT, fault_exit);
+      signal(SIGTERM, fault_exit);
+   }
+   return 3;
+}
+
+int fault_active(void)
+{
+   return active;
+}
+
+static void fault_start(void)
+{
+   if (start)
+      return;
+   start = time_us();
+   srand(seed ? seed : time(NULL));
+}
+
+static int fault(int f)
+{
+   if (!prob[f] || rand() >= prob[f] * ((double) RAND_MAX + 1))
+      return 0;
+   count[f]++;
+   // Logged with time, so recovery can be measured from the controller's logs
+   printf("Fault %.3fs: %s\n", (time_us() - start) / 1000000.0, names[f]);
+   fflush(stdout);
+   return 1;
+}
+
+int fault_tx(const unsigned char *in, int len, int sumback, unsigned char *out, unsigned int *delay)
+{
+   int n = 0,
+      l = len;
+
+   *delay = 0;
+   fault_start();
+   frames++;
+   if (!active || len > sizeof(last)) {
+      memcpy(out, in, len);
+      return len;
+   }
+   if (lastlen && fault(FAULT_STALE)) {
+      memcpy(out, last, lastlen);
+      n = lastlen;
+   }
+   memcpy(out + n, in, l);
+   if (sumback && sumback <= l && fault(FAULT_CORRUPT))
+      out[n + l - sumback] ^= 0x5A;
+   if (fault(FAULT_DROP)) {
+      int d = rand() % l;
+      memmove(out + n + d, out + n + d + 1, l - d - 1);
+      l--;
+   }
+   n += l;
+   if (l && fault(FAULT_DUP)) {
+      memcpy(out + n, out + n - l, l);
+      n += l;
+   }
+   if (fault(FAULT_INVERT))
+      for (int i = 0; i < n; i++)
+         out[i] ^= 0xFF;
+   if (fault(FAULT_DELAY))
+      *delay = delayms;
+   if (sumback) {
+      // Only frames with a checksum, not ACK/NAK
+      memcpy(last, in, len);
+      lastlen = len;
+   }
+   return n;
+}
+
+int fault_echo(void)
+{
+   fault_start();
+   return active && fault(FAULT_ECHO);
+}
+
+void fault_summary(void)
+{
+   unsigned long total = 0;
+   double secs = start ? (time_us() - start) / 1000000.0 : 0;
+
+   for (int f = 0; f < FAULTS; f++)
+      total += count[f];
+   printf("Faults: %lu injected in %lu frames over %.1fs", total, frames, secs);
+   for (int f = 0; f < FAULTS; f++)
+      if (prob[f])
+         printf(", %s %lu", names[f], count[f]);
+   printf("\n");
+   fflush(stdout);
+}
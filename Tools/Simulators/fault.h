@@ -0,0 +1,15 @@
+// Fault injection, to exercise the controller's recovery (loopback, badsum, mismatch, missing ACK, timeout)
+// Shared by faikin-s21 and faikin-x50, with one set of probabilities for the process
+
+// Parse --fault <type> <probability> and --faultdelay/--faultseed, returns args used, 0 if not a fault option
+int fault_option(int argc, const char **argv);
+void fault_help(void);
+// Any faults configured
+int fault_active(void);
+// Apply faults to a frame to send, sumback is position of checksum from end (0 for none, e.g. ACK)
+// Writes what to send to out (up to 256 + 2x len, with a stale frame and duplicate), returns its length, sets delay (ms)
+int fault_tx(const unsigned char *in, int len, int sumback, unsigned char *out, unsigned int *delay);
+// Received frame is to be echoed back, as a loopback, instead of processed
+int fault_echo(void);
+// Print counts of faults injected
+void fault_summary(void);
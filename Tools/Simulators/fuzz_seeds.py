@@ -0,0 +1,117 @@
+# This script makes a seed corpus for faikout-fuzz from simulator .settings files, so fuzzing
+# starts from replies real aircons send rather than from nothing
+# Usage: fuzz_seeds.py <corpus dir> <settings> [<settings>...]
+# Each seed is the command sent then the reply (ACK, then the frame), as faikout-fuzz takes it,
+# plus some X50A replies, CN_WIRED packets and legacy values
+
+import os
+import sys
+
+STX = 0x02
+ETX = 0x03
+ACK = 0x06
+
+def checksum(body):
+    s = sum(body) & 0xFF
+    return s + 2 if s == STX or s == ETX or s == ACK else s
+
+def s21_seed(cmd, payload):
+    # The reply to M and V keeps the letter, VS000M replies VS, others increment the first letter
+    if cmd in ("M", "V"):
+        sent = cmd + cmd
+        body = cmd.encode("ascii") + payload
+    elif cmd == "VS000M":
+        sent = "VS"
+        body = b"VS" + payload
+    else:
+        sent = cmd[:2]
+        body = bytes([ord(cmd[0]) + 1]) + cmd[1:].encode("ascii") + payload
+    return sent.encode("ascii") + bytes([ACK, STX]) + body + bytes([checksum(body), ETX])
+
+def temp(t):
+    # Sign and 3 digits, reversed, tenths of C
+    t = round(t * 10)
+    return ("%03d" % abs(t))[::-1].encode("ascii") + (b"-" if t < 0 else b"+")
+
+def cnw_seed(payload):
+    # As cnw_checksum(), nibble sum in the high nibble of the last byte
+    crc = payload[7] & 0x0F
+    for b in payload[:7]:
+        crc += (b >> 4) + (b & 0x0F)
+    if payload[7] & 0x0F > 1:
+        crc = 0x0F - crc
+    payload[7] = ((crc << 4) & 0xF0) | (payload[7] & 0x0F)
+    return b"C" + bytes(payload)
+
+def x50a_seed(cmd, payload):
+    # As faikin-x50, 06 cmd len 01 06 payload, then ~sum, where len is the whole frame
+    body = bytes([ACK, cmd, len(payload) + 6, 1, ACK]) + payload
+    return b"X" + bytes([cmd]) + body + bytes([~sum(body) & 0xFF])
+
+def raw_byte(w):
+    # 0x41 or 'A, as in .settings files
+    if w.startswith("0x"):
+        return int(w, 16)
+    if len(w) == 2 and w[0] == "'":
+        return ord(w[1])
+    return None
+
+def settings_seeds(name):
+    seeds = {}
+    # As faikin-s21 defaults, unless the settings file has them
+    state = {"power": 0, "mode": 3, "temp": 22.0, "fan": 3, "home": 24.5, "outside": 20.5, "inlet": 18.5,
+             "fanrpm": 52, "comprpm": 42}
+    with open(name) as f:
+        for line in f:
+            words = line.split("#")[0].split()
+            if len(words) < 2:
+                continue
+            opt = words[0]
+            raw = [raw_byte(w) for w in words[1:]]
+            if None not in raw:
+                seeds[opt] = s21_seed(opt, bytes(raw))
+            elif opt in state:
+                state[opt] = float(words[1])
+            elif opt == "model":
+                seeds[opt] = s21_seed("FC", words[1][::-1].encode("ascii"))
+    for opt, cmd in (("home", "RH"), ("outside", "Ra"), ("inlet", "RI")):
+        seeds[opt] = s21_seed(cmd, temp(state[opt]))
+    for opt, cmd in (("fanrpm", "RL"), ("comprpm", "Rd")):
+        seeds[opt] = s21_seed(cmd, ("%03d" % int(state[opt]))[::-1].encode("ascii"))
+    fan = "A" if state["fan"] == 0 else "B" if state["fan"] == 6 else chr(ord("3") + int(state["fan"]) - 1)
+    seeds["F1"] = s21_seed("F1", bytes([0x30 + int(state["power"]), 0x30 + int(state["mode"]),
+                                        0x40 + round((state["temp"] - 18) * 2), ord(fan)]))
+    return seeds
+
+if len(sys.argv) < 3:
+    print("Usage: {} <corpus dir> <settings> [<settings>...]".format(sys.argv[0]))
+    sys.exit(255)
+
+os.makedirs(sys.argv[1], exist_ok=True)
+count = 0
+for name in sys.argv[2:]:
+    base = os.path.splitext(os.path.basename(name))[0]
+    for opt, seed in settings_seeds(name).items():
+        with open(os.path.join(sys.argv[1], base + "-" + opt), "wb") as f:
+            f.write(seed)
+        count += 1
+# Power meter, special modes, fan, X50A start up and status (heat 22C fan 3), CN_WIRED sensor report and mode
+# changed (cool 24C fan auto, LED on), and legacy mode heat with f_rate 3, and auto with quiet
+for name, seed in (("FM", s21_seed("FM", b"2100")),
+                   ("F6", s21_seed("F6", b"B000")),
+                   ("F7", s21_seed("F7", b"0200")),
+                   ("RG", s21_seed("RG", b"5")),
+                   ("x50a-AA", x50a_seed(0xAA, b"\x01")),
+                   ("x50a-BA", x50a_seed(0xBA, b"FTXM25R".ljust(20, b"\0"))),
+                   ("x50a-CA", x50a_seed(0xCA, bytes([1, 1, 1, 0, 0, 0, 0x30, 0, 0, 0]))),
+                   ("x50a-CB", x50a_seed(0xCB, bytes([3, 0]))),
+                   ("x50a-BD", x50a_seed(0xBD, bytes(8) + bytes([0x00, 0x0B]) + bytes(19))),
+                   ("x50a-BE", x50a_seed(0xBE, bytes(9))),
+                   ("cnw-sensor", cnw_seed(bytearray([0x23, 0, 0, 0, 0, 0, 0, 0x00]))),
+                   ("cnw-mode", cnw_seed(bytearray([0x24, 0, 0, 0x02, 0x01, 0x80, 0, 0x01]))),
+                   ("legacy-heat", b"L4\x003"),
+                   ("legacy-auto", b"L0\x00B")):
+    with open(os.path.join(sys.argv[1], name), "wb") as f:
+        f.write(seed)
+    count += 1
+print("%d seeds in %s" % (count, sys.argv[1]))
@@ -0,0 +1,194 @@
+# This script measures Faikout's end to end latency, from an MQTT command, to the simulated A/C
+# receiving the D1 (set) frame, to the resulting state/<name>/status, firing bursts of temp commands
+# Usage: latency.py [options] <Faikin name> <simulator command...>
+# e.g. latency.py --burst 5 --bursts 20 Faikin ./faikin-s21 -p /dev/ttyUSB0 -s FTXM35R.settings
+# The script runs the simulator itself, timestamping its "Set" lines, so everything is on one clock.
+# Faikout needs livestatus on (live setting) so status is sent straight away, and auto (autor) off,
+# else temp sets the auto target instead
+# Prerequisites: pip install paho-mqtt, a local mosquitto
+
+import argparse
+import json
+import os
+import pty
+import re
+import subprocess
+import sys
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+lock = threading.Condition()
+applied = []  # (time, temp) of each D1 the simulator got
+status = []   # (time, temp) of each status with a new temp
+connected = False
+
+def now():
+    return time.monotonic()
+
+def key(temp):
+    # Targets are in 0.5C steps on the S21 line
+    return round(float(temp) * 2)
+
+def read_simulator(fd):
+    line = b""
+    while True:
+        try:
+            data = os.read(fd, 1024)
+        except OSError:
+            data = b""
+        if not data:
+            break
+        t = now()
+        line += data
+        while b"\n" in line:
+            text, line = line.split(b"\n", 1)
+            m = re.search(rb"Set power \d+ mode \d+ temp ([\d.]+)", text)
+            if m:
+                with lock:
+                    applied.append((t, key(m.group(1))))
+                    lock.notify_all()
+    with lock:
+        lock.notify_all()
+
+def on_connect(client, userdata, flags, reason_code, properties):
+    global connected
+    client.subscribe("state/{}/status".format(args.name))
+    with lock:
+        connected = True
+        lock.notify_all()
+
+def on_message(client, userdata, msg):
+    t = now()
+    try:
+        data = json.loads(msg.payload.decode("ascii"))
+    except ValueError:
+        return
+    if not isinstance(data, dict) or data.get("temp") is None:
+        return
+    with lock:
+        if not status or status[-1][1] != key(data["temp"]):
+            status.append((t, key(data["temp"])))
+            lock.notify_all()
+
+def wait_for(what, temp, since, timeout):
+    # Time of first event in what with temp, after since, or None
+    end = now() + timeout
+    with lock:
+        while True:
+            for t, k in what:
+                if t >= since and k == temp:
+                    return t
+            if now() >= end or sim.poll() is not None:
+                return None
+            lock.wait(end - now())
+
+def percentiles(name, values):
+    if not values:
+        print("%-18s none" % name)
+        return
+    values = sorted(values)
+    def p(n):
+        return values[min(len(values) - 1, int(len(values) * n / 100))] * 1000
+    print("%-18s %5d  p50 %7.1fms  p90 %7.1fms  p99 %7.1fms  max %7.1fms" % (name, len(values), p(50), p(90), p(99), values[-1] * 1000))
+
+parser = argparse.ArgumentParser(description="Faikout command to A/C to status latency, using a simulator")
+parser.add_argument("--host", default="localhost", help="MQTT broker (default localhost)")
+parser.add_argument("--burst", type=int, default=1, help="Commands per burst (default 1)")
+parser.add_argument("--bursts", type=int, default=10, help="Number of bursts (default 10)")
+parser.add_argument("--spacing", type=float, default=0, help="Between commands in a burst (ms, default 0)")
+parser.add_argument("--gap", type=float, default=2000, help="After a burst settles, before the next (ms, default 2000)")
+parser.add_argument("--timeout", type=float, default=30, help="For a burst to settle (s, default 30)")
+parser.add_argument("-v", "--verbose", action="store_true", help="Show each command")
+parser.add_argument("name", help="Faikin name")
+parser.add_argument("simulator", nargs=argparse.REMAINDER, help="Simulator command, e.g. ./faikin-s21 -p /dev/ttyUSB0")
+args = parser.parse_args()
+
+if not args.simulator or args.burst < 1 or args.burst > 20:
+    parser.error("need a simulator command, and --burst 1 to 20")
+
+# The simulator's output on a pty, so it is line buffered, and each line timestamped as it happens
+master, slave = pty.openpty()
+sim = subprocess.Popen(args.simulator, stdout=slave, stderr=subprocess.DEVNULL, stdin=subprocess.DEVNULL)
+os.close(slave)
+threading.Thread(target=read_simulator, args=(master,), daemon=True).start()
+
+mqttc = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
+mqttc.on_connect = on_connect
+mqttc.on_message = on_message
+mqttc.connect(args.host, 1883, 60)
+mqttc.loop_start()
+
+with lock:
+    lock.wait_for(lambda: connected, 10)
+if not connected:
+    print("Cannot connect to", args.host)
+    sim.terminate()
+    sys.exit(255)
+time.sleep(1) # Faikout and simulator talking
+
+# Targets to cycle through, each different from the last, so each command can be told apart
+temps = [18 + 0.5 * n for n in range(25)]
+next_temp = 0
+to_ac = []
+to_status = []
+total = []
+superseded = 0
+lost = 0
+sent = 0
+busy = 0.0
+
+for b in range(args.bursts):
+    burst = []
+    for n in range(args.burst):
+        temp = temps[next_temp % len(temps)]
+        next_temp += 1
+        t0 = now()
+        mqttc.publish("command/{}/temp".format(args.name), "%.1f" % temp)
+        burst.append((t0, key(temp), temp))
+        sent += 1
+        if args.spacing and n + 1 < args.burst:
+            time.sleep(args.spacing / 1000)
+    # Settled when the last one is in status, earlier ones may be superseded before being sent
+    last = burst[-1]
+    done = wait_for(status, last[1], last[0], args.timeout)
+    for i, (t0, k, temp) in enumerate(burst):
+        t1 = wait_for(applied, k, t0, 0)
+        t2 = wait_for(status, k, t1 or t0, 0)
+        if args.verbose:
+            print("%2d/%-2d %4.1f  ac %s  status %s" % (b + 1, i + 1, temp,
+                  "%7.1fms" % ((t1 - t0) * 1000) if t1 else "      -  ",
+                  "%7.1fms" % ((t2 - t0) * 1000) if t2 else "      -"))
+        if t1:
+            to_ac.append(t1 - t0)
+        if t1 and t2:
+            to_status.append(t2 - t1)
+        if t2:
+            total.append(t2 - t0)
+        elif i + 1 < len(burst):
+            superseded += 1
+        else:
+            lost += 1
+    busy += (done or now()) - burst[0][0]
+    if sim.poll() is not None:
+        print("Simulator has stopped")
+        break
+    if not done:
+        print("Burst %d did not settle" % (b + 1))
+    time.sleep(args.gap / 1000)
+
+mqttc.loop_stop()
+sim.terminate()
+
+print("%d commands, %d bursts of %d" % (sent, b + 1, args.burst))
+percentiles("command to A/C", to_ac)
+percentiles("A/C to status", to_status)
+percentiles("command to status", total)
+if busy:
+    print("throughput %.2f commands/s, %.2f applied/s" % (sent / busy, len(total) / busy))
+if superseded:
+    print("%d superseded by a later command in the burst before being sent" % superseded)
+if lost:
+    print("%d not seen in status (is livestatus on?)" % lost)
+sys.exit(1 if lost else 0)
@@ -1,10 +1,44 @@
+#define _GNU_SOURCE        // posix_openpt() and friends
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <limits.h>
 
 #include "osal.h"
 
+#define HEADER(mem) ((struct shmem_header *) ((char *) (mem) - SHMEM_HEADER))
+
+static void *shmem_init(void *pBuf, void *data, unsigned int size, unsigned int count, unsigned int version)
+{
+   struct shmem_header *h = pBuf;
+
+   memset(h, 0, SHMEM_HEADER);
+   h->magic = SHMEM_MAGIC;
+   h->version = version;
+   h->size = size;
+   h->count = count;
+   memcpy((char *) pBuf + SHMEM_HEADER, data, size * count);
+   return (char *) pBuf + SHMEM_HEADER;
+}
+
+static void *shmem_check(void *pBuf, unsigned int size, unsigned int count, unsigned int version)
+{
+   struct shmem_header *h = pBuf;
+
+   if (h->magic != SHMEM_MAGIC || h->version != version || h->size != size) {
+      fprintf(stderr, "Shared memory is not from this build of the simulator (version %u size %u, expected version %u size %u)\n",
+              h->magic == SHMEM_MAGIC ? h->version : 0, h->magic == SHMEM_MAGIC ? h->size : 0, version, size);
+      return NULL;
+   }
+   if (h->count < count) {
+      fprintf(stderr, "Simulator has %u units\n", h->count);
+      return NULL;
+   }
+   return (char *) pBuf + SHMEM_HEADER;
+}
+
 #ifdef WIN32
 
 int set_serial(int p, unsigned int speed, unsigned int bits, unsigned int parity, unsigned int stop)
@@ -27,6 +61,12 @@ int set_serial(int p, unsigned int speed, unsigned int bits, unsigned int parity
    return 0;
 }
 
+int open_pty(char *name, unsigned int len)
+{
+   fprintf(stderr, "No pty on Windows, use a serial port, e.g. with com0com\n");
+   return -1;
+}
+
 // This implementation is not tested, sorry
 int wait_read(int p, unsigned int timeout)
 {
@@ -42,9 +82,10 @@ int wait_read(int p, unsigned int timeout)
 
 static HANDLE hMapFile;
 
-void *create_shmem(const char *name, void *data, unsigned int len)
+void *create_shmem(const char *name, void *data, unsigned int size, unsigned int count, unsigned int version)
 {
    void *pBuf;
+   unsigned int len = SHMEM_HEADER + size * count;
 
    hMapFile = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, len, name);
    if (hMapFile == NULL)
@@ -62,12 +103,10 @@ void *create_shmem(const char *name, void *data, unsigned int len)
        return NULL;
    }
 
-   CopyMemory(pBuf, data, len);
-
-   return pBuf;
+   return shmem_init(pBuf, data, size, count, version);
 }
 
-void *open_shmem(const char *name, unsigned int len)
+void *open_shmem(const char *name, unsigned int size, unsigned int count, unsigned int version)
 {
    void *pBuf;
 
@@ -79,7 +118,8 @@ void *open_shmem(const char *name, unsigned int len)
       return NULL;
    }
 
-   pBuf = MapViewOfFile(hMapFile, FILE_MAP_ALL_ACCESS, 0, 0, len);
+   // Just the header first, to see how much there is
+   pBuf = MapViewOfFile(hMapFile, FILE_MAP_ALL_ACCESS, 0, 0, SHMEM_HEADER);
 
    if (pBuf == NULL)
    {
@@ -88,12 +128,17 @@ void *open_shmem(const char *name, unsigned int len)
       return NULL;
    }
 
-   return pBuf;
+   if (!shmem_check(pBuf, size, count, version))
+      return NULL;
+   count = ((struct shmem_header *) pBuf)->count;
+   UnmapViewOfFile(pBuf);
+   pBuf = MapViewOfFile(hMapFile, FILE_MAP_ALL_ACCESS, 0, 0, SHMEM_HEADER + size * count);
+   return pBuf ? (char *) pBuf + SHMEM_HEADER : NULL;
 }
 
 void close_shmem(void *mem)
 {
-   UnmapViewOfFile(mem);
+   UnmapViewOfFile(HEADER(mem));
    CloseHandle(hMapFile);
 }
 
@@ -102,6 +147,7 @@ void close_shmem(void *mem)
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 
 int set_serial(int p, unsigned int speed, unsigned int bits, unsigned int parity, unsigned int stop)
 {
@@ -126,6 +172,28 @@ int set_serial(int p, unsigned int speed, unsigned int bits, unsigned int parity
    return 0;
 }
 
+int open_pty(char *name, unsigned int len)
+{
+   int p = posix_openpt(O_RDWR | O_NOCTTY);
+   if (p < 0) {
+      perror("Cannot open pty");
+      return -1;
+   }
+   if (grantpt(p) || unlockpt(p) || !ptsname(p)) {
+      perror("Cannot set up pty");
+      close(p);
+      return -1;
+   }
+   snprintf(name, len, "%s", ptsname(p));
+   // Keep the slave open, so the master does not see EIO whenever the user closes it
+   if (open(name, O_RDWR | O_NOCTTY) < 0) {
+      perror("Cannot open pty slave");
+      close(p);
+      return -1;
+   }
+   return p;
+}
+
 int wait_read(int p, unsigned int timeout)
 {
     fd_set          r;
@@ -159,6 +227,20 @@ void *create_shmem_internal(const char *name, unsigned int len, int oflag)
       return NULL;
    }
 
+   struct stat st;
+
+   if (!(oflag & O_CREAT))
+   {
+      // All there is, as mapping past the end would fault, e.g. a simulator from before the header
+      if (fstat(shm_fd, &st) || st.st_size < SHMEM_HEADER)
+      {
+         fprintf(stderr, "Shared memory is not from this build of the simulator\n");
+         close(shm_fd);
+         return NULL;
+      }
+      len = st.st_size;
+   }
+
    pBuf = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd, 0);
 
    if (pBuf == MAP_FAILED)
@@ -171,21 +253,23 @@ void *create_shmem_internal(const char *name, unsigned int len, int oflag)
    return pBuf;
 }
 
-void *create_shmem(const char *name, void* data, unsigned int len)
+void *create_shmem(const char *name, void* data, unsigned int size, unsigned int count, unsigned int version)
 {
-   void *pBuf = create_shmem_internal(name, len, O_RDWR|O_CREAT);
+   void *pBuf = create_shmem_internal(name, SHMEM_HEADER + size * count, O_RDWR|O_CREAT);
 
    if (pBuf)
-      memcpy(pBuf, data, len);
-   else if (shm_fd != -1)
+      return shmem_init(pBuf, data, size, count, version);
+   if (shm_fd != -1)
       shm_unlink(name);
 
-   return pBuf;
+   return NULL;
 }
 
-void *open_shmem(const char *name, unsigned int len)
+void *open_shmem(const char *name, unsigned int size, unsigned int count, unsigned int version)
 {
-   return create_shmem_internal(name, len, O_RDWR);
+   void *pBuf = create_shmem_internal(name, 0, O_RDWR);
+
+   return pBuf ? shmem_check(pBuf, size, count, version) : NULL;
 }
 
 void close_shmem(void *mem)
@@ -194,3 +278,176 @@ void close_shmem(void *mem)
 }
 
 #endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Not FUTEX_PRIVATE, as the word is shared between processes
+static void futex_wait(unsigned int *word, unsigned int value, unsigned int timeout)
+{
+   struct timespec ts = {timeout / 1000, timeout % 1000 * 1000000};
+
+   syscall(SYS_futex, word, FUTEX_WAIT, value, timeout ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int *word)
+{
+   syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#else
+// No futex, so poll
+static void futex_wait(unsigned int *word, unsigned int value, unsigned int timeout)
+{
+   usleep(timeout && timeout < 10 ? timeout * 1000 : 10000);
+}
+
+static void futex_wake(unsigned int *word)
+{
+}
+#endif
+
+void shmem_lock(void *mem)
+{
+   struct shmem_header *h = HEADER(mem);
+
+   // Taking seq from even to odd also keeps other writers out
+   while (1) {
+      unsigned int seq = __atomic_load_n(&h->seq, __ATOMIC_RELAXED);
+
+      if (!(seq & 1) && __atomic_compare_exchange_n(&h->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+         break;
+      usleep(100);
+   }
+}
+
+unsigned int shmem_unlock(void *mem, int notify)
+{
+   struct shmem_header *h = HEADER(mem);
+
+   __atomic_add_fetch(&h->seq, 1, __ATOMIC_RELEASE);
+   if (!notify)
+      return __atomic_load_n(&h->changes, __ATOMIC_ACQUIRE);
+   unsigned int changes = __atomic_add_fetch(&h->changes, 1, __ATOMIC_RELEASE);
+
+   futex_wake(&h->changes);
+   return changes;
+}
+
+void shmem_read(void *mem, const void *from, void *copy, unsigned int len)
+{
+   struct shmem_header *h = HEADER(mem);
+
+   while (1) {
+      unsigned int seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+
+      if (seq & 1) {
+         usleep(100);
+         continue;
+      }
+      memcpy(copy, from, len);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq)
+         break;
+   }
+}
+
+void shmem_merge(void *mem, void *to, const void *before, const void *after, unsigned int len)
+{
+   const unsigned char *b = before, *a = after;
+   unsigned char *t = to;
+
+   if (!memcmp(before, after, len))
+      return;
+   shmem_lock(mem);
+   for (unsigned int i = 0; i < len; i++)
+      if (a[i] != b[i])
+         t[i] = a[i];
+   shmem_unlock(mem, 0);
+}
+
+unsigned int shmem_changes(void *mem)
+{
+   return __atomic_load_n(&HEADER(mem)->changes, __ATOMIC_ACQUIRE);
+}
+
+unsigned int shmem_wait_changes(void *mem, unsigned int changes, unsigned int timeout)
+{
+   struct shmem_header *h = HEADER(mem);
+   unsigned long long end = time_us() + timeout * 1000ULL;
+   unsigned int c;
+
+   while ((c = __atomic_load_n(&h->changes, __ATOMIC_ACQUIRE)) == changes) {
+      unsigned long long now = time_us();
+
+      if (timeout && now >= end)
+         break;
+      futex_wait(&h->changes, changes, timeout ? (end - now + 999) / 1000 : 0);
+   }
+   return c;
+}
+
+void shmem_seen(void *mem, unsigned int changes)
+{
+   struct shmem_header *h = HEADER(mem);
+
+   __atomic_store_n(&h->seen, changes, __ATOMIC_RELEASE);
+   futex_wake(&h->seen);
+}
+
+int shmem_wait_seen(void *mem, unsigned int changes, unsigned int timeout)
+{
+   struct shmem_header *h = HEADER(mem);
+   unsigned long long end = time_us() + timeout * 1000ULL;
+   unsigned int seen;
+
+   // Counts wrap, so compare the difference
+   while ((int) ((seen = __atomic_load_n(&h->seen, __ATOMIC_ACQUIRE)) - changes) < 0) {
+      unsigned long long now = time_us();
+
+      if (now >= end)
+         return -1;
+      futex_wait(&h->seen, seen, (end - now + 999) / 1000);
+   }
+   return 0;
+}
+
+unsigned long long time_us(void)
+{
+#ifdef WIN32
+   return GetTickCount64() * 1000ULL;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+void throttle_init(struct throttle *t, unsigned int speed, unsigned int bits, unsigned int parity, unsigned int stop)
+{
+   // Start bit, data bits, parity bit, stop bits
+   unsigned int n = 1 + (bits == CS5 ? 5 : bits == CS6 ? 6 : bits == CS7 ? 7 : 8) + (parity ? 1 : 0) + (stop == TWOSTOPBITS ? 2 : 1);
+
+   t->us = speed ? n * 1000000 / speed : 0;
+   t->next = 0;
+}
+
+unsigned long long throttle_slot(struct throttle *t)
+{
+   unsigned long long now = time_us();
+
+   if (t->next < now)
+      t->next = now;         // Line was idle
+   t->next += t->us;
+   return t->next;
+}
+
+void throttle_wait(struct throttle *t)
+{
+   if (!t->us)
+      return;
+   unsigned long long done = throttle_slot(t), now = time_us();
+
+   if (done > now)
+      usleep(done - now);
+}
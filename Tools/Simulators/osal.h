@@ -20,7 +20,53 @@
 #endif
 
 int set_serial(int pm, unsigned int speed, unsigned int bits, unsigned int parity, unsigned int stop);
+// Pseudo terminal instead of a serial port, so no hardware is needed, slave path put in name, returns master or -1
+int open_pty(char *name, unsigned int len);
 int wait_read(int p, unsigned int timeout);
-void *create_shmem(const char *name, void* data, unsigned int len);
-void *open_shmem(const char *name, unsigned int len);
+// Shared memory starts with a header, so a control tool built for a different state layout is refused, and the
+// simulator and control tool can update several fields consistently, and see each other's changes at once
+#define SHMEM_MAGIC  0x4E494B46 // "FKIN"
+#define SHMEM_HEADER 64         // Header size, state follows
+struct shmem_header
+{
+   unsigned int magic;
+   unsigned int version;  // State layout version, from the simulator
+   unsigned int size;     // State size (bytes)
+   unsigned int count;    // States, e.g. units with faikin-s21 --units
+   unsigned int seq;      // Seqlock, odd while being written
+   unsigned int changes;  // Count of changes by control tools, futex word on Linux
+   unsigned int seen;     // Changes the simulator has taken in, futex word on Linux
+};
+// Create with a copy of data, an array of count states of size bytes, returns the state (after the header)
+void *create_shmem(const char *name, void* data, unsigned int size, unsigned int count, unsigned int version);
+// Open from a control tool, returns the state, or NULL if none, not the same version and size, or fewer than count
+void *open_shmem(const char *name, unsigned int size, unsigned int count, unsigned int version);
 void close_shmem(void *mem);
+// Seqlock, mem is as returned by create_shmem()/open_shmem(), from/to within it
+// Lock for writing in place, notify if a control tool change, returns changes
+void shmem_lock(void *mem);
+unsigned int shmem_unlock(void *mem, int notify);
+// Consistent copy, not torn by a write
+void shmem_read(void *mem, const void *from, void *copy, unsigned int len);
+// Write back only bytes changed from before to after, so changes by a control tool meanwhile are kept
+void shmem_merge(void *mem, void *to, const void *before, const void *after, unsigned int len);
+// Change notification, wait for changes not to be as given (timeout ms, 0 for none), returns changes
+unsigned int shmem_changes(void *mem);
+unsigned int shmem_wait_changes(void *mem, unsigned int changes, unsigned int timeout);
+// Simulator has taken in changes, and control tool waiting for that, returns 0 if it has
+void shmem_seen(void *mem, unsigned int changes);
+int shmem_wait_seen(void *mem, unsigned int changes, unsigned int timeout);
+
+// Line rate throttle, as a pty has no baud rate, so bytes are paced as on a real serial line
+struct throttle
+{
+   unsigned int us;              // Time per character (us), 0 for no throttle
+   unsigned long long next;      // Time line is free (us)
+};
+void throttle_init(struct throttle *t, unsigned int speed, unsigned int bits, unsigned int parity, unsigned int stop);
+// Wait for a character to be on the line, call after reading, or before writing, each byte
+void throttle_wait(struct throttle *t);
+// As throttle_wait, but does not wait, returns when the character is done on the line (us)
+unsigned long long throttle_slot(struct throttle *t);
+// Monotonic time (us)
+unsigned long long time_us(void);
@@ -1,26 +1,107 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "faikin-s21.h"
 #include "osal.h"
+#include "scenario.h"
+
+static int parse(int argc, const char **argv, void *state)
+{
+    return parse_item(argc, argv, state);
+}
 
 int main(int argc, const char **argv)
 {
-    if (argc < 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
-        fprintf(stderr, "Usage: %s <option> <value>\n", argv[0]);
+    const char *shmname = SHARED_MEM_NAME;
+    const char *scenario = NULL;
+    double speed = 1;
+    int first = 0, last = 0, sync = 0;
+
+    while (argc > 2 && argv[1][0] == '-' && strcmp(argv[1], "-h") && strcmp(argv[1], "--help")) {
+        if (!strcmp(argv[1], "--sync")) {
+            sync = 1;
+            argv[1] = argv[0];
+            argc--;
+            argv++;
+            continue;
+        }
+        if (!strcmp(argv[1], "-n") || !strcmp(argv[1], "--name")) {
+            // Simulator started with the same -n option
+            shmname = argv[2];
+        } else if (!strcmp(argv[1], "-u") || !strcmp(argv[1], "--unit")) {
+            // Simulator started with --units, a unit, or range of units
+            const char *r = strchr(argv[2], '-');
+
+            first = last = atoi(argv[2]);
+            if (r)
+                last = atoi(r + 1);
+        } else if (!strcmp(argv[1], "-f") || !strcmp(argv[1], "--scenario")) {
+            scenario = argv[2];
+        } else if (!strcmp(argv[1], "--speed")) {
+            speed = atof(argv[2]);
+        } else
+            break;
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+
+    if ((argc < 2 && !scenario) || (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) || first < 0 || last < first) {
+        fprintf(stderr, "Usage: %s [--sync] [-n <name>] [-u <unit>[-<unit>]] <option> <value> [<option> <value>...]\n"
+                        "       %s [-n <name>] [-u <unit>[-<unit>]] -f <scenario> [--speed <n>]\n"
+                        "Options are applied together, --sync waits for the simulator to have taken them in\n"
+                        "Scenario file lines are <time> [@<unit>] <options>, time as seconds, M:SS or H:MM:SS, or +time from\n"
+                        "the line before, and options can include ramp <seconds> <option> <from> <to>, e.g.\n"
+                        "0 power 1 mode 1 temp 21\n"
+                        "+10:00 ramp 1:00:00 outside 10 2\n"
+                        "1:30:00 @1 model 135D\n", argv[0], argv[0]);
         state_options_help();
         return -1;
     }
 
-    struct S21State *state = open_shmem(SHARED_MEM_NAME, sizeof(struct S21State));
+    int units = last + 1;
+
+    if (scenario) {
+        int n = scenario_units(scenario);
+
+        if (n < 0)
+            return -1;
+        if (n > units)
+            units = n;
+    }
+
+    struct S21State *state = open_shmem(shmname, sizeof(struct S21State), units, SHARED_MEM_VERSION);
 
     if (!state) {
         fprintf(stderr, "Failed to open shared memory from the simulator\n");
         return -1;
     }
 
-    if (parse_item(argc - 1, &argv[1], state) < 1) {
-        fprintf(stderr, "Invalid command line given\n");
+    if (scenario) {
+        if (scenario_run(scenario, speed, state, sizeof(*state), first, last, parse))
+            return -1;
+    } else {
+        struct S21State check;
+        unsigned int changes;
+
+        // Check all options first, on a copy of each unit, so a mistake changes nothing
+        for (int u = first; u <= last; u++) {
+            shmem_read(state, &state[u], &check, sizeof(check));
+            for (int a = 1, n; a < argc; a += n)
+                if ((n = parse_item(argc - a, &argv[a], &check)) < 1) {
+                    fprintf(stderr, "Invalid command line given: %s\n", argv[a]);
+                    close_shmem(state);
+                    return -1;
+                }
+        }
+        shmem_lock(state);
+        for (int u = first; u <= last; u++)
+            for (int a = 1; a < argc;)
+                a += parse_item(argc - a, &argv[a], &state[u]);
+        changes = shmem_unlock(state, 1);
+        if (sync && shmem_wait_seen(state, changes, 5000))
+            fprintf(stderr, "Simulator has not taken the change in\n");
     }
 
     close_shmem(state);
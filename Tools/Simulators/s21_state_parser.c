@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "faikin-s21.h"
 
@@ -116,6 +117,17 @@ static int parse_float(int argc, const char **argv, float *v)
     return 2;
 }
 
+// Temperature in C, kept multiplied by 10
+static int parse_temp(int argc, const char **argv, int *v)
+{
+    float t;
+    int ret = parse_float(argc, argv, &t);
+
+    if (ret > 0)
+        *v = lroundf(t * 10);
+    return ret;
+}
+
 static int parse_string(int argc, const char **argv, char *v, unsigned int len)
 {
     const char *opt = argv[0];
@@ -129,6 +141,25 @@ static int parse_string(int argc, const char **argv, char *v, unsigned int len)
     return 2;
 }
 
+// Add a command to NAK, or none to clear
+static int parse_nak(int argc, const char **argv, char *v, unsigned int len)
+{
+    if (argc < 2) {
+        fprintf(stderr, "%s: command is required\n", argv[0]);
+        return -1;
+    }
+    if (!strcmp(argv[1], "none"))
+        *v = 0;
+    else if (strlen(v) + strlen(argv[1]) + 2 > len) {
+        fprintf(stderr, "%s: too many commands\n", argv[0]);
+        return -1;
+    } else {
+        strcat(v, " ");
+        strcat(v, argv[1]);
+    }
+    return 2;
+}
+
 static int parse_enum(int argc, const char **argv, unsigned int*v, const struct EnumOption* opts)
 {
     const char *opt = argv[0];
@@ -221,12 +252,14 @@ void state_options_help(void)
            " streamer <bool> - streamer mode on/off\n"
            " sensor <bool> - sensor mode on/off\n"
            " temp <float> - Target temperature in C\n"
+           " home, outside, inlet <float> - Reported temperatures in C\n"
            " hum_sensor <int> - Reported indoor humidity\n"
            " fanrpm <int> - Fan rpm (divided by 10)\n"
 	       " comprpm <int> - Compressor rpm\n");
     enum_option("demand", "Demand mode setting", demand);
     printf(" consumption <int> - Reported power consumption\n"
-           " protocol <major>.<minor> - Reported protocol version. Major and minor are 2 digits max.\n");
+           " protocol <major>.<minor> - Reported protocol version. Major and minor are 2 digits max.\n"
+           " nak <command> - NAK a command, e.g. FU55, as not supported by the model, none to clear\n");
 #define RAW_OPTION(cmd) raw_option(#cmd, sizeof(state->cmd))
     RAW_OPTION(F2);
     RAW_OPTION(F3);
@@ -313,6 +346,14 @@ int parse_item(int argc, const char **argv, struct S21State *state)
         return parse_bool(argc, argv, &state->eco);
     } else if (!strcmp(opt, "temp")) {
         return parse_float(argc, argv, &state->temp);
+    } else if (!strcmp(opt, "home")) {
+        return parse_temp(argc, argv, &state->home);
+    } else if (!strcmp(opt, "outside")) {
+        return parse_temp(argc, argv, &state->outside);
+    } else if (!strcmp(opt, "inlet")) {
+        return parse_temp(argc, argv, &state->inlet);
+    } else if (!strcmp(opt, "fanrpm")) {
+        return parse_int(argc, argv, &state->fanrpm);
     } else if (!strcmp(opt, "hum_sensor")) {
         return parse_int(argc, argv, &state->hum_sensor);
     } else if (!strcmp(opt, "comprpm")) {
@@ -325,6 +366,8 @@ int parse_item(int argc, const char **argv, struct S21State *state)
         return parse_protocol(argc, argv, state);
     } else if (!strcmp(opt, "model")) {
         return parse_string(argc, argv, state->model, sizeof(state->model));
+    } else if (!strcmp(opt, "nak")) {
+        return parse_nak(argc, argv, state->nak, sizeof(state->nak));
     }
 #define PARSE_RAW(cmd)               \
     else if (!strcmp(argv[0], #cmd)) \
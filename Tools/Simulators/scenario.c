@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "scenario.h"
+#include "osal.h"
+
+struct event
+{
+   double t;        // Simulated time (s)
+   int unit;        // -1 for first to last
+   int argc;
+   char **argv;     // State options, or for a ramp the option
+   double ramp;     // Ramp time (s), 0 for none
+   double from, to; // Ramp values
+   int integer;     // Ramp values are whole numbers
+   int done;
+   char *text;      // Line, to show when applied, first event of a line only
+};
+
+static struct event *events;
+static int nevents;
+
+static void free_events(void)
+{
+   for (int e = 0; e < nevents; e++) {
+      for (int a = 0; a < events[e].argc; a++)
+         free(events[e].argv[a]);
+      free(events[e].argv);
+      free(events[e].text);
+   }
+   free(events);
+   events = NULL;
+   nevents = 0;
+}
+
+static struct event *add_event(void)
+{
+   struct event *e;
+
+   events = realloc(events, (nevents + 1) * sizeof(*events));
+   if (!events) {
+      fprintf(stderr, "Out of memory\n");
+      exit(255);
+   }
+   e = &events[nevents++];
+   memset(e, 0, sizeof(*e));
+   return e;
+}
+
+// Seconds, M:SS or H:MM:SS, returns -1 if not valid
+static double parse_time(const char *s)
+{
+   double t = 0;
+
+   while (1) {
+      char *end;
+      double v = strtod(s, &end);
+
+      if (end == s || v < 0)
+         return -1;
+      t = t * 60 + v;
+      if (!*end)
+         return t;
+      if (*end != ':')
+         return -1;
+      s = end + 1;
+   }
+}
+
+// Whole string is a number, returns 0 if not
+static int parse_number(const char *s, double *v)
+{
+   char *end;
+
+   *v = strtod(s, &end);
+   return end != s && !*end;
+}
+
+static int is_integer(const char *s)
+{
+   return !strchr(s, '.') && !strchr(s, 'e') && !strchr(s, 'E');
+}
+
+// Split a line into words, returns count, line is modified
+static int split(char *p, char **argv, int max)
+{
+   int argc = 0;
+
+   while (argc < max) {
+      while (isspace((int) *p))
+         p++;
+      if (!*p || *p == '#')
+         break;
+      argv[argc++] = p;
+      while (*p && !isspace((int) *p))
+         p++;
+      if (!*p)
+         break;
+      *p++ = 0;
+   }
+   return argc;
+}
+
+static int load(const char *filename)
+{
+   char line[1024];
+   int n = 0;
+   double last = 0;
+   FILE *f = fopen(filename, "r");
+
+   if (!f) {
+      perror(filename);
+      return -1;
+   }
+   free_events();
+   while (fgets(line, sizeof(line), f)) {
+      char *argv[64], text[sizeof(line)];
+      int argc, a = 0, unit = -1, first = 1;
+      double t;
+
+      n++;
+      line[strcspn(line, "\r\n#")] = 0;
+      for (int l = strlen(line); l && isspace((int) line[l - 1]); l--)
+         line[l - 1] = 0;
+      strcpy(text, line);
+      argc = split(line, argv, sizeof(argv) / sizeof(*argv));
+      if (!argc)
+         continue;
+      t = parse_time(argv[a][0] == '+' ? argv[a] + 1 : argv[a]);
+      if (t < 0) {
+         fprintf(stderr, "%s:%d: Bad time %s\n", filename, n, argv[a]);
+         goto bad;
+      }
+      if (argv[a][0] == '+')
+         t += last;
+      else if (t < last) {
+         fprintf(stderr, "%s:%d: Time %s is before the line before\n", filename, n, argv[a]);
+         goto bad;
+      }
+      last = t;
+      a++;
+      if (a < argc && argv[a][0] == '@') {
+         unit = atoi(argv[a] + 1);
+         if (unit < 0 || !isdigit((int) argv[a][1])) {
+            fprintf(stderr, "%s:%d: Bad unit %s\n", filename, n, argv[a]);
+            goto bad;
+         }
+         a++;
+      }
+      if (a == argc) {
+         fprintf(stderr, "%s:%d: No state options\n", filename, n);
+         goto bad;
+      }
+      while (a < argc) {
+         struct event *e = add_event();
+         int b = a;
+
+         e->t = t;
+         e->unit = unit;
+         if (first)
+            e->text = strdup(text);
+         first = 0;
+         if (!strcmp(argv[a], "ramp")) {
+            if (argc - a < 5 || (e->ramp = parse_time(argv[a + 1])) <= 0) {
+               fprintf(stderr, "%s:%d: Expecting ramp <seconds> <option> <from> <to>\n", filename, n);
+               goto bad;
+            }
+            if (!parse_number(argv[a + 3], &e->from) || !parse_number(argv[a + 4], &e->to)) {
+               fprintf(stderr, "%s:%d: Bad ramp %s %s, expecting numbers\n", filename, n, argv[a + 3], argv[a + 4]);
+               goto bad;
+            }
+            e->integer = is_integer(argv[a + 3]) && is_integer(argv[a + 4]);
+            b = a + 2;
+            a += 5;
+            e->argc = 1;
+         } else {
+            // Up to the next ramp, if any
+            while (a < argc && strcmp(argv[a], "ramp"))
+               a++;
+            e->argc = a - b;
+         }
+         e->argv = malloc(e->argc * sizeof(*e->argv));
+         for (int i = 0; i < e->argc; i++)
+            e->argv[i] = strdup(argv[b + i]);
+      }
+   }
+   fclose(f);
+   return 0;
+
+ bad:
+   fclose(f);
+   free_events();
+   return -1;
+}
+
+int scenario_units(const char *filename)
+{
+   int units = 0;
+
+   if (load(filename))
+      return -1;
+   for (int e = 0; e < nevents; e++)
+      if (events[e].unit + 1 > units)
+         units = events[e].unit + 1;
+   free_events();
+   return units;
+}
+
+// Apply an event to one unit, at time now for a ramp, returns -1 if not valid
+static int apply(struct event *e, double now, void *state, scenario_parse_t *parse)
+{
+   if (e->ramp) {
+      char value[32];
+      const char *argv[2] = {e->argv[0], value};
+      double f = (now - e->t) / e->ramp;
+
+      if (f > 1)
+         f = 1;
+      if (e->integer)
+         snprintf(value, sizeof(value), "%.0f", e->from + (e->to - e->from) * f);
+      else
+         snprintf(value, sizeof(value), "%.2f", e->from + (e->to - e->from) * f);
+      return parse(2, argv, state) < 1 ? -1 : 0;
+   }
+   for (int a = 0; a < e->argc;) {
+      int n = parse(e->argc - a, (const char **) e->argv + a, state);
+
+      if (n < 1)
+         return -1;
+      a += n;
+   }
+   return 0;
+}
+
+static void apply_units(struct event *e, double now, void *state, size_t size, int first, int last, scenario_parse_t *parse)
+{
+   // All units at once, as the simulator sees it
+   shmem_lock(state);
+   if (e->unit >= 0)
+      apply(e, now, (char *) state + e->unit * size, parse);
+   else
+      for (int u = first; u <= last; u++)
+         apply(e, now, (char *) state + u * size, parse);
+   shmem_unlock(state, 1);
+}
+
+int scenario_run(const char *filename, double speed, void *state, size_t size, int first, int last, scenario_parse_t *parse)
+{
+   void *check;
+   unsigned long long start;
+   int next = 0;
+
+   if (load(filename))
+      return -1;
+   if (speed <= 0)
+      speed = 1;
+   // Check all lines first, on a copy, so a mistake doesn't stop a run part way
+   check = malloc(size);
+   memcpy(check, (char *) state + first * size, size);
+   for (int e = 0; e < nevents; e++)
+      if (apply(&events[e], events[e].t + events[e].ramp, check, parse)) {
+         fprintf(stderr, "%s: Invalid state option in: %s\n", filename, events[e].text ? events[e].text : events[e].argv[0]);
+         free(check);
+         free_events();
+         return -1;
+      }
+   free(check);
+
+   start = time_us();
+   while (1) {
+      double now = (time_us() - start) * speed / 1000000;
+      int ramping = 0;
+
+      while (next < nevents && events[next].t <= now) {
+         struct event *e = &events[next++];
+
+         if (e->text) {
+            int s = e->t;
+
+            printf("%d:%02d:%02d %s\n", s / 3600, s / 60 % 60, s % 60, e->text);
+            fflush(stdout);
+         }
+         if (!e->ramp) {
+            apply_units(e, now, state, size, first, last, parse);
+            e->done = 1;
+         }
+      }
+      for (int e = 0; e < next; e++)
+         if (!events[e].done) {
+            apply_units(&events[e], now, state, size, first, last, parse);
+            if (now >= events[e].t + events[e].ramp)
+               events[e].done = 1;
+            else
+               ramping = 1;
+         }
+      if (next == nevents && !ramping)
+         break;
+      // Sleep until next line, or a while if ramping
+      double wait = next < nevents ? (events[next].t - now) / speed : 1;
+
+      if (wait > 1)
+         wait = 1;
+      if (ramping && wait > 0.1)
+         wait = 0.1;
+      if (wait > 0)
+         usleep(wait * 1000000);
+   }
+   free_events();
+   return 0;
+}
@@ -0,0 +1,18 @@
+// Scenario runner, replays timed state changes from a file against a simulator's shared memory
+// Shared by s21-control and x50-control
+//
+// Each line is <time> [@<unit>] <state options>, # starts a comment
+// time is seconds, M:SS or H:MM:SS from the start, or +time from the line before
+// ramp <seconds> <option> <from> <to> as a state option changes it linearly over that time
+// Without @unit, a line applies to all units from first to last
+
+#include <stddef.h>
+
+// Parse a state option, as parse_item(), returns args used or -1
+typedef int scenario_parse_t(int argc, const char **argv, void *state);
+
+// Highest @unit in the file plus 1, 0 if none, -1 if it cannot be read
+int scenario_units(const char *filename);
+// Check and run, speed is simulated seconds per real second, state is an array of units of size bytes, from open_shmem()
+// Returns 0 when done, -1 if the file is not valid
+int scenario_run(const char *filename, double speed, void *state, size_t size, int first, int last, scenario_parse_t *parse);
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "faikin-x50.h"
+#include "osal.h"
+#include "scenario.h"
+
+static int parse(int argc, const char **argv, void *state)
+{
+    return parse_item(argc, argv, state);
+}
+
+int main(int argc, const char **argv)
+{
+    const char *shmname = SHARED_MEM_NAME;
+    const char *scenario = NULL;
+    double speed = 1;
+    int sync = 0;
+
+    while (argc > 2 && argv[1][0] == '-' && strcmp(argv[1], "-h") && strcmp(argv[1], "--help")) {
+        if (!strcmp(argv[1], "--sync")) {
+            sync = 1;
+            argv[1] = argv[0];
+            argc--;
+            argv++;
+            continue;
+        }
+        if (!strcmp(argv[1], "-n") || !strcmp(argv[1], "--name")) {
+            // Simulator started with the same -n option
+            shmname = argv[2];
+        } else if (!strcmp(argv[1], "-f") || !strcmp(argv[1], "--scenario")) {
+            scenario = argv[2];
+        } else if (!strcmp(argv[1], "--speed")) {
+            speed = atof(argv[2]);
+        } else
+            break;
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+
+    if ((argc < 2 && !scenario) || (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")))) {
+        fprintf(stderr, "Usage: %s [--sync] [-n <name>] <option> <value> [<option> <value>...]\n"
+                        "       %s [-n <name>] -f <scenario> [--speed <n>]\n"
+                        "Options are applied together, --sync waits for the simulator to have taken them in (its next poll)\n"
+                        "Scenario file lines are <time> <options>, time as seconds, M:SS or H:MM:SS, or +time from the line\n"
+                        "before, and options can include ramp <seconds> <option> <from> <to>, e.g.\n"
+                        "0 power 1 mode 1 temp 21\n"
+                        "+10:00 antifreeze 1\n"
+                        "+5:00 antifreeze 0\n", argv[0], argv[0]);
+        state_options_help();
+        return -1;
+    }
+
+    if (scenario && scenario_units(scenario) > 1) {
+        fprintf(stderr, "%s: @unit is only for s21-control\n", scenario);
+        return -1;
+    }
+
+    struct X50AState *state = open_shmem(shmname, sizeof(struct X50AState), 1, SHARED_MEM_VERSION);
+
+    if (!state) {
+        fprintf(stderr, "Failed to open shared memory from the simulator\n");
+        return -1;
+    }
+
+    if (scenario) {
+        if (scenario_run(scenario, speed, state, sizeof(*state), 0, 0, parse))
+            return -1;
+    } else {
+        struct X50AState check;
+        unsigned int changes;
+
+        // Check all options first, on a copy, so a mistake changes nothing
+        shmem_read(state, state, &check, sizeof(check));
+        for (int a = 1, n; a < argc; a += n)
+            if ((n = parse_item(argc - a, &argv[a], &check)) < 1) {
+                fprintf(stderr, "Invalid command line given: %s\n", argv[a]);
+                close_shmem(state);
+                return -1;
+            }
+        shmem_lock(state);
+        for (int a = 1; a < argc;)
+            a += parse_item(argc - a, &argv[a], state);
+        changes = shmem_unlock(state, 1);
+        if (sync && shmem_wait_seen(state, changes, 5000))
+            fprintf(stderr, "Simulator has not taken the change in\n");
+    }
+
+    close_shmem(state);
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "faikin-x50.h"
+
+static int parse_bool(int argc, const char **argv, int *v)
+{
+    const char *opt, *val;
+
+    opt = argv[0];
+
+    if (argc < 2) {
+        fprintf(stderr, "%s: boolean value is required\n", opt);
+        return -1;
+    }
+
+    val = argv[1];
+
+    if (val[0] == '1' || !strcasecmp(val, "true") || !strcasecmp(val, "on"))
+        *v = 1;
+    else if (val[0] == '0' || !strcasecmp(val, "false") || !strcasecmp(val, "off"))
+        *v = 0;
+    else {
+        fprintf(stderr, "%s: Invalid boolean value '%s'\n", opt, val);
+        return -1;
+    }
+
+    return 2;
+}
+
+static int parse_int(int argc, const char **argv, int *v)
+{
+    const char *opt = argv[0];
+    char *endp = NULL;
+
+    if (argc < 2) {
+        fprintf(stderr, "%s: integer value is required\n", opt);
+        return -1;
+    }
+
+    *v = strtoul(argv[1], &endp, 0);
+    if (endp && *endp) {
+        fprintf(stderr, "%s: Invalid integer value: %s\n", opt, argv[1]);
+        return -1;
+    }
+    return 2;
+}
+
+static int parse_float(int argc, const char **argv, float *v)
+{
+    const char *opt = argv[0];
+
+    if (argc < 2) {
+        fprintf(stderr, "%s: float value is required\n", opt);
+        return -1;
+    }
+
+    *v = strtof(argv[1], NULL);
+    return 2;
+}
+
+static int parse_raw(int argc, const char **argv, unsigned char *v, unsigned int len)
+{
+    const char *opt = *argv++;
+    unsigned int i;
+
+    if (argc < len + 1) {
+        fprintf(stderr, "%s: %u payload bytes are required; only %u given\n", opt, len, argc - 1);
+        return -1;
+    }
+
+    for (i = 0; i < len; i++) {
+        char *endp = NULL;
+
+        v[i] = strtoul(argv[i], &endp, 0);
+        if (endp && *endp) {
+            fprintf(stderr, "%s: Invalid integer value: %s\n", opt, argv[i]);
+            return -1;
+        }
+    }
+
+    return len + 1;
+}
+
+void state_options_help(void)
+{
+    printf("Supported state options:\n"
+           " power <bool> - power on/off\n"
+           " mode <integer> - Operation mode: 0 = Fan, 1 = Heat, 2 = Cool, 3 = Auto, 7 = Dry\n"
+           " comp <integer> - Compressor mode: 1 = Heat, 2 = Cool\n"
+           " fan <integer> - Fan speed: 1-5\n"
+           " temp <float> - Target temperature in C\n"
+           " antifreeze <bool> - Anti-freeze (defrost), reported in response to BE\n"
+           " t1 ... t13 <integer> - Raw 16 bit values reported in response to BD\n"
+           " BA <b0> <b1> ... - Raw value (29 bytes) of response to BA\n"
+           " BB <b0> <b1> ... - Raw value (20 bytes) of response to BB\n"
+           " BE <b0> <b1> ... - Raw value (9 bytes) of response to BE\n"
+           "Supported boolean values: 'on', 'true', '1', 'off', 'false', '0'\n"
+           "Integer values can be prefixed with 0x for hex or 0 for octal\n");
+}
+
+int parse_item(int argc, const char **argv, struct X50AState *state)
+{
+    const char *opt = argv[0];
+
+    if (!strcmp(opt, "power")) {
+        return parse_bool(argc, argv, &state->power);
+    } else if (!strcmp(opt, "mode")) {
+        return parse_int(argc, argv, &state->mode);
+    } else if (!strcmp(opt, "comp")) {
+        return parse_int(argc, argv, &state->comp);
+    } else if (!strcmp(opt, "fan")) {
+        return parse_int(argc, argv, &state->fan);
+    } else if (!strcmp(opt, "temp")) {
+        return parse_float(argc, argv, &state->temp);
+    } else if (!strcmp(opt, "antifreeze")) {
+        int v, ret = parse_bool(argc, argv, &v);
+
+        if (ret > 0)
+            state->BE[6] = v;
+        return ret;
+    } else if (opt[0] == 't' && atoi(opt + 1) >= 1 && atoi(opt + 1) <= 13) {
+        return parse_int(argc, argv, &state->t[atoi(opt + 1) - 1]);
+    }
+#define PARSE_RAW(cmd)               \
+    else if (!strcmp(argv[0], #cmd)) \
+        return parse_raw(argc, argv, state->cmd, sizeof(state->cmd));
+    PARSE_RAW(BA)
+    PARSE_RAW(BB)
+    PARSE_RAW(BE)
+    else {
+        fprintf(stderr, "Unknown option %s\n", opt);
+        return -1;
+    }
+}